@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "dataset.h"
 
 using namespace nnFit;
@@ -17,7 +18,58 @@ size_t SimpleDataset::outputSize() const {
     return outputs.columns();
 }
 
+ValueType SimpleDataset::inputType() const {
+    return inputs.type();
+}
+
+ValueType SimpleDataset::outputType() const {
+    return outputs.type();
+}
+
 void SimpleDataset::get(size_t i, size_t count, Vector &input, Vector &output) {
     inputs.row(i, count).copy(input);
     outputs.row(i, count).copy(output);
-}
\ No newline at end of file
+}
+
+SimpleSparseDataset::SimpleSparseDataset(size_t inputSize, std::vector<uint32_t> rowOffsets, std::vector<uint32_t> columnIndices, std::vector<float> values, const Matrix &outputs) : columns(inputSize), rowOffsets(std::move(rowOffsets)), columnIndices(std::move(columnIndices)), values(std::move(values)), largestRow(0), outputs(outputs) {
+    assert(this->rowOffsets.size() == outputs.rows() + 1);
+    assert(this->columnIndices.size() == this->values.size() && this->rowOffsets.back() == this->values.size());
+    for (size_t i = 0; i < outputs.rows(); ++i)
+        largestRow = std::max(largestRow, size_t(this->rowOffsets[i + 1] - this->rowOffsets[i]));
+}
+
+size_t SimpleSparseDataset::size() const {
+    return outputs.rows();
+}
+
+size_t SimpleSparseDataset::inputSize() const {
+    return columns;
+}
+
+size_t SimpleSparseDataset::outputSize() const {
+    return outputs.columns();
+}
+
+size_t SimpleSparseDataset::maxNonzeros() const {
+    return largestRow;
+}
+
+ValueType SimpleSparseDataset::outputType() const {
+    return outputs.type();
+}
+
+void SimpleSparseDataset::get(size_t i, size_t count, SparseMatrix &input, Vector &output) {
+    assert(input.rows() == count && input.columns() == columns);
+    input.write(rowOffsets.data() + i, columnIndices.data(), values.data());
+    outputs.row(i, count).copy(output);
+}
+
+void SimpleSparseDataset::get(size_t i, size_t count, Vector &input, Vector &output) {
+    std::vector<float> dense(count*columns, 0.0f);
+    for (size_t r = 0; r < count; ++r) {
+        for (size_t k = rowOffsets[i + r]; k < rowOffsets[i + r + 1]; ++k)
+            dense[r*columns + columnIndices[k]] += values[k];
+    }
+    writeFloats(input, dense);
+    outputs.row(i, count).copy(output);
+}
@@ -4,6 +4,8 @@
 
 namespace nnFit {
 
+class SparseDataset;
+
 class Dataset {
 public:
     virtual size_t size() const = 0;
@@ -11,6 +13,14 @@ public:
     virtual size_t outputSize() const = 0;
     virtual void get(size_t i, size_t count, Vector &input, Vector &output) = 0;
     
+    // The types of the input and output vectors.
+    virtual ValueType inputType() const {
+        return ValueType::Float;
+    }
+    virtual ValueType outputType() const {
+        return ValueType::Float;
+    }
+    
     // Optional
     virtual const Vector *classificationLabels() {
         return nullptr;
@@ -19,6 +29,52 @@ public:
     bool hasClassificationLabels() {
         return classificationLabels() != nullptr;
     }
+    
+    // Optional, the datasets with sparse inputs return themselves.
+    virtual SparseDataset *sparseInputs() {
+        return nullptr;
+    }
+};
+
+// SparseDataset - a dataset whose input vectors are mostly zeros, e.g. bag of words
+// or one-hot features. The inputs of a batch are read as a CSR sparse matrix with a row
+// per example, so that only their non-zeros are uploaded and multiplied. The dense
+// Dataset::get is still available for the users that need dense inputs.
+class SparseDataset: public Dataset {
+public:
+    // The largest number of non-zeros in an input vector, which sizes the batch buffers.
+    virtual size_t maxNonzeros() const = 0;
+    virtual void get(size_t i, size_t count, SparseMatrix &input, Vector &output) = 0;
+    using Dataset::get;
+    
+    SparseDataset *sparseInputs() override {
+        return this;
+    }
+};
+
+// SimpleSparseDataset - the CSR inputs in the host memory and the dense outputs on the device.
+// The input of the example i has the non-zeros values[k] in the columns columnIndices[k]
+// for rowOffsets[i] <= k < rowOffsets[i + 1].
+class SimpleSparseDataset: public SparseDataset {
+public:
+    SimpleSparseDataset(size_t inputSize, std::vector<uint32_t> rowOffsets, std::vector<uint32_t> columnIndices, std::vector<float> values, const Matrix &outputs);
+    
+    size_t size() const override;
+    size_t inputSize() const override;
+    size_t outputSize() const override;
+    size_t maxNonzeros() const override;
+    void get(size_t i, size_t count, SparseMatrix &input, Vector &output) override;
+    // Expands the inputs to dense vectors.
+    void get(size_t i, size_t count, Vector &input, Vector &output) override;
+    ValueType outputType() const override;
+    
+private:
+    size_t columns;
+    std::vector<uint32_t> rowOffsets;
+    std::vector<uint32_t> columnIndices;
+    std::vector<float> values;
+    size_t largestRow;
+    const Matrix &outputs;
 };
 
 class SimpleDataset: public Dataset {
@@ -29,6 +85,8 @@ public:
     size_t inputSize() const override;
     size_t outputSize() const override;
     void get(size_t i, size_t count, Vector &input, Vector &output) override;
+    ValueType inputType() const override;
+    ValueType outputType() const override;
     
 private:
     const Matrix &inputs;
@@ -0,0 +1,13 @@
+#!/bin/sh
+# Embeds the given OpenCL programs into a C++ include file.
+# Usage: embedKernels.sh output.inc program.cl...
+output=$1
+shift
+{
+    echo "// Generated by embedKernels.sh, do not edit."
+    for file in "$@"; do
+        echo "{ \"$(basename "$file")\", R\"nnFitProgram("
+        cat "$file"
+        echo ")nnFitProgram\" },"
+    done
+} > "$output.tmp" && mv "$output.tmp" "$output"
@@ -0,0 +1,290 @@
+#include <sstream>
+#include "expression.h"
+
+using namespace nnFit;
+
+struct Expression::Node {
+    Operation operation;
+    const Vector *vector;
+    float constant;
+    std::shared_ptr<const Node> operands[2];
+
+    Node(Operation operation) : operation(operation), vector(nullptr), constant(0.0f) { }
+};
+
+Expression::Expression(const Vector &x) {
+    assert(x.type() == ValueType::Float);
+    auto n = std::make_shared<Node>(Load);
+    n->vector = &x;
+    node = n;
+}
+
+Expression::Expression(float k) {
+    auto n = std::make_shared<Node>(Constant);
+    n->constant = k;
+    node = n;
+}
+
+Expression::Expression(Operation operation, const Expression &x) {
+    auto n = std::make_shared<Node>(operation);
+    n->operands[0] = x.node;
+    node = n;
+}
+
+Expression::Expression(Operation operation, const Expression &x, const Expression &y) {
+    auto n = std::make_shared<Node>(operation);
+    n->operands[0] = x.node;
+    n->operands[1] = y.node;
+    node = n;
+}
+
+namespace nnFit {
+
+Expression operator -(const Expression &x) {
+    return Expression(Expression::Negate, x);
+}
+
+Expression operator +(const Expression &x, const Expression &y) {
+    return Expression(Expression::Add, x, y);
+}
+
+Expression operator -(const Expression &x, const Expression &y) {
+    return Expression(Expression::Sub, x, y);
+}
+
+Expression operator *(const Expression &x, const Expression &y) {
+    return Expression(Expression::Mul, x, y);
+}
+
+Expression operator /(const Expression &x, const Expression &y) {
+    return Expression(Expression::Div, x, y);
+}
+
+Expression min(const Expression &x, const Expression &y) {
+    return Expression(Expression::Min, x, y);
+}
+
+Expression max(const Expression &x, const Expression &y) {
+    return Expression(Expression::Max, x, y);
+}
+
+Expression operator +(const Expression &x, float k) {
+    return Expression(Expression::Add, x, Expression(k));
+}
+
+Expression operator +(float k, const Expression &x) {
+    return Expression(Expression::Add, Expression(k), x);
+}
+
+Expression operator -(const Expression &x, float k) {
+    return Expression(Expression::Sub, x, Expression(k));
+}
+
+Expression operator -(float k, const Expression &x) {
+    return Expression(Expression::Sub, Expression(k), x);
+}
+
+Expression operator *(const Expression &x, float k) {
+    return Expression(Expression::Mul, x, Expression(k));
+}
+
+Expression operator *(float k, const Expression &x) {
+    return Expression(Expression::Mul, Expression(k), x);
+}
+
+Expression operator /(const Expression &x, float k) {
+    return Expression(Expression::Div, x, Expression(k));
+}
+
+Expression operator /(float k, const Expression &x) {
+    return Expression(Expression::Div, Expression(k), x);
+}
+
+Expression min(const Expression &x, float k) {
+    return Expression(Expression::Min, x, Expression(k));
+}
+
+Expression min(float k, const Expression &x) {
+    return Expression(Expression::Min, Expression(k), x);
+}
+
+Expression max(const Expression &x, float k) {
+    return Expression(Expression::Max, x, Expression(k));
+}
+
+Expression max(float k, const Expression &x) {
+    return Expression(Expression::Max, Expression(k), x);
+}
+
+Expression exp(const Expression &x) {
+    return Expression(Expression::Exp, x);
+}
+
+Expression log(const Expression &x) {
+    return Expression(Expression::Log, x);
+}
+
+Expression sqrt(const Expression &x) {
+    return Expression(Expression::Sqrt, x);
+}
+
+} // namespace nnFit
+
+namespace {
+
+// An argument of a generated kernel.
+struct Argument {
+    const Vector *vector;
+    float constant;
+};
+
+// Generates the kernel of an expression. Every vector and constant becomes a
+// parameter of the kernel, so the source only depends on the structure of the
+// expression and on which vectors are repeated. The code for the host device
+// is generated at the same time.
+class KernelGenerator {
+public:
+    KernelGenerator(size_t size) : size(size) { }
+
+    std::string generate(const Expression::Node &root) {
+        std::ostringstream value;
+        emit(root, value);
+        std::ostringstream source;
+        source << "kernel void expression(global float *dest" << parameters.str() << ") {\n";
+        source << "    size_t i = get_global_id(0);\n";
+        source << "    dest[i] = " << value.str() << ";\n";
+        source << "}\n";
+        return source.str();
+    }
+
+    std::vector<Argument> arguments;
+    HostExpression host;
+private:
+    void emit(const Expression::Node &node, std::ostream &os) {
+        emitNode(node, os);
+        // The operations follow their operands, so the host code is in postfix order.
+        if (node.operation != Expression::Load && node.operation != Expression::Constant)
+            host.code.push_back(HostExpression::Instruction{ node.operation, 0, 0 });
+    }
+
+    void emitNode(const Expression::Node &node, std::ostream &os) {
+        const auto &x = node.operands[0];
+        const auto &y = node.operands[1];
+        switch (node.operation) {
+        case Expression::Load:
+            return emitLoad(*node.vector, os);
+        case Expression::Constant:
+            os << "c" << arguments.size();
+            parameters << ", const float c" << arguments.size();
+            // The destination is the first argument of the kernel.
+            host.code.push_back(HostExpression::Instruction{ Expression::Constant, unsigned(arguments.size() + 1), 0 });
+            arguments.push_back(Argument{ nullptr, node.constant });
+            return;
+        case Expression::Negate:
+            return emitUnary("-", *x, os);
+        case Expression::Add:
+            return emitBinary(" + ", *x, *y, os);
+        case Expression::Sub:
+            return emitBinary(" - ", *x, *y, os);
+        case Expression::Mul:
+            return emitBinary(" * ", *x, *y, os);
+        case Expression::Div:
+            return emitBinary(" / ", *x, *y, os);
+        case Expression::Min:
+            return emitCall("fmin", *x, *y, os);
+        case Expression::Max:
+            return emitCall("fmax", *x, *y, os);
+        case Expression::Exp:
+            return emitUnary("exp", *x, os);
+        case Expression::Log:
+            return emitUnary("log", *x, os);
+        case Expression::Sqrt:
+            return emitUnary("sqrt", *x, os);
+        }
+    }
+
+    // Every vector is passed once, even when the expression reads it several times.
+    void emitLoad(const Vector &vector, std::ostream &os) {
+        assert(size % vector.size() == 0);
+        size_t i = 0;
+        for (; i < arguments.size(); ++i) {
+            if (arguments[i].vector == &vector)
+                break;
+        }
+        if (i == arguments.size()) {
+            parameters << ", const global float *v" << i;
+            arguments.push_back(Argument{ &vector, 0.0f });
+        }
+        host.code.push_back(HostExpression::Instruction{ Expression::Load, unsigned(i + 1), vector.size() });
+        if (vector.size() == size)
+            os << "v" << i << "[i]";
+        else
+            os << "v" << i << "[i % " << vector.size() << "]";
+    }
+
+    void emitUnary(const char *function, const Expression::Node &x, std::ostream &os) {
+        os << function << "(";
+        emit(x, os);
+        os << ")";
+    }
+
+    void emitBinary(const char *op, const Expression::Node &x, const Expression::Node &y, std::ostream &os) {
+        os << "(";
+        emit(x, os);
+        os << op;
+        emit(y, os);
+        os << ")";
+    }
+
+    void emitCall(const char *function, const Expression::Node &x, const Expression::Node &y, std::ostream &os) {
+        os << function << "(";
+        emit(x, os);
+        os << ", ";
+        emit(y, os);
+        os << ")";
+    }
+
+    size_t size;
+    std::ostringstream parameters;
+};
+
+} // namespace
+
+Expressions::CompiledExpression::CompiledExpression(Device &device, const std::string &source, const HostExpression &host) : program(device, source), kernel(program, "expression"), host(host) {
+    program.buildAsync();
+}
+
+Expressions::Expressions(Device &device) : dev(device) {
+}
+
+void Expressions::evaluate(const Vector &dest, const Expression &expression) {
+    assert(dest.type() == ValueType::Float);
+    KernelGenerator generator(dest.size());
+    auto source = generator.generate(expression.root());
+
+    auto i = kernels.find(source);
+    if (i == kernels.end())
+        i = kernels.insert(std::make_pair(source, std::unique_ptr<CompiledExpression>(new CompiledExpression(dev, source, generator.host)))).first;
+
+    KernelInvocation invocation(i->second->kernel);
+    invocation << dest;
+    for (const auto &argument : generator.arguments) {
+        if (argument.vector)
+            invocation << *argument.vector;
+        else
+            invocation << argument.constant;
+    }
+    if (dev.isHost()) {
+        const HostExpression *code = &i->second->host;
+        invocation.pushArg(&code, sizeof(code));
+    }
+    dev.queue().enqueue1Dim(invocation, dest.size());
+}
+
+namespace nnFit {
+
+void evaluate(const Vector &dest, const Expression &expression) {
+    dest.device().shared<Expressions>().evaluate(dest, expression);
+}
+
+} // namespace nnFit
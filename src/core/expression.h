@@ -0,0 +1,126 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "vector.h"
+
+namespace nnFit {
+
+// Expression - a lazy elementwise expression of float vectors and constants, e.g.
+//   evaluate(dest, x * k + y * z);
+// Building an expression only records it. When it's evaluated, one kernel is
+// generated for the shape of the expression and launched once, so the
+// intermediate results stay in registers instead of being written to temporary vectors.
+// The vectors are referenced and not copied, so they must outlive the evaluation.
+// A vector that's smaller than the destination is repeated, like in parallelAdd.
+class Expression {
+public:
+    enum Operation {
+        Load,
+        Constant,
+        Negate,
+        Add,
+        Sub,
+        // Elementwise multiplication, i.e. x .* y
+        Mul,
+        Div,
+        Min,
+        Max,
+        Exp,
+        Log,
+        Sqrt
+    };
+
+    Expression(const Vector &x);
+    // Explicit so that the unqualified calls of min, max, exp, log and sqrt with
+    // scalars in the nnFit namespace don't build expressions. The operators
+    // below take the constants directly.
+    explicit Expression(float k);
+    Expression(Operation operation, const Expression &x);
+    Expression(Operation operation, const Expression &x, const Expression &y);
+
+    // A node of the expression tree.
+    struct Node;
+
+    const Node &root() const {
+        return *node;
+    }
+private:
+    std::shared_ptr<const Node> node;
+};
+
+Expression operator -(const Expression &x);
+Expression operator +(const Expression &x, const Expression &y);
+Expression operator -(const Expression &x, const Expression &y);
+// Elementwise multiplication.
+Expression operator *(const Expression &x, const Expression &y);
+Expression operator /(const Expression &x, const Expression &y);
+Expression min(const Expression &x, const Expression &y);
+Expression max(const Expression &x, const Expression &y);
+
+Expression operator +(const Expression &x, float k);
+Expression operator +(float k, const Expression &x);
+Expression operator -(const Expression &x, float k);
+Expression operator -(float k, const Expression &x);
+Expression operator *(const Expression &x, float k);
+Expression operator *(float k, const Expression &x);
+Expression operator /(const Expression &x, float k);
+Expression operator /(float k, const Expression &x);
+Expression min(const Expression &x, float k);
+Expression min(float k, const Expression &x);
+Expression max(const Expression &x, float k);
+Expression max(float k, const Expression &x);
+
+Expression exp(const Expression &x);
+Expression log(const Expression &x);
+Expression sqrt(const Expression &x);
+
+// HostExpression - the code of an expression that's evaluated on the host device.
+// The instructions are in postfix order, so every operation pops its operands from a stack
+// of values and pushes its result. The kernels of the expressions get a pointer to the code as
+// their last argument.
+struct HostExpression {
+    struct Instruction {
+        Expression::Operation operation;
+        // The index of the kernel argument of the loaded vector or the constant.
+        unsigned argument;
+        // The size of the loaded vector.
+        size_t size;
+    };
+
+    std::vector<Instruction> code;
+};
+
+// Expressions - the kernels that were generated for the expressions evaluated on
+// a device. The kernels are cached by the structure of the expression, so the
+// expressions that only differ in their vectors and constants share a kernel.
+class Expressions {
+public:
+    Expressions(Device &device);
+
+    // dest = expression
+    void evaluate(const Vector &dest, const Expression &expression);
+
+    // Returns the number of kernels that were generated.
+    size_t kernelCount() const {
+        return kernels.size();
+    }
+private:
+    struct CompiledExpression {
+        Program program;
+        Kernel kernel;
+        // The code that the host device runs instead of the kernel.
+        HostExpression host;
+
+        CompiledExpression(Device &device, const std::string &source, const HostExpression &host);
+    };
+
+    Device &dev;
+    std::unordered_map<std::string, std::unique_ptr<CompiledExpression>> kernels;
+};
+
+// dest = expression
+void evaluate(const Vector &dest, const Expression &expression);
+
+} // namespace nnFit
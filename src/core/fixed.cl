@@ -1,5 +1,5 @@
 
-kernel void partialTrueCount(global uchar *x, const uint size, const uint partSize, global uint *dest) {
+kernel void partialTrueCount(const global uchar *x, const uint size, const uint partSize, global uint *dest) {
     uint part = get_global_id(0);
     
     uint correct = 0;
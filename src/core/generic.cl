@@ -1,65 +1,218 @@
 // Basic linear algebra
 
-typedef float Scalar;
-typedef float4 Scalar4;
+// The program can be specialized with the following definitions:
+//   SCALAR        - the scalar type, float or double (float by default). The double
+//                   kernels are only built for the devices that support cl_khr_fp64.
+//                   The constants passed by the host are floats in either case.
+//   VECTOR_WIDTH  - the width of the vectors used by the vectorized kernels (4, 8 or 16).
+//   COLUMNS       - the number of matrix columns for the vectorized matrix vector
+//                   multiplication kernels. Replaces the 'columns' argument.
+//   PART_SIZE     - the number of vectors summed by one thread in the vectorized
+//                   matrix vector multiplication kernels. Replaces the 'partSize' argument.
+//   GEMM_TILE_K   - the number of columns that are staged in local memory at once in the
+//                   tiled matrix multiplication kernels (16 by default).
+//
+// The matrices are row-major views: a matrix argument is followed by the offset of its
+// first element and its leading dimension, i.e. the number of elements between the
+// starts of two consecutive rows. The vectors are dense.
+//
+//   HALF_STORAGE  - defined when the vectors and matrices are stored as half precision floats.
+//                   The elements are converted to Scalar when they're loaded, so the arithmetic
+//                   and the accumulation are done in SCALAR precision. The half elements are
+//                   only loaded and stored with vload_half and vstore_half, which don't need
+//                   the cl_khr_fp16 extension.
 
-kernel void fill(global Scalar *dest, const Scalar value) {
+#ifndef SCALAR
+#define SCALAR float
+#endif
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+typedef SCALAR Scalar;
+typedef CONCAT(SCALAR, 4) Scalar4;
+typedef CONCAT(SCALAR, VECTOR_WIDTH) ScalarN;
+
+// Element - the type of the elements in the global memory.
+// LOAD(p, i)      - loads the i-th element of p as a Scalar.
+// STORE(x, p, i)  - stores the Scalar x as the i-th element of p.
+// LOAD4(p, i)     - loads the i-th group of 4 elements of p as a Scalar4.
+// LOADN(p, i)     - loads the i-th group of VECTOR_WIDTH elements of p as a ScalarN.
+//                   p only has to be aligned to its elements.
+#ifdef HALF_STORAGE
+typedef half Element;
+#define LOAD(p, i) vload_half(i, p)
+#define STORE(x, p, i) vstore_half(x, i, p)
+#define LOAD4(p, i) vload_half4(i, p)
+#define LOADN(p, i) CONCAT(vload_half, VECTOR_WIDTH)(i, p)
+#else
+typedef Scalar Element;
+#define LOAD(p, i) ((p)[i])
+#define STORE(x, p, i) ((p)[i] = (x))
+#define LOAD4(p, i) vload4(i, p)
+#define LOADN(p, i) CONCAT(vload, VECTOR_WIDTH)(i, p)
+#endif
+
+#if VECTOR_WIDTH == 4
+#define DOT(x, y) dot(x, y)
+#elif VECTOR_WIDTH == 8
+#define DOT(x, y) (dot((x).lo, (y).lo) + dot((x).hi, (y).hi))
+#elif VECTOR_WIDTH == 16
+#define DOT(x, y) (dot((x).lo.lo, (y).lo.lo) + dot((x).lo.hi, (y).lo.hi) + dot((x).hi.lo, (y).hi.lo) + dot((x).hi.hi, (y).hi.hi))
+#else
+#error "Unsupported VECTOR_WIDTH"
+#endif
+
+#ifdef COLUMNS
+#define MATRIX_COLUMNS COLUMNS
+#else
+#define MATRIX_COLUMNS columns
+#endif
+
+#ifdef PART_SIZE
+#define MATRIX_PART_SIZE PART_SIZE
+#else
+#define MATRIX_PART_SIZE partSize
+#endif
+
+// The number of rows and vectors in the output tile of a work-group in the tiled matrix
+// multiplication kernels, and the number computed by one thread. The host computes the
+// launch geometry from the same values (matrixMulTile and matrixMulBlock in vector.cpp),
+// so they aren't build options.
+#define GEMM_TILE 32
+#define GEMM_BLOCK 4
+
+#ifndef GEMM_TILE_K
+#define GEMM_TILE_K 16
+#endif
+
+// The number of threads in each dimension of a work-group.
+#define GEMM_THREADS (GEMM_TILE / GEMM_BLOCK)
+
+// The epilogue of the matrix multiplications that produce the activations of a layer.
+// It combines the flags with the activation function shifted by EPILOGUE_ACTIVATION_SHIFT.
+#define EPILOGUE_BIAS 1
+#define EPILOGUE_DERIVATIVE 2
+#define EPILOGUE_ACTIVATION_SHIFT 2
+
+#define ACTIVATION_IDENTITY 0
+#define ACTIVATION_SIGMOID 1
+#define ACTIVATION_TANH 2
+#define ACTIVATION_RELU 3
+
+// Returns f(x + bias[row]), and writes f'(x + bias[row]) to derivative[index] when the
+// epilogue has the derivative flag. The bias and derivative aren't read otherwise.
+inline Scalar applyEpilogue(Scalar x, const uint epilogue, const global Element *bias, size_t row, global Element *derivative, size_t index) {
+    if (epilogue & EPILOGUE_BIAS)
+        x += LOAD(bias, row);
+    Scalar d = 1;
+    switch (epilogue >> EPILOGUE_ACTIVATION_SHIFT) {
+    case ACTIVATION_SIGMOID:
+        x = (Scalar)1.0/((Scalar)1.0 + exp(-x));
+        d = x*((Scalar)1.0 - x);
+        break;
+    case ACTIVATION_TANH:
+        x = tanh(x);
+        d = 1 - x*x;
+        break;
+    case ACTIVATION_RELU:
+        d = x > 0? 1 : 0;
+        x = max(x, (Scalar)0.0);
+        break;
+    default: break;
+    }
+    if (epilogue & EPILOGUE_DERIVATIVE)
+        STORE(d, derivative, index);
+    return x;
+}
+
+kernel void fill(global Element *dest, const float value) {
     size_t i = get_global_id(0);
-    dest[i] = value;
+    STORE(value, dest, i);
 }
 
 // dest = x * k
-kernel void constantMul(global Scalar *x, const Scalar k, global Scalar *dest) {
+kernel void constantMul(const global Element *x, const float k, global Element *dest) {
     size_t i = get_global_id(0);
-    dest[i] = x[i] * k;
+    STORE(LOAD(x, i) * k, dest, i);
 }
 
 // dest = x / k
-kernel void constantDiv(global Scalar *x, const Scalar k, global Scalar *dest) {
+kernel void constantDiv(const global Element *x, const float k, global Element *dest) {
     size_t i = get_global_id(0);
-    dest[i] = x[i] / k;
+    STORE(LOAD(x, i) / k, dest, i);
 }
 
 // dest = x - y
-kernel void elementSub(global Scalar *x, global Scalar *y, global Scalar *dest) {
+kernel void elementSub(const global Element *x, const global Element *y, global Element *dest) {
     size_t i = get_global_id(0);
-    dest[i] = x[i] - y[i];
+    STORE(LOAD(x, i) - LOAD(y, i), dest, i);
 }
 
 // dest = x + y
-kernel void elementAdd(global Scalar *x, global Scalar *y, global Scalar *dest) {
+kernel void elementAdd(const global Element *x, const global Element *y, global Element *dest) {
     size_t i = get_global_id(0);
-    dest[i] = x[i] + y[i];
+    STORE(LOAD(x, i) + LOAD(y, i), dest, i);
 }
 
-kernel void elementAddParallel(global Scalar *x, global Scalar *y, global Scalar *dest) {
+kernel void elementAddParallel(const global Element *x, const global Element *y, global Element *dest) {
     size_t i = get_global_id(1);
     size_t pi = get_global_id(0)*get_global_size(1) + i;
-    dest[pi] = x[i] + y[pi];
+    STORE(LOAD(x, i) + LOAD(y, pi), dest, pi);
+}
+
+// dest[i] = beta*dest[i] + sum(x[v*size + i]) for all the vectors, where size is
+// the global size. dest isn't read when beta is zero.
+kernel void sumVectors(const global Element *x, const uint count, const float beta, global Element *dest) {
+    size_t i = get_global_id(0);
+    size_t size = get_global_size(0);
+    Scalar sum = 0;
+    for (size_t v = 0; v < count; ++v)
+        sum += LOAD(x, v*size + i);
+    STORE(beta == 0? sum : beta*LOAD(dest, i) + sum, dest, i);
+}
+
+// dest = x, converted between the float and the storage type.
+kernel void convertToFloat(const global Element *x, global float *dest) {
+    size_t i = get_global_id(0);
+    dest[i] = LOAD(x, i);
+}
+
+kernel void convertFromFloat(const global float *x, global Element *dest) {
+    size_t i = get_global_id(0);
+    STORE(x[i], dest, i);
 }
 
 // dest = x * y
-kernel void elementMul(global Scalar *x, global Scalar *y, global Scalar *dest) {
+kernel void elementMul(const global Element *x, const global Element *y, global Element *dest) {
     size_t i = get_global_id(0);
-    dest[i] = x[i] * y[i];
+    STORE(LOAD(x, i) * LOAD(y, i), dest, i);
 }
 
-kernel void partialSum(global Scalar *x, const uint size, const uint partSize, global Scalar *dest) {
+kernel void partialSum(const global Element *x, const uint size, const uint partSize, global Element *dest) {
     uint part = get_global_id(0);
     
     Scalar sum = 0.0f;
     for (size_t i = part*partSize, end = min(part*partSize + partSize, size); i < end; ++i)
-        sum += x[i];
-    dest[part] = sum;
+        sum += LOAD(x, i);
+    STORE(sum, dest, part);
 }
 
-kernel void matrixIdentity(global Scalar *matrix, const uint columns) {
+kernel void matrixIdentity(global Element *matrix, const uint matrixOffset, const uint leadingDimension) {
     size_t i = get_global_id(0);
     size_t j = get_global_id(1);
-    matrix[i * columns + j] = i == j? 1.0 : 0.0;
+    STORE(i == j? (Scalar)1.0 : (Scalar)0.0, matrix, matrixOffset + i * leadingDimension + j);
 }
 
-kernel void matrixVectorMul(global Scalar *matrix, global Scalar *vector, const uint columns, const uint partSize, global Scalar *output, local Scalar *work) {
+kernel void matrixVectorMul(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *vector, const uint columns, const uint partSize, global Element *output, const global Element *bias, global Element *derivative, const uint epilogue, local Scalar *work) {
     // Compute partial dot product
     size_t i = get_global_id(0);
     size_t j = get_global_id(1);
@@ -67,9 +220,9 @@ kernel void matrixVectorMul(global Scalar *matrix, global Scalar *vector, const
     size_t k = j*partSize;
     
     Scalar partialSum = 0;
-    const global Scalar *row = matrix + i*columns;
+    const global Element *row = matrix + matrixOffset + i*leadingDimension;
     for (size_t end = k + partSize; k < end; k++) {
-        partialSum += row[k] * vector[k];
+        partialSum += LOAD(row, k) * LOAD(vector, k);
     }
     
     // Store the partial result in local work memory
@@ -89,22 +242,39 @@ kernel void matrixVectorMul(global Scalar *matrix, global Scalar *vector, const
         for (size_t k = workRowOffset, end = workRowOffset + workColumns; k < end; ++k) {
             sum += work[k];
         }
-        output[i] = sum;
+        STORE(applyEpilogue(sum, epilogue, bias, i, derivative, i), output, i);
+    }
+}
+
+// Computes the j-th of the parts partial dot products of a row and a vector with columns elements.
+// Every part sums partSize vectors of VECTOR_WIDTH elements. The last part also sums the
+// vectors that don't fill a part and the columns that don't fill a vector, so the
+// vectorized kernels handle any number of columns.
+inline Scalar partialDotN(const global Element *row, const global Element *vector, size_t j, size_t parts, uint columns, uint partSize) {
+    Scalar partialSum = 0;
+    size_t k = j*partSize;
+    for (uint p = 0; p < partSize; p++) {
+        partialSum += DOT(LOADN(row, k + p), LOADN(vector, k + p));
+    }
+    if (j == parts - 1) {
+        const size_t vectors = columns / VECTOR_WIDTH;
+        for (size_t p = parts*partSize; p < vectors; p++) {
+            partialSum += DOT(LOADN(row, p), LOADN(vector, p));
+        }
+        for (size_t c = vectors*VECTOR_WIDTH; c < columns; c++) {
+            partialSum += LOAD(row, c) * LOAD(vector, c);
+        }
     }
+    return partialSum;
 }
 
-kernel void matrixVectorMul4(global Scalar4 *matrix, global Scalar4 *vector, const uint columns, const uint partSize, global Scalar *output, local Scalar *work) {
+kernel void matrixVectorMul4(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *vector, const uint columns, const uint partSize, global Element *output, const global Element *bias, global Element *derivative, const uint epilogue, local Scalar *work) {
     // Compute partial dot product
     size_t i = get_global_id(0);
     size_t j = get_global_id(1);
     size_t parts = get_global_size(1);
-    size_t k = j*partSize;
-
-    Scalar partialSum = 0;
-    const global Scalar4 *row = matrix + i*columns;
-    for (size_t end = k + partSize; k < end; k++) {
-        partialSum += dot(row[k], vector[k]);
-    }
+    const global Element *row = matrix + matrixOffset + i*leadingDimension;
+    Scalar partialSum = partialDotN(row, vector, j, parts, MATRIX_COLUMNS, MATRIX_PART_SIZE);
     
     // Store the partial result in local work memory
     size_t ii = get_local_id(0);
@@ -123,12 +293,12 @@ kernel void matrixVectorMul4(global Scalar4 *matrix, global Scalar4 *vector, con
         for (size_t k = workRowOffset, end = workRowOffset + workColumns; k < end; ++k) {
             sum += work[k];
         }
-        output[i] = sum;
+        STORE(applyEpilogue(sum, epilogue, bias, i, derivative, i), output, i);
     }
 }
 
-kernel void matrixVectorMulParallel(global Scalar *matrix, global Scalar *vectors, const uint columns, const uint partSize, global Scalar *output, local Scalar *work) {
-    const global Scalar *vector = vectors + get_global_id(0)*columns;
+kernel void matrixVectorMulParallel(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *vectors, const uint columns, const uint partSize, global Element *output, const global Element *bias, global Element *derivative, const uint epilogue, local Scalar *work) {
+    const global Element *vector = vectors + get_global_id(0)*columns;
     // Compute partial dot product
     size_t i = get_global_id(1);
     size_t j = get_global_id(2);
@@ -136,9 +306,9 @@ kernel void matrixVectorMulParallel(global Scalar *matrix, global Scalar *vector
     size_t k = j*partSize;
     
     Scalar partialSum = 0;
-    const global Scalar *row = matrix + i*columns;
+    const global Element *row = matrix + matrixOffset + i*leadingDimension;
     for (size_t end = k + partSize; k < end; k++) {
-        partialSum += row[k] * vector[k];
+        partialSum += LOAD(row, k) * LOAD(vector, k);
     }
     
     // Store the partial result in local work memory
@@ -158,23 +328,19 @@ kernel void matrixVectorMulParallel(global Scalar *matrix, global Scalar *vector
         for (size_t k = workRowOffset, end = workRowOffset + workColumns; k < end; ++k) {
             sum += work[k];
         }
-        output[get_global_id(0)*get_global_size(1) + i] = sum;
+        size_t index = get_global_id(0)*get_global_size(1) + i;
+        STORE(applyEpilogue(sum, epilogue, bias, i, derivative, index), output, index);
     }
 }
 
-kernel void matrixVectorMul4Parallel(global Scalar4 *matrix, global Scalar4 *vectors, const uint columns, const uint partSize, global Scalar *output, local Scalar *work) {
-    const global Scalar4 *vector = vectors + get_global_id(0)*columns;
+kernel void matrixVectorMul4Parallel(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *vectors, const uint columns, const uint partSize, global Element *output, const global Element *bias, global Element *derivative, const uint epilogue, local Scalar *work) {
+    const global Element *vector = vectors + get_global_id(0)*MATRIX_COLUMNS;
     // Compute partial dot product
     size_t i = get_global_id(1);
     size_t j = get_global_id(2);
     size_t parts = get_global_size(2);
-    size_t k = j*partSize;
-    
-    Scalar partialSum = 0;
-    const global Scalar4 *row = matrix + i*columns;
-    for (size_t end = k + partSize; k < end; k++) {
-        partialSum += dot(row[k], vector[k]);
-    }
+    const global Element *row = matrix + matrixOffset + i*leadingDimension;
+    Scalar partialSum = partialDotN(row, vector, j, parts, MATRIX_COLUMNS, MATRIX_PART_SIZE);
     
     // Store the partial result in local work memory
     size_t ii = get_local_id(1);
@@ -193,23 +359,301 @@ kernel void matrixVectorMul4Parallel(global Scalar4 *matrix, global Scalar4 *vec
         for (size_t k = workRowOffset, end = workRowOffset + workColumns; k < end; ++k) {
             sum += work[k];
         }
-        output[get_global_id(0)*get_global_size(1) + i] = sum;
+        size_t index = get_global_id(0)*get_global_size(1) + i;
+        STORE(applyEpilogue(sum, epilogue, bias, i, derivative, index), output, index);
     }
 }
 
-kernel void transposeMatrixVectorMulParallel(global Scalar *matrix, global Scalar *vectors, const uint rows, global Scalar *output) {
-    const global Scalar *vector = vectors + get_global_id(0)*rows;
+kernel void transposeMatrixVectorMulParallel(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *vectors, const uint rows, global Element *output) {
+    const global Element *vector = vectors + get_global_id(0)*rows;
     const size_t columns = get_global_size(1);
     
     // Compute the dot product of the matrix's column and one of the given vectors.
     size_t i = get_global_id(1);
     Scalar sum = 0;
-    size_t offset = i; // index into the matrix column
-    for (size_t j = 0; j < rows; j++, offset+=columns) {
-        sum += matrix[offset] * vector[j];
+    size_t offset = matrixOffset + i; // index into the matrix column
+    for (size_t j = 0; j < rows; j++, offset+=leadingDimension) {
+        sum += LOAD(matrix, offset) * LOAD(vector, j);
     }
     
-    output[get_global_id(0)*columns + i] = sum;
+    STORE(sum, output, get_global_id(0)*columns + i);
 }
 
+// Loads 4 consecutive elements of a row of a row-major matrix whose rows are stride elements apart.
+// The elements outside of the matrix are zeros.
+inline Scalar4 loadRow4(const global Element *matrix, uint row, uint rows, uint column, uint columns, uint stride) {
+    if (row >= rows)
+        return (Scalar4)(0);
+    const global Element *p = matrix + (size_t)row*stride + column;
+    if (column + 4 <= columns)
+        return LOAD4(p, 0);
+    Scalar4 result = (Scalar4)(0);
+    if (column < columns)
+        result.x = LOAD(p, 0);
+    if (column + 1 < columns)
+        result.y = LOAD(p, 1);
+    if (column + 2 < columns)
+        result.z = LOAD(p, 2);
+    return result;
+}
 
+// output[v*rows + i] = dot(matrix[i], vectors[v]) for all the rows and vectors, i.e.
+// a matrix multiplication of the vectors by the transposed matrix.
+// Every work-group computes a GEMM_TILE by GEMM_TILE tile of the output, and every thread
+// computes a GEMM_BLOCK by GEMM_BLOCK block of it in registers. The rows of the matrix and the
+// vectors are staged in local memory, so every element is read from global memory once per tile.
+// Launched with the work-group size (GEMM_THREADS, GEMM_THREADS) and the global size
+// (ceil(rows/GEMM_TILE)*GEMM_THREADS, ceil(count/GEMM_TILE)*GEMM_THREADS).
+// The epilogue is applied to every output element before it's written.
+kernel void matrixMatrixMul(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *vectors, const uint rows, const uint columns, const uint count, global Element *output, const global Element *bias, global Element *derivative, const uint epilogue) {
+    // The tiles are stored transposed, so that the threads read consecutive elements.
+    local Scalar matrixTile[GEMM_TILE_K][GEMM_TILE + 1];
+    local Scalar vectorTile[GEMM_TILE_K][GEMM_TILE + 1];
+    
+    const uint ti = get_local_id(0);
+    const uint tv = get_local_id(1);
+    const uint thread = tv*GEMM_THREADS + ti;
+    const uint rowOffset = get_group_id(0)*GEMM_TILE;
+    const uint vectorOffset = get_group_id(1)*GEMM_TILE;
+    
+    Scalar sums[GEMM_BLOCK][GEMM_BLOCK];
+    for (uint v = 0; v < GEMM_BLOCK; ++v) {
+        for (uint i = 0; i < GEMM_BLOCK; ++i)
+            sums[v][i] = 0;
+    }
+    
+    for (uint k = 0; k < columns; k += GEMM_TILE_K) {
+        for (uint l = thread; l < GEMM_TILE*GEMM_TILE_K/4; l += GEMM_THREADS*GEMM_THREADS) {
+            uint r = l / (GEMM_TILE_K/4);
+            uint c = (l % (GEMM_TILE_K/4))*4;
+            Scalar4 m = loadRow4(matrix + matrixOffset, rowOffset + r, rows, k + c, columns, leadingDimension);
+            matrixTile[c][r] = m.x;
+            matrixTile[c + 1][r] = m.y;
+            matrixTile[c + 2][r] = m.z;
+            matrixTile[c + 3][r] = m.w;
+            Scalar4 x = loadRow4(vectors, vectorOffset + r, count, k + c, columns, columns);
+            vectorTile[c][r] = x.x;
+            vectorTile[c + 1][r] = x.y;
+            vectorTile[c + 2][r] = x.z;
+            vectorTile[c + 3][r] = x.w;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        for (uint kk = 0; kk < GEMM_TILE_K; ++kk) {
+            Scalar m[GEMM_BLOCK], x[GEMM_BLOCK];
+            for (uint i = 0; i < GEMM_BLOCK; ++i)
+                m[i] = matrixTile[kk][ti + i*GEMM_THREADS];
+            for (uint v = 0; v < GEMM_BLOCK; ++v)
+                x[v] = vectorTile[kk][tv + v*GEMM_THREADS];
+            for (uint v = 0; v < GEMM_BLOCK; ++v) {
+                for (uint i = 0; i < GEMM_BLOCK; ++i)
+                    sums[v][i] += m[i] * x[v];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    
+    // Neighbouring threads write neighbouring rows of an output vector.
+    for (uint v = 0; v < GEMM_BLOCK; ++v) {
+        uint vector = vectorOffset + tv + v*GEMM_THREADS;
+        for (uint i = 0; i < GEMM_BLOCK; ++i) {
+            uint row = rowOffset + ti + i*GEMM_THREADS;
+            if (vector < count && row < rows) {
+                size_t index = (size_t)vector*rows + row;
+                STORE(applyEpilogue(sums[v][i], epilogue, bias, row, derivative, index), output, index);
+            }
+        }
+    }
+}
+
+// output[v*columns + j] = dot(column j of matrix, vectors[v]) for all the columns and vectors,
+// i.e. a matrix multiplication of the vectors by the matrix. The work is split into tiles
+// like in matrixMatrixMul. The rows of the matrix tile are read with coalesced loads and are
+// kept in local memory in the layout that lets neighbouring threads produce neighbouring
+// output columns, so the writes are coalesced as well.
+// Launched with the work-group size (GEMM_THREADS, GEMM_THREADS) and the global size
+// (ceil(columns/GEMM_TILE)*GEMM_THREADS, ceil(count/GEMM_TILE)*GEMM_THREADS).
+kernel void transposeMatrixMatrixMul(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *vectors, const uint rows, const uint columns, const uint count, global Element *output) {
+    local Scalar matrixTile[GEMM_TILE_K][GEMM_TILE + 1];
+    local Scalar vectorTile[GEMM_TILE_K][GEMM_TILE + 1];
+    
+    const uint tj = get_local_id(0);
+    const uint tv = get_local_id(1);
+    const uint thread = tv*GEMM_THREADS + tj;
+    const uint columnOffset = get_group_id(0)*GEMM_TILE;
+    const uint vectorOffset = get_group_id(1)*GEMM_TILE;
+    
+    Scalar sums[GEMM_BLOCK][GEMM_BLOCK];
+    for (uint v = 0; v < GEMM_BLOCK; ++v) {
+        for (uint j = 0; j < GEMM_BLOCK; ++j)
+            sums[v][j] = 0;
+    }
+    
+    for (uint k = 0; k < rows; k += GEMM_TILE_K) {
+        // GEMM_TILE_K rows of the matrix by GEMM_TILE columns.
+        for (uint l = thread; l < GEMM_TILE*GEMM_TILE_K/4; l += GEMM_THREADS*GEMM_THREADS) {
+            uint r = l / (GEMM_TILE/4);
+            uint c = (l % (GEMM_TILE/4))*4;
+            Scalar4 m = loadRow4(matrix + matrixOffset, k + r, rows, columnOffset + c, columns, leadingDimension);
+            matrixTile[r][c] = m.x;
+            matrixTile[r][c + 1] = m.y;
+            matrixTile[r][c + 2] = m.z;
+            matrixTile[r][c + 3] = m.w;
+        }
+        // GEMM_TILE vectors by GEMM_TILE_K elements, transposed.
+        for (uint l = thread; l < GEMM_TILE*GEMM_TILE_K/4; l += GEMM_THREADS*GEMM_THREADS) {
+            uint r = l / (GEMM_TILE_K/4);
+            uint c = (l % (GEMM_TILE_K/4))*4;
+            Scalar4 x = loadRow4(vectors, vectorOffset + r, count, k + c, rows, rows);
+            vectorTile[c][r] = x.x;
+            vectorTile[c + 1][r] = x.y;
+            vectorTile[c + 2][r] = x.z;
+            vectorTile[c + 3][r] = x.w;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        for (uint kk = 0; kk < GEMM_TILE_K; ++kk) {
+            Scalar m[GEMM_BLOCK], x[GEMM_BLOCK];
+            for (uint j = 0; j < GEMM_BLOCK; ++j)
+                m[j] = matrixTile[kk][tj + j*GEMM_THREADS];
+            for (uint v = 0; v < GEMM_BLOCK; ++v)
+                x[v] = vectorTile[kk][tv + v*GEMM_THREADS];
+            for (uint v = 0; v < GEMM_BLOCK; ++v) {
+                for (uint j = 0; j < GEMM_BLOCK; ++j)
+                    sums[v][j] += m[j] * x[v];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    
+    for (uint v = 0; v < GEMM_BLOCK; ++v) {
+        uint vector = vectorOffset + tv + v*GEMM_THREADS;
+        for (uint j = 0; j < GEMM_BLOCK; ++j) {
+            uint column = columnOffset + tj + j*GEMM_THREADS;
+            if (vector < count && column < columns)
+                STORE(sums[v][j], output, (size_t)vector*columns + column);
+        }
+    }
+}
+
+// dest[i, j] = beta*dest[i, j] + sum(x[v*rows + i] * y[v*columns + j]) for all the vectors,
+// i.e. the sum of the outer products of the vectors in x and y. The destination isn't read when
+// beta is zero, so it doesn't have to be initialized. The work is split into tiles like in
+// matrixMatrixMul, and neighbouring threads write neighbouring columns of the destination.
+// Launched with the work-group size (GEMM_THREADS, GEMM_THREADS) and the global size
+// (ceil(columns/GEMM_TILE)*GEMM_THREADS, ceil(rows/GEMM_TILE)*GEMM_THREADS).
+kernel void matrixOuterProductSum(const global Element *x, const global Element *y, const uint rows, const uint columns, const uint count, const float beta, global Element *dest, const uint destOffset, const uint leadingDimension) {
+    local Scalar xTile[GEMM_TILE_K][GEMM_TILE + 1];
+    local Scalar yTile[GEMM_TILE_K][GEMM_TILE + 1];
+    
+    const uint tj = get_local_id(0);
+    const uint ti = get_local_id(1);
+    const uint thread = ti*GEMM_THREADS + tj;
+    const uint columnOffset = get_group_id(0)*GEMM_TILE;
+    const uint rowOffset = get_group_id(1)*GEMM_TILE;
+    
+    Scalar sums[GEMM_BLOCK][GEMM_BLOCK];
+    for (uint i = 0; i < GEMM_BLOCK; ++i) {
+        for (uint j = 0; j < GEMM_BLOCK; ++j)
+            sums[i][j] = 0;
+    }
+    
+    for (uint k = 0; k < count; k += GEMM_TILE_K) {
+        // GEMM_TILE_K vectors by GEMM_TILE elements of both x and y.
+        for (uint l = thread; l < GEMM_TILE*GEMM_TILE_K/4; l += GEMM_THREADS*GEMM_THREADS) {
+            uint r = l / (GEMM_TILE/4);
+            uint c = (l % (GEMM_TILE/4))*4;
+            Scalar4 a = loadRow4(x, k + r, count, rowOffset + c, rows, rows);
+            xTile[r][c] = a.x;
+            xTile[r][c + 1] = a.y;
+            xTile[r][c + 2] = a.z;
+            xTile[r][c + 3] = a.w;
+            Scalar4 b = loadRow4(y, k + r, count, columnOffset + c, columns, columns);
+            yTile[r][c] = b.x;
+            yTile[r][c + 1] = b.y;
+            yTile[r][c + 2] = b.z;
+            yTile[r][c + 3] = b.w;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        // Small batches don't fill the tile.
+        const uint tileSize = min((uint)GEMM_TILE_K, count - k);
+        for (uint kk = 0; kk < tileSize; ++kk) {
+            Scalar a[GEMM_BLOCK], b[GEMM_BLOCK];
+            for (uint i = 0; i < GEMM_BLOCK; ++i)
+                a[i] = xTile[kk][ti + i*GEMM_THREADS];
+            for (uint j = 0; j < GEMM_BLOCK; ++j)
+                b[j] = yTile[kk][tj + j*GEMM_THREADS];
+            for (uint i = 0; i < GEMM_BLOCK; ++i) {
+                for (uint j = 0; j < GEMM_BLOCK; ++j)
+                    sums[i][j] += a[i] * b[j];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    
+    for (uint i = 0; i < GEMM_BLOCK; ++i) {
+        uint row = rowOffset + ti + i*GEMM_THREADS;
+        for (uint j = 0; j < GEMM_BLOCK; ++j) {
+            uint column = columnOffset + tj + j*GEMM_THREADS;
+            if (row < rows && column < columns) {
+                size_t index = destOffset + (size_t)row*leadingDimension + column;
+                STORE(beta == 0? sums[i][j] : beta * LOAD(dest, index) + sums[i][j], dest, index);
+            }
+        }
+    }
+}
+
+// The sparse matrices are batches of vectors in the compressed sparse row format: the non-zeros
+// of the vector v are values[k] in the columns columnIndices[k] for rowOffsets[v] <= k < rowOffsets[v + 1].
+
+// dest[v*columns + j] = x[v][j], i.e. the sparse vectors expanded to dense vectors.
+// Launched with the global size count.
+kernel void sparseToDense(const global Element *values, const global uint *columnIndices, const global uint *rowOffsets, const uint columns, global Element *dest) {
+    const size_t v = get_global_id(0);
+    global Element *vector = dest + v*columns;
+    for (uint j = 0; j < columns; ++j)
+        STORE((Scalar)0, vector, j);
+    for (uint k = rowOffsets[v], end = rowOffsets[v + 1]; k < end; ++k)
+        STORE(LOAD(vector, columnIndices[k]) + LOAD(values, k), vector, columnIndices[k]);
+}
+
+// output[v*rows + i] = dot(matrix[i], x[v]) for all the rows and the sparse vectors x[v].
+// Only the columns of the matrix that have a non-zero in x[v] are read, so the work scales
+// with the number of non-zeros instead of the number of columns.
+// Launched with the global size (rows, count). The epilogue is applied like in matrixMatrixMul.
+kernel void sparseMatrixMul(const global Element *matrix, const uint matrixOffset, const uint leadingDimension, const global Element *values, const global uint *columnIndices, const global uint *rowOffsets, global Element *output, const global Element *bias, global Element *derivative, const uint epilogue) {
+    const size_t i = get_global_id(0);
+    const size_t v = get_global_id(1);
+    const global Element *row = matrix + matrixOffset + i*leadingDimension;
+    Scalar sum = 0;
+    for (uint k = rowOffsets[v], end = rowOffsets[v + 1]; k < end; ++k)
+        sum += LOAD(row, columnIndices[k]) * LOAD(values, k);
+    size_t index = v*get_global_size(0) + i;
+    STORE(applyEpilogue(sum, epilogue, bias, i, derivative, index), output, index);
+}
+
+// dest[i, j] = beta*dest[i, j] + sum(x[v*rows + i] * y[v][j]) for all the vectors in x and
+// the sparse vectors y[v], i.e. the sum of their outer products. Every thread updates one row
+// of the destination, so the non-zeros of the vectors that share a column don't conflict.
+// The destination isn't read when beta is zero. When beta is 1, only the columns that have
+// a non-zero are read and written.
+// Launched with the global size rows.
+kernel void sparseOuterProductSum(const global Element *x, const global Element *values, const global uint *columnIndices, const global uint *rowOffsets, const uint count, const uint columns, const float beta, global Element *dest, const uint destOffset, const uint leadingDimension) {
+    const size_t i = get_global_id(0);
+    const size_t rows = get_global_size(0);
+    global Element *row = dest + destOffset + i*leadingDimension;
+    if (beta != 1) {
+        for (uint j = 0; j < columns; ++j)
+            STORE(beta == 0? (Scalar)0 : beta * LOAD(row, j), row, j);
+    }
+    for (uint v = 0; v < count; ++v) {
+        const Scalar e = LOAD(x, v*rows + i);
+        if (e == 0)
+            continue;
+        for (uint k = rowOffsets[v], end = rowOffsets[v + 1]; k < end; ++k) {
+            const uint j = columnIndices[k];
+            STORE(LOAD(row, j) + e * LOAD(values, k), row, j);
+        }
+    }
+}
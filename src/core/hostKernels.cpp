@@ -0,0 +1,973 @@
+#include <cmath>
+#include <cstdlib>
+#include <climits>
+#include <limits>
+#include <algorithm>
+#include "hostKernels.h"
+#include "expression.h"
+#include "reduction.h"
+#include "threadPool.h"
+#include "simd.h"
+
+using namespace nnFit;
+
+// The alignment of the host buffers, enough for the AVX-512 loads.
+static const size_t bufferAlignment = 64;
+// The number of operations that are worth running on another thread.
+static const size_t minimumTaskCost = 1 << 15;
+
+HostBuffer::HostBuffer(size_t size) : memory(nullptr), length(size), references(1) {
+    void *p = nullptr;
+    if (posix_memalign(&p, bufferAlignment, std::max(size, size_t(1))) == 0)
+        memory = static_cast<unsigned char*>(p);
+}
+
+HostBuffer::~HostBuffer() {
+    free(memory);
+}
+
+cl_mem HostBuffer::create(size_t size, const void *data) {
+    auto buffer = new HostBuffer(size);
+    if (!buffer->memory) {
+        delete buffer;
+        return nullptr;
+    }
+    if (data)
+        memcpy(buffer->memory, data, size);
+    else
+        memset(buffer->memory, 0, size);
+    return reinterpret_cast<cl_mem>(buffer);
+}
+
+void HostBuffer::retain() {
+    references.fetch_add(1);
+}
+
+void HostBuffer::release() {
+    if (references.fetch_sub(1) == 1)
+        delete this;
+}
+
+void HostLaunch::parallelFor(size_t begin, size_t end, size_t cost, const std::function<void (size_t, size_t)> &body) const {
+    pool.parallelFor(begin, end, std::max(minimumTaskCost / std::max(cost, size_t(1)), size_t(1)), body);
+}
+
+namespace {
+
+// Runs the body over the global range of a 1 dimensional launch.
+void forEach(const HostLaunch &launch, size_t cost, const std::function<void (size_t, size_t)> &body) {
+    launch.parallelFor(launch.globalOffset[0], launch.globalOffset[0] + launch.globalSize[0], cost, body);
+}
+
+// The EPILOGUE_ and ACTIVATION_ definitions of generic.cl.
+const unsigned epilogueBias = 1;
+const unsigned epilogueDerivative = 2;
+const unsigned epilogueActivationShift = 2;
+
+enum Activation {
+    ActivationIdentity,
+    ActivationSigmoid,
+    ActivationTanh,
+    ActivationRelu
+};
+
+inline float sigmoid(float x) {
+    return 1.0f/(1.0f + std::exp(-x));
+}
+
+// applyEpilogue of generic.cl.
+inline float applyEpilogue(float x, unsigned epilogue, const float *bias, size_t row, float *derivative, size_t index) {
+    if (epilogue & epilogueBias)
+        x += bias[row];
+    float d = 1;
+    switch (epilogue >> epilogueActivationShift) {
+    case ActivationSigmoid:
+        x = sigmoid(x);
+        d = x*(1.0f - x);
+        break;
+    case ActivationTanh:
+        x = std::tanh(x);
+        d = 1 - x*x;
+        break;
+    case ActivationRelu:
+        d = x > 0? 1 : 0;
+        x = std::max(x, 0.0f);
+        break;
+    default: break;
+    }
+    if (epilogue & epilogueDerivative)
+        derivative[index] = d;
+    return x;
+}
+
+template<simd::Operation op>
+void elementwiseKernel(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto y = launch.buffer<const float>(1);
+    auto dest = launch.buffer<float>(2);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        simd::elementwise(op, x + begin, y + begin, dest + begin, end - begin);
+    });
+}
+
+template<simd::Operation op>
+void elementwiseConstantKernel(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto k = launch.scalar<float>(1);
+    auto dest = launch.buffer<float>(2);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        simd::elementwiseConstant(op, x + begin, k, dest + begin, end - begin);
+    });
+}
+
+void fill(const HostLaunch &launch) {
+    auto dest = launch.buffer<float>(0);
+    auto value = launch.scalar<float>(1);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        std::fill(dest + begin, dest + end, value);
+    });
+}
+
+void elementAddParallel(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto y = launch.buffer<const float>(1);
+    auto dest = launch.buffer<float>(2);
+    size_t size = launch.globalSize[1];
+    launch.parallelFor(0, launch.globalSize[0], size, [=] (size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v)
+            simd::elementwise(simd::Add, x, y + v*size, dest + v*size, size);
+    });
+}
+
+void sumVectors(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto count = launch.scalar<cl_uint>(1);
+    auto beta = launch.scalar<float>(2);
+    auto dest = launch.buffer<float>(3);
+    size_t size = launch.globalSize[0];
+    launch.parallelFor(0, size, count, [=] (size_t begin, size_t end) {
+        // The sums of a block stay in the cache while the vectors are added to them.
+        const size_t block = 1024;
+        float sums[block];
+        for (size_t b = begin; b < end; b += block) {
+            size_t n = std::min(block, end - b);
+            std::fill(sums, sums + n, 0.0f);
+            for (size_t v = 0; v < count; ++v)
+                simd::elementwise(simd::Add, sums, x + v*size + b, sums, n);
+            for (size_t i = 0; i < n; ++i)
+                dest[b + i] = beta == 0? sums[i] : beta*dest[b + i] + sums[i];
+        }
+    });
+}
+
+// convertToFloat and convertFromFloat, which copy the floats.
+void convertFloat(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto dest = launch.buffer<float>(1);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        memmove(dest + begin, x + begin, (end - begin)*sizeof(float));
+    });
+}
+
+void partialSum(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto size = launch.scalar<cl_uint>(1);
+    auto partSize = launch.scalar<cl_uint>(2);
+    auto dest = launch.buffer<float>(3);
+    forEach(launch, partSize, [=] (size_t begin, size_t end) {
+        for (size_t part = begin; part < end; ++part) {
+            size_t first = std::min(size_t(part*partSize), size_t(size));
+            size_t last = std::min(size_t(part*partSize + partSize), size_t(size));
+            dest[part] = simd::sum(x + first, last - first);
+        }
+    });
+}
+
+void matrixIdentity(const HostLaunch &launch) {
+    auto matrix = launch.buffer<float>(0) + launch.scalar<cl_uint>(1);
+    auto ld = launch.scalar<cl_uint>(2);
+    size_t columns = launch.globalSize[1];
+    launch.parallelFor(0, launch.globalSize[0], columns, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t j = 0; j < columns; ++j)
+                matrix[i*ld + j] = i == j? 1.0f : 0.0f;
+        }
+    });
+}
+
+// output[v*rows + i] = epilogue(dot(row i of the matrix, vectors[v])) for the rows
+// [begin, end) and all the vectors. The rows are multiplied 4 at a time, so every
+// load of a vector is shared by 4 rows, and the rows stay in the cache for all the vectors.
+void multiplyRows(const float *matrix, size_t ld, const float *vectors, size_t vectorStride, size_t columns, size_t rows, size_t count, size_t begin, size_t end, float *output, const float *bias, float *derivative, unsigned epilogue) {
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        const float *const r[4] = { matrix + i*ld, matrix + (i + 1)*ld, matrix + (i + 2)*ld, matrix + (i + 3)*ld };
+        for (size_t v = 0; v < count; ++v) {
+            float sums[4];
+            simd::dot4(r, vectors + v*vectorStride, columns, sums);
+            for (unsigned k = 0; k < 4; ++k) {
+                size_t index = v*rows + i + k;
+                output[index] = applyEpilogue(sums[k], epilogue, bias, i + k, derivative, index);
+            }
+        }
+    }
+    for (; i < end; ++i) {
+        for (size_t v = 0; v < count; ++v) {
+            size_t index = v*rows + i;
+            output[index] = applyEpilogue(simd::dot(matrix + i*ld, vectors + v*vectorStride, columns), epilogue, bias, i, derivative, index);
+        }
+    }
+}
+
+// The matrix vector multiplication kernels. The parallel kernels multiply the vectors in the
+// first dimension. The parts of a row are summed at once, the scalar kernels sum parts*partSize
+// columns and the vectorized kernels sum all the columns.
+template<bool parallel, bool vectorized>
+void matrixVectorMul(const HostLaunch &launch) {
+    auto matrix = launch.buffer<const float>(0) + launch.scalar<cl_uint>(1);
+    auto ld = launch.scalar<cl_uint>(2);
+    auto vectors = launch.buffer<const float>(3);
+    auto columns = launch.scalar<cl_uint>(4);
+    auto partSize = launch.scalar<cl_uint>(5);
+    auto output = launch.buffer<float>(6);
+    auto bias = launch.buffer<const float>(7);
+    auto derivative = launch.buffer<float>(8);
+    auto epilogue = launch.scalar<cl_uint>(9);
+    size_t count = parallel? launch.globalSize[0] : 1;
+    size_t rows = launch.globalSize[parallel? 1 : 0];
+    size_t parts = launch.globalSize[parallel? 2 : 1];
+    size_t n = vectorized? columns : parts*partSize;
+    launch.parallelFor(0, rows, n*count, [=] (size_t begin, size_t end) {
+        multiplyRows(matrix, ld, vectors, columns, n, rows, count, begin, end, output, bias, derivative, epilogue);
+    });
+}
+
+void matrixMatrixMul(const HostLaunch &launch) {
+    auto matrix = launch.buffer<const float>(0) + launch.scalar<cl_uint>(1);
+    auto ld = launch.scalar<cl_uint>(2);
+    auto vectors = launch.buffer<const float>(3);
+    size_t rows = launch.scalar<cl_uint>(4);
+    size_t columns = launch.scalar<cl_uint>(5);
+    size_t count = launch.scalar<cl_uint>(6);
+    auto output = launch.buffer<float>(7);
+    auto bias = launch.buffer<const float>(8);
+    auto derivative = launch.buffer<float>(9);
+    auto epilogue = launch.scalar<cl_uint>(10);
+    launch.parallelFor(0, rows, columns*count, [=] (size_t begin, size_t end) {
+        multiplyRows(matrix, ld, vectors, columns, columns, rows, count, begin, end, output, bias, derivative, epilogue);
+    });
+}
+
+// output[v*columns + j] = dot(column j of the matrix, vectors[v]). Every task computes a block of
+// columns of one output vector by adding the rows of the matrix scaled by the vector's elements,
+// so the matrix is read along its rows.
+void multiplyTransposed(const HostLaunch &launch, const float *matrix, size_t ld, const float *vectors, size_t rows, size_t columns, size_t count, float *output) {
+    const size_t block = 512;
+    size_t blocks = (columns + block - 1) / block;
+    launch.parallelFor(0, count*blocks, rows*std::min(block, columns), [=] (size_t begin, size_t end) {
+        for (size_t task = begin; task < end; ++task) {
+            size_t v = task / blocks;
+            size_t first = (task % blocks)*block;
+            size_t n = std::min(block, columns - first);
+            const float *vector = vectors + v*rows;
+            float *result = output + v*columns + first;
+            std::fill(result, result + n, 0.0f);
+            for (size_t k = 0; k < rows; ++k) {
+                if (vector[k] != 0)
+                    simd::axpy(vector[k], matrix + k*ld + first, result, n);
+            }
+        }
+    });
+}
+
+void transposeMatrixVectorMulParallel(const HostLaunch &launch) {
+    auto matrix = launch.buffer<const float>(0) + launch.scalar<cl_uint>(1);
+    auto ld = launch.scalar<cl_uint>(2);
+    auto vectors = launch.buffer<const float>(3);
+    auto rows = launch.scalar<cl_uint>(4);
+    auto output = launch.buffer<float>(5);
+    multiplyTransposed(launch, matrix, ld, vectors, rows, launch.globalSize[1], launch.globalSize[0], output);
+}
+
+void transposeMatrixMatrixMul(const HostLaunch &launch) {
+    auto matrix = launch.buffer<const float>(0) + launch.scalar<cl_uint>(1);
+    auto ld = launch.scalar<cl_uint>(2);
+    auto vectors = launch.buffer<const float>(3);
+    auto rows = launch.scalar<cl_uint>(4);
+    auto columns = launch.scalar<cl_uint>(5);
+    auto count = launch.scalar<cl_uint>(6);
+    auto output = launch.buffer<float>(7);
+    multiplyTransposed(launch, matrix, ld, vectors, rows, columns, count, output);
+}
+
+void matrixOuterProductSum(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto y = launch.buffer<const float>(1);
+    size_t rows = launch.scalar<cl_uint>(2);
+    size_t columns = launch.scalar<cl_uint>(3);
+    size_t count = launch.scalar<cl_uint>(4);
+    auto beta = launch.scalar<float>(5);
+    auto dest = launch.buffer<float>(6) + launch.scalar<cl_uint>(7);
+    auto ld = launch.scalar<cl_uint>(8);
+    launch.parallelFor(0, rows, columns*count, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            float *row = dest + i*ld;
+            if (beta == 0)
+                std::fill(row, row + columns, 0.0f);
+            else if (beta != 1)
+                simd::scale(beta, row, columns);
+            for (size_t v = 0; v < count; ++v) {
+                if (x[v*rows + i] != 0)
+                    simd::axpy(x[v*rows + i], y + v*columns, row, columns);
+            }
+        }
+    });
+}
+
+void sparseToDense(const HostLaunch &launch) {
+    auto values = launch.buffer<const float>(0);
+    auto columnIndices = launch.buffer<const cl_uint>(1);
+    auto rowOffsets = launch.buffer<const cl_uint>(2);
+    size_t columns = launch.scalar<cl_uint>(3);
+    auto dest = launch.buffer<float>(4);
+    forEach(launch, columns, [=] (size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            float *vector = dest + v*columns;
+            std::fill(vector, vector + columns, 0.0f);
+            for (size_t k = rowOffsets[v]; k < rowOffsets[v + 1]; ++k)
+                vector[columnIndices[k]] += values[k];
+        }
+    });
+}
+
+void sparseMatrixMul(const HostLaunch &launch) {
+    auto matrix = launch.buffer<const float>(0) + launch.scalar<cl_uint>(1);
+    auto ld = launch.scalar<cl_uint>(2);
+    auto values = launch.buffer<const float>(3);
+    auto columnIndices = launch.buffer<const cl_uint>(4);
+    auto rowOffsets = launch.buffer<const cl_uint>(5);
+    auto output = launch.buffer<float>(6);
+    auto bias = launch.buffer<const float>(7);
+    auto derivative = launch.buffer<float>(8);
+    auto epilogue = launch.scalar<cl_uint>(9);
+    size_t rows = launch.globalSize[0];
+    size_t count = launch.globalSize[1];
+    launch.parallelFor(0, rows, rowOffsets[count] - rowOffsets[0] + count, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const float *row = matrix + i*ld;
+            for (size_t v = 0; v < count; ++v) {
+                float sum = 0;
+                for (size_t k = rowOffsets[v]; k < rowOffsets[v + 1]; ++k)
+                    sum += row[columnIndices[k]] * values[k];
+                size_t index = v*rows + i;
+                output[index] = applyEpilogue(sum, epilogue, bias, i, derivative, index);
+            }
+        }
+    });
+}
+
+void sparseOuterProductSum(const HostLaunch &launch) {
+    auto x = launch.buffer<const float>(0);
+    auto values = launch.buffer<const float>(1);
+    auto columnIndices = launch.buffer<const cl_uint>(2);
+    auto rowOffsets = launch.buffer<const cl_uint>(3);
+    size_t count = launch.scalar<cl_uint>(4);
+    size_t columns = launch.scalar<cl_uint>(5);
+    auto beta = launch.scalar<float>(6);
+    auto dest = launch.buffer<float>(7) + launch.scalar<cl_uint>(8);
+    auto ld = launch.scalar<cl_uint>(9);
+    size_t rows = launch.globalSize[0];
+    launch.parallelFor(0, rows, rowOffsets[count] - rowOffsets[0] + (beta != 1? columns : 0), [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            float *row = dest + i*ld;
+            if (beta == 0)
+                std::fill(row, row + columns, 0.0f);
+            else if (beta != 1)
+                simd::scale(beta, row, columns);
+            for (size_t v = 0; v < count; ++v) {
+                const float e = x[v*rows + i];
+                if (e == 0)
+                    continue;
+                for (size_t k = rowOffsets[v]; k < rowOffsets[v + 1]; ++k)
+                    row[columnIndices[k]] += e * values[k];
+            }
+        }
+    });
+}
+
+// The transfer functions of nn.cl.
+struct Sigmoid {
+    static float apply(float x) { return sigmoid(x); }
+    static float derivative(float y) { return y*(1.0f - y); }
+};
+
+struct Tanh {
+    static float apply(float x) { return std::tanh(x); }
+    static float derivative(float y) { return 1 - y*y; }
+};
+
+struct Relu {
+    static float apply(float x) { return std::max(x, 0.0f); }
+    static float derivative(float y) { return y > 0? 1.0f : 0.0f; }
+};
+
+template<typename Function>
+void predict(const HostLaunch &launch) {
+    auto x = launch.buffer<float>(0);
+    forEach(launch, 16, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            x[i] = Function::apply(x[i]);
+    });
+}
+
+template<typename Function>
+void feedforward(const HostLaunch &launch) {
+    auto x = launch.buffer<float>(0);
+    auto derivative = launch.buffer<float>(1);
+    forEach(launch, 16, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            float y = Function::apply(x[i]);
+            x[i] = y;
+            derivative[i] = Function::derivative(y);
+        }
+    });
+}
+
+void meanSquaredError(const HostLaunch &launch) {
+    auto prediction = launch.buffer<const float>(0);
+    auto y = launch.buffer<const float>(1);
+    auto output = launch.buffer<float>(2);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            float diff = y[i] - prediction[i];
+            output[i] += diff * diff;
+        }
+    });
+}
+
+void crossEntropyError(const HostLaunch &launch) {
+    auto prediction = launch.buffer<const float>(0);
+    auto y = launch.buffer<const float>(1);
+    auto output = launch.buffer<float>(2);
+    forEach(launch, 16, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            float err = -(y[i]*std::log(prediction[i]) + (1.0f - y[i])*std::log(1.0f - prediction[i]));
+            output[i] += std::isnan(err)? 0.0f : err;
+        }
+    });
+}
+
+void computeMSELayerError(const HostLaunch &launch) {
+    auto prediction = launch.buffer<const float>(0);
+    auto y = launch.buffer<const float>(1);
+    auto derivative = launch.buffer<const float>(2);
+    auto errorTerm = launch.buffer<float>(3);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            errorTerm[i] = (prediction[i] - y[i]) * derivative[i];
+    });
+}
+
+void computeCrossEntropyLayerError(const HostLaunch &launch) {
+    auto prediction = launch.buffer<const float>(0);
+    auto y = launch.buffer<const float>(1);
+    auto errorTerm = launch.buffer<float>(2);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        simd::elementwise(simd::Sub, prediction + begin, y + begin, errorTerm + begin, end - begin);
+    });
+}
+
+// gradients[row*columns + column] += sum(errorTerm[i*rows + row] * input[i*columns + column]) for
+// all the count vectors. Like in the kernels, the products of the vectors are summed before
+// they're added to the gradients.
+void addWeightGradients(const HostLaunch &launch, const float *errorTerm, const float *input, float *gradients, size_t rows, size_t columns, size_t count) {
+    launch.parallelFor(0, rows, columns*count, [=] (size_t begin, size_t end) {
+        std::vector<float> sums(count > 1? columns : 0);
+        for (size_t row = begin; row < end; ++row) {
+            float *rowGradients = gradients + row*columns;
+            if (count == 1) {
+                simd::axpy(errorTerm[row], input, rowGradients, columns);
+                continue;
+            }
+            std::fill(sums.begin(), sums.end(), 0.0f);
+            for (size_t i = 0; i < count; ++i)
+                simd::axpy(errorTerm[i*rows + row], input + i*columns, sums.data(), columns);
+            simd::elementwise(simd::Add, rowGradients, sums.data(), rowGradients, columns);
+        }
+    });
+}
+
+void computeWeightGradient(const HostLaunch &launch) {
+    addWeightGradients(launch, launch.buffer<const float>(0), launch.buffer<const float>(1), launch.buffer<float>(2), launch.globalSize[0], launch.globalSize[1], 1);
+}
+
+void computeWeightGradient4(const HostLaunch &launch) {
+    addWeightGradients(launch, launch.buffer<const float>(0), launch.buffer<const float>(1), launch.buffer<float>(2), launch.globalSize[0], launch.scalar<cl_uint>(3), 1);
+}
+
+void computeWeightGradientParallel(const HostLaunch &launch) {
+    addWeightGradients(launch, launch.buffer<const float>(0), launch.buffer<const float>(1), launch.buffer<float>(2), launch.globalSize[0], launch.globalSize[1], launch.scalar<cl_uint>(3));
+}
+
+void computeWeightGradient4Parallel(const HostLaunch &launch) {
+    addWeightGradients(launch, launch.buffer<const float>(0), launch.buffer<const float>(1), launch.buffer<float>(2), launch.globalSize[0], launch.scalar<cl_uint>(4), launch.scalar<cl_uint>(3));
+}
+
+void evaluateClassification(const HostLaunch &launch) {
+    auto outputs = launch.buffer<const float>(0);
+    size_t size = launch.scalar<cl_uint>(1);
+    auto labels = launch.buffer<const cl_ushort>(2);
+    auto dest = launch.buffer<cl_uchar>(3);
+    size_t offset = launch.globalOffset[0];
+    forEach(launch, size, [=] (size_t begin, size_t end) {
+        for (size_t part = begin; part < end; ++part) {
+            const float *output = outputs + size*(part - offset);
+            size_t maxIndex = std::max_element(output, output + size) - output;
+            dest[part] = maxIndex == labels[part];
+        }
+    });
+}
+
+void gradientDescent(const HostLaunch &launch) {
+    auto weights = launch.buffer<float>(0);
+    auto gradients = launch.buffer<const float>(1);
+    auto learningRate = launch.scalar<float>(2);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        simd::axpy(-learningRate, gradients + begin, weights + begin, end - begin);
+    });
+}
+
+void momentumGradientDescent(const HostLaunch &launch) {
+    auto weights = launch.buffer<float>(0);
+    auto gradients = launch.buffer<const float>(1);
+    auto velocity = launch.buffer<float>(2);
+    auto learningRate = launch.scalar<float>(3);
+    auto momentumDecay = launch.scalar<float>(4);
+    forEach(launch, 1, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            float v = velocity[i]*momentumDecay - learningRate*gradients[i];
+            weights[i] = weights[i] + v;
+            velocity[i] = v;
+        }
+    });
+}
+
+// The generator of random.cl.
+inline cl_uint tausStep(cl_uint z, int s1, int s2, int s3, cl_uint m) {
+    cl_uint b = (((z << s1) ^ z) >> s2);
+    return (((z & m) << s3) ^ b);
+}
+
+inline float random(cl_uint *state) {
+    state[0] = tausStep(state[0], 13, 19, 12, 4294967294u);
+    state[1] = tausStep(state[1], 2, 25, 4, 4294967288u);
+    state[2] = tausStep(state[2], 3, 11, 17, 4294967280u);
+    state[3] = 1664525u * state[3] + 1013904223u;
+    return float(2.3283064365387e-10 * (state[0] ^ state[1] ^ state[2] ^ state[3]));
+}
+
+void uniformRandom(const HostLaunch &launch) {
+    auto x = launch.buffer<float>(0);
+    auto state = launch.buffer<cl_uint>(1);
+    forEach(launch, 8, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            x[i] = random(state + 4*i);
+    });
+}
+
+void invertedDropout(const HostLaunch &launch) {
+    auto x = launch.buffer<float>(0);
+    auto state = launch.buffer<cl_uint>(1);
+    auto activationProbability = launch.scalar<float>(2);
+    forEach(launch, 8, [=] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            x[i] *= (random(state + 4*i) < activationProbability? 1.0f : 0.0f) / activationProbability;
+    });
+}
+
+void partialTrueCount(const HostLaunch &launch) {
+    auto x = launch.buffer<const cl_uchar>(0);
+    size_t size = launch.scalar<cl_uint>(1);
+    size_t partSize = launch.scalar<cl_uint>(2);
+    auto dest = launch.buffer<cl_uint>(3);
+    forEach(launch, partSize, [=] (size_t begin, size_t end) {
+        for (size_t part = begin; part < end; ++part) {
+            size_t first = std::min(part*partSize, size);
+            size_t last = std::min(part*partSize + partSize, size);
+            cl_uint correct = 0;
+            for (size_t i = first; i < last; ++i)
+                correct += x[i] != 0;
+            dest[part] = correct;
+        }
+    });
+}
+
+// The reductions of reduce.cl. Every work-group of the launch reduces a contiguous part of the
+// vector to its partial result, so the results have the same layout as on the OpenCL devices.
+template<typename Accumulator, Reduction reduction>
+struct Reducer {
+    static Accumulator identity() {
+        if (reduction == Reduction::Max || reduction == Reduction::ArgMax)
+            return std::numeric_limits<Accumulator>::has_infinity? -std::numeric_limits<Accumulator>::infinity() : std::numeric_limits<Accumulator>::lowest();
+        if (reduction == Reduction::Min)
+            return std::numeric_limits<Accumulator>::has_infinity? std::numeric_limits<Accumulator>::infinity() : std::numeric_limits<Accumulator>::max();
+        return 0;
+    }
+
+    static Accumulator combine(Accumulator a, Accumulator b) {
+        if (reduction == Reduction::Max || reduction == Reduction::ArgMax)
+            return std::max(a, b);
+        if (reduction == Reduction::Min)
+            return std::min(a, b);
+        return a + b;
+    }
+
+    // The value of the i-th element that's reduced.
+    template<typename T>
+    static Accumulator map(const T *x, const T *y, size_t i) {
+        switch (reduction) {
+        case Reduction::Dot: return Accumulator(x[i]) * Accumulator(y[i]);
+        case Reduction::L2Norm: return Accumulator(x[i]) * Accumulator(x[i]);
+        case Reduction::CountNonzero: return Accumulator(x[i] != 0);
+        default: return Accumulator(x[i]);
+        }
+    }
+
+    static Accumulator finish(Accumulator x) {
+        return reduction == Reduction::L2Norm? Accumulator(std::sqrt(x)) : x;
+    }
+};
+
+// Reduces x[first], ..., x[last - 1]. The floats are summed with the vector instructions.
+template<typename T, typename Accumulator, Reduction reduction>
+Accumulator reduceRange(const T *x, const T *y, size_t first, size_t last) {
+    typedef Reducer<Accumulator, reduction> R;
+    Accumulator value = R::identity();
+    for (size_t i = first; i < last; ++i)
+        value = R::combine(value, R::template map<T>(x, y, i));
+    return value;
+}
+
+template<>
+float reduceRange<float, float, Reduction::Sum>(const float *x, const float *, size_t first, size_t last) {
+    return simd::sum(x + first, last - first);
+}
+
+template<>
+float reduceRange<float, float, Reduction::Dot>(const float *x, const float *y, size_t first, size_t last) {
+    return simd::dot(x + first, y + first, last - first);
+}
+
+template<>
+float reduceRange<float, float, Reduction::L2Norm>(const float *x, const float *, size_t first, size_t last) {
+    return simd::dot(x + first, x + first, last - first);
+}
+
+// Runs the reduction of a work-group for every work-group of the launch. The elements and
+// the indices of the elements are read by the given functions.
+template<typename Accumulator, Reduction reduction, typename Range, typename Element>
+void reduceWorkgroups(const HostLaunch &launch, Range reduceRange, Element element) {
+    typedef Reducer<Accumulator, reduction> R;
+    size_t size = launch.scalar<cl_uint>(2);
+    bool last = launch.scalar<cl_uint>(3) != 0;
+    auto dest = launch.buffer<Accumulator>(4);
+    auto destIndices = launch.buffer<cl_uint>(5);
+    size_t groups = launch.workgroupSize[0]? std::max(launch.globalSize[0] / launch.workgroupSize[0], size_t(1)) : 1;
+    size_t partSize = (size + groups - 1) / groups;
+    launch.parallelFor(0, groups, partSize, [=] (size_t begin, size_t end) {
+        for (size_t group = begin; group < end; ++group) {
+            size_t first = std::min(group*partSize, size);
+            size_t lastElement = std::min(first + partSize, size);
+            if (reduction != Reduction::ArgMax) {
+                Accumulator value = reduceRange(first, lastElement);
+                dest[group] = last? R::finish(value) : value;
+                continue;
+            }
+            // The first maximum wins, like in UPDATE_MAXIMUM.
+            Accumulator value = R::identity();
+            cl_uint index = UINT_MAX;
+            for (size_t i = first; i < lastElement; ++i) {
+                Accumulator v;
+                cl_uint vi;
+                element(i, v, vi);
+                if (v > value || (v == value && vi < index)) {
+                    value = v;
+                    index = vi;
+                }
+            }
+            dest[group] = value;
+            destIndices[group] = index;
+        }
+    });
+}
+
+template<typename T, typename Accumulator, Reduction reduction>
+void reduce(const HostLaunch &launch) {
+    auto x = launch.buffer<const T>(0);
+    auto y = launch.buffer<const T>(1);
+    reduceWorkgroups<Accumulator, reduction>(launch, [=] (size_t first, size_t last) {
+        return reduceRange<T, Accumulator, reduction>(x, y, first, last);
+    }, [=] (size_t i, Accumulator &value, cl_uint &index) {
+        value = Accumulator(x[i]);
+        index = cl_uint(i);
+    });
+}
+
+template<typename Accumulator, Reduction reduction>
+void reducePartials(const HostLaunch &launch) {
+    typedef Reducer<Accumulator, reduction> R;
+    auto x = launch.buffer<const Accumulator>(0);
+    auto indices = launch.buffer<const cl_uint>(1);
+    reduceWorkgroups<Accumulator, reduction>(launch, [=] (size_t first, size_t last) {
+        Accumulator value = R::identity();
+        for (size_t i = first; i < last; ++i)
+            value = R::combine(value, x[i]);
+        return value;
+    }, [=] (size_t i, Accumulator &value, cl_uint &index) {
+        value = x[i];
+        index = indices[i];
+    });
+}
+
+template<typename T, typename Accumulator, Reduction reduction>
+HostKernel reduceKernel(bool partials) {
+    return partials? reducePartials<Accumulator, reduction> : reduce<T, Accumulator, reduction>;
+}
+
+template<typename T, typename Accumulator>
+HostKernel reduceKernel(Reduction reduction, bool partials) {
+    switch (reduction) {
+    case Reduction::Sum: return reduceKernel<T, Accumulator, Reduction::Sum>(partials);
+    case Reduction::Max: return reduceKernel<T, Accumulator, Reduction::Max>(partials);
+    case Reduction::Min: return reduceKernel<T, Accumulator, Reduction::Min>(partials);
+    case Reduction::ArgMax: return reduceKernel<T, Accumulator, Reduction::ArgMax>(partials);
+    case Reduction::Dot: return reduceKernel<T, Accumulator, Reduction::Dot>(partials);
+    case Reduction::L2Norm: return reduceKernel<T, Accumulator, Reduction::L2Norm>(partials);
+    case Reduction::CountNonzero: return reduceKernel<T, Accumulator, Reduction::CountNonzero>(partials);
+    }
+    return nullptr;
+}
+
+template<typename T>
+HostKernel reduceKernel(bool integerAccumulator, bool signedAccumulator, Reduction reduction, bool partials) {
+    if (!integerAccumulator)
+        return reduceKernel<T, float>(reduction, partials);
+    return signedAccumulator? reduceKernel<T, cl_int>(reduction, partials) : reduceKernel<T, cl_uint>(reduction, partials);
+}
+
+// Returns true if the options define the given name, and sets the value to its value.
+bool isDefined(const std::string &options, const char *name, std::string *value = nullptr) {
+    std::string definition = std::string("-D") + name;
+    for (size_t i = options.find(definition); i != std::string::npos; i = options.find(definition, i + 1)) {
+        size_t end = i + definition.size();
+        if (i != 0 && options[i - 1] != ' ')
+            continue;
+        if (end == options.size() || options[end] == ' ') {
+            if (value)
+                value->clear();
+            return true;
+        }
+        if (options[end] == '=') {
+            if (value)
+                *value = options.substr(end + 1, options.find(' ', end) - end - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+HostKernel findReduceKernel(const std::string &options, bool partials) {
+    std::string type = "float", accumulator = "float";
+    isDefined(options, "TYPE", &type);
+    isDefined(options, "ACCUMULATOR", &accumulator);
+    bool integerAccumulator = isDefined(options, "INTEGER_ACCUMULATOR");
+    bool signedAccumulator = integerAccumulator && isDefined(options, "SIGNED_ACCUMULATOR");
+    if (accumulator != (!integerAccumulator? "float" : signedAccumulator? "int" : "uint"))
+        return nullptr;
+
+    Reduction reduction = Reduction::Sum;
+    const std::pair<const char *, Reduction> reductions[] = {
+        { "MAX", Reduction::Max }, { "MIN", Reduction::Min }, { "ARGMAX", Reduction::ArgMax }, { "DOT", Reduction::Dot },
+        { "L2_NORM", Reduction::L2Norm }, { "COUNT_NONZERO", Reduction::CountNonzero }
+    };
+    for (const auto &r : reductions) {
+        if (isDefined(options, r.first))
+            reduction = r.second;
+    }
+
+    if (type == "float")
+        return reduceKernel<float>(integerAccumulator, signedAccumulator, reduction, partials);
+    if (type == "char")
+        return reduceKernel<cl_char>(integerAccumulator, signedAccumulator, reduction, partials);
+    if (type == "uchar")
+        return reduceKernel<cl_uchar>(integerAccumulator, signedAccumulator, reduction, partials);
+    if (type == "ushort")
+        return reduceKernel<cl_ushort>(integerAccumulator, signedAccumulator, reduction, partials);
+    if (type == "uint")
+        return reduceKernel<cl_uint>(integerAccumulator, signedAccumulator, reduction, partials);
+    // The half and double reductions.
+    return nullptr;
+}
+
+// The kernels of the generated expressions, which run the code of the expression on blocks of elements.
+void expression(const HostLaunch &launch) {
+    auto dest = launch.buffer<float>(0);
+    const auto &code = launch.scalar<const HostExpression*>(unsigned(launch.arguments.size() - 1))->code;
+    size_t size = launch.globalSize[0];
+    forEach(launch, code.size(), [&] (size_t begin, size_t end) {
+        const size_t block = 256;
+        // The stack can't be deeper than the number of instructions.
+        std::vector<float> stack(code.size()*block);
+        for (size_t b = begin; b < end; b += block) {
+            size_t n = std::min(block, end - b);
+            float *top = stack.data();
+            for (const auto &instruction : code) {
+                float *x = top - 2*block;
+                float *y = top - block;
+                switch (instruction.operation) {
+                case Expression::Load: {
+                    auto v = launch.buffer<const float>(instruction.argument);
+                    if (instruction.size == size)
+                        memcpy(top, v + b, n*sizeof(float));
+                    else {
+                        for (size_t i = 0; i < n; ++i)
+                            top[i] = v[(b + i) % instruction.size];
+                    }
+                    top += block;
+                    break;
+                }
+                case Expression::Constant:
+                    std::fill(top, top + n, launch.scalar<float>(instruction.argument));
+                    top += block;
+                    break;
+                case Expression::Negate:
+                    for (size_t i = 0; i < n; ++i)
+                        y[i] = -y[i];
+                    break;
+                case Expression::Exp:
+                    for (size_t i = 0; i < n; ++i)
+                        y[i] = std::exp(y[i]);
+                    break;
+                case Expression::Log:
+                    for (size_t i = 0; i < n; ++i)
+                        y[i] = std::log(y[i]);
+                    break;
+                case Expression::Sqrt:
+                    for (size_t i = 0; i < n; ++i)
+                        y[i] = std::sqrt(y[i]);
+                    break;
+                case Expression::Add:
+                    simd::elementwise(simd::Add, x, y, x, n);
+                    top -= block;
+                    break;
+                case Expression::Sub:
+                    simd::elementwise(simd::Sub, x, y, x, n);
+                    top -= block;
+                    break;
+                case Expression::Mul:
+                    simd::elementwise(simd::Mul, x, y, x, n);
+                    top -= block;
+                    break;
+                case Expression::Div:
+                    simd::elementwise(simd::Div, x, y, x, n);
+                    top -= block;
+                    break;
+                case Expression::Min:
+                    for (size_t i = 0; i < n; ++i)
+                        x[i] = std::fmin(x[i], y[i]);
+                    top -= block;
+                    break;
+                case Expression::Max:
+                    for (size_t i = 0; i < n; ++i)
+                        x[i] = std::fmax(x[i], y[i]);
+                    top -= block;
+                    break;
+                }
+            }
+            memcpy(dest + b, stack.data(), n*sizeof(float));
+        }
+    });
+}
+
+struct NamedKernel {
+    const char *name;
+    HostKernel kernel;
+};
+
+// The float kernels of generic.cl, nn.cl, gradientDescent.cl, random.cl and fixed.cl.
+const NamedKernel kernels[] = {
+    { "fill", fill },
+    { "constantMul", elementwiseConstantKernel<simd::Mul> },
+    { "constantDiv", elementwiseConstantKernel<simd::Div> },
+    { "elementSub", elementwiseKernel<simd::Sub> },
+    { "elementAdd", elementwiseKernel<simd::Add> },
+    { "elementMul", elementwiseKernel<simd::Mul> },
+    { "elementAddParallel", elementAddParallel },
+    { "sumVectors", sumVectors },
+    { "convertToFloat", convertFloat },
+    { "convertFromFloat", convertFloat },
+    { "partialSum", partialSum },
+    { "matrixIdentity", matrixIdentity },
+    { "matrixVectorMul", matrixVectorMul<false, false> },
+    { "matrixVectorMul4", matrixVectorMul<false, true> },
+    { "matrixVectorMulParallel", matrixVectorMul<true, false> },
+    { "matrixVectorMul4Parallel", matrixVectorMul<true, true> },
+    { "transposeMatrixVectorMulParallel", transposeMatrixVectorMulParallel },
+    { "matrixMatrixMul", matrixMatrixMul },
+    { "transposeMatrixMatrixMul", transposeMatrixMatrixMul },
+    { "matrixOuterProductSum", matrixOuterProductSum },
+    { "sparseToDense", sparseToDense },
+    { "sparseMatrixMul", sparseMatrixMul },
+    { "sparseOuterProductSum", sparseOuterProductSum },
+    { "sigmoidPredict", predict<Sigmoid> },
+    { "sigmoidFeedforward", feedforward<Sigmoid> },
+    { "tanhPredict", predict<Tanh> },
+    { "tanhFeedforward", feedforward<Tanh> },
+    { "reluPredict", predict<Relu> },
+    { "reluFeedforward", feedforward<Relu> },
+    { "meanSquaredError", meanSquaredError },
+    { "crossEntropyError", crossEntropyError },
+    { "computeMSELayerError", computeMSELayerError },
+    { "computeCrossEntropyLayerError", computeCrossEntropyLayerError },
+    { "computeWeightGradient", computeWeightGradient },
+    { "computeWeightGradient4", computeWeightGradient4 },
+    { "computeWeightGradientParallel", computeWeightGradientParallel },
+    { "computeWeightGradient4Parallel", computeWeightGradient4Parallel },
+    { "evaluateClassification", evaluateClassification },
+    { "gradientDescent", gradientDescent },
+    { "momentumGradientDescent", momentumGradientDescent },
+    { "uniformRandom", uniformRandom },
+    { "invertedDropout", invertedDropout },
+    { "partialTrueCount", partialTrueCount },
+    { "expression", expression }
+};
+
+} // namespace
+
+namespace nnFit {
+
+HostKernel findHostKernel(const char *name, const std::string &options) {
+    if (!strcmp(name, "reduce") || !strcmp(name, "reducePartials"))
+        return findReduceKernel(options, !strcmp(name, "reducePartials"));
+    // Only the float kernels are implemented.
+    std::string scalar;
+    if (isDefined(options, "HALF_STORAGE") || (isDefined(options, "SCALAR", &scalar) && scalar != "float"))
+        return nullptr;
+    for (const auto &kernel : kernels) {
+        if (!strcmp(kernel.name, name))
+            return kernel.kernel;
+    }
+    return nullptr;
+}
+
+void runHostKernel(HostKernel kernel, const std::vector<KernelArgument> &arguments, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize, ThreadPool &pool) {
+    HostLaunch launch = { arguments, dimensions, { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 }, pool };
+    for (unsigned i = 0; i < dimensions; ++i) {
+        launch.globalSize[i] = globalSize[i];
+        launch.globalOffset[i] = globalOffset? globalOffset[i] : 0;
+        launch.workgroupSize[i] = workgroupSize? workgroupSize[i] : 0;
+    }
+    kernel(launch);
+}
+
+} // namespace nnFit
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstring>
+#include "opencl.h"
+
+namespace nnFit {
+
+// HostBuffer - the memory of a storage object on the host device. The memory is aligned
+// for the widest vector loads. The cl_mem handles of the host device point to HostBuffers,
+// so the code that only passes the handles around, like the kernel invocations and the
+// command recordings, is shared with the OpenCL devices.
+class HostBuffer {
+public:
+    // Returns a buffer with a single reference. The memory is zeroed when there's no data.
+    static cl_mem create(size_t size, const void *data = nullptr);
+
+    static HostBuffer *get(cl_mem buffer) {
+        return reinterpret_cast<HostBuffer*>(buffer);
+    }
+
+    void retain();
+    void release();
+
+    unsigned char *data() const {
+        return memory;
+    }
+
+    size_t size() const {
+        return length;
+    }
+private:
+    HostBuffer(size_t size);
+    ~HostBuffer();
+    HostBuffer(const HostBuffer &) = delete;
+
+    unsigned char *memory;
+    size_t length;
+    std::atomic<unsigned> references;
+};
+
+// HostLaunch - a kernel launch on the host device. The sizes and the offsets of the
+// dimensions that aren't used are 0, and so are the work-group sizes when the launch
+// doesn't specify them. Only the kernels whose results depend on the work-groups,
+// like the reductions, use their sizes.
+struct HostLaunch {
+    const std::vector<KernelArgument> &arguments;
+    unsigned dimensions;
+    size_t globalSize[3], globalOffset[3], workgroupSize[3];
+    ThreadPool &pool;
+
+    // The memory of the i-th argument.
+    template<typename T>
+    T *buffer(unsigned i) const {
+        assert(i < arguments.size() && arguments[i].isStorage);
+        cl_mem mem;
+        memcpy(&mem, arguments[i].value, sizeof(mem));
+        return reinterpret_cast<T*>(HostBuffer::get(mem)->data());
+    }
+
+    // The value of the i-th argument.
+    template<typename T>
+    T scalar(unsigned i) const {
+        assert(i < arguments.size() && arguments[i].size == sizeof(T));
+        T result;
+        memcpy(&result, arguments[i].value, sizeof(result));
+        return result;
+    }
+
+    // Calls body(first, last) for the subranges of [begin, end) on the threads of the
+    // host device. Every index costs about the given number of operations, and the
+    // ranges are large enough to amortize the cost of running them on another thread.
+    void parallelFor(size_t begin, size_t end, size_t cost, const std::function<void (size_t, size_t)> &body) const;
+};
+
+// Returns the native implementation of the kernel with the given name that's specialized
+// with the given build options, or nullptr when the host device doesn't support it.
+HostKernel findHostKernel(const char *name, const std::string &options);
+
+// Runs the kernel on the host device and returns once it's done.
+void runHostKernel(HostKernel kernel, const std::vector<KernelArgument> &arguments, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize, ThreadPool &pool);
+
+} // namespace nnFit
@@ -0,0 +1,175 @@
+#include <cassert>
+#include <algorithm>
+#include <iomanip>
+#include "instrumentation.h"
+#include "opencl.h"
+
+using namespace nnFit;
+
+// The device times of the launches are resolved when there are this many pending launches.
+static const size_t maxPendingLaunches = 4096;
+
+Instrumentation::Scope::Scope(const std::string &name, Scope *parent) : name(name), parent(parent) {
+    reset();
+}
+
+void Instrumentation::Scope::reset() {
+    calls = 0;
+    hostTime = deviceTime = 0;
+    launches = 0;
+    bytesToDevice = bytesFromDevice = 0;
+    for (auto &child : children)
+        child->reset();
+}
+
+Instrumentation::Instrumentation() : root("root", nullptr), current(&root) {
+}
+
+Instrumentation::~Instrumentation() {
+    for (auto &launch : pending)
+        clReleaseEvent(launch.first);
+}
+
+// Returns the child of the scope with the given name, creating it if needed.
+Instrumentation::Scope *Instrumentation::child(Scope *scope, const std::string &name) {
+    for (auto &child : scope->children) {
+        if (child->name == name)
+            return child.get();
+    }
+    scope->children.emplace_back(new Scope(name, scope));
+    return scope->children.back().get();
+}
+
+void Instrumentation::enter(const char *name, size_t index) {
+    std::string scopeName(name);
+    if (index != InstrumentationScope::noIndex)
+        scopeName += " " + std::to_string(index);
+    current = child(current, scopeName);
+}
+
+void Instrumentation::leave(double hostTime) {
+    assert(current != &root);
+    current->calls++;
+    current->hostTime += hostTime;
+    current = current->parent;
+}
+
+void Instrumentation::kernelLaunched(cl_event event, const std::vector<std::string> &scopes) {
+    auto scope = current;
+    for (const auto &name : scopes)
+        scope = child(scope, name);
+    scope->launches++;
+    if (!event)
+        return;
+    clRetainEvent(event);
+    pending.push_back(std::make_pair(event, scope));
+    if (pending.size() >= maxPendingLaunches)
+        resolvePendingLaunches();
+}
+
+size_t Instrumentation::depth() const {
+    size_t result = 0;
+    for (auto scope = current; scope->parent; scope = scope->parent)
+        ++result;
+    return result;
+}
+
+std::vector<std::string> Instrumentation::scopesBelow(size_t depth) const {
+    size_t currentDepth = this->depth();
+    std::vector<std::string> result(currentDepth > depth? currentDepth - depth : 0);
+    auto scope = current;
+    for (size_t i = result.size(); i > 0; --i, scope = scope->parent)
+        result[i - 1] = scope->name;
+    return result;
+}
+
+void Instrumentation::transferred(size_t bytes, bool toDevice) {
+    if (toDevice)
+        current->bytesToDevice += bytes;
+    else
+        current->bytesFromDevice += bytes;
+}
+
+void Instrumentation::resolvePendingLaunches() {
+    for (auto &launch : pending) {
+        auto event = launch.first;
+        clWaitForEvents(1, &event);
+        cl_ulong start = 0, end = 0;
+        if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr) == CL_SUCCESS &&
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr) == CL_SUCCESS)
+            launch.second->deviceTime += double(end - start) * 1e-6;
+        clReleaseEvent(event);
+    }
+    pending.clear();
+}
+
+const Instrumentation::Scope &Instrumentation::report() {
+    resolvePendingLaunches();
+    return root;
+}
+
+// Returns the sum of the given counter over the scope and all of its children.
+template<typename T>
+static T total(const Instrumentation::Scope &scope, T Instrumentation::Scope::*counter) {
+    T result = scope.*counter;
+    for (const auto &child : scope.children)
+        result += total(*child, counter);
+    return result;
+}
+
+static void writeScope(std::ostream &os, const Instrumentation::Scope &scope, unsigned depth) {
+    os << std::string(depth * 2, ' ') << std::left << std::setw(32 - std::min(depth * 2, 30u)) << scope.name << std::right
+       << std::setw(8) << scope.calls
+       << std::setw(12) << std::fixed << std::setprecision(3) << scope.hostTime
+       << std::setw(12) << total(scope, &Instrumentation::Scope::deviceTime)
+       << std::setw(10) << total(scope, &Instrumentation::Scope::launches)
+       << std::setw(14) << total(scope, &Instrumentation::Scope::bytesToDevice)
+       << std::setw(14) << total(scope, &Instrumentation::Scope::bytesFromDevice) << "\n";
+    for (const auto &child : scope.children)
+        writeScope(os, *child, depth + 1);
+}
+
+void Instrumentation::writeReport(std::ostream &os) {
+    report();
+    os << std::left << std::setw(32) << "Scope" << std::right << std::setw(8) << "Calls" << std::setw(12) << "Host ms" << std::setw(12) << "Device ms" << std::setw(10) << "Launches" << std::setw(14) << "To device B" << std::setw(14) << "From device B" << "\n";
+    for (const auto &child : root.children)
+        writeScope(os, *child, 0);
+}
+
+static void writeJSONScope(std::ostream &os, const Instrumentation::Scope &scope) {
+    // The counters of a scope don't include its children.
+    os << "{\"name\":\"" << scope.name << "\",\"calls\":" << scope.calls
+       << ",\"hostTime\":" << scope.hostTime << ",\"deviceTime\":" << scope.deviceTime
+       << ",\"launches\":" << scope.launches << ",\"bytesToDevice\":" << scope.bytesToDevice
+       << ",\"bytesFromDevice\":" << scope.bytesFromDevice << ",\"children\":[";
+    for (size_t i = 0; i < scope.children.size(); ++i) {
+        if (i)
+            os << ",";
+        writeJSONScope(os, *scope.children[i]);
+    }
+    os << "]}";
+}
+
+void Instrumentation::writeJSON(std::ostream &os) {
+    writeJSONScope(os, report());
+    os << "\n";
+}
+
+void Instrumentation::reset() {
+    resolvePendingLaunches();
+    root.reset();
+}
+
+InstrumentationScope::InstrumentationScope(Device &device, const char *name, size_t index) : instrumentation(device.instrumentation()) {
+    if (!instrumentation)
+        return;
+    instrumentation->enter(name, index);
+    start = std::chrono::high_resolution_clock::now();
+}
+
+InstrumentationScope::~InstrumentationScope() {
+    if (!instrumentation)
+        return;
+    auto end = std::chrono::high_resolution_clock::now();
+    instrumentation->leave(std::chrono::duration<double, std::milli>(end - start).count());
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <ostream>
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+
+namespace nnFit {
+
+class Device;
+
+// Instrumentation - attributes the work done on a device to a tree of named scopes.
+// Every scope accumulates its host wall time, the device time and the number of
+// the kernels launched in it, and the bytes transferred between the host and
+// the device in it. The device time is only known for the kernels launched on
+// a profiling command queue.
+class Instrumentation {
+public:
+    struct Scope {
+        std::string name;
+        size_t calls;
+        // The times are in milliseconds.
+        double hostTime;
+        double deviceTime;
+        size_t launches;
+        size_t bytesToDevice;
+        size_t bytesFromDevice;
+        Scope *parent;
+        std::vector<std::unique_ptr<Scope>> children;
+        
+        Scope(const std::string &name, Scope *parent);
+        void reset();
+    };
+    
+    Instrumentation();
+    ~Instrumentation();
+    
+    void enter(const char *name, size_t index);
+    void leave(double hostTime);
+    // The event is only given for the kernels launched on a profiling queue, which have
+    // a device time. A replayed launch is attributed to the scope it was recorded in,
+    // whose path is relative to the current scope. The calls and the host time of
+    // the replayed scopes aren't counted, as no host code runs for them.
+    void kernelLaunched(cl_event event, const std::vector<std::string> &scopes = std::vector<std::string>());
+    void transferred(size_t bytes, bool toDevice);
+    
+    // The number of scopes that enclose the current scope.
+    size_t depth() const;
+    // Returns the names of the scopes that were entered below the given depth,
+    // outermost first, e.g. to record the scopes of a command.
+    std::vector<std::string> scopesBelow(size_t depth) const;
+    
+    // Returns the root scope, waiting for the kernels that were launched so far
+    // to find out their device time.
+    const Scope &report();
+    
+    // Writes the scopes as an indented table.
+    void writeReport(std::ostream &os);
+    void writeJSON(std::ostream &os);
+    
+    // Resets the counters of all the scopes, e.g. after every training iteration.
+    void reset();
+private:
+    Instrumentation(const Instrumentation &) = delete;
+    void resolvePendingLaunches();
+    static Scope *child(Scope *scope, const std::string &name);
+    
+    Scope root;
+    Scope *current;
+    std::vector<std::pair<cl_event, Scope*>> pending;
+};
+
+// InstrumentationScope - attributes the work done during its lifetime to a
+// child of the current scope of the device's instrumentation. It does nothing
+// when the instrumentation of the device is disabled.
+class InstrumentationScope {
+public:
+    static const size_t noIndex = size_t(-1);
+    
+    // The index is appended to the name of the scope, e.g. to tell the layers apart.
+    InstrumentationScope(Device &device, const char *name, size_t index = noIndex);
+    ~InstrumentationScope();
+private:
+    InstrumentationScope(const InstrumentationScope &) = delete;
+    Instrumentation *instrumentation;
+    std::chrono::high_resolution_clock::time_point start;
+};
+
+} // namespace nnFit
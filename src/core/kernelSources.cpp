@@ -0,0 +1,31 @@
+#include <cstring>
+#include "kernelSources.h"
+
+namespace {
+
+struct EmbeddedProgram {
+    const char *name;
+    const char *source;
+};
+
+// The programs are embedded at build time by embedKernels.sh.
+const EmbeddedProgram embeddedPrograms[] = {
+#include "kernelSources.inc"
+};
+
+} // end anonymous namespace
+
+const char *nnFit::embeddedProgramSource(const char *name) {
+    for (const auto &program : embeddedPrograms) {
+        if (strcmp(program.name, name) == 0)
+            return program.source;
+    }
+    return nullptr;
+}
+
+std::vector<const char *> nnFit::embeddedProgramNames() {
+    std::vector<const char *> result;
+    for (const auto &program : embeddedPrograms)
+        result.push_back(program.name);
+    return result;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+
+namespace nnFit {
+
+// Returns the source of an OpenCL program that's embedded in the library,
+// or nullptr if there's no embedded program with the given name.
+const char *embeddedProgramSource(const char *name);
+
+// Returns the names of all the programs that are embedded in the library.
+std::vector<const char *> embeddedProgramNames();
+
+} // namespace nnFit
@@ -0,0 +1,138 @@
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "memoryPool.h"
+
+using namespace nnFit;
+
+struct MemoryPool::State {
+    struct Block {
+        cl_mem slab;
+        size_t offset;
+        size_t size;
+    };
+    
+    // Passed to the destructor callback of an allocated buffer.
+    struct Allocation {
+        std::shared_ptr<State> state;
+        Block block;
+        bool dedicated;
+    };
+    
+    std::mutex mutex;
+    cl_context context;
+    size_t alignment;
+    size_t slabSize;
+    std::vector<cl_mem> slabs;
+    // The end of the allocated part of the last slab.
+    size_t slabOffset;
+    std::unordered_map<size_t, std::vector<Block>> freeBlocks;
+    Statistics stats;
+    
+    State(cl_context context, size_t alignment, size_t slabSize) : context(context), alignment(alignment), slabSize(slabSize), slabOffset(0) {
+        clRetainContext(context);
+    }
+    
+    ~State() {
+        for (auto slab : slabs)
+            clReleaseMemObject(slab);
+        clReleaseContext(context);
+    }
+    
+    void use(size_t size) {
+        stats.bytesInUse += size;
+        stats.highWaterMark = std::max(stats.highWaterMark, stats.bytesInUse);
+    }
+    
+    // Rounds the size up to one of the four classes between two powers of two.
+    size_t sizeClass(size_t size) const {
+        size_t power = alignment;
+        while (power * 2 <= size)
+            power *= 2;
+        size_t step = std::max(power / 4, alignment);
+        return (size + step - 1) / step * step;
+    }
+};
+
+void CL_CALLBACK MemoryPool::release(cl_mem, void *userData) {
+    std::unique_ptr<State::Allocation> allocation(static_cast<State::Allocation*>(userData));
+    auto &state = *allocation->state;
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.stats.bytesInUse -= allocation->block.size;
+    if (allocation->dedicated) {
+        state.stats.bytesReserved -= allocation->block.size;
+        return;
+    }
+    state.freeBlocks[allocation->block.size].push_back(allocation->block);
+}
+
+static size_t deviceAlignment(cl_device_id device) {
+    // The alignment is reported in bits.
+    cl_uint bits = 0;
+    if (clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(bits), &bits, nullptr) != CL_SUCCESS || bits < 8)
+        return 128;
+    return std::max(size_t(bits / 8), size_t(64));
+}
+
+MemoryPool::MemoryPool(cl_context context, cl_device_id device, size_t slabSize) : state(std::make_shared<State>(context, deviceAlignment(device), slabSize)) {
+}
+
+cl_mem MemoryPool::allocate(size_t size, cl_int &error) {
+    std::unique_ptr<State::Allocation> allocation(new State::Allocation());
+    allocation->state = state;
+    cl_mem result = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        size_t blockSize = state->sizeClass(size);
+        if (size == 0 || blockSize > state->slabSize / 4) {
+            result = clCreateBuffer(state->context, CL_MEM_READ_WRITE, size, nullptr, &error);
+            if (!result || error != CL_SUCCESS)
+                return result;
+            allocation->block = { nullptr, 0, size };
+            allocation->dedicated = true;
+            state->stats.bytesReserved += size;
+            state->use(size);
+        } else {
+            auto &blocks = state->freeBlocks[blockSize];
+            State::Block block;
+            if (!blocks.empty()) {
+                block = blocks.back();
+                blocks.pop_back();
+            } else {
+                if (state->slabs.empty() || state->slabOffset + blockSize > state->slabSize) {
+                    auto slab = clCreateBuffer(state->context, CL_MEM_READ_WRITE, state->slabSize, nullptr, &error);
+                    if (!slab || error != CL_SUCCESS)
+                        return nullptr;
+                    state->slabs.push_back(slab);
+                    state->slabOffset = 0;
+                    state->stats.bytesReserved += state->slabSize;
+                }
+                block = { state->slabs.back(), state->slabOffset, blockSize };
+                state->slabOffset += blockSize;
+            }
+            cl_buffer_region region = { block.offset, size };
+            result = clCreateSubBuffer(block.slab, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &error);
+            if (!result || error != CL_SUCCESS) {
+                blocks.push_back(block);
+                return result;
+            }
+            allocation->block = block;
+            allocation->dedicated = false;
+            state->use(blockSize);
+        }
+    }
+    error = clSetMemObjectDestructorCallback(result, release, allocation.get());
+    if (error == CL_SUCCESS)
+        allocation.release();
+    return result;
+}
+
+MemoryPool::Statistics MemoryPool::statistics() const {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->stats;
+}
+
+size_t MemoryPool::alignment() const {
+    return state->alignment;
+}
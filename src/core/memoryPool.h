@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+
+namespace nnFit {
+
+// MemoryPool - a caching device memory allocator.
+// Small and medium sized buffers are handed out as sub-buffers of large slabs,
+// so that the temporary vectors don't have to call clCreateBuffer every time
+// they are created. Freed blocks are recycled by their size class once the
+// OpenCL runtime destroys the sub-buffer, i.e. after all the commands that
+// use it have completed.
+class MemoryPool {
+public:
+    struct Statistics {
+        // The total size of the device memory allocated by the pool.
+        size_t bytesReserved;
+        // The total size of the blocks that are currently used.
+        size_t bytesInUse;
+        // The maximum value of bytesInUse.
+        size_t highWaterMark;
+        
+        Statistics() : bytesReserved(0), bytesInUse(0), highWaterMark(0) { }
+    };
+    
+    static const size_t defaultSlabSize = 32 * 1024 * 1024;
+    
+    MemoryPool(cl_context context, cl_device_id device, size_t slabSize = defaultSlabSize);
+    MemoryPool(const MemoryPool &) = delete;
+    
+    // Allocates a new buffer. Buffers that are larger than a quarter of the
+    // slab size get their own dedicated allocation.
+    cl_mem allocate(size_t size, cl_int &error);
+    
+    Statistics statistics() const;
+    
+    size_t alignment() const;
+private:
+    struct State;
+    static void CL_CALLBACK release(cl_mem buffer, void *userData);
+    
+    std::shared_ptr<State> state;
+};
+
+} // namespace nnFit
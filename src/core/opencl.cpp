@@ -1,11 +1,21 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <mutex>
+#include <condition_variable>
 #include "opencl.h"
 #include "vector.h"
+#include "kernelSources.h"
+#include "hostKernels.h"
+#include "threadPool.h"
+#include "simd.h"
 
 using namespace nnFit;
 
-Device::Device(cl_device_id device) : device(device), ctx(nullptr) {
+Device::Device(cl_device_id device) : device(device), ctx(nullptr), subDevice(false) {
     auto error = clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
     if (error != CL_SUCCESS) {
         type = CL_DEVICE_TYPE_DEFAULT;
@@ -13,41 +23,206 @@ Device::Device(cl_device_id device) : device(device), ctx(nullptr) {
     maxThreadsInWorkgroup = 0;
 }
 
-Device::Device(Device &&other) : device(std::move(other.device)), ctx(std::move(other.ctx)), type(other.type), maxThreadsInWorkgroup(other.maxThreadsInWorkgroup), tensorKernel(std::move(other.tensorKernel)), programs(std::move(other.programs)) {
+Device::Device(std::unique_ptr<ThreadPool> threads) : device(nullptr), defaultQueue(nullptr), ctx(nullptr), type(CL_DEVICE_TYPE_CPU), subDevice(false), maxThreadsInWorkgroup(0), hostThreads(std::move(threads)) {
+}
+
+Device Device::host(unsigned threads) {
+    return Device(std::unique_ptr<ThreadPool>(new ThreadPool(threads)));
+}
+
+Device::Device(Device &&other) : device(std::move(other.device)), ctx(std::move(other.ctx)), type(other.type), subDevice(other.subDevice), maxThreadsInWorkgroup(other.maxThreadsInWorkgroup), hostThreads(std::move(other.hostThreads)), tensorKernel(std::move(other.tensorKernel)), compiledProgramCache(std::move(other.compiledProgramCache)), tuner(std::move(other.tuner)), pool(std::move(other.pool)), instrumentationScopes(std::move(other.instrumentationScopes)), programs(std::move(other.programs)), sharedObjects(std::move(other.sharedObjects)) {
     other.device = nullptr;
     other.ctx = nullptr;
 }
 
 Device::~Device() {
+    // The shared objects hold kernels of the programs owned by this device.
+    sharedObjects.clear();
+    tensorKernel.reset();
     if (ctx)
         clReleaseContext(ctx);
+    if (device && subDevice)
+        clReleaseDevice(device);
+}
+
+BuildOptions &BuildOptions::define(const std::string &name) {
+    options += (options.empty()? "-D" : " -D") + name;
+    return *this;
+}
+
+BuildOptions &BuildOptions::define(const std::string &name, const std::string &value) {
+    return define(name + "=" + value);
+}
+
+BuildOptions &BuildOptions::define(const std::string &name, size_t value) {
+    return define(name, std::to_string(value));
+}
+
+BuildOptions &BuildOptions::option(const std::string &option) {
+    options += (options.empty()? "" : " ") + option;
+    return *this;
 }
 
 void Device::init() {
-    std::ifstream generic("generic.cl");
-    std::ifstream fixed("fixed.cl");
-    tensorKernel.reset(new TensorKernels(*this, generic, fixed));
+    // Start building all the programs at once so that they're compiled concurrently.
+    // The kernels are created when they're used, which waits for their program to be built.
+    for (auto name : embeddedProgramNames())
+        getProgram(name);
+    tensorKernel.reset(new TensorKernels(*this));
     
+    if (isHost()) {
+        // The host kernels don't have a work-group size limit, but the
+        // reductions still split the work between the work-groups.
+        maxThreadsInWorkgroup = 1024;
+        return;
+    }
     auto errorCode = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxThreadsInWorkgroup), &maxThreadsInWorkgroup, nullptr);
     if (errorCode != CL_SUCCESS) {
         error(errorCode, "Failed to get the max work group size");
     }
 }
 
+bool Device::supportsSharedVirtualMemory() {
+#ifdef CL_VERSION_2_0
+    // The version string has the form "OpenCL <major>.<minor> <vendor specific>".
+    auto deviceVersion = version();
+    if (deviceVersion.compare(0, 7, "OpenCL ") != 0 || deviceVersion.size() < 8 || deviceVersion[7] < '2')
+        return false;
+    cl_bitfield capabilities = 0;
+    if (clGetDeviceInfo(device, CL_DEVICE_SVM_CAPABILITIES, sizeof(capabilities), &capabilities, nullptr) != CL_SUCCESS)
+        return false;
+    return (capabilities & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) != 0;
+#else
+    return false;
+#endif
+}
+
+bool Device::supportsSubGroups() {
+    auto deviceVersion = version();
+    if (deviceVersion.compare(0, 7, "OpenCL ") != 0 || deviceVersion.size() < 8 || deviceVersion[7] < '2')
+        return false;
+    return extensions().find("cl_khr_subgroups") != std::string::npos;
+}
+
+bool Device::supportsOpenCLC2() {
+    // The version string has the form "OpenCL C <major>.<minor> <vendor specific>". A device
+    // may support an OpenCL 2.x API while its compiler only accepts OpenCL C 1.2.
+    auto cVersion = openCLCVersion();
+    if (cVersion.compare(0, 9, "OpenCL C ") != 0 || cVersion.size() < 10)
+        return false;
+    return cVersion[9] >= '2' && cVersion[9] <= '9';
+}
+
+bool Device::supportsDoubles() {
+    return extensions().find("cl_khr_fp64") != std::string::npos;
+}
+
+unsigned Device::preferredVectorWidth(bool doubles) {
+    if (isHost())
+        return unsigned(std::max(simd::width() / (doubles? 2 : 1), size_t(1)));
+    cl_uint result = 0;
+    auto errorCode = clGetDeviceInfo(device, doubles? CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE : CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(result), &result, nullptr);
+    if (errorCode != CL_SUCCESS) {
+        error(errorCode, "Failed to get the preferred vector width");
+    }
+    return std::max(result, cl_uint(1));
+}
+
+unsigned Device::computeUnits() {
+    if (isHost())
+        return hostThreads->threads();
+    cl_uint result = 0;
+    auto errorCode = clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(result), &result, nullptr);
+    if (errorCode != CL_SUCCESS) {
+        error(errorCode, "Failed to get the number of compute units");
+    }
+    return result;
+}
+
+std::vector<Device> Device::partition(const cl_device_partition_property *properties) {
+    if (isHost())
+        return std::vector<Device>();
+    cl_uint count = 0;
+    auto errorCode = clCreateSubDevices(device, properties, 0, nullptr, &count);
+    if (errorCode != CL_SUCCESS || count == 0) {
+        error(errorCode, "Failed to partition the device");
+        return std::vector<Device>();
+    }
+    std::vector<cl_device_id> ids(count);
+    errorCode = clCreateSubDevices(device, properties, count, ids.data(), nullptr);
+    if (errorCode != CL_SUCCESS) {
+        error(errorCode, "Failed to partition the device");
+        return std::vector<Device>();
+    }
+    
+    std::vector<Device> devices;
+    for (auto id : ids) {
+        Device subDevice(id);
+        subDevice.subDevice = true;
+        // The sub-devices share the program cache of the parent device.
+        if (compiledProgramCache)
+            subDevice.cacheCompiledPrograms(compiledProgramCache->path());
+        if (tuner && !tuner->path().empty())
+            subDevice.storeTunedKernels(tuner->path());
+        devices.push_back(std::move(subDevice));
+    }
+    return devices;
+}
+
+std::vector<Device> Device::partitionByNUMANode() {
+    const cl_device_partition_property properties[] = {
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+    };
+    return partition(properties);
+}
+
+std::vector<Device> Device::partitionEqually(unsigned computeUnits) {
+    const cl_device_partition_property properties[] = {
+        CL_DEVICE_PARTITION_EQUALLY, cl_device_partition_property(computeUnits), 0
+    };
+    return partition(properties);
+}
+
+void Device::instrument(bool enable) {
+    if (!enable)
+        instrumentationScopes.reset();
+    else if (!instrumentationScopes)
+        instrumentationScopes.reset(new Instrumentation);
+}
+
+void Device::cacheCompiledPrograms(const std::string &directory) {
+    compiledProgramCache.reset(new ProgramCache(directory));
+}
+
+void Device::storeTunedKernels(const std::string &directory) {
+    tuner.reset(new KernelTuner(*this, directory));
+}
+
+KernelTuner &Device::kernelTuner() {
+    if (!tuner)
+        tuner.reset(new KernelTuner(*this));
+    return *tuner;
+}
+
+std::unique_ptr<KernelTuner> Device::kernelTuner(std::unique_ptr<KernelTuner> newTuner) {
+    std::swap(tuner, newTuner);
+    return newTuner;
+}
+
+MemoryPool &Device::memoryPool() {
+    if (!pool)
+        pool.reset(new MemoryPool(context(), device));
+    return *pool;
+}
+
 cl_context Device::context() {
-    if (ctx)
+    if (ctx || isHost())
         return ctx;
     
-    cl_uint platformIdCount = 0;
-    clGetPlatformIDs (0, nullptr, &platformIdCount);
-    
-    std::vector<cl_platform_id> platformIds (platformIdCount);
-    clGetPlatformIDs (platformIdCount, platformIds.data (), nullptr);
-    
     const cl_context_properties contextProperties [] =
     {
         CL_CONTEXT_PLATFORM,
-        reinterpret_cast<cl_context_properties> (platformIds [0]),
+        reinterpret_cast<cl_context_properties> (platform()),
         0, 0
     };
     
@@ -70,91 +245,176 @@ static std::string getDeviceString(cl_device_id device, cl_device_info value) {
     return result;
 }
 
+cl_platform_id Device::platform() const {
+    if (isHost())
+        return nullptr;
+    cl_platform_id result = nullptr;
+    auto error = clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(result), &result, nullptr);
+    if (error != CL_SUCCESS)
+        return nullptr;
+    return result;
+}
+
 std::string Device::name() {
+    if (isHost())
+        return "Host (" + std::to_string(hostThreads->threads()) + (hostThreads->threads() == 1? " thread, " : " threads, ") + simd::instructionSet() + ")";
     return getDeviceString(device, CL_DEVICE_NAME);
 }
 
 std::string Device::vendor() {
-    return getDeviceString(device, CL_DEVICE_VENDOR);
+    return isHost()? "nnFit" : getDeviceString(device, CL_DEVICE_VENDOR);
 }
 
 std::string Device::version() {
-    return getDeviceString(device, CL_DEVICE_VERSION);
+    return isHost()? "Host" : getDeviceString(device, CL_DEVICE_VERSION);
+}
+
+std::string Device::openCLCVersion() {
+    return isHost()? "Host" : getDeviceString(device, CL_DEVICE_OPENCL_C_VERSION);
+}
+
+std::string Device::driverVersion() {
+    return isHost()? "Host" : getDeviceString(device, CL_DRIVER_VERSION);
+}
+
+std::string Device::extensions() {
+    return isHost()? "" : getDeviceString(device, CL_DEVICE_EXTENSIONS);
 }
 
 void Device::error(int errorCode, const char *msg) {
     std::cerr << "OpenCL error (" << errorCode << "): " << msg << "\n";
 }
 
-Program &Device::getProgram(const char *name) {
-    std::string key(name);
-    if (programs.find(key) == programs.end()) {
+void Device::fatalError(int errorCode, const char *msg) {
+    error(errorCode, msg);
+    std::abort();
+}
+
+Program &Device::getProgram(const char *name, const BuildOptions &options) {
+    std::string key = std::string(name) + "\n" + options.str();
+    auto i = programs.find(key);
+    if (i != programs.end())
+        return *i->second;
+    
+    std::unique_ptr<Program> p;
+    if (auto source = embeddedProgramSource(name)) {
+        p.reset(new Program(*this, std::string(source)));
+    } else {
         std::ifstream is(name);
-        std::unique_ptr<Program> p(new Program(*this, is));
-        p->build();
-        auto &result = *p;
-        programs.insert(std::make_pair(key, std::move(p)));
-        return result;
+        p.reset(new Program(*this, is));
     }
-    return *programs[key];
+    p->buildAsync(options.str());
+    auto &result = *p;
+    programs.insert(std::make_pair(key, std::move(p)));
+    return result;
 }
 
-std::vector<Device> Device::findAll() {
+// Returns the devices of the given type from all the available platforms.
+std::vector<Device> Device::findDevices(cl_device_type type) {
     cl_uint platformIdCount = 0;
     clGetPlatformIDs (0, nullptr, &platformIdCount);
     
     std::vector<cl_platform_id> platformIds (platformIdCount);
     clGetPlatformIDs (platformIdCount, platformIds.data (), nullptr);
     
-    cl_uint deviceIdCount = 0;
-    clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_ALL, 0, nullptr,
-                    &deviceIdCount);
-    std::vector<cl_device_id> deviceIds (deviceIdCount);
-    clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_ALL, deviceIdCount,
-                    deviceIds.data (), nullptr);
-    
     std::vector<Device> devices;
-    for (auto id : deviceIds) {
-        devices.push_back(Device(id));
+    for (auto platform : platformIds) {
+        // A platform without the devices of the given type reports an error.
+        cl_uint deviceIdCount = 0;
+        if (clGetDeviceIDs (platform, type, 0, nullptr, &deviceIdCount) != CL_SUCCESS)
+            continue;
+        std::vector<cl_device_id> deviceIds (deviceIdCount);
+        clGetDeviceIDs (platform, type, deviceIdCount, deviceIds.data (), nullptr);
+        
+        for (auto id : deviceIds) {
+            devices.push_back(Device(id));
+        }
     }
     
     return devices;
 }
 
+std::vector<Device> Device::findAll() {
+    return findDevices(CL_DEVICE_TYPE_ALL);
+}
+
 std::vector<Device> Device::findGPUs() {
-    cl_uint platformIdCount = 0;
-    clGetPlatformIDs (0, nullptr, &platformIdCount);
-    
-    std::vector<cl_platform_id> platformIds (platformIdCount);
-    clGetPlatformIDs (platformIdCount, platformIds.data (), nullptr);
-    
-    cl_uint deviceIdCount = 0;
-    clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_GPU, 0, nullptr,
-                    &deviceIdCount);
-    std::vector<cl_device_id> deviceIds (deviceIdCount);
-    clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_GPU, deviceIdCount,
-                    deviceIds.data (), nullptr);
-    
-    std::vector<Device> devices;
-    for (auto id : deviceIds) {
-        devices.push_back(Device(id));
-    }
-    
-    return devices;
+    return findDevices(CL_DEVICE_TYPE_GPU);
 }
 
 double Device::profile(std::function<void (void)> f) {
     CommandQueue q(*this, true);
     auto prevQueue = defaultQueue;
     defaultQueue = &q;
+    // The host kernels run synchronously and don't have profiling events,
+    // so the wall-clock time is measured instead.
+    auto start = std::chrono::steady_clock::now();
     f();
+    auto end = std::chrono::steady_clock::now();
     defaultQueue = prevQueue;
+    if (isHost())
+        return std::chrono::duration<double, std::milli>(end - start).count();
     return q.totalKernelProfilingTime();
 }
 
-CommandQueue::CommandQueue(Device &device, bool profile) : device(device), profile(profile) {
+Event::Event(const Event &other) : event(other.event) {
+    if (event)
+        clRetainEvent(event);
+}
+
+Event::Event(Event &&other) : event(other.event) {
+    other.event = nullptr;
+}
+
+Event::~Event() {
+    if (event)
+        clReleaseEvent(event);
+}
+
+Event &Event::operator =(const Event &other) {
+    if (other.event)
+        clRetainEvent(other.event);
+    if (event)
+        clReleaseEvent(event);
+    event = other.event;
+    return *this;
+}
+
+Event &Event::operator =(Event &&other) {
+    if (this != &other) {
+        if (event)
+            clReleaseEvent(event);
+        event = other.event;
+        other.event = nullptr;
+    }
+    return *this;
+}
+
+void Event::wait() const {
+    if (event)
+        clWaitForEvents(1, &event);
+}
+
+// The number of read events that are tracked for one memory object before
+// they are merged into a single marker event.
+static const size_t maxTrackedReads = 16;
+
+CommandQueue::CommandQueue(Device &device, bool profile, bool outOfOrder) : device(device), profile(profile), outOfOrder(outOfOrder) {
+    if (device.isHost()) {
+        // The host device runs the commands in order as they're enqueued.
+        queue = nullptr;
+        this->profile = false;
+        this->outOfOrder = false;
+        return;
+    }
     cl_int error = 0;
-    queue = clCreateCommandQueue(device.context(), device.id(), profile? CL_QUEUE_PROFILING_ENABLE : 0, &error);
+    cl_command_queue_properties properties = (profile? CL_QUEUE_PROFILING_ENABLE : 0) | (outOfOrder? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0);
+    queue = clCreateCommandQueue(device.context(), device.id(), properties, &error);
+    if (!queue && outOfOrder) {
+        // The device doesn't support out of order execution.
+        this->outOfOrder = false;
+        queue = clCreateCommandQueue(device.context(), device.id(), profile? CL_QUEUE_PROFILING_ENABLE : 0, &error);
+    }
     if (!queue || error != CL_SUCCESS) {
         device.error(error, "Failed to create command queue");
         queue = nullptr;
@@ -168,168 +428,814 @@ CommandQueue::~CommandQueue() {
 
 void CommandQueue::dumpProfilingInfo() {
     if (profile) {
-        for (auto &record : profileRecords) {
+        for (auto &record : kernelProfiler.statistics()) {
             auto info = record.second;
-            std::cout<< "Kernel '" << record.first << "' was called " << info.invocations << " times " << info.totalTime << "ms " << " avg " << (info.totalTime/double(info.invocations)) << "ms\n";
+            std::cout<< "Kernel '" << record.first << "' was called " << info.invocations << " times " << info.totalTime << "ms " << " avg " << (info.totalTime/double(info.invocations)) << "ms p50 " << info.median << "ms p99 " << info.p99 << "ms\n";
         }
     }
 }
 
-double CommandQueue::totalKernelProfilingTime() const {
+double CommandQueue::totalKernelProfilingTime() {
     double total = 0;
-    for (auto &record : profileRecords) {
+    for (auto &record : kernelProfiler.statistics()) {
         total += record.second.totalTime;
     }
     return total;
 }
 
-void CommandQueue::profileKernel(cl_event event, const Kernel &kernel) {
-    auto error = clWaitForEvents(1, &event);
-    if (error != CL_SUCCESS) {
-        device.error(error, "Failed to wait for an event");
+// Formats the value of a kernel argument using the type of its parameter.
+static std::string formatArgument(const KernelInvocation::Argument &arg, const std::string &type) {
+    if (arg.isStorage)
+        return type.empty()? "buffer" : type;
+    if (arg.isLocal)
+        return "local " + std::to_string(arg.size) + " bytes";
+    if (arg.size > sizeof(arg.value))
+        return std::to_string(arg.size) + " bytes";
+    if (type == "float" && arg.size == sizeof(float)) {
+        float value;
+        memcpy(&value, arg.value, sizeof(value));
+        return std::to_string(value);
+    }
+    if (type == "double" && arg.size == sizeof(double)) {
+        double value;
+        memcpy(&value, arg.value, sizeof(value));
+        return std::to_string(value);
+    }
+    if (arg.size == sizeof(int32_t) && (type == "int" || type == "const int")) {
+        int32_t value;
+        memcpy(&value, arg.value, sizeof(value));
+        return std::to_string(value);
     }
-    cl_ulong start = 0, end = 0;
-    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr);
-    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr);
-    auto time = (cl_double)(end - start)*(cl_double)(1e-06);
-    std::string key(kernel.kernelName());
-    auto i = profileRecords.insert(std::make_pair(key, ProfileInfo()));
-    i.first->second.invocations++;
-    i.first->second.totalTime += time;
+    uint64_t value = 0;
+    memcpy(&value, arg.value, std::min(arg.size, sizeof(value)));
+    return std::to_string(value);
 }
 
-void CommandQueue::enqueueKernel(const Kernel &kernel, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize) {
+static std::vector<std::string> formatArguments(const KernelInvocation &invocation) {
+    std::vector<std::string> result;
+    const auto &args = invocation.arguments();
+    for (unsigned i = 0; i < args.size(); ++i)
+        result.push_back(formatArgument(args[i], invocation.kernel.argumentType(i)));
+    return result;
+}
+
+void CommandQueue::profileKernel(cl_event event, const char *name, unsigned dimensions, const size_t *globalSize, const size_t *workgroupSize, std::vector<std::string> arguments) {
+    KernelProfiler::Launch launch = {};
+    launch.name = name;
+    launch.dimensions = dimensions;
+    launch.hasWorkgroupSize = workgroupSize != nullptr;
+    for (unsigned i = 0; i < dimensions; ++i) {
+        launch.globalSize[i] = globalSize[i];
+        launch.workgroupSize[i] = workgroupSize? workgroupSize[i] : 0;
+    }
+    launch.arguments = std::move(arguments);
+    kernelProfiler.add(event, std::move(launch));
+}
+
+std::vector<cl_event> CommandQueue::dependencies(std::vector<Access> &accesses, const std::vector<Event> &waitList) const {
+    std::vector<cl_event> events;
+    for (const auto &event : waitList) {
+        if (event)
+            events.push_back(event.id());
+    }
+    if (!outOfOrder)
+        return events;
+    
+    // Merge the accesses to the same memory object, as a kernel can get the same
+    // buffer as both its input and its output.
+    for (size_t i = 0; i < accesses.size(); ++i) {
+        for (size_t j = i + 1; j < accesses.size(); ) {
+            if (accesses[j].dependencies == accesses[i].dependencies) {
+                accesses[i].write |= accesses[j].write;
+                accesses.erase(accesses.begin() + j);
+            } else
+                ++j;
+        }
+    }
+    
+    for (const auto &access : accesses) {
+        if (!access.dependencies)
+            continue;
+        // Read after write.
+        if (access.dependencies->lastWrite)
+            events.push_back(access.dependencies->lastWrite.id());
+        // Write after read.
+        if (access.write) {
+            for (const auto &read : access.dependencies->reads)
+                events.push_back(read.id());
+        }
+    }
+    return events;
+}
+
+void CommandQueue::recordAccesses(const std::vector<Access> &accesses, const Event &event) {
+    if (!outOfOrder || !event)
+        return;
+    for (const auto &access : accesses) {
+        auto deps = access.dependencies;
+        if (!deps)
+            continue;
+        if (access.write) {
+            deps->lastWrite = event;
+            deps->reads.clear();
+            continue;
+        }
+        deps->reads.push_back(event);
+        if (deps->reads.size() > maxTrackedReads) {
+            // Replace the reads with a marker that completes once all of them are
+            // done to avoid tracking an unbounded number of events for memory
+            // objects which are read often but are never written to.
+            std::vector<cl_event> reads;
+            for (const auto &read : deps->reads)
+                reads.push_back(read.id());
+            cl_event marker = nullptr;
+            auto error = clEnqueueMarkerWithWaitList(queue, cl_uint(reads.size()), reads.data(), &marker);
+            if (error == CL_SUCCESS) {
+                deps->reads.clear();
+                deps->reads.push_back(Event(marker));
+            }
+        }
+    }
+}
+
+Event CommandQueue::enqueueKernel(const KernelInvocation &invocation, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize, const std::vector<Event> &waitList) {
+    const auto &kernel = invocation.kernel;
+    std::vector<Access> accesses;
+    if (outOfOrder) {
+        for (const auto &arg : invocation.storageArgs()) {
+            Access access = { arg.second, kernel.writesArgument(arg.first) };
+            accesses.push_back(access);
+        }
+    }
+    auto events = dependencies(accesses, waitList);
+    
+    if (device.isHost()) {
+        auto function = kernel.hostFunction();
+        if (!function)
+            device.fatalError(CL_INVALID_KERNEL, "The host device has no implementation of the kernel");
+        runHostKernel(function, invocation.arguments(), dimensions, globalSize, globalOffset, workgroupSize, *device.threadPool());
+        if (recording)
+            recordKernel(invocation, dimensions, globalSize, globalOffset, workgroupSize);
+        if (auto instrumentation = device.instrumentation())
+            instrumentation->kernelLaunched(nullptr);
+        return Event();
+    }
+    
+    size_t tunedWorkgroupSize[3];
+    if (!workgroupSize && device.kernelTuner().find(kernel, dimensions, globalSize, tunedWorkgroupSize) && tunedWorkgroupSize[0] != 0)
+        workgroupSize = tunedWorkgroupSize;
+    
     cl_event event = nullptr;
-    auto error = clEnqueueNDRangeKernel(queue, kernel.id(), dimensions, globalOffset, globalSize, workgroupSize, 0, nullptr, profile? &event : nullptr);
+    auto error = clEnqueueNDRangeKernel(queue, kernel.id(), dimensions, globalOffset, globalSize, workgroupSize, cl_uint(events.size()), events.empty()? nullptr : events.data(), &event);
     if (error != CL_SUCCESS) {
         device.error(error, "Failed to enqueue a kernel");
-    } else if (profile) {
-        profileKernel(event, kernel);
+        return Event();
+    }
+    Event result(event);
+    recordAccesses(accesses, result);
+    if (recording) {
+        recordKernel(invocation, dimensions, globalSize, globalOffset, workgroupSize);
     }
+    if (auto instrumentation = device.instrumentation()) {
+        // Only the launches on a profiling queue have a device time.
+        instrumentation->kernelLaunched(profile? event : nullptr);
+    }
+    if (profile) {
+        profileKernel(event, kernel.kernelName(), dimensions, globalSize, workgroupSize, formatArguments(invocation));
+    }
+    return result;
 }
 
-void CommandQueue::enqueue1Dim(const KernelInvocation &kernel, size_t size, size_t offset) {
+Event CommandQueue::enqueue1Dim(const KernelInvocation &kernel, size_t size, size_t offset, const std::vector<Event> &waitList) {
     size_t sizes[] = { size, 0, 0 };
     size_t offsets[] = { offset, 0, 0 };
-    enqueueKernel(kernel.kernel, 1, sizes, offsets);
+    return enqueueKernel(kernel, 1, sizes, offsets, nullptr, waitList);
 }
 
-void CommandQueue::enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset) {
+Event CommandQueue::enqueue1Dim(const KernelInvocation &kernel, size_t size, size_t offset, size_t workgroupSize, const std::vector<Event> &waitList) {
+    size_t sizes[] = { size, 0, 0 };
+    size_t offsets[] = { offset, 0, 0 };
+    size_t localSizes[] = { workgroupSize, 0, 0 };
+    return enqueueKernel(kernel, 1, sizes, offsets, localSizes, waitList);
+}
+
+Event CommandQueue::enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset, const std::vector<Event> &waitList) {
     size_t sizes[] = { size[0], size[1], 0 };
     size_t offsets[] = { offset[0], offset[1], 0 };
-    enqueueKernel(kernel.kernel, 2, sizes, offsets);
+    return enqueueKernel(kernel, 2, sizes, offsets, nullptr, waitList);
 }
 
-void CommandQueue::enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset, const Range2D &workgroupSize) {
+Event CommandQueue::enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset, const Range2D &workgroupSize, const std::vector<Event> &waitList) {
     size_t sizes[] = { size[0], size[1], 0 };
     size_t offsets[] = { offset[0], offset[1], 0 };
     size_t localSizes[] = { workgroupSize[0], workgroupSize[1], 0 };
-    enqueueKernel(kernel.kernel, 2, sizes, offsets, localSizes);
+    return enqueueKernel(kernel, 2, sizes, offsets, localSizes, waitList);
 }
 
-void CommandQueue::enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset) {
+Event CommandQueue::enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset, const std::vector<Event> &waitList) {
     size_t sizes[] = { size[0], size[1], size[2] };
     size_t offsets[] = { offset[0], offset[1], offset[2] };
-    enqueueKernel(kernel.kernel, 3, sizes, offsets);
+    return enqueueKernel(kernel, 3, sizes, offsets, nullptr, waitList);
 }
 
-void CommandQueue::enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset, const Range3D &workgroupSize) {
+Event CommandQueue::enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset, const Range3D &workgroupSize, const std::vector<Event> &waitList) {
     size_t sizes[] = { size[0], size[1], size[2] };
     size_t offsets[] = { offset[0], offset[1], offset[2] };
     size_t localSizes[] = { workgroupSize[0], workgroupSize[1], workgroupSize[2] };
-    enqueueKernel(kernel.kernel, 3, sizes, offsets, localSizes);
+    return enqueueKernel(kernel, 3, sizes, offsets, localSizes, waitList);
 }
 
-void CommandQueue::fill(const Storage &dest, size_t size, size_t offset, const void *pattern, size_t patternSize) {
-    auto error = clEnqueueFillBuffer(queue, dest.id(), pattern, patternSize, offset, size, 0, nullptr, nullptr);
+Event CommandQueue::fill(const Storage &dest, size_t size, size_t offset, const void *pattern, size_t patternSize, const std::vector<Event> &waitList) {
+    if (device.isHost()) {
+        auto data = HostBuffer::get(dest.id())->data() + offset;
+        for (size_t i = 0; i < size; i += patternSize)
+            memcpy(data + i, pattern, patternSize);
+        if (recording)
+            recording->replayable = false;
+        return Event();
+    }
+    std::vector<Access> accesses = { { dest.dependencies(), true } };
+    auto events = dependencies(accesses, waitList);
+    cl_event event = nullptr;
+    auto error = clEnqueueFillBuffer(queue, dest.id(), pattern, patternSize, offset, size, cl_uint(events.size()), events.empty()? nullptr : events.data(), &event);
     if (error != CL_SUCCESS) {
         device.error(error, "Failed to fill a buffer");
+        return Event();
     }
+    Event result(event);
+    recordAccesses(accesses, result);
+    if (recording)
+        recording->replayable = false;
+    return result;
 }
 
-void CommandQueue::copy(const StorageRef &src, const StorageRef &dest, size_t size, size_t srcOffset, size_t destOffset) {
-    auto error = clEnqueueCopyBuffer(queue, src.id(), dest.id(), srcOffset, destOffset, size, 0, nullptr, nullptr);
-    if (error != CL_SUCCESS) {
-        device.error(error, "Failed to copy a buffer");
+Event CommandQueue::copy(const StorageRef &src, const StorageRef &dest, size_t size, size_t srcOffset, size_t destOffset, const std::vector<Event> &waitList) {
+    Event result;
+    if (device.isHost()) {
+        memmove(HostBuffer::get(dest.id())->data() + destOffset, HostBuffer::get(src.id())->data() + srcOffset, size);
+    } else {
+        std::vector<Access> accesses = { { src.dependencies(), false }, { dest.dependencies(), true } };
+        auto events = dependencies(accesses, waitList);
+        cl_event event = nullptr;
+        auto error = clEnqueueCopyBuffer(queue, src.id(), dest.id(), srcOffset, destOffset, size, cl_uint(events.size()), events.empty()? nullptr : events.data(), &event);
+        if (error != CL_SUCCESS) {
+            device.error(error, "Failed to copy a buffer");
+            return Event();
+        }
+        result = Event(event);
+        recordAccesses(accesses, result);
+    }
+    if (recording) {
+        CommandRecording::Command command = {};
+        command.size = size;
+        command.srcOffset = srcOffset;
+        command.destOffset = destOffset;
+        command.bindings.push_back(CommandRecording::Binding{ 0, src.id(), src.id() });
+        command.bindings.push_back(CommandRecording::Binding{ 1, dest.id(), dest.id() });
+        recording->retain(command);
+        recording->commands.push_back(command);
     }
+    return result;
 }
 
-void CommandQueue::blockingRead(const Storage &src, void *dest, size_t size, size_t offset) {
-    auto error = clEnqueueReadBuffer(queue, src.id(), CL_TRUE, offset, size, dest, 0, nullptr, nullptr);
+Event CommandQueue::blockingRead(const Storage &src, void *dest, size_t size, size_t offset, const std::vector<Event> &waitList) {
+    if (device.isHost()) {
+        memcpy(dest, HostBuffer::get(src.id())->data() + offset, size);
+        if (auto instrumentation = device.instrumentation())
+            instrumentation->transferred(size, /* toDevice= */false);
+        if (recording)
+            recording->replayable = false;
+        return Event();
+    }
+    std::vector<Access> accesses = { { src.dependencies(), false } };
+    auto events = dependencies(accesses, waitList);
+    cl_event event = nullptr;
+    auto error = clEnqueueReadBuffer(queue, src.id(), CL_TRUE, offset, size, dest, cl_uint(events.size()), events.empty()? nullptr : events.data(), &event);
     if (error != CL_SUCCESS) {
         device.error(error, "Failed to read a buffer");
+        return Event();
+    }
+    if (auto instrumentation = device.instrumentation())
+        instrumentation->transferred(size, /* toDevice= */false);
+    Event result(event);
+    recordAccesses(accesses, result);
+    if (recording)
+        recording->replayable = false;
+    return result;
+}
+
+void *CommandQueue::map(const Storage &storage, size_t size, size_t offset, const std::vector<Event> &waitList) {
+    if (device.isHost()) {
+        if (recording)
+            recording->replayable = false;
+        return HostBuffer::get(storage.id())->data() + offset;
+    }
+    // The mapping is treated as a write so that it waits for all the other accesses.
+    std::vector<Access> accesses = { { storage.dependencies(), true } };
+    auto events = dependencies(accesses, waitList);
+    cl_event event = nullptr;
+    cl_int error;
+    auto result = clEnqueueMapBuffer(queue, storage.id(), CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, offset, size, cl_uint(events.size()), events.empty()? nullptr : events.data(), &event, &error);
+    if (!result || error != CL_SUCCESS) {
+        device.error(error, "Failed to map a buffer");
+        return nullptr;
     }
+    recordAccesses(accesses, Event(event));
+    if (recording)
+        recording->replayable = false;
+    return result;
+}
+
+Event CommandQueue::unmap(const Storage &storage, void *data, const std::vector<Event> &waitList) {
+    if (device.isHost()) {
+        if (recording)
+            recording->replayable = false;
+        return Event();
+    }
+    std::vector<Access> accesses = { { storage.dependencies(), true } };
+    auto events = dependencies(accesses, waitList);
+    cl_event event = nullptr;
+    auto error = clEnqueueUnmapMemObject(queue, storage.id(), data, cl_uint(events.size()), events.empty()? nullptr : events.data(), &event);
+    if (error != CL_SUCCESS) {
+        device.error(error, "Failed to unmap a buffer");
+        return Event();
+    }
+    Event result(event);
+    recordAccesses(accesses, result);
+    if (recording)
+        recording->replayable = false;
+    return result;
 }
 
-void CommandQueue::blockingWrite(const Storage &dest, const void *src, size_t size, size_t offset) {
-    auto error = clEnqueueWriteBuffer(queue, dest.id(), CL_TRUE, offset, size, src, 0, nullptr, nullptr);
+Event CommandQueue::blockingWrite(const Storage &dest, const void *src, size_t size, size_t offset, const std::vector<Event> &waitList) {
+    if (device.isHost()) {
+        memcpy(HostBuffer::get(dest.id())->data() + offset, src, size);
+        if (auto instrumentation = device.instrumentation())
+            instrumentation->transferred(size, /* toDevice= */true);
+        if (recording)
+            recording->replayable = false;
+        return Event();
+    }
+    std::vector<Access> accesses = { { dest.dependencies(), true } };
+    auto events = dependencies(accesses, waitList);
+    cl_event event = nullptr;
+    auto error = clEnqueueWriteBuffer(queue, dest.id(), CL_TRUE, offset, size, src, cl_uint(events.size()), events.empty()? nullptr : events.data(), &event);
     if (error != CL_SUCCESS) {
         device.error(error, "Failed to write to a buffer");
+        return Event();
+    }
+    if (auto instrumentation = device.instrumentation())
+        instrumentation->transferred(size, /* toDevice= */true);
+    Event result(event);
+    recordAccesses(accesses, result);
+    if (recording)
+        recording->replayable = false;
+    return result;
+}
+
+void CommandQueue::recordKernel(const KernelInvocation &invocation, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize) {
+    // The kernel object can't be shared with the other recorded commands as
+    // they set different arguments, so the recording gets its own kernel.
+    // The host device keeps a copy of the arguments instead.
+    cl_kernel kernel = nullptr;
+    if (!device.isHost()) {
+        cl_program program = nullptr;
+        cl_int error = clGetKernelInfo(invocation.kernel.id(), CL_KERNEL_PROGRAM, sizeof(program), &program, nullptr);
+        kernel = error == CL_SUCCESS? clCreateKernel(program, invocation.kernel.kernelName(), &error) : nullptr;
+        if (!kernel || error != CL_SUCCESS) {
+            recording->replayable = false;
+            return;
+        }
+    }
+    
+    CommandRecording::Command command = {};
+    command.kernel = kernel;
+    if (device.isHost()) {
+        command.hostKernel = invocation.kernel.hostFunction();
+        command.arguments = invocation.arguments();
+    }
+    command.name = invocation.kernel.kernelName();
+    command.programOptionsHash = invocation.kernel.programOptionsHash();
+    command.formattedArguments = formatArguments(invocation);
+    if (auto instrumentation = device.instrumentation())
+        command.scopes = instrumentation->scopesBelow(recording->instrumentationDepth);
+    command.dimensions = dimensions;
+    command.hasWorkgroupSize = workgroupSize != nullptr;
+    for (unsigned i = 0; i < dimensions; ++i) {
+        command.globalSize[i] = globalSize[i];
+        command.globalOffset[i] = globalOffset[i];
+        command.workgroupSize[i] = workgroupSize? workgroupSize[i] : 0;
+    }
+    const auto &args = invocation.arguments();
+    for (unsigned i = 0; i < args.size(); ++i) {
+        const auto &arg = args[i];
+        if (!arg.isLocal && arg.size > sizeof(arg.value)) {
+            recording->replayable = false;
+        }
+        if (kernel)
+            clSetKernelArg(kernel, i, arg.size, arg.isLocal? nullptr : arg.value);
+        if (arg.isStorage) {
+            cl_mem mem;
+            memcpy(&mem, arg.value, sizeof(mem));
+            command.bindings.push_back(CommandRecording::Binding{ i, mem, mem });
+        }
+    }
+    recording->retain(command);
+    recording->commands.push_back(command);
+}
+
+void CommandQueue::startRecording() {
+    assert(!recording);
+    recording.reset(new CommandRecording());
+    recording->host = device.isHost();
+    if (auto instrumentation = device.instrumentation())
+        recording->instrumentationDepth = instrumentation->depth();
+}
+
+CommandRecording CommandQueue::stopRecording() {
+    assert(recording);
+    CommandRecording result(std::move(*recording));
+    recording.reset();
+    return result;
+}
+
+void CommandQueue::replay(const CommandRecording &recording) {
+    assert(recording.isReplayable());
+    if (device.isHost()) {
+        for (const auto &command : recording.commands) {
+            if (command.hostKernel) {
+                runHostKernel(command.hostKernel, command.arguments, command.dimensions, command.globalSize, command.globalOffset, command.hasWorkgroupSize? command.workgroupSize : nullptr, *device.threadPool());
+                if (auto instrumentation = device.instrumentation())
+                    instrumentation->kernelLaunched(nullptr, command.scopes);
+            } else {
+                memmove(HostBuffer::get(command.bindings[1].current)->data() + command.destOffset, HostBuffer::get(command.bindings[0].current)->data() + command.srcOffset, command.size);
+            }
+        }
+        return;
+    }
+    // The recorded commands don't take part in the dependency tracking, so on
+    // an out of order queue they are executed one after another between two barriers.
+    Event previous;
+    if (outOfOrder) {
+        cl_event barrier = nullptr;
+        clEnqueueBarrierWithWaitList(queue, 0, nullptr, &barrier);
+        previous = Event(barrier);
+    }
+    for (const auto &command : recording.commands) {
+        cl_event event = nullptr;
+        cl_event previousEvent = previous.id();
+        cl_uint waitCount = previous? 1 : 0;
+        const cl_event *waitList = previous? &previousEvent : nullptr;
+        cl_event *eventOut = (outOfOrder || profile)? &event : nullptr;
+        cl_int error;
+        if (command.kernel) {
+            error = clEnqueueNDRangeKernel(queue, command.kernel, command.dimensions, command.globalOffset, command.globalSize, command.hasWorkgroupSize? command.workgroupSize : nullptr, waitCount, waitList, eventOut);
+        } else {
+            error = clEnqueueCopyBuffer(queue, command.bindings[0].current, command.bindings[1].current, command.srcOffset, command.destOffset, command.size, waitCount, waitList, eventOut);
+        }
+        if (error != CL_SUCCESS) {
+            device.error(error, "Failed to replay a command");
+            continue;
+        }
+        Event result(event);
+        if (command.kernel) {
+            if (auto instrumentation = device.instrumentation())
+                instrumentation->kernelLaunched(profile? event : nullptr, command.scopes);
+        }
+        if (profile && command.kernel) {
+            profileKernel(event, command.name, command.dimensions, command.globalSize, command.hasWorkgroupSize? command.workgroupSize : nullptr, command.formattedArguments);
+        }
+        if (outOfOrder)
+            previous = std::move(result);
+    }
+    if (outOfOrder) {
+        clEnqueueBarrierWithWaitList(queue, 0, nullptr, nullptr);
     }
 }
 
 void CommandQueue::finish() {
-    clFinish(queue);
+    if (queue)
+        clFinish(queue);
+    if (profile)
+        kernelProfiler.drain(false);
 }
 
 void CommandQueue::flush() {
-    clFlush(queue);
+    if (queue)
+        clFlush(queue);
 }
 
-static cl_program initProgram(Device &device, const char *src, size_t length) {
-    const char *sources[] = { src };
-    cl_int error;
-    auto program = clCreateProgramWithSource(device.context(), 1, sources, &length, &error);
-    if (!program || error != CL_SUCCESS) {
-        device.error(error, "Failed to create program");
+CommandRecording::CommandRecording() : replayable(true), host(false), instrumentationDepth(0) {
+}
+
+CommandRecording::CommandRecording(CommandRecording &&other) : commands(std::move(other.commands)), replayable(other.replayable), host(other.host), instrumentationDepth(other.instrumentationDepth) {
+    other.commands.clear();
+}
+
+CommandRecording::~CommandRecording() {
+    release();
+}
+
+CommandRecording &CommandRecording::operator =(CommandRecording &&other) {
+    if (this != &other) {
+        release();
+        commands = std::move(other.commands);
+        replayable = other.replayable;
+        host = other.host;
+        instrumentationDepth = other.instrumentationDepth;
+        other.commands.clear();
     }
-    return program;
+    return *this;
 }
 
-Program::Program(Device &device, const char *src, size_t length) : dev(device) {
-    program = initProgram(device, src, length);
+void CommandRecording::retain(const Command &command) {
+    // Keep the recorded memory objects alive, so that their handles
+    // can't be reused by other buffers while the recording exists.
+    for (const auto &binding : command.bindings) {
+        if (host) {
+            HostBuffer::get(binding.recorded)->retain();
+            HostBuffer::get(binding.current)->retain();
+            continue;
+        }
+        clRetainMemObject(binding.recorded);
+        clRetainMemObject(binding.current);
+    }
+}
+
+void CommandRecording::release() {
+    for (auto &command : commands) {
+        if (command.kernel)
+            clReleaseKernel(command.kernel);
+        for (const auto &binding : command.bindings) {
+            if (host) {
+                HostBuffer::get(binding.recorded)->release();
+                HostBuffer::get(binding.current)->release();
+                continue;
+            }
+            clReleaseMemObject(binding.recorded);
+            clReleaseMemObject(binding.current);
+        }
+    }
+    commands.clear();
 }
 
-Program::Program(Device &device, std::ifstream &is) : dev(device) {
+void CommandRecording::bind(const StorageRef &from, const StorageRef &to) {
+    for (auto &command : commands) {
+        for (auto &binding : command.bindings) {
+            if (binding.recorded != from.id() || binding.current == to.id())
+                continue;
+            if (host) {
+                HostBuffer::get(to.id())->retain();
+                HostBuffer::get(binding.current)->release();
+            } else {
+                clRetainMemObject(to.id());
+                clReleaseMemObject(binding.current);
+            }
+            binding.current = to.id();
+            if (command.kernel)
+                clSetKernelArg(command.kernel, binding.parameter, sizeof(cl_mem), &binding.current);
+            if (command.hostKernel)
+                memcpy(command.arguments[binding.parameter].value, &binding.current, sizeof(cl_mem));
+        }
+    }
+}
+
+// The state of a build that's running in the background.
+struct Program::BuildState {
+    std::mutex mutex;
+    std::condition_variable finishedCondition;
+    std::string options, optionsHash;
+    bool pending;
+    bool finished;
+    bool fromBinary;
+    
+    BuildState() : pending(false), finished(false), fromBinary(false) { }
+};
+
+Program::Program(Device &device, const char *src, size_t length) : dev(device), source(src, length), program(nullptr), loadedFromCache(false), state(new BuildState) {
+}
+
+Program::Program(Device &device, const std::string &src) : dev(device), source(src), program(nullptr), loadedFromCache(false), state(new BuildState) {
+}
+
+Program::Program(Device &device, std::ifstream &is) : dev(device), program(nullptr), loadedFromCache(false), state(new BuildState) {
     is.seekg(0, std::ios::end);
     size_t size = is.tellg();
-    std::vector<char> buffer(size+1, ' ');
+    source.resize(size, ' ');
     is.seekg(0);
-    is.read(buffer.data(), size);
-    buffer[size] = '\0';
-    program = initProgram(device, buffer.data(), size);
+    is.read(&source[0], size);
 }
 
-Program::Program(Program &&other) : dev(other.dev), program(std::move(other.program)) {
+Program::Program(Program &&other) : dev(other.dev), source(std::move(other.source)), program(std::move(other.program)), loadedFromCache(other.loadedFromCache), state(std::move(other.state)) {
     other.program = nullptr;
 }
 
 Program::~Program() {
+    // The build callback mustn't outlive the build state.
+    if (state)
+        wait();
+    if (program)
+        clReleaseProgram(program);
+}
+
+cl_program Program::id() {
+    wait();
+    return program;
+}
+
+void Program::build(const std::string &options) {
+    buildAsync(options);
+    wait();
+}
+
+void Program::buildAsync(const std::string &userOptions) {
+    wait();
+    if (dev.isHost()) {
+        // The host kernels are specialized with the options when they're created.
+        state->options = userOptions;
+        state->optionsHash = stableHash(state->options);
+        return;
+    }
+    // The argument information is used to infer which kernel parameters are written to.
+    state->options = "-cl-kernel-arg-info";
+    if (!userOptions.empty())
+        state->options += " " + userOptions;
+    state->optionsHash = stableHash(state->options);
+    loadedFromCache = false;
+    if (auto cache = dev.programCache()) {
+        std::vector<unsigned char> cachedBinary;
+        if (cache->load(dev, source, state->options, cachedBinary) && startBuildFromBinary(cachedBinary))
+            return;
+    }
+    startBuildFromSource();
+}
+
+const std::string &Program::options() const {
+    return state->options;
+}
+
+const std::string &Program::optionsHash() const {
+    return state->optionsHash;
+}
+
+void CL_CALLBACK Program::buildFinished(cl_program, void *userData) {
+    auto state = static_cast<BuildState*>(userData);
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->finished = true;
+    state->finishedCondition.notify_all();
+}
+
+void Program::wait() {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (state->pending) {
+        state->finishedCondition.wait(lock, [this] { return state->finished; });
+        state->pending = false;
+        if (state->fromBinary) {
+            if (buildSucceeded()) {
+                loadedFromCache = true;
+                break;
+            }
+            // The driver rejected the cached binary, e.g. after a driver update.
+            lock.unlock();
+            startBuildFromSource();
+            lock.lock();
+            continue;
+        }
+        if (!buildSucceeded()) {
+            dev.error(CL_BUILD_PROGRAM_FAILURE, "Failed to build program");
+            break;
+        }
+        if (auto cache = dev.programCache()) {
+            auto compiledBinary = binary();
+            if (!compiledBinary.empty())
+                cache->store(dev, source, state->options, compiledBinary);
+        }
+    }
+}
+
+bool Program::startBuildFromBinary(const std::vector<unsigned char> &binary) {
+    auto deviceId = dev.id();
+    const unsigned char *binaries[] = { binary.data() };
+    size_t size = binary.size();
+    cl_int status, error;
+    auto result = clCreateProgramWithBinary(dev.context(), 1, &deviceId, &size, binaries, &status, &error);
+    if (!result || error != CL_SUCCESS || status != CL_SUCCESS) {
+        if (result)
+            clReleaseProgram(result);
+        return false;
+    }
+    if (program)
+        clReleaseProgram(program);
+    program = result;
+    state->fromBinary = true;
+    return startBuild();
+}
+
+bool Program::startBuildFromSource() {
+    const char *sources[] = { source.data() };
+    size_t length = source.size();
+    cl_int error;
     if (program)
         clReleaseProgram(program);
+    program = clCreateProgramWithSource(dev.context(), 1, sources, &length, &error);
+    if (!program || error != CL_SUCCESS) {
+        dev.error(error, "Failed to create program");
+        return false;
+    }
+    state->fromBinary = false;
+    return startBuild();
 }
 
-void Program::build() {
+bool Program::startBuild() {
     auto deviceId = dev.id();
-    auto error = clBuildProgram(program, 1, &deviceId, "", nullptr, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->pending = true;
+        state->finished = false;
+    }
+    auto error = clBuildProgram(program, 1, &deviceId, state->options.c_str(), buildFinished, state.get());
     if (error != CL_SUCCESS) {
-        dev.error(error, "Failed to build program");
+        // The build failed before it was started so the callback might not be called.
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->finished = true;
+        return false;
     }
+    return true;
+}
+
+bool Program::buildSucceeded() const {
+    cl_build_status status = CL_BUILD_ERROR;
+    auto error = clGetProgramBuildInfo(program, dev.id(), CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, nullptr);
+    return error == CL_SUCCESS && status == CL_BUILD_SUCCESS;
+}
+
+std::vector<unsigned char> Program::binary() const {
+    size_t size = 0;
+    auto error = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, nullptr);
+    if (error != CL_SUCCESS || size == 0)
+        return std::vector<unsigned char>();
+    std::vector<unsigned char> result(size);
+    unsigned char *binaries[] = { result.data() };
+    error = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, nullptr);
+    if (error != CL_SUCCESS)
+        return std::vector<unsigned char>();
+    return result;
 }
 
-Kernel::Kernel() : kernel(nullptr), name("") { }
+Kernel::Kernel() : program(nullptr), kernel(nullptr), hostKernel(nullptr), name("") { }
+
+Kernel::Kernel(Program &program, const char *name) : program(&program), kernel(nullptr), hostKernel(nullptr), name(name) { }
+
+const std::string &Kernel::programOptionsHash() const {
+    static const std::string none;
+    return program? program->optionsHash() : none;
+}
 
-Kernel::Kernel(Program &program, const char *name) {
+void Kernel::create() const {
+    if (program->device().isHost()) {
+        hostKernel = findHostKernel(name, program->options());
+        if (!hostKernel)
+            program->device().fatalError(CL_INVALID_KERNEL_NAME, (std::string("The host device doesn't support the kernel ") + name).c_str());
+        return;
+    }
     cl_int error;
-    kernel = clCreateKernel(program.id(), name, &error);
-    this->name = name;
+    kernel = clCreateKernel(program->id(), name, &error);
     if (!kernel || error != CL_SUCCESS) {
-        program.device().error(error, "Failed to create kernel");
+        program->device().error(error, "Failed to create kernel");
+        kernel = nullptr;
+        return;
+    }
+    
+    // Find out which parameters are written to using the argument qualifiers.
+    // When the argument information isn't available all of them are assumed to be written.
+    cl_uint argumentCount = 0;
+    if (clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(argumentCount), &argumentCount, nullptr) != CL_SUCCESS)
+        return;
+    std::vector<bool> writes(argumentCount, true);
+    for (cl_uint i = 0; i < argumentCount; ++i) {
+        cl_kernel_arg_type_qualifier qualifier = 0;
+        if (clGetKernelArgInfo(kernel, i, CL_KERNEL_ARG_TYPE_QUALIFIER, sizeof(qualifier), &qualifier, nullptr) != CL_SUCCESS)
+            return;
+        writes[i] = (qualifier & CL_KERNEL_ARG_TYPE_CONST) == 0;
+    }
+    argumentWrites = std::move(writes);
+    
+    std::vector<std::string> types(argumentCount);
+    for (cl_uint i = 0; i < argumentCount; ++i) {
+        size_t size = 0;
+        if (clGetKernelArgInfo(kernel, i, CL_KERNEL_ARG_TYPE_NAME, 0, nullptr, &size) != CL_SUCCESS || size == 0)
+            return;
+        types[i].resize(size);
+        clGetKernelArgInfo(kernel, i, CL_KERNEL_ARG_TYPE_NAME, size, &types[i][0], nullptr);
+        types[i].resize(size - 1);
     }
+    argumentTypes = std::move(types);
 }
 
-Kernel::Kernel(Kernel &&other) : kernel(std::move(other.kernel)), name(other.name) {
+Kernel::Kernel(Kernel &&other) : program(other.program), kernel(std::move(other.kernel)), hostKernel(other.hostKernel), name(other.name), argumentWrites(std::move(other.argumentWrites)), argumentTypes(std::move(other.argumentTypes)) {
+    other.program = nullptr;
     other.kernel = nullptr;
+    other.hostKernel = nullptr;
 }
 
 Kernel::~Kernel() {
@@ -338,50 +1244,173 @@ Kernel::~Kernel() {
 }
 
 Kernel &Kernel::operator =(Kernel &&other) {
+    program = other.program;
     kernel = std::move(other.kernel);
+    hostKernel = other.hostKernel;
     name = other.name;
+    argumentWrites = std::move(other.argumentWrites);
+    argumentTypes = std::move(other.argumentTypes);
+    other.program = nullptr;
     other.kernel = nullptr;
+    other.hostKernel = nullptr;
     return *this;
 }
 
 void KernelInvocation::pushArg(const void *p, size_t size) {
-    clSetKernelArg(kernel.id(), parameterId, size, p);
+    if (auto id = kernel.id())
+        clSetKernelArg(id, parameterId, size, p);
     parameterId++;
+    
+    Argument arg;
+    arg.size = size;
+    arg.isLocal = p == nullptr;
+    arg.isStorage = false;
+    if (p && size <= sizeof(arg.value))
+        memcpy(arg.value, p, size);
+    args.push_back(arg);
 }
 
-Storage::Storage() : buffer(nullptr) {
+void KernelInvocation::pushStorage(const StorageRef &ref) {
+    storage.push_back(std::make_pair(parameterId, ref.dependencies()));
+    auto mem = ref.id();
+    pushArg(&mem, sizeof(mem));
+    args.back().isStorage = true;
 }
 
-Storage::Storage(Device &device, size_t size, const void *data) {
-    cl_int error;
-    buffer = clCreateBuffer(device.context(), CL_MEM_READ_WRITE | (data == nullptr? 0 : CL_MEM_COPY_HOST_PTR), size, const_cast<void*>(data), &error);
+Storage::Storage() : buffer(nullptr), loc(StorageLocation::Device), host(false) {
+}
+
+Storage::Storage(Device &device, size_t size, const void *data) : loc(StorageLocation::Device), host(device.isHost()) {
+    cl_int error = CL_SUCCESS;
+    if (host) {
+        loc = StorageLocation::Host;
+        buffer = HostBuffer::create(size, data);
+        if (!buffer)
+            error = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    } else if (data == nullptr) {
+        buffer = device.memoryPool().allocate(size, error);
+    } else {
+        buffer = clCreateBuffer(device.context(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, const_cast<void*>(data), &error);
+    }
     if (!buffer || error != CL_SUCCESS) {
         device.error(error, "Failed to create buffer");
     }
+    deps = std::make_shared<StorageDependencies>();
+}
+
+static void CL_CALLBACK freeHostMemory(cl_mem, void *memory) {
+    free(memory);
+}
+
+#ifdef CL_VERSION_2_0
+struct SharedVirtualMemory {
+    cl_context context;
+    void *memory;
+};
+
+static void CL_CALLBACK freeSharedVirtualMemory(cl_mem, void *userData) {
+    auto svm = static_cast<SharedVirtualMemory*>(userData);
+    clSVMFree(svm->context, svm->memory);
+    delete svm;
 }
+#endif
 
-Storage::Storage(Storage &&other) : buffer(std::move(other.buffer)) {
+// Creates a buffer that uses the given host memory, which is freed with the buffer.
+static cl_mem createHostBuffer(cl_context context, size_t size, void *memory, void (CL_CALLBACK *release)(cl_mem, void*), void *userData, cl_int &error) {
+    auto buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, memory, &error);
+    if (!buffer || error != CL_SUCCESS) {
+        release(nullptr, userData);
+        return nullptr;
+    }
+    // Without the callback the memory would never be freed, so the buffer is
+    // released and the memory is freed right away.
+    error = clSetMemObjectDestructorCallback(buffer, release, userData);
+    if (error != CL_SUCCESS) {
+        clReleaseMemObject(buffer);
+        release(nullptr, userData);
+        return nullptr;
+    }
+    return buffer;
+}
+
+Storage::Storage(Device &device, size_t size, StorageLocation location) : buffer(nullptr), loc(location), host(device.isHost()) {
+    cl_int error = CL_SUCCESS;
+    if (host) {
+        // All the memory of the host device is host memory.
+        loc = StorageLocation::Host;
+        buffer = HostBuffer::create(size);
+        if (!buffer)
+            device.error(CL_MEM_OBJECT_ALLOCATION_FAILURE, "Failed to create buffer");
+        deps = std::make_shared<StorageDependencies>();
+        return;
+    }
+#ifdef CL_VERSION_2_0
+    if (loc == StorageLocation::SharedVirtualMemory && device.supportsSharedVirtualMemory()) {
+        if (auto memory = clSVMAlloc(device.context(), CL_MEM_READ_WRITE, size, 0))
+            buffer = createHostBuffer(device.context(), size, memory, freeSharedVirtualMemory, new SharedVirtualMemory{ device.context(), memory }, error);
+    }
+#endif
+    if (!buffer && loc != StorageLocation::Device) {
+        loc = StorageLocation::Host;
+        if (device.isCPU()) {
+            // CPU devices use page aligned memory without copying it.
+            const size_t pageSize = 4096;
+            void *memory = nullptr;
+            if (posix_memalign(&memory, pageSize, (size + pageSize - 1) / pageSize * pageSize) == 0)
+                buffer = createHostBuffer(device.context(), size, memory, freeHostMemory, memory, error);
+        } else {
+            // Other devices allocate pinned host memory themselves.
+            buffer = clCreateBuffer(device.context(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &error);
+        }
+    }
+    if (!buffer && loc == StorageLocation::Device) {
+        buffer = device.memoryPool().allocate(size, error);
+    }
+    if (!buffer || error != CL_SUCCESS) {
+        device.error(error, "Failed to create buffer");
+    }
+    deps = std::make_shared<StorageDependencies>();
+}
+
+Storage::Storage(Storage &&other) : buffer(std::move(other.buffer)), loc(other.loc), host(other.host), deps(std::move(other.deps)) {
     other.buffer = nullptr;
 }
 
+// Releases the reference to a memory object of the host or an OpenCL device.
+static void releaseBuffer(cl_mem buffer, bool host) {
+    if (host)
+        HostBuffer::get(buffer)->release();
+    else
+        clReleaseMemObject(buffer);
+}
+
 Storage::~Storage() {
     if (buffer)
-        clReleaseMemObject(buffer);
+        releaseBuffer(buffer, host);
 }
 
 Storage &Storage::operator = (Storage &&other) {
     if (buffer)
-        clReleaseMemObject(buffer);
+        releaseBuffer(buffer, host);
     buffer = other.buffer;
+    loc = other.loc;
+    host = other.host;
     other.buffer = nullptr;
+    deps = std::move(other.deps);
     return *this;
 }
 
 void Storage::shareWith(Storage &other) const {
     if (other.buffer)
-        clReleaseMemObject(other.buffer);
-    clRetainMemObject(buffer);
+        releaseBuffer(other.buffer, other.host);
+    if (host)
+        HostBuffer::get(buffer)->retain();
+    else
+        clRetainMemObject(buffer);
     other.buffer = buffer;
+    other.loc = loc;
+    other.host = host;
+    other.deps = deps;
 }
 
 namespace nnFit {
@@ -409,8 +1438,7 @@ KernelInvocation &operator <<(KernelInvocation &kernel, LocalStorage x) {
 }
     
 KernelInvocation &operator <<(KernelInvocation &kernel, const Storage &storage) {
-    auto mem = storage.id();
-    kernel.pushArg(&mem, sizeof(mem));
+    kernel.pushStorage(storage);
     return kernel;
 }
     
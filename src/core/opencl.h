@@ -2,13 +2,20 @@
 
 #include <vector>
 #include <string>
+#include <memory>
 #include <unordered_map>
+#include <typeindex>
 #ifdef __APPLE__
 #include "OpenCL/opencl.h"
 #else
 #include "CL/cl.h"
 #endif
 #include "range.h"
+#include "programCache.h"
+#include "tuner.h"
+#include "memoryPool.h"
+#include "profiler.h"
+#include "instrumentation.h"
 
 namespace nnFit {
 
@@ -21,16 +28,61 @@ class Storage;
 class StorageRef;
 class Vector;
 class TensorKernels;
+class Event;
+class CommandRecording;
+class BuildOptions;
+class ThreadPool;
+struct StorageDependencies;
+struct HostLaunch;
+
+// A native implementation of a kernel that runs on the host device.
+typedef void (*HostKernel)(const HostLaunch &launch);
+
+// Where the data of a storage object is allocated.
+enum class StorageLocation {
+    // Memory allocated by the driver, e.g. in the memory of a GPU.
+    Device,
+    // Page aligned host memory that the device uses directly. It can be mapped
+    // into the host without a copy, and CPU devices run kernels on it without copies.
+    Host,
+    // Shared virtual memory on the devices that support OpenCL 2.0, host memory otherwise.
+    SharedVirtualMemory
+};
+
+// BuildOptions - the compiler options that a program is specialized with.
+class BuildOptions {
+public:
+    BuildOptions &define(const std::string &name);
+    BuildOptions &define(const std::string &name, const std::string &value);
+    BuildOptions &define(const std::string &name, size_t value);
+    // Adds a compiler option that isn't a definition, e.g. -cl-std=CL2.0.
+    BuildOptions &option(const std::string &option);
+    
+    const std::string &str() const {
+        return options;
+    }
+private:
+    std::string options;
+};
 
 class Device {
 public:
     ~Device();
     Device(Device &&other);
     
+    // Returns the host device, which runs native implementations of the kernels on
+    // the CPU without an OpenCL driver. The kernels are vectorized with the instruction
+    // set that the library is compiled for, and are split between the given number of
+    // threads (all the hardware threads by default). The host device doesn't support
+    // the half precision, double precision and quantized kernels.
+    static Device host(unsigned threads = 0);
+    
     inline cl_device_id id() const {
         return device;
     }
     cl_context context();
+    // The platform that the device belongs to.
+    cl_platform_id platform() const;
     
     bool isGPU() const {
         return type == CL_DEVICE_TYPE_GPU;
@@ -40,9 +92,52 @@ public:
         return type == CL_DEVICE_TYPE_CPU;
     }
     
+    bool isSubDevice() const {
+        return subDevice;
+    }
+    
+    bool isHost() const {
+        return hostThreads != nullptr;
+    }
+    
+    // The threads that run the kernels of the host device, nullptr for the OpenCL devices.
+    ThreadPool *threadPool() const {
+        return hostThreads.get();
+    }
+    
+    unsigned computeUnits();
+    
+    // Return true if the device supports the OpenCL 2.0 shared virtual memory buffers.
+    bool supportsSharedVirtualMemory();
+    
+    // Return true if the device supports the OpenCL 2.0 sub-group functions.
+    bool supportsSubGroups();
+    
+    // Return true if the device compiles OpenCL C 2.0 kernels (-cl-std=CL2.0).
+    bool supportsOpenCLC2();
+    
+    // Return true if the device supports the double precision kernels (cl_khr_fp64).
+    bool supportsDoubles();
+    
+    // The number of floats (or doubles) in the vectors that the device prefers,
+    // e.g. 8 on a CPU with AVX. Returns 1 when the device prefers scalars.
+    unsigned preferredVectorWidth(bool doubles = false);
+    
+    // Splits the device into sub-devices that don't share a NUMA node, so that
+    // the kernels running on a sub-device only access the memory local to it.
+    // Every sub-device has its own context and has to be initialized separately.
+    // Returns an empty list if the device can't be split.
+    std::vector<Device> partitionByNUMANode();
+    // Splits the device into sub-devices with the given number of compute units each.
+    std::vector<Device> partitionEqually(unsigned computeUnits);
+    
     std::string name();
     std::string vendor();
     std::string version();
+    // The version of the OpenCL C language that the compiler of the device accepts.
+    std::string openCLCVersion();
+    std::string driverVersion();
+    std::string extensions();
     
     size_t maxThreadsPerWorkgroup() const {
         return maxThreadsInWorkgroup;
@@ -50,6 +145,38 @@ public:
     
     void init();
     
+    // Enables the on-disk cache of compiled program binaries.
+    // Should be called before the device is initialized.
+    void cacheCompiledPrograms(const std::string &directory);
+    
+    ProgramCache *programCache() const {
+        return compiledProgramCache.get();
+    }
+    
+    // Enables the on-disk database of the tuned kernel work-group sizes.
+    // The sizes that were tuned before are loaded from the given directory.
+    void storeTunedKernels(const std::string &directory);
+    
+    // The tuned work-group sizes are used by the kernel launches that don't
+    // specify a work-group size.
+    KernelTuner &kernelTuner();
+    
+    // Replaces the kernel tuner and returns the previous one, which is nullptr
+    // when the device didn't use the tuner yet.
+    std::unique_ptr<KernelTuner> kernelTuner(std::unique_ptr<KernelTuner> tuner);
+    
+    // The pool that the device buffers are allocated from.
+    MemoryPool &memoryPool();
+    
+    // Enables or disables the attribution of the work done on this device to the
+    // instrumentation scopes. Use a profiling command queue to measure the device time.
+    void instrument(bool enable);
+    
+    // Returns nullptr when the instrumentation is disabled.
+    Instrumentation *instrumentation() const {
+        return instrumentationScopes.get();
+    }
+    
     void queue(CommandQueue &q) {
         defaultQueue = &q;
     }
@@ -63,8 +190,26 @@ public:
     }
     
     void error(int errorCode, const char *msg);
-    
-    Program &getProgram(const char *name);
+    // Reports an error that the computation can't continue after, e.g. a kernel that
+    // the device doesn't implement, and aborts. It's fatal in the release builds too.
+    [[noreturn]] void fatalError(int errorCode, const char *msg);
+    
+    // Returns a program with the given name that's built with the given options.
+    // The programs that are embedded in the library are preferred to the files
+    // in the working directory. Every specialization of a program is built once.
+    // The program is built in the background, and its users wait for the build
+    // to finish when they create a kernel.
+    Program &getProgram(const char *name, const BuildOptions &options = BuildOptions());
+    
+    // Returns the object of the given type that's shared by all the users of
+    // this device. The object is constructed from the device on first use.
+    template<typename T>
+    T &shared() {
+        auto &object = sharedObjects[std::type_index(typeid(T))];
+        if (!object)
+            object = std::make_shared<T>(*this);
+        return *static_cast<T*>(object.get());
+    }
     
     double profile(std::function<void (void)> f);
     
@@ -73,72 +218,285 @@ public:
 private:
     Device(const Device &) = delete;
     Device(cl_device_id device);
+    explicit Device(std::unique_ptr<ThreadPool> threads);
+    static std::vector<Device> findDevices(cl_device_type type);
+    std::vector<Device> partition(const cl_device_partition_property *properties);
     
     cl_device_id device;
     CommandQueue *defaultQueue;
     cl_context ctx;
     cl_device_type type;
+    bool subDevice;
     size_t maxThreadsInWorkgroup;
+    std::unique_ptr<ThreadPool> hostThreads;
     std::unique_ptr<TensorKernels> tensorKernel;
+    std::unique_ptr<ProgramCache> compiledProgramCache;
+    std::unique_ptr<KernelTuner> tuner;
+    std::unique_ptr<MemoryPool> pool;
+    std::unique_ptr<Instrumentation> instrumentationScopes;
     std::unordered_map<std::string, std::unique_ptr<Program>> programs;
+    std::unordered_map<std::type_index, std::shared_ptr<void>> sharedObjects;
+    
+    friend class QueueScope;
+};
+
+// Event - a reference counted handle to the completion event of an enqueued command.
+class Event {
+public:
+    Event() : event(nullptr) { }
+    // Takes the ownership of the given event.
+    explicit Event(cl_event event) : event(event) { }
+    Event(const Event &other);
+    Event(Event &&other);
+    ~Event();
+    
+    Event &operator =(const Event &other);
+    Event &operator =(Event &&other);
+    
+    inline cl_event id() const {
+        return event;
+    }
+    
+    inline explicit operator bool() const {
+        return event != nullptr;
+    }
+    
+    void wait() const;
+private:
+    cl_event event;
+};
+
+// StorageDependencies - the last command that wrote to a memory object and the
+// commands that read from it since then. Out of order command queues use them
+// to infer the dependencies between the enqueued commands.
+struct StorageDependencies {
+    Event lastWrite;
+    std::vector<Event> reads;
+};
+
+// The value of a kernel argument, kept so that the launches can be recorded and
+// run by the host device.
+struct KernelArgument {
+    size_t size;
+    // Local memory arguments don't have a value.
+    bool isLocal;
+    bool isStorage;
+    unsigned char value[sizeof(cl_double)];
+};
+
+// CommandRecording - a sequence of commands captured by a command queue.
+// The kernels in a recording have their arguments already set, so replaying
+// it only has to enqueue the commands again.
+class CommandRecording {
+public:
+    CommandRecording();
+    CommandRecording(CommandRecording &&other);
+    ~CommandRecording();
+    
+    CommandRecording &operator =(CommandRecording &&other);
+    
+    bool isEmpty() const {
+        return commands.empty();
+    }
+    
+    // Return false when a command that can't be replayed, like a blocking read,
+    // was enqueued during the recording.
+    bool isReplayable() const {
+        return replayable;
+    }
+    
+    // Makes the recorded commands that accessed the 'from' memory object when they
+    // were recorded access the 'to' memory object instead.
+    void bind(const StorageRef &from, const StorageRef &to);
+private:
+    friend class CommandQueue;
+    friend class KernelTuner;
+    CommandRecording(const CommandRecording &) = delete;
+    
+    struct Binding {
+        unsigned parameter;
+        cl_mem recorded;
+        cl_mem current;
+    };
+    
+    struct Command {
+        // Kernel launches own a private copy of the kernel with the arguments set.
+        cl_kernel kernel;
+        // The kernel launches of the host device keep the function and the arguments instead.
+        HostKernel hostKernel;
+        std::vector<KernelArgument> arguments;
+        const char *name;
+        std::string programOptionsHash;
+        // The instrumentation scopes that the command was recorded in, relative to
+        // the scope where the recording started.
+        std::vector<std::string> scopes;
+        // The values of the arguments for the kernel profiler. The buffers are
+        // formatted by their type, so they stay valid when the buffers are rebound.
+        std::vector<std::string> formattedArguments;
+        unsigned dimensions;
+        size_t globalSize[3], globalOffset[3], workgroupSize[3];
+        bool hasWorkgroupSize;
+        // Buffer copies use the first two bindings as the source and the destination.
+        size_t size, srcOffset, destOffset;
+        std::vector<Binding> bindings;
+    };
+    
+    void retain(const Command &command);
+    void release();
+    
+    std::vector<Command> commands;
+    bool replayable;
+    // The commands of the host device reference HostBuffers instead of OpenCL memory objects.
+    bool host;
+    // The depth of the instrumentation scope where the recording started.
+    size_t instrumentationDepth;
 };
 
 class CommandQueue {
 public:
-    CommandQueue(Device &device, bool profile = false);
+    // An out of order queue can execute the enqueued commands in any order.
+    // The dependencies between them are inferred from the memory objects that
+    // they access, so only the commands with real data hazards are serialized.
+    CommandQueue(Device &device, bool profile = false, bool outOfOrder = false);
     ~CommandQueue();
     
-    void enqueue1Dim(const KernelInvocation &kernel, size_t size, size_t offset = 0);
-    void enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset = Range2D());
-    void enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset, const Range2D &workgroupSize);
-    void enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset = Range3D());
-    void enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset, const Range3D &workgroupSize);
+    bool isOutOfOrder() const {
+        return outOfOrder;
+    }
+    
+    // Every enqueue function returns the event of the enqueued command and
+    // accepts a list of additional events that the command should wait for.
+    Event enqueue1Dim(const KernelInvocation &kernel, size_t size, size_t offset = 0, const std::vector<Event> &waitList = std::vector<Event>());
+    Event enqueue1Dim(const KernelInvocation &kernel, size_t size, size_t offset, size_t workgroupSize, const std::vector<Event> &waitList = std::vector<Event>());
+    Event enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset = Range2D(), const std::vector<Event> &waitList = std::vector<Event>());
+    Event enqueue2Dim(const KernelInvocation &kernel, const Range2D &size, const Range2D &offset, const Range2D &workgroupSize, const std::vector<Event> &waitList = std::vector<Event>());
+    Event enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset = Range3D(), const std::vector<Event> &waitList = std::vector<Event>());
+    Event enqueue3Dim(const KernelInvocation &kernel, const Range3D &size, const Range3D &offset, const Range3D &workgroupSize, const std::vector<Event> &waitList = std::vector<Event>());
+    
+    Event fill(const Storage &dest, size_t size, size_t offset, const void *pattern, size_t patternSize, const std::vector<Event> &waitList = std::vector<Event>());
+    Event copy(const StorageRef &src, const StorageRef &dest, size_t size, size_t srcOffset = 0, size_t destOffset = 0, const std::vector<Event> &waitList = std::vector<Event>());
+    Event blockingRead(const Storage &src, void *dest, size_t size, size_t offset = 0, const std::vector<Event> &waitList = std::vector<Event>());
+    Event blockingWrite(const Storage &dest, const void *src, size_t size, size_t offset = 0, const std::vector<Event> &waitList = std::vector<Event>());
+    // Maps the storage into the host memory for reading and writing, waiting
+    // until the mapping is done. The storage mustn't be used by the kernels
+    // until it's unmapped.
+    void *map(const Storage &storage, size_t size, size_t offset = 0, const std::vector<Event> &waitList = std::vector<Event>());
+    Event unmap(const Storage &storage, void *data, const std::vector<Event> &waitList = std::vector<Event>());
+    
+    // Starts capturing the enqueued commands. The commands are still
+    // executed while they are being recorded.
+    void startRecording();
+    CommandRecording stopRecording();
+    
+    bool isRecording() const {
+        return recording != nullptr;
+    }
     
-    void fill(const Storage &dest, size_t size, size_t offset, const void *pattern, size_t patternSize);
-    void copy(const StorageRef &src, const StorageRef &dest, size_t size, size_t srcOffset = 0, size_t destOffset = 0);
-    void blockingRead(const Storage &src, void *dest, size_t size, size_t offset = 0);
-    void blockingWrite(const Storage &dest, const void *src, size_t size, size_t offset = 0);
+    void replay(const CommandRecording &recording);
     
     void finish();
     void flush();
     void dumpProfilingInfo();
-    double totalKernelProfilingTime() const;
+    double totalKernelProfilingTime();
+    
+    // The profiler that collects the kernel launches when the queue profiles them.
+    KernelProfiler &profiler() {
+        return kernelProfiler;
+    }
 private:
-    void enqueueKernel(const Kernel &kernel, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize = nullptr);
-    void profileKernel(cl_event event, const Kernel &kernel);
+    struct Access {
+        StorageDependencies *dependencies;
+        bool write;
+    };
+    
+    Event enqueueKernel(const KernelInvocation &invocation, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize, const std::vector<Event> &waitList);
+    void profileKernel(cl_event event, const char *name, unsigned dimensions, const size_t *globalSize, const size_t *workgroupSize, std::vector<std::string> arguments);
+    void recordKernel(const KernelInvocation &invocation, unsigned dimensions, const size_t *globalSize, const size_t *globalOffset, const size_t *workgroupSize);
+    
+    // Returns the events that a command which performs the given memory accesses must wait for.
+    std::vector<cl_event> dependencies(std::vector<Access> &accesses, const std::vector<Event> &waitList) const;
+    // Records the command as the last access of the given memory objects.
+    void recordAccesses(const std::vector<Access> &accesses, const Event &event);
+    
     CommandQueue(const CommandQueue &) = delete;
     
     Device &device;
     cl_command_queue queue;
     bool profile;
-    struct ProfileInfo {
-        size_t invocations;
-        double totalTime;
-        
-        ProfileInfo() : invocations(0), totalTime(0) { }
-    };
-    std::unordered_map<std::string, ProfileInfo> profileRecords;
+    bool outOfOrder;
+    std::unique_ptr<CommandRecording> recording;
+    KernelProfiler kernelProfiler;
+};
+
+// QueueScope - makes the queue the default queue of the device during its lifetime,
+// and restores the previous default queue, if any, when it's destroyed.
+class QueueScope {
+public:
+    QueueScope(Device &device, CommandQueue &queue) : device(device), previousQueue(device.defaultQueue) {
+        device.queue(queue);
+    }
+    
+    ~QueueScope() {
+        device.defaultQueue = previousQueue;
+    }
+private:
+    QueueScope(const QueueScope &) = delete;
+    
+    Device &device;
+    CommandQueue *previousQueue;
 };
 
 class Program {
 public:
     Program(Device &device, const char *src, size_t length);
+    Program(Device &device, const std::string &src);
     Program(Device &device, std::ifstream &is);
     Program(Program &&other);
     ~Program();
     
-    inline cl_program id() const {
-        return program;
-    }
+    // Returns the program object, waiting for the build to finish if the
+    // program is still being built.
+    cl_program id();
+    
     Device &device() const {
         return dev;
     }
     
-    void build();
+    // Builds the program. When the device has a program cache the binary is
+    // loaded from the cache, and the program is built from source only when
+    // the cached binary is missing or is rejected by the driver.
+    void build(const std::string &options = "");
+    
+    // Starts building the program without waiting for the build to finish,
+    // so that several programs can be built at the same time.
+    void buildAsync(const std::string &options = "");
+    
+    // Waits for the build started by buildAsync to finish.
+    void wait();
+    
+    bool isLoadedFromCache() const {
+        return loadedFromCache;
+    }
+    
+    // The options that the program was built with.
+    const std::string &options() const;
+    // A short hash of the options that identifies the specialization of the program.
+    const std::string &optionsHash() const;
 private:
     Program(const Program &) = delete;
+    struct BuildState;
+    static void CL_CALLBACK buildFinished(cl_program program, void *state);
+    bool startBuildFromBinary(const std::vector<unsigned char> &binary);
+    bool startBuildFromSource();
+    bool startBuild();
+    bool buildSucceeded() const;
+    std::vector<unsigned char> binary() const;
+    
     Device &dev;
+    std::string source;
     cl_program program;
+    bool loadedFromCache;
+    std::unique_ptr<BuildState> state;
 };
     
 class KernelInvocation {
@@ -146,6 +504,7 @@ public:
     explicit KernelInvocation(const Kernel &kernel) : kernel(kernel), parameterId(0) { }
     
     void pushArg(const void *p, size_t size);
+    void pushStorage(const StorageRef &storage);
     
     template<typename T>
     KernelInvocation &pushArgs(const T &x) {
@@ -159,8 +518,22 @@ public:
     }
     
     const Kernel &kernel;
+    
+    // The memory objects passed to the kernel together with the indices of their parameters.
+    const std::vector<std::pair<unsigned, StorageDependencies*>> &storageArgs() const {
+        return storage;
+    }
+    
+    // The values of the arguments, kept so that the invocation can be recorded.
+    typedef KernelArgument Argument;
+    
+    const std::vector<Argument> &arguments() const {
+        return args;
+    }
 private:
     unsigned parameterId;
+    std::vector<std::pair<unsigned, StorageDependencies*>> storage;
+    std::vector<Argument> args;
 };
     
 KernelInvocation &operator <<(KernelInvocation &kernel, float x);
@@ -172,6 +545,7 @@ KernelInvocation &operator <<(KernelInvocation &kernel, size_t x);
 class Kernel {
 public:
     Kernel();
+    // The kernel object is created when the kernel is used for the first time.
     Kernel(Program &program, const char *name);
     Kernel(Kernel &&other);
     ~Kernel();
@@ -180,12 +554,38 @@ public:
         return name;
     }
     
+    // The hash of the build options of the program, which identifies the specialization of the kernel.
+    const std::string &programOptionsHash() const;
+    
+    // Returns nullptr on the host device, which uses hostFunction instead.
     inline cl_kernel id() const {
+        if (!kernel && !hostKernel && program)
+            create();
         return kernel;
     }
     
+    // The native implementation of the kernel on the host device.
+    HostKernel hostFunction() const {
+        id();
+        return hostKernel;
+    }
+    
     inline operator bool() const {
-        return kernel != nullptr;
+        return kernel != nullptr || program != nullptr;
+    }
+    
+    // Returns the type name of the given parameter, or an empty string when it isn't known.
+    const std::string &argumentType(unsigned i) const {
+        static const std::string unknown;
+        id();
+        return i < argumentTypes.size()? argumentTypes[i] : unknown;
+    }
+    
+    // Return true if the kernel may write to the memory passed as the given parameter.
+    // Parameters which aren't declared as 'const' pointers are assumed to be written.
+    bool writesArgument(unsigned i) const {
+        id();
+        return i >= argumentWrites.size() || argumentWrites[i];
     }
     
     Kernel &operator =(Kernel &&other);
@@ -206,8 +606,14 @@ public:
     }
 private:
     Kernel(const Kernel &) = delete;
-    cl_kernel kernel;
+    void create() const;
+    
+    Program *program;
+    mutable cl_kernel kernel;
+    mutable HostKernel hostKernel;
     const char *name;
+    mutable std::vector<bool> argumentWrites;
+    mutable std::vector<std::string> argumentTypes;
 };
     
 // LocalStorage - a utility structure that allow the user to allocate local memory
@@ -224,6 +630,7 @@ class Storage {
 public:
     Storage();
     Storage(Device &device, size_t size, const void *data = nullptr);
+    Storage(Device &device, size_t size, StorageLocation location);
     Storage(Storage &&other);
     ~Storage();
     
@@ -233,24 +640,41 @@ public:
         return buffer;
     }
     
+    StorageDependencies *dependencies() const {
+        return deps.get();
+    }
+    
+    StorageLocation location() const {
+        return loc;
+    }
+    
     // Shares the data with another storage object.
     void shareWith(Storage &other) const;
 private:
     Storage(const Storage &) = delete;
     cl_mem buffer;
+    StorageLocation loc;
+    // The buffers of the host device are HostBuffers.
+    bool host;
+    std::shared_ptr<StorageDependencies> deps;
 };
     
 KernelInvocation &operator <<(KernelInvocation &kernel, const Storage &storage);
 
 class StorageRef {
 public:
-    StorageRef(const Storage &storage) : buffer(storage.id()) { }
+    StorageRef(const Storage &storage) : buffer(storage.id()), deps(storage.dependencies()) { }
     
     inline cl_mem id() const {
         return buffer;
     }
+    
+    StorageDependencies *dependencies() const {
+        return deps;
+    }
 private:
     cl_mem buffer;
+    StorageDependencies *deps;
 };
 
 } // namespace nnFit
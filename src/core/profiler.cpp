@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "profiler.h"
+
+using namespace nnFit;
+
+// The completed launches are collected when there are this many pending launches.
+static const size_t maxPendingLaunches = 1024;
+
+KernelProfiler::KernelProfiler() {
+}
+
+KernelProfiler::~KernelProfiler() {
+    for (auto &launch : pending)
+        clReleaseEvent(launch.first);
+}
+
+void KernelProfiler::add(cl_event event, Launch launch) {
+    clRetainEvent(event);
+    pending.push_back(std::make_pair(event, std::move(launch)));
+    if (pending.size() >= maxPendingLaunches)
+        drain(false);
+}
+
+void KernelProfiler::drain(bool wait) {
+    std::vector<std::pair<cl_event, Launch>> remaining;
+    for (auto &launch : pending) {
+        auto event = launch.first;
+        if (!wait) {
+            cl_int status = CL_COMPLETE;
+            if (clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr) == CL_SUCCESS && status > CL_COMPLETE) {
+                remaining.push_back(std::move(launch));
+                continue;
+            }
+        } else {
+            clWaitForEvents(1, &event);
+        }
+        auto &info = launch.second;
+        info.queued = info.submitted = info.started = info.ended = 0;
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &info.queued, nullptr);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &info.submitted, nullptr);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &info.started, nullptr);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &info.ended, nullptr);
+        clReleaseEvent(event);
+        completed.push_back(std::move(info));
+    }
+    pending = std::move(remaining);
+}
+
+// Returns the value below which the given fraction of the sorted times lie.
+static double percentile(const std::vector<double> &sortedTimes, double fraction) {
+    size_t i = size_t(fraction * double(sortedTimes.size() - 1) + 0.5);
+    return sortedTimes[std::min(i, sortedTimes.size() - 1)];
+}
+
+std::map<std::string, KernelProfiler::Statistics> KernelProfiler::statistics() {
+    drain(true);
+    std::map<std::string, std::vector<double>> times;
+    for (const auto &launch : completed)
+        times[launch.name].push_back(launch.milliseconds());
+    
+    std::map<std::string, Statistics> result;
+    for (auto &kernel : times) {
+        auto &values = kernel.second;
+        std::sort(values.begin(), values.end());
+        Statistics stats;
+        stats.invocations = values.size();
+        stats.totalTime = 0;
+        for (auto time : values)
+            stats.totalTime += time;
+        stats.median = percentile(values, 0.5);
+        stats.p99 = percentile(values, 0.99);
+        result.insert(std::make_pair(kernel.first, stats));
+    }
+    return result;
+}
+
+static void writeJSONString(std::ostream &os, const std::string &str) {
+    os << '"';
+    for (auto c : str) {
+        if (c == '"' || c == '\\')
+            os << '\\';
+        os << c;
+    }
+    os << '"';
+}
+
+static void writeSizes(std::ostream &os, const size_t *sizes, unsigned dimensions) {
+    os << '[';
+    for (unsigned i = 0; i < dimensions; ++i)
+        os << (i? "," : "") << sizes[i];
+    os << ']';
+}
+
+void KernelProfiler::writeChromeTrace(std::ostream &os) {
+    drain(true);
+    cl_ulong origin = completed.empty()? 0 : completed[0].queued;
+    for (const auto &launch : completed)
+        origin = std::min(origin, launch.queued);
+    
+    // The trace timestamps are in microseconds.
+    os << "{\"traceEvents\":[";
+    for (size_t i = 0; i < completed.size(); ++i) {
+        const auto &launch = completed[i];
+        os << (i? ",\n" : "\n") << "{\"name\":";
+        writeJSONString(os, launch.name);
+        os << ",\"cat\":\"kernel\",\"ph\":\"X\",\"pid\":0,\"tid\":0";
+        os << ",\"ts\":" << double(launch.started - origin) * 1e-3;
+        os << ",\"dur\":" << double(launch.ended - launch.started) * 1e-3;
+        os << ",\"args\":{\"queued\":" << double(launch.queued - origin) * 1e-3;
+        os << ",\"submitted\":" << double(launch.submitted - origin) * 1e-3;
+        os << ",\"globalSize\":";
+        writeSizes(os, launch.globalSize, launch.dimensions);
+        if (launch.hasWorkgroupSize) {
+            os << ",\"localSize\":";
+            writeSizes(os, launch.workgroupSize, launch.dimensions);
+        }
+        os << ",\"arguments\":[";
+        for (size_t j = 0; j < launch.arguments.size(); ++j) {
+            if (j)
+                os << ',';
+            writeJSONString(os, launch.arguments[j]);
+        }
+        os << "]}}";
+    }
+    os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+bool KernelProfiler::writeChromeTrace(const std::string &filename) {
+    std::ofstream os(filename);
+    if (!os) {
+        std::cerr << "Error writing '" << filename << "'\n";
+        return true;
+    }
+    writeChromeTrace(os);
+    return !os;
+}
+
+void KernelProfiler::clear() {
+    drain(true);
+    completed.clear();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+
+namespace nnFit {
+
+// KernelProfiler - collects the timings of the kernels launched by a command queue.
+// The launches are profiled without waiting for them. Their timestamps are read
+// when the queue is finished, or once the number of pending launches grows too large.
+class KernelProfiler {
+public:
+    struct Launch {
+        const char *name;
+        // The timestamps are in nanoseconds of the device clock.
+        cl_ulong queued, submitted, started, ended;
+        unsigned dimensions;
+        size_t globalSize[3];
+        size_t workgroupSize[3];
+        bool hasWorkgroupSize;
+        std::vector<std::string> arguments;
+        
+        double milliseconds() const {
+            return double(ended - started) * 1e-6;
+        }
+    };
+    
+    struct Statistics {
+        size_t invocations;
+        // The times are in milliseconds.
+        double totalTime;
+        double median;
+        double p99;
+    };
+    
+    KernelProfiler();
+    ~KernelProfiler();
+    
+    // Takes a reference to the event and reads its timestamps once it's completed.
+    void add(cl_event event, Launch launch);
+    
+    // Reads the timestamps of the pending launches, waiting for them to complete
+    // when wait is set.
+    void drain(bool wait);
+    
+    const std::vector<Launch> &launches() {
+        drain(true);
+        return completed;
+    }
+    
+    // Returns the latency statistics of every kernel, keyed by the kernel's name.
+    std::map<std::string, Statistics> statistics();
+    
+    // Writes the launches as a timeline in the Chrome trace event format,
+    // which can be opened by chrome://tracing or Perfetto.
+    void writeChromeTrace(std::ostream &os);
+    // Return true on error.
+    bool writeChromeTrace(const std::string &filename);
+    
+    void clear();
+private:
+    KernelProfiler(const KernelProfiler &) = delete;
+    
+    std::vector<std::pair<cl_event, Launch>> pending;
+    std::vector<Launch> completed;
+};
+
+} // namespace nnFit
@@ -0,0 +1,117 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "programCache.h"
+#include "opencl.h"
+
+using namespace nnFit;
+
+static const char cacheFileMagic[8] = { 'n', 'n', 'F', 'i', 't', 'B', 'i', 'n' };
+static const uint32_t cacheFileVersion = 1;
+
+// 64 bit FNV-1a hash. Unlike std::hash it's stable across processes and
+// standard library implementations.
+static uint64_t hash(const std::string &str) {
+    uint64_t result = 14695981039346656037ULL;
+    for (auto c : str) {
+        result ^= uint64_t((unsigned char)c);
+        result *= 1099511628211ULL;
+    }
+    return result;
+}
+
+static std::string hexString(uint64_t x) {
+    std::ostringstream os;
+    os << std::hex << std::setw(16) << std::setfill('0') << x;
+    return os.str();
+}
+
+std::string nnFit::stableHash(const std::string &str) {
+    return hexString(hash(str));
+}
+
+ProgramCache::ProgramCache(const std::string &directory) : directory(directory) {
+    // It's fine if the directory already exists.
+    mkdir(directory.c_str(), 0755);
+}
+
+std::string ProgramCache::key(Device &device, const std::string &source, const std::string &options) const {
+    std::ostringstream os;
+    os << device.name().c_str() << "\n" << device.driverVersion().c_str() << "\n" << device.version().c_str() << "\n" << options << "\n" << hexString(hash(source));
+    return os.str();
+}
+
+std::string ProgramCache::filename(const std::string &key) const {
+    return directory + "/" + hexString(hash(key)) + ".bin";
+}
+
+bool ProgramCache::load(Device &device, const std::string &source, const std::string &options, std::vector<unsigned char> &binary) const {
+    auto k = key(device, source, options);
+    std::ifstream is(filename(k), std::ios::binary | std::ios::ate);
+    if (!is)
+        return false;
+    // The sizes stored in the file are bounded by the rest of the file, so
+    // that a corrupt or a truncated file can't cause huge allocations.
+    auto fileSize = is.tellg();
+    is.seekg(0);
+    if (!is.good() || fileSize < 0)
+        return false;
+    auto remaining = [&] () -> uint64_t {
+        auto position = is.tellg();
+        return position < 0 || position > fileSize? 0 : uint64_t(fileSize - position);
+    };
+    
+    char magic[sizeof(cacheFileMagic)];
+    uint32_t version = 0;
+    uint32_t keySize = 0;
+    is.read(magic, sizeof(magic));
+    is.read(reinterpret_cast<char*>(&version), sizeof(version));
+    is.read(reinterpret_cast<char*>(&keySize), sizeof(keySize));
+    if (!is.good() || !std::equal(magic, magic + sizeof(magic), cacheFileMagic) || version != cacheFileVersion || keySize != k.size() || keySize > remaining())
+        return false;
+    
+    // Verify the full key to make sure that the file name hash didn't collide.
+    std::string storedKey(keySize, ' ');
+    is.read(&storedKey[0], keySize);
+    if (!is.good() || storedKey != k)
+        return false;
+    
+    uint64_t size = 0;
+    is.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (!is.good() || size == 0 || size > remaining())
+        return false;
+    binary.resize(size);
+    is.read(reinterpret_cast<char*>(binary.data()), size);
+    return !is.fail() && uint64_t(is.gcount()) == size;
+}
+
+void ProgramCache::store(Device &device, const std::string &source, const std::string &options, const std::vector<unsigned char> &binary) const {
+    auto k = key(device, source, options);
+    auto name = filename(k);
+    // Write to a temporary file first so that concurrent processes never
+    // observe a partially written binary.
+    auto temporaryName = name + "." + hexString(uint64_t(getpid())) + ".tmp";
+    {
+        std::ofstream os(temporaryName, std::ios::binary | std::ios::trunc);
+        if (!os)
+            return;
+        uint32_t keySize = uint32_t(k.size());
+        uint64_t size = binary.size();
+        os.write(cacheFileMagic, sizeof(cacheFileMagic));
+        os.write(reinterpret_cast<const char*>(&cacheFileVersion), sizeof(cacheFileVersion));
+        os.write(reinterpret_cast<const char*>(&keySize), sizeof(keySize));
+        os.write(k.data(), k.size());
+        os.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        os.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+        if (!os) {
+            os.close();
+            std::remove(temporaryName.c_str());
+            return;
+        }
+    }
+    if (std::rename(temporaryName.c_str(), name.c_str()) != 0)
+        std::remove(temporaryName.c_str());
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace nnFit {
+
+class Device;
+
+// Returns the 64 bit FNV-1a hash of a string formatted as a hex string.
+// Unlike std::hash it's stable across processes, so it can name files.
+std::string stableHash(const std::string &str);
+
+// ProgramCache - stores compiled OpenCL program binaries on disk so that
+// the programs don't have to be rebuilt from source every time a process starts.
+// The binaries are keyed by the device name, the driver version, the build
+// options and a hash of the program's source.
+class ProgramCache {
+public:
+    ProgramCache(const std::string &directory);
+    
+    const std::string &path() const {
+        return directory;
+    }
+    
+    // Return true if a binary for the given program was found.
+    bool load(Device &device, const std::string &source, const std::string &options, std::vector<unsigned char> &binary) const;
+    void store(Device &device, const std::string &source, const std::string &options, const std::vector<unsigned char> &binary) const;
+private:
+    std::string key(Device &device, const std::string &source, const std::string &options) const;
+    std::string filename(const std::string &key) const;
+    
+    std::string directory;
+};
+    
+} // namespace nnFit
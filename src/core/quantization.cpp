@@ -0,0 +1,86 @@
+#include "quantization.h"
+
+using namespace nnFit;
+
+// The size of the output tiles of the tiled quantized matrix multiplication.
+static const size_t quantizedMatrixMulTile = 16;
+
+// The number of vectors from which the tiled matrix multiplication is used.
+static const size_t quantizedMatrixMulMinimumVectorCount = 8;
+
+QuantizedMatrix::QuantizedMatrix(Device &device, size_t rows, size_t columns) : values_(device, rows, columns, ValueType::Int8), scales_(device, rows), zeroPoints_(device, rows, ValueType::Int8) {
+    // The host device only has the float kernels.
+    if (device.isHost())
+        device.fatalError(CL_INVALID_VALUE, "The host device doesn't support quantized matrices");
+}
+
+void QuantizedMatrix::quantize(const MatrixView &x) {
+    assert(x.type() == ValueType::Float);
+    assert(!x.isTransposed());
+    assert(x.rows() == rows() && x.columns() == columns());
+    auto &device = x.device();
+    auto &kernels = device.shared<QuantizedKernels>();
+    device.queue().enqueue1Dim(kernels.quantizeRows(x, columns(), values_, scales_, zeroPoints_), rows());
+}
+
+void QuantizedMatrix::dequantize(const MatrixView &dest) const {
+    assert(dest.type() == ValueType::Float);
+    assert(!dest.isTransposed());
+    assert(dest.rows() == rows() && dest.columns() == columns());
+    auto &device = dest.device();
+    auto &kernels = device.shared<QuantizedKernels>();
+    device.queue().enqueue2Dim(kernels.dequantizeRows(values_, scales_, zeroPoints_, dest), Range2D(rows(), columns()));
+}
+
+QuantizedKernels::Multiplication::Multiplication(Program &program) : matrixVectorMul(program, "quantizedMatrixVectorMul"), matrixMatrixMul(program, "quantizedMatrixMatrixMul") {
+}
+
+QuantizedKernels::QuantizedKernels(Device &device) : program(device.getProgram("quantized.cl")), quantizeRows(program, "quantizeRows"), dequantizeRows(program, "dequantizeRows"), quantizeVectors(program, "quantizeVectors"), floatInputs(program), int8Inputs(device.getProgram("quantized.cl", BuildOptions().define("INT8_INPUT"))) {
+}
+
+static size_t roundUp(size_t size, size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+// dest = x * y + bias with the kernels of the type of y.
+static void multiply(const Vector &dest, const QuantizedMatrix &x, const Vector &y, const Vector &yScales, const Vector &bias, const QuantizedKernels::Multiplication &kernels) {
+    size_t vectorCount = y.size() / x.columns();
+    assert((y.size() % x.columns()) == 0);
+    assert(dest.type() == ValueType::Float);
+    assert(dest.size() == x.rows() * vectorCount);
+    assert(bias.type() == ValueType::Float && bias.size() == x.rows());
+    
+    auto &device = dest.device();
+    if (vectorCount >= quantizedMatrixMulMinimumVectorCount && device.maxThreadsPerWorkgroup() >= quantizedMatrixMulTile * quantizedMatrixMulTile) {
+        auto task = kernels.matrixMatrixMul(x.values(), x.scales(), x.zeroPoints(), y, yScales, x.rows(), x.columns(), vectorCount, bias, dest);
+        device.queue().enqueue2Dim(task, Range2D(roundUp(x.rows(), quantizedMatrixMulTile), roundUp(vectorCount, quantizedMatrixMulTile)), Range2D(), Range2D(quantizedMatrixMulTile, quantizedMatrixMulTile));
+        return;
+    }
+    auto task = kernels.matrixVectorMul(x.values(), x.scales(), x.zeroPoints(), y, yScales, x.rows(), x.columns(), vectorCount, bias, dest);
+    device.queue().enqueue2Dim(task, Range2D(x.rows(), vectorCount));
+}
+
+namespace nnFit {
+
+void quantizeVectors(const Vector &values, const Vector &scales, const Vector &x) {
+    assert(x.type() == ValueType::Float);
+    assert(values.type() == ValueType::Int8 && values.size() == x.size());
+    assert(scales.type() == ValueType::Float);
+    assert((x.size() % scales.size()) == 0);
+    auto &kernels = x.device().shared<QuantizedKernels>();
+    x.device().queue().enqueue1Dim(kernels.quantizeVectors(x, x.size() / scales.size(), values, scales), scales.size());
+}
+
+void quantizedMmul(const Vector &dest, const QuantizedMatrix &x, const Vector &y, const Vector &bias) {
+    assert(y.type() == ValueType::Float);
+    // The vector scales aren't read by the float kernels.
+    multiply(dest, x, y, x.scales(), bias, dest.device().shared<QuantizedKernels>().floatInputs);
+}
+
+void quantizedMmul(const Vector &dest, const QuantizedMatrix &x, const Vector &y, const Vector &yScales, const Vector &bias) {
+    assert(y.type() == ValueType::Int8);
+    assert(yScales.type() == ValueType::Float && yScales.size() * x.columns() == y.size());
+    multiply(dest, x, y, yScales, bias, dest.device().shared<QuantizedKernels>().int8Inputs);
+}
+
+} // namespace nnFit
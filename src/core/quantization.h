@@ -0,0 +1,76 @@
+#pragma once
+
+#include <map>
+#include "vector.h"
+
+namespace nnFit {
+
+// QuantizedMatrix - a float matrix that's stored as int8 values with a scale and
+// a zero point per row, i.e. the element (r, j) is scale[r] * (value[r, j] - zeroPoint[r]).
+// The per-row ranges keep the rows with small weights accurate, and the int8 values
+// move a quarter of the bytes of the float matrix.
+class QuantizedMatrix {
+public:
+    QuantizedMatrix(Device &device, size_t rows, size_t columns);
+    
+    size_t rows() const {
+        return values_.rows();
+    }
+    size_t columns() const {
+        return values_.columns();
+    }
+    const Matrix &values() const {
+        return values_;
+    }
+    const Vector &scales() const {
+        return scales_;
+    }
+    const Vector &zeroPoints() const {
+        return zeroPoints_;
+    }
+    
+    // Quantizes the given float matrix. The range of every row includes 0.
+    // The views mustn't be transposed.
+    void quantize(const MatrixView &x);
+    // dest = the float values that the quantized matrix represents.
+    void dequantize(const MatrixView &dest) const;
+private:
+    Matrix values_;
+    Vector scales_;
+    Vector zeroPoints_;
+};
+
+// QuantizedKernels - the kernels of the quantized matrices of a device.
+// Shared by all the users of a device.
+class QuantizedKernels {
+public:
+    QuantizedKernels(Device &device);
+    
+    // The matrix multiplications of one type of vectors.
+    struct Multiplication {
+        Kernel matrixVectorMul;
+        Kernel matrixMatrixMul;
+        
+        Multiplication(Program &program);
+    };
+    
+    Program &program;
+    Kernel quantizeRows;
+    Kernel dequantizeRows;
+    Kernel quantizeVectors;
+    // The multiplications with float vectors and with int8 vectors.
+    Multiplication floatInputs;
+    Multiplication int8Inputs;
+};
+
+// Quantizes the float vectors x symmetrically to int8 values with a scale per vector,
+// i.e. x[v*size + j] = scales[v] * values[v*size + j], where size = x.size() / scales.size().
+void quantizeVectors(const Vector &values, const Vector &scales, const Vector &x);
+
+// dest = x * y + bias, where y are float vectors.
+void quantizedMmul(const Vector &dest, const QuantizedMatrix &x, const Vector &y, const Vector &bias);
+// dest = x * y + bias, where y are int8 vectors that were quantized by quantizeVectors
+// with the given scales. The products are accumulated as int32 values.
+void quantizedMmul(const Vector &dest, const QuantizedMatrix &x, const Vector &y, const Vector &yScales, const Vector &bias);
+
+} // namespace nnFit
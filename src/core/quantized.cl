@@ -0,0 +1,142 @@
+// Int8 quantized matrix multiplications
+
+// The program can be specialized with the following definitions:
+//   INT8_INPUT - defined when the vectors are quantized to int8 as well. The products
+//                are accumulated as int32 values and scaled once at the end. The vectors
+//                are floats by default.
+//   TILE       - the number of rows and vectors in the output tile of a work-group in
+//                the tiled matrix multiplication (16 by default).
+//
+// Every row r of a quantized matrix is stored as the int8 values q with a scale s[r]
+// and a zero point z[r], so that its elements are s[r] * (q - z[r]). The int8 vectors
+// are quantized symmetrically with a scale per vector, i.e. x = vs[v] * qx.
+// The zero points are applied once per output instead of once per element:
+//   sum((q - z) * x) = sum(q * x) - z * sum(x)
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+#ifdef INT8_INPUT
+typedef char Input;
+typedef int Accumulator;
+typedef int4 Accumulator4;
+#define CONVERT4(x) convert_int4(x)
+#else
+typedef float Input;
+typedef float Accumulator;
+typedef float4 Accumulator4;
+#define CONVERT4(x) convert_float4(x)
+#endif
+
+// Returns the output of row r for a vector with the given scale.
+inline float dequantize(Accumulator sum, Accumulator inputSum, const global float *scales, const global char *zeroPoints, uint r, float inputScale) {
+    return scales[r] * inputScale * (float)(sum - zeroPoints[r] * inputSum);
+}
+
+#ifdef INT8_INPUT
+#define INPUT_SCALE(v) vectorScales[v]
+#else
+#define INPUT_SCALE(v) 1.0f
+#endif
+
+// Quantizes every row of a float matrix with its own scale and zero point.
+// The range of a row always includes 0, so that 0 stays exact. One thread per row.
+// The rows of the float matrix are leadingDimension elements apart, the quantized values are dense.
+kernel void quantizeRows(const global float *matrix, const uint matrixOffset, const uint leadingDimension, const uint columns, global char *values, global float *scales, global char *zeroPoints) {
+    const uint r = get_global_id(0);
+    const global float *row = matrix + matrixOffset + r*leadingDimension;
+    float low = 0.0f, high = 0.0f;
+    for (uint j = 0; j < columns; ++j) {
+        low = min(low, row[j]);
+        high = max(high, row[j]);
+    }
+    float scale = (high - low) / 255.0f;
+    if (scale == 0.0f)
+        scale = 1.0f;
+    // The lowest value is mapped to -128.
+    int zeroPoint = clamp((int)round(-128.0f - low / scale), -128, 127);
+    for (uint j = 0; j < columns; ++j)
+        values[r*columns + j] = convert_char_sat_rte(row[j] / scale + (float)zeroPoint);
+    scales[r] = scale;
+    zeroPoints[r] = zeroPoint;
+}
+
+// matrix = the float values of a quantized matrix.
+kernel void dequantizeRows(const global char *values, const global float *scales, const global char *zeroPoints, global float *matrix, const uint matrixOffset, const uint leadingDimension) {
+    const uint r = get_global_id(0);
+    const uint j = get_global_id(1);
+    const uint i = r*get_global_size(1) + j;
+    matrix[matrixOffset + r*leadingDimension + j] = scales[r] * (float)(values[i] - zeroPoints[r]);
+}
+
+// Quantizes every vector symmetrically with its own scale, so that the element
+// with the largest magnitude becomes 127 or -127. One thread per vector.
+kernel void quantizeVectors(const global float *vectors, const uint size, global char *values, global float *scales) {
+    const uint v = get_global_id(0);
+    const global float *vector = vectors + v*size;
+    float largest = 0.0f;
+    for (uint j = 0; j < size; ++j)
+        largest = max(largest, fabs(vector[j]));
+    float scale = largest > 0.0f? largest / 127.0f : 1.0f;
+    for (uint j = 0; j < size; ++j)
+        values[v*size + j] = convert_char_sat_rte(vector[j] / scale);
+    scales[v] = scale;
+}
+
+// output[v*rows + r] = row r of the matrix * vector v + bias[r]
+// Every thread computes one output, 4 columns at a time. The vector scales are
+// only read when the vectors are quantized.
+kernel void quantizedMatrixVectorMul(const global char *matrix, const global float *scales, const global char *zeroPoints, const global Input *vectors, const global float *vectorScales, const uint rows, const uint columns, const uint vectorCount, const global float *bias, global float *output) {
+    const uint r = get_global_id(0);
+    const uint v = get_global_id(1);
+    const global char *row = matrix + r*columns;
+    const global Input *vector = vectors + v*columns;
+    Accumulator4 sum4 = 0, inputSum4 = 0;
+    const uint end = columns & ~3u;
+    for (uint j = 0; j < end; j += 4) {
+        Accumulator4 x = CONVERT4(vload4(0, vector + j));
+        sum4 += CONVERT4(vload4(0, row + j)) * x;
+        inputSum4 += x;
+    }
+    Accumulator sum = sum4.x + sum4.y + sum4.z + sum4.w;
+    Accumulator inputSum = inputSum4.x + inputSum4.y + inputSum4.z + inputSum4.w;
+    // The remaining columns.
+    for (uint j = end; j < columns; ++j) {
+        sum += row[j] * vector[j];
+        inputSum += vector[j];
+    }
+    output[v*rows + r] = dequantize(sum, inputSum, scales, zeroPoints, r, INPUT_SCALE(v)) + bias[r];
+}
+
+// The tiled version of quantizedMatrixVectorMul for many vectors. Every work-group
+// computes a TILE by TILE tile of the output, and stages TILE columns of the matrix
+// and of the vectors in local memory at a time, so that the int8 rows are read from
+// global memory once per tile instead of once per vector.
+// The global size is rounded up to a multiple of TILE in both dimensions.
+kernel void quantizedMatrixMatrixMul(const global char *matrix, const global float *scales, const global char *zeroPoints, const global Input *vectors, const global float *vectorScales, const uint rows, const uint columns, const uint vectorCount, const global float *bias, global float *output) {
+    local char matrixTile[TILE][TILE];
+    local Input vectorTile[TILE][TILE];
+    const uint lr = get_local_id(0);
+    const uint lv = get_local_id(1);
+    const uint r = get_group_id(0)*TILE + lr;
+    const uint v = get_group_id(1)*TILE + lv;
+    // The thread (lr, lv) loads the element lr of the matrix row loadRow and of the
+    // vector v, so that the neighbouring threads read neighbouring elements of both.
+    // The tiles are padded with zeros.
+    const uint loadRow = get_group_id(0)*TILE + lv;
+    Accumulator sum = 0, inputSum = 0;
+    for (uint k = 0; k < columns; k += TILE) {
+        matrixTile[lv][lr] = loadRow < rows && k + lr < columns? matrix[loadRow*columns + k + lr] : 0;
+        vectorTile[lv][lr] = v < vectorCount && k + lr < columns? vectors[v*columns + k + lr] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (uint j = 0; j < TILE; ++j) {
+            Input x = vectorTile[lv][j];
+            sum += matrixTile[lr][j] * x;
+            inputSum += x;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (r < rows && v < vectorCount)
+        output[v*rows + r] = dequantize(sum, inputSum, scales, zeroPoints, r, INPUT_SCALE(v)) + bias[r];
+}
@@ -42,4 +42,11 @@ kernel void invertedDropout(global Scalar *x, global uint4 *state, const float a
     struct RandomResult result = random(state[i]);
     state[i] = result.state;
     x[i] *= (result.value < activationProbability? (Scalar)1.0 : (Scalar)0.0) / activationProbability;
+}
+
+kernel void invertedDropoutHalf(global half *x, global uint4 *state, const float activationProbability) {
+    size_t i = get_global_id(0);
+    struct RandomResult result = random(state[i]);
+    state[i] = result.state;
+    vstore_half(vload_half(i, x) * (result.value < activationProbability? 1.0f : 0.0f) / activationProbability, i, x);
 }
\ No newline at end of file
@@ -22,10 +22,17 @@ void RandomGenerator::uniformFloatDistribution(const Vector &dest) {
 }
 
 void RandomGenerator::invertedDropout(const Vector &dest, float activationProbability) {
+    assert(dest.size()*4 == state.size());
+    if (dest.type() == ValueType::Half) {
+        if (!invertedDropoutHalfKernel) {
+            invertedDropoutHalfKernel = std::move(Kernel(program, "invertedDropoutHalf"));
+        }
+        dest.device().queue().enqueue1Dim(invertedDropoutHalfKernel(dest, state, activationProbability), dest.size());
+        return;
+    }
     if (!invertedDropoutKernel) {
         invertedDropoutKernel = std::move(Kernel(program, "invertedDropout"));
     }
     assert(dest.type() == valueType<float>());
-    assert(dest.size()*4 == state.size());
     dest.device().queue().enqueue1Dim(invertedDropoutKernel(dest, state, activationProbability), dest.size());
 }
\ No newline at end of file
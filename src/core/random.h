@@ -11,7 +11,7 @@ public:
     // Generates a uniform distribution of random floats in the range from 0 to 1.
     void uniformFloatDistribution(const Vector &dest);
     
-    // Performs an inverted dropout on the given vector.
+    // Performs an inverted dropout on the given float or half vector.
     void invertedDropout(const Vector &dest, float activationProbability);
     
 private:
@@ -19,6 +19,7 @@ private:
     Program &program;
     Kernel uniformRandomKernel;
     Kernel invertedDropoutKernel;
+    Kernel invertedDropoutHalfKernel;
 };
     
 } // namespace nnFit
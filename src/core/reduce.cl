@@ -0,0 +1,182 @@
+// Parallel reductions
+
+// The program is specialized with the following definitions:
+//   TYPE                - the type of the elements of the reduced vectors (float by default).
+//   ACCUMULATOR         - the type of the partial results (float by default).
+//   INTEGER_ACCUMULATOR - defined when the accumulator is an integer.
+//   SIGNED_ACCUMULATOR  - defined together with INTEGER_ACCUMULATOR when the integer is signed.
+//   HALF                - defined when TYPE is half. The elements are loaded with vload_half.
+//   SUM, MAX, MIN, ARGMAX, DOT, L2_NORM or COUNT_NONZERO - the reduction (SUM by default).
+//
+// A reduction runs in up to two stages. In the first stage every work-group reduces
+// a part of the vector to a partial result, and in the second one a single work-group
+// reduces the partial results. The threads of a work-group combine their values with
+// the sub-group reductions when they are available, or with a tree in local memory.
+
+#ifndef TYPE
+#define TYPE float
+#endif
+
+#ifndef ACCUMULATOR
+#define ACCUMULATOR float
+#endif
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#if !defined(SUM) && !defined(MAX) && !defined(MIN) && !defined(ARGMAX) && !defined(DOT) && !defined(L2_NORM) && !defined(COUNT_NONZERO)
+#define SUM
+#endif
+
+#if defined(INTEGER_ACCUMULATOR) && defined(SIGNED_ACCUMULATOR)
+#define LOWEST INT_MIN
+#define HIGHEST INT_MAX
+#elif defined(INTEGER_ACCUMULATOR)
+#define LOWEST 0
+#define HIGHEST UINT_MAX
+#else
+#define LOWEST (-INFINITY)
+#define HIGHEST INFINITY
+#endif
+
+// ELEMENT(p, i) - the i-th element of p as an ACCUMULATOR.
+#ifdef HALF
+#define ELEMENT(p, i) vload_half(i, p)
+#else
+#define ELEMENT(p, i) ((ACCUMULATOR)(p)[i])
+#endif
+
+// MAP(i)        - the value of the i-th element that's reduced.
+// COMBINE(a, b) - combines two values.
+// IDENTITY      - the value that doesn't change the result when it's combined.
+// FINISH(x)     - the final result.
+#if defined(SUM)
+#define MAP(i) ELEMENT(x, i)
+#define COMBINE(a, b) ((a) + (b))
+#define IDENTITY 0
+#define SUB_GROUP_REDUCE sub_group_reduce_add
+#elif defined(MAX) || defined(ARGMAX)
+#define MAP(i) ELEMENT(x, i)
+#define COMBINE(a, b) max(a, b)
+#define IDENTITY LOWEST
+#define SUB_GROUP_REDUCE sub_group_reduce_max
+#elif defined(MIN)
+#define MAP(i) ELEMENT(x, i)
+#define COMBINE(a, b) min(a, b)
+#define IDENTITY HIGHEST
+#define SUB_GROUP_REDUCE sub_group_reduce_min
+#elif defined(DOT)
+#define MAP(i) (ELEMENT(x, i) * ELEMENT(y, i))
+#define COMBINE(a, b) ((a) + (b))
+#define IDENTITY 0
+#define SUB_GROUP_REDUCE sub_group_reduce_add
+#elif defined(L2_NORM)
+#define MAP(i) (ELEMENT(x, i) * ELEMENT(x, i))
+#define COMBINE(a, b) ((a) + (b))
+#define IDENTITY 0
+#define FINISH(x) sqrt(x)
+#define SUB_GROUP_REDUCE sub_group_reduce_add
+#elif defined(COUNT_NONZERO)
+#define MAP(i) ((ACCUMULATOR)(ELEMENT(x, i) != 0))
+#define COMBINE(a, b) ((a) + (b))
+#define IDENTITY 0
+#define SUB_GROUP_REDUCE sub_group_reduce_add
+#endif
+
+#ifndef FINISH
+#define FINISH(x) (x)
+#endif
+
+// The sub-group functions can't track the index of the maximum.
+#if defined(cl_khr_subgroups) && defined(__OPENCL_C_VERSION__) && __OPENCL_C_VERSION__ >= 200 && !defined(ARGMAX)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#define USE_SUB_GROUPS
+#endif
+
+// Replaces the current maximum when the value is greater, or when it's equal and
+// has a smaller index, so that argmax returns the first maximum.
+#define UPDATE_MAXIMUM(value, index, v, vi) \
+    if ((v) > (value) || ((v) == (value) && (vi) < (index))) { \
+        value = (v); \
+        index = (vi); \
+    }
+
+// Combines the values of all the threads in a work-group and writes the result
+// of the work-group. The work-group size must be a power of two.
+inline void reduceWorkgroup(ACCUMULATOR value, uint index, const uint last, global ACCUMULATOR *dest, global uint *destIndices, local ACCUMULATOR *work, local uint *workIndices) {
+    const uint lid = get_local_id(0);
+#ifdef USE_SUB_GROUPS
+    value = SUB_GROUP_REDUCE(value);
+    if (get_sub_group_local_id() == 0)
+        work[get_sub_group_id()] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid == 0) {
+        for (uint i = 1; i < get_num_sub_groups(); ++i)
+            value = COMBINE(value, work[i]);
+    }
+#else
+    work[lid] = value;
+#ifdef ARGMAX
+    workIndices[lid] = index;
+#endif
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint s = get_local_size(0)/2; s > 0; s >>= 1) {
+        if (lid < s) {
+#ifdef ARGMAX
+            ACCUMULATOR v = work[lid];
+            uint vi = workIndices[lid];
+            UPDATE_MAXIMUM(v, vi, work[lid + s], workIndices[lid + s]);
+            work[lid] = v;
+            workIndices[lid] = vi;
+#else
+            work[lid] = COMBINE(work[lid], work[lid + s]);
+#endif
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    value = work[0];
+#ifdef ARGMAX
+    index = workIndices[0];
+#endif
+#endif
+
+    if (lid == 0) {
+        uint group = get_group_id(0);
+        dest[group] = last? FINISH(value) : value;
+#ifdef ARGMAX
+        destIndices[group] = index;
+#endif
+    }
+}
+
+// The first stage, which reduces the elements of x (and y for the dot product).
+// Every thread combines the elements that are a global size apart.
+// The indices are only written by ARGMAX.
+kernel void reduce(const global TYPE *x, const global TYPE *y, const uint size, const uint last, global ACCUMULATOR *dest, global uint *destIndices, local ACCUMULATOR *work, local uint *workIndices) {
+    ACCUMULATOR value = IDENTITY;
+    uint index = UINT_MAX;
+    for (uint i = get_global_id(0); i < size; i += get_global_size(0)) {
+#ifdef ARGMAX
+        ACCUMULATOR v = MAP(i);
+        UPDATE_MAXIMUM(value, index, v, i);
+#else
+        value = COMBINE(value, MAP(i));
+#endif
+    }
+    reduceWorkgroup(value, index, last, dest, destIndices, work, workIndices);
+}
+
+// The second stage, which reduces the partial results of the first stage.
+kernel void reducePartials(const global ACCUMULATOR *x, const global uint *indices, const uint size, const uint last, global ACCUMULATOR *dest, global uint *destIndices, local ACCUMULATOR *work, local uint *workIndices) {
+    ACCUMULATOR value = IDENTITY;
+    uint index = UINT_MAX;
+    for (uint i = get_global_id(0); i < size; i += get_global_size(0)) {
+#ifdef ARGMAX
+        UPDATE_MAXIMUM(value, index, x[i], indices[i]);
+#else
+        value = COMBINE(value, x[i]);
+#endif
+    }
+    reduceWorkgroup(value, index, last, dest, destIndices, work, workIndices);
+}
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <memory>
+#include "reduction.h"
+
+using namespace nnFit;
+
+// The largest work-group size used by the reductions.
+static const size_t maxReductionWorkgroupSize = 256;
+
+static const char *reductionName(Reduction reduction) {
+    switch (reduction) {
+        case Reduction::Sum: return "SUM";
+        case Reduction::Max: return "MAX";
+        case Reduction::Min: return "MIN";
+        case Reduction::ArgMax: return "ARGMAX";
+        case Reduction::Dot: return "DOT";
+        case Reduction::L2Norm: return "L2_NORM";
+        case Reduction::CountNonzero: return "COUNT_NONZERO";
+    }
+}
+
+static const char *typeName(const ValueType &type) {
+    switch (type.type()) {
+        case ValueType::Float: return "float";
+        case ValueType::Half: return "half";
+        case ValueType::Double: return "double";
+        case ValueType::Int8: return "char";
+        case ValueType::Uint8: return "uchar";
+        case ValueType::Uint16: return "ushort";
+        case ValueType::Uint32: return "uint";
+        case ValueType::Int32: return "int";
+    }
+}
+
+// The type of the partial results of a reduction. The nonzero elements are
+// counted in integers, like the result. The signed bytes are reduced in
+// signed integers, so that their sums, minimums and maximums can be negative.
+static ValueType accumulatorType(Reduction reduction, const ValueType &type) {
+    if (reduction == Reduction::CountNonzero)
+        return ValueType::Uint32;
+    if (type == ValueType::Double)
+        return ValueType::Double;
+    if (type.isFloatingPoint() || reduction == Reduction::L2Norm)
+        return ValueType::Float;
+    if (type == ValueType::Int8)
+        return ValueType::Int32;
+    return ValueType::Uint32;
+}
+
+ValueType nnFit::reductionType(Reduction reduction, const ValueType &type) {
+    if (reduction == Reduction::ArgMax || reduction == Reduction::CountNonzero)
+        return ValueType::Uint32;
+    return accumulatorType(reduction, type);
+}
+
+Reductions::Kernels::Kernels(Device &device, Program &program) : reduce(program, "reduce"), reducePartials(program, "reducePartials") {
+    workgroupSize = std::min(device.maxThreadsPerWorkgroup(), maxReductionWorkgroupSize);
+    for (auto kernel : { &reduce, &reducePartials }) {
+        size_t kernelWorkgroupSize = 0;
+        if (kernel->id() && clGetKernelWorkGroupInfo(kernel->id(), device.id(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelWorkgroupSize), &kernelWorkgroupSize, nullptr) == CL_SUCCESS && kernelWorkgroupSize)
+            workgroupSize = std::min(workgroupSize, kernelWorkgroupSize);
+    }
+    // The work-groups reduce their values in a tree.
+    size_t powerOfTwo = 1;
+    while (powerOfTwo * 2 <= workgroupSize)
+        powerOfTwo *= 2;
+    workgroupSize = powerOfTwo;
+}
+
+Reductions::Reductions(Device &device) : dev(device) {
+}
+
+Reductions::Kernels &Reductions::kernels(Reduction reduction, const ValueType &type) {
+    auto key = std::make_pair(reduction, type.type());
+    auto i = specializations.find(key);
+    if (i != specializations.end())
+        return *i->second;
+
+    auto accumulator = accumulatorType(reduction, type);
+    BuildOptions options;
+    options.define("TYPE", typeName(type)).define("ACCUMULATOR", typeName(accumulator)).define(reductionName(reduction));
+    if (accumulator == ValueType::Uint32 || accumulator == ValueType::Int32)
+        options.define("INTEGER_ACCUMULATOR");
+    if (accumulator == ValueType::Int32)
+        options.define("SIGNED_ACCUMULATOR");
+    if (type == ValueType::Half)
+        options.define("HALF");
+    // The sub-group functions are a part of OpenCL C 2.0, which the compiler of the
+    // device has to accept even when the device supports the OpenCL 2.0 API.
+    if (dev.supportsSubGroups() && dev.supportsOpenCLC2())
+        options.option("-cl-std=CL2.0");
+    std::unique_ptr<Kernels> result(new Kernels(dev, dev.getProgram("reduce.cl", options)));
+    auto &kernels = *result;
+    specializations.insert(std::make_pair(key, std::move(result)));
+    return kernels;
+}
+
+void Reductions::reduce(const Vector &dest, Reduction reduction, const Vector &x, const Vector *y) {
+    assert(dest.size() == 1);
+    assert(dest.type() == reductionType(reduction, x.type()));
+    assert((reduction == Reduction::Dot) == (y != nullptr));
+    assert(!y || (y->type() == x.type() && y->size() == x.size()));
+
+    auto &k = kernels(reduction, x.type());
+    auto &queue = dev.queue();
+    auto accumulator = accumulatorType(reduction, x.type());
+    size_t workgroupSize = k.workgroupSize;
+    LocalStorage work(workgroupSize * accumulator.size());
+    bool argMax = reduction == Reduction::ArgMax;
+    LocalStorage workIndices(argMax? workgroupSize * sizeof(uint32_t) : sizeof(uint32_t));
+
+    // The partial results fit into a single work-group, so there are two stages at most.
+    size_t groups = std::max(std::min((x.size() + workgroupSize - 1) / workgroupSize, workgroupSize), size_t(1));
+    bool singleStage = groups == 1;
+    Vector partials(dev, groups, accumulator);
+    // The maximum itself isn't a part of the result of argmax.
+    std::unique_ptr<Vector> partialIndices, maximum;
+    if (argMax) {
+        partialIndices.reset(new Vector(dev, groups, ValueType::Uint32));
+        maximum.reset(new Vector(dev, 1, accumulator));
+    }
+
+    // The index arguments are only used by argmax, the other reductions get any buffer.
+    const Vector &values = !singleStage? partials : argMax? *maximum : dest;
+    const Vector &indices = !argMax? partials : singleStage? dest : *partialIndices;
+    queue.enqueue1Dim(k.reduce(x, y? *y : x, x.size(), size_t(singleStage), values, indices, work, workIndices), groups * workgroupSize, 0, workgroupSize);
+    if (singleStage)
+        return;
+
+    queue.enqueue1Dim(k.reducePartials(partials, argMax? *partialIndices : partials, groups, size_t(1), argMax? *maximum : dest, argMax? dest : partials, work, workIndices), workgroupSize, 0, workgroupSize);
+}
+
+namespace nnFit {
+
+void reduce(const Vector &dest, Reduction reduction, const Vector &x) {
+    dest.device().shared<Reductions>().reduce(dest, reduction, x);
+}
+
+void dot(const Vector &dest, const Vector &x, const Vector &y) {
+    dest.device().shared<Reductions>().reduce(dest, Reduction::Dot, x, &y);
+}
+
+} // namespace nnFit
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <map>
+#include "vector.h"
+
+namespace nnFit {
+
+enum class Reduction {
+    Sum,
+    Max,
+    Min,
+    // The index of the first maximum.
+    ArgMax,
+    Dot,
+    L2Norm,
+    CountNonzero
+};
+
+// Returns the type of the result of a reduction of a vector of the given type.
+// The sums, dot products, minimums and maximums of floats and halfs are floats, of doubles
+// are doubles, and of integers are uint32 values. L2 norms are floats (doubles for doubles),
+// counts and indices are uint32 values.
+ValueType reductionType(Reduction reduction, const ValueType &type);
+
+// Reductions - the reduction kernels of a device, specialized for every reduction
+// and element type on first use. Shared by all the users of a device.
+class Reductions {
+public:
+    Reductions(Device &device);
+
+    // dest[0] = reduction(x), or dot(x, y) for the dot product.
+    // The number of stages and their sizes are chosen from the size of x and the
+    // work-group size limits of the device.
+    void reduce(const Vector &dest, Reduction reduction, const Vector &x, const Vector *y = nullptr);
+private:
+    struct Kernels {
+        Kernel reduce;
+        Kernel reducePartials;
+        size_t workgroupSize;
+
+        Kernels(Device &device, Program &program);
+    };
+
+    Kernels &kernels(Reduction reduction, const ValueType &type);
+
+    Device &dev;
+    std::map<std::pair<Reduction, ValueType::ElementType>, std::unique_ptr<Kernels>> specializations;
+};
+
+// dest[0] = reduction(x)
+void reduce(const Vector &dest, Reduction reduction, const Vector &x);
+// dest[0] = dot(x, y)
+void dot(const Vector &dest, const Vector &x, const Vector &y);
+
+} // namespace nnFit
@@ -0,0 +1,262 @@
+#include "simd.h"
+
+// The x86 builds of GCC and Clang compile the loops for every instruction set with target
+// attributes and select one with __builtin_cpu_supports. The other builds only have the
+// instruction set that they're compiled for.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_DISPATCH
+#endif
+
+#if defined(SIMD_DISPATCH) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace nnFit {
+namespace simd {
+
+// The loops of an instruction set.
+struct Functions {
+    const char *instructionSet;
+    size_t width;
+    float (*dot)(const float *x, const float *y, size_t n);
+    void (*dot4)(const float *const rows[4], const float *x, size_t n, float *result);
+    void (*axpy)(float a, const float *x, float *y, size_t n);
+    void (*scale)(float a, float *y, size_t n);
+    float (*sum)(const float *x, size_t n);
+    void (*elementwise)(Operation op, const float *x, const float *y, float *dest, size_t n);
+    void (*elementwiseConstant)(Operation op, const float *x, float k, float *dest, size_t n);
+};
+
+// Floats - a vector of floats in the registers of an instruction set. The loads and
+// stores don't need to be aligned.
+#ifdef SIMD_DISPATCH
+namespace avx512 {
+#define SIMD_TARGET __attribute__((target("avx512f")))
+const char instructionSetName[] = "AVX-512";
+
+struct Floats {
+    static const size_t width = 16;
+    __m512 v;
+
+    SIMD_TARGET Floats() { }
+    SIMD_TARGET Floats(__m512 v) : v(v) { }
+
+    SIMD_TARGET static Floats load(const float *p) { return _mm512_loadu_ps(p); }
+    SIMD_TARGET static Floats broadcast(float x) { return _mm512_set1_ps(x); }
+    SIMD_TARGET static Floats zero() { return _mm512_setzero_ps(); }
+    SIMD_TARGET void store(float *p) const { _mm512_storeu_ps(p, v); }
+    SIMD_TARGET float sum() const { return _mm512_reduce_add_ps(v); }
+
+    SIMD_TARGET friend Floats operator +(Floats x, Floats y) { return _mm512_add_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator -(Floats x, Floats y) { return _mm512_sub_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator *(Floats x, Floats y) { return _mm512_mul_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator /(Floats x, Floats y) { return _mm512_div_ps(x.v, y.v); }
+    // x*y + z
+    SIMD_TARGET friend Floats fma(Floats x, Floats y, Floats z) { return _mm512_fmadd_ps(x.v, y.v, z.v); }
+};
+
+#include "simdKernels.h"
+#undef SIMD_TARGET
+} // namespace avx512
+
+namespace avx2 {
+#define SIMD_TARGET __attribute__((target("avx2,fma")))
+const char instructionSetName[] = "AVX2";
+
+struct Floats {
+    static const size_t width = 8;
+    __m256 v;
+
+    SIMD_TARGET Floats() { }
+    SIMD_TARGET Floats(__m256 v) : v(v) { }
+
+    SIMD_TARGET static Floats load(const float *p) { return _mm256_loadu_ps(p); }
+    SIMD_TARGET static Floats broadcast(float x) { return _mm256_set1_ps(x); }
+    SIMD_TARGET static Floats zero() { return _mm256_setzero_ps(); }
+    SIMD_TARGET void store(float *p) const { _mm256_storeu_ps(p, v); }
+    SIMD_TARGET float sum() const {
+        __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+        x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+        return _mm_cvtss_f32(x);
+    }
+
+    SIMD_TARGET friend Floats operator +(Floats x, Floats y) { return _mm256_add_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator -(Floats x, Floats y) { return _mm256_sub_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator *(Floats x, Floats y) { return _mm256_mul_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator /(Floats x, Floats y) { return _mm256_div_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats fma(Floats x, Floats y, Floats z) { return _mm256_fmadd_ps(x.v, y.v, z.v); }
+};
+
+#include "simdKernels.h"
+#undef SIMD_TARGET
+} // namespace avx2
+#endif
+
+#if defined(SIMD_DISPATCH) || defined(__SSE2__)
+namespace sse2 {
+#ifdef SIMD_DISPATCH
+#define SIMD_TARGET __attribute__((target("sse2")))
+#else
+#define SIMD_TARGET
+#endif
+const char instructionSetName[] = "SSE2";
+
+struct Floats {
+    static const size_t width = 4;
+    __m128 v;
+
+    SIMD_TARGET Floats() { }
+    SIMD_TARGET Floats(__m128 v) : v(v) { }
+
+    SIMD_TARGET static Floats load(const float *p) { return _mm_loadu_ps(p); }
+    SIMD_TARGET static Floats broadcast(float x) { return _mm_set1_ps(x); }
+    SIMD_TARGET static Floats zero() { return _mm_setzero_ps(); }
+    SIMD_TARGET void store(float *p) const { _mm_storeu_ps(p, v); }
+    SIMD_TARGET float sum() const {
+        __m128 x = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+        return _mm_cvtss_f32(x);
+    }
+
+    SIMD_TARGET friend Floats operator +(Floats x, Floats y) { return _mm_add_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator -(Floats x, Floats y) { return _mm_sub_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator *(Floats x, Floats y) { return _mm_mul_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats operator /(Floats x, Floats y) { return _mm_div_ps(x.v, y.v); }
+    SIMD_TARGET friend Floats fma(Floats x, Floats y, Floats z) { return _mm_add_ps(_mm_mul_ps(x.v, y.v), z.v); }
+};
+
+#include "simdKernels.h"
+#undef SIMD_TARGET
+} // namespace sse2
+#elif defined(__ARM_NEON)
+namespace neon {
+#define SIMD_TARGET
+const char instructionSetName[] = "NEON";
+
+struct Floats {
+    static const size_t width = 4;
+    float32x4_t v;
+
+    Floats() { }
+    Floats(float32x4_t v) : v(v) { }
+
+    static Floats load(const float *p) { return vld1q_f32(p); }
+    static Floats broadcast(float x) { return vdupq_n_f32(x); }
+    static Floats zero() { return vdupq_n_f32(0.0f); }
+    void store(float *p) const { vst1q_f32(p, v); }
+    float sum() const {
+        float32x2_t x = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+        return vget_lane_f32(vpadd_f32(x, x), 0);
+    }
+
+    friend Floats operator +(Floats x, Floats y) { return vaddq_f32(x.v, y.v); }
+    friend Floats operator -(Floats x, Floats y) { return vsubq_f32(x.v, y.v); }
+    friend Floats operator *(Floats x, Floats y) { return vmulq_f32(x.v, y.v); }
+    friend Floats operator /(Floats x, Floats y) {
+        float a[4], b[4];
+        vst1q_f32(a, x.v);
+        vst1q_f32(b, y.v);
+        for (unsigned i = 0; i < 4; ++i)
+            a[i] /= b[i];
+        return vld1q_f32(a);
+    }
+    friend Floats fma(Floats x, Floats y, Floats z) { return vmlaq_f32(z.v, x.v, y.v); }
+};
+
+#include "simdKernels.h"
+#undef SIMD_TARGET
+} // namespace neon
+#else
+namespace scalar {
+#define SIMD_TARGET
+const char instructionSetName[] = "scalar";
+
+struct Floats {
+    static const size_t width = 1;
+    float v;
+
+    Floats() { }
+    Floats(float v) : v(v) { }
+
+    static Floats load(const float *p) { return *p; }
+    static Floats broadcast(float x) { return x; }
+    static Floats zero() { return 0.0f; }
+    void store(float *p) const { *p = v; }
+    float sum() const { return v; }
+
+    friend Floats operator +(Floats x, Floats y) { return x.v + y.v; }
+    friend Floats operator -(Floats x, Floats y) { return x.v - y.v; }
+    friend Floats operator *(Floats x, Floats y) { return x.v * y.v; }
+    friend Floats operator /(Floats x, Floats y) { return x.v / y.v; }
+    friend Floats fma(Floats x, Floats y, Floats z) { return x.v * y.v + z.v; }
+};
+
+#include "simdKernels.h"
+#undef SIMD_TARGET
+} // namespace scalar
+#endif
+
+static const Functions &selectFunctions() {
+#if defined(SIMD_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return avx512::functions;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return avx2::functions;
+    return sse2::functions;
+#elif defined(__SSE2__)
+    return sse2::functions;
+#elif defined(__ARM_NEON)
+    return neon::functions;
+#else
+    return scalar::functions;
+#endif
+}
+
+// The CPU is only checked once.
+static const Functions &selected() {
+    static const Functions &functions = selectFunctions();
+    return functions;
+}
+
+const char *instructionSet() {
+    return selected().instructionSet;
+}
+
+size_t width() {
+    return selected().width;
+}
+
+float dot(const float *x, const float *y, size_t n) {
+    return selected().dot(x, y, n);
+}
+
+void dot4(const float *const rows[4], const float *x, size_t n, float *result) {
+    selected().dot4(rows, x, n, result);
+}
+
+void axpy(float a, const float *x, float *y, size_t n) {
+    selected().axpy(a, x, y, n);
+}
+
+void scale(float a, float *y, size_t n) {
+    selected().scale(a, y, n);
+}
+
+float sum(const float *x, size_t n) {
+    return selected().sum(x, n);
+}
+
+void elementwise(Operation op, const float *x, const float *y, float *dest, size_t n) {
+    selected().elementwise(op, x, y, dest, n);
+}
+
+void elementwiseConstant(Operation op, const float *x, float k, float *dest, size_t n) {
+    selected().elementwiseConstant(op, x, k, dest, n);
+}
+
+} // namespace simd
+} // namespace nnFit
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+
+namespace nnFit {
+namespace simd {
+
+// The vectorized loops of the host kernels. On x86 they're compiled for AVX-512, AVX2
+// (with FMA) and SSE2, and the widest instruction set that the CPU supports is selected
+// at run time, so the library itself doesn't have to be built for a particular CPU.
+// The other targets use NEON when it's available and single floats otherwise.
+// The pointers don't need to be aligned.
+
+// The name of the selected instruction set.
+const char *instructionSet();
+
+// The number of floats in the vectors of the selected instruction set.
+size_t width();
+
+// Returns the dot product of x and y.
+float dot(const float *x, const float *y, size_t n);
+
+// Returns the dot products of the 4 rows and x.
+void dot4(const float *const rows[4], const float *x, size_t n, float *result);
+
+// y += a*x
+void axpy(float a, const float *x, float *y, size_t n);
+
+// y *= a
+void scale(float a, float *y, size_t n);
+
+// Returns the sum of x[0], ..., x[n - 1].
+float sum(const float *x, size_t n);
+
+enum Operation {
+    Add,
+    Sub,
+    Mul,
+    Div
+};
+
+// dest[i] = op(x[i], y[i])
+void elementwise(Operation op, const float *x, const float *y, float *dest, size_t n);
+
+// dest[i] = op(x[i], k)
+void elementwiseConstant(Operation op, const float *x, float k, float *dest, size_t n);
+
+} // namespace simd
+} // namespace nnFit
@@ -0,0 +1,136 @@
+// The vectorized loops, included by simd.cpp once for every instruction set. The including
+// namespace defines Floats, a vector of floats in the registers of the instruction set, and
+// SIMD_TARGET, the target attribute of the functions that use it.
+
+struct AddOperation {
+    template<typename T> SIMD_TARGET T operator ()(T x, T y) const { return x + y; }
+};
+
+struct SubOperation {
+    template<typename T> SIMD_TARGET T operator ()(T x, T y) const { return x - y; }
+};
+
+struct MulOperation {
+    template<typename T> SIMD_TARGET T operator ()(T x, T y) const { return x * y; }
+};
+
+struct DivOperation {
+    template<typename T> SIMD_TARGET T operator ()(T x, T y) const { return x / y; }
+};
+
+// The products are summed in several independent accumulators, so the loop isn't bound
+// by the latency of the additions.
+SIMD_TARGET float dot(const float *x, const float *y, size_t n) {
+    const size_t w = Floats::width;
+    Floats s0 = Floats::zero(), s1 = Floats::zero(), s2 = Floats::zero(), s3 = Floats::zero();
+    size_t i = 0;
+    for (; i + 4*w <= n; i += 4*w) {
+        s0 = fma(Floats::load(x + i), Floats::load(y + i), s0);
+        s1 = fma(Floats::load(x + i + w), Floats::load(y + i + w), s1);
+        s2 = fma(Floats::load(x + i + 2*w), Floats::load(y + i + 2*w), s2);
+        s3 = fma(Floats::load(x + i + 3*w), Floats::load(y + i + 3*w), s3);
+    }
+    for (; i + w <= n; i += w)
+        s0 = fma(Floats::load(x + i), Floats::load(y + i), s0);
+    float result = ((s0 + s1) + (s2 + s3)).sum();
+    for (; i < n; ++i)
+        result += x[i] * y[i];
+    return result;
+}
+
+// Every load of x is reused for all the rows.
+SIMD_TARGET void dot4(const float *const rows[4], const float *x, size_t n, float *result) {
+    const size_t w = Floats::width;
+    Floats s0 = Floats::zero(), s1 = Floats::zero(), s2 = Floats::zero(), s3 = Floats::zero();
+    size_t i = 0;
+    for (; i + w <= n; i += w) {
+        Floats v = Floats::load(x + i);
+        s0 = fma(Floats::load(rows[0] + i), v, s0);
+        s1 = fma(Floats::load(rows[1] + i), v, s1);
+        s2 = fma(Floats::load(rows[2] + i), v, s2);
+        s3 = fma(Floats::load(rows[3] + i), v, s3);
+    }
+    result[0] = s0.sum();
+    result[1] = s1.sum();
+    result[2] = s2.sum();
+    result[3] = s3.sum();
+    for (; i < n; ++i) {
+        for (unsigned r = 0; r < 4; ++r)
+            result[r] += rows[r][i] * x[i];
+    }
+}
+
+SIMD_TARGET void axpy(float a, const float *x, float *y, size_t n) {
+    const size_t w = Floats::width;
+    Floats k = Floats::broadcast(a);
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        fma(k, Floats::load(x + i), Floats::load(y + i)).store(y + i);
+    for (; i < n; ++i)
+        y[i] += a * x[i];
+}
+
+SIMD_TARGET void scale(float a, float *y, size_t n) {
+    const size_t w = Floats::width;
+    Floats k = Floats::broadcast(a);
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        (k * Floats::load(y + i)).store(y + i);
+    for (; i < n; ++i)
+        y[i] *= a;
+}
+
+SIMD_TARGET float sum(const float *x, size_t n) {
+    const size_t w = Floats::width;
+    Floats s0 = Floats::zero(), s1 = Floats::zero();
+    size_t i = 0;
+    for (; i + 2*w <= n; i += 2*w) {
+        s0 = s0 + Floats::load(x + i);
+        s1 = s1 + Floats::load(x + i + w);
+    }
+    float result = (s0 + s1).sum();
+    for (; i < n; ++i)
+        result += x[i];
+    return result;
+}
+
+template<typename Op>
+SIMD_TARGET void elementwise(const float *x, const float *y, float *dest, size_t n, Op op) {
+    const size_t w = Floats::width;
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        op(Floats::load(x + i), Floats::load(y + i)).store(dest + i);
+    for (; i < n; ++i)
+        dest[i] = op(x[i], y[i]);
+}
+
+SIMD_TARGET void elementwise(Operation op, const float *x, const float *y, float *dest, size_t n) {
+    switch (op) {
+    case Add: elementwise(x, y, dest, n, AddOperation()); break;
+    case Sub: elementwise(x, y, dest, n, SubOperation()); break;
+    case Mul: elementwise(x, y, dest, n, MulOperation()); break;
+    case Div: elementwise(x, y, dest, n, DivOperation()); break;
+    }
+}
+
+template<typename Op>
+SIMD_TARGET void elementwiseConstant(const float *x, float k, float *dest, size_t n, Op op) {
+    const size_t w = Floats::width;
+    Floats kk = Floats::broadcast(k);
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        op(Floats::load(x + i), kk).store(dest + i);
+    for (; i < n; ++i)
+        dest[i] = op(x[i], k);
+}
+
+SIMD_TARGET void elementwiseConstant(Operation op, const float *x, float k, float *dest, size_t n) {
+    switch (op) {
+    case Add: elementwiseConstant(x, k, dest, n, AddOperation()); break;
+    case Sub: elementwiseConstant(x, k, dest, n, SubOperation()); break;
+    case Mul: elementwiseConstant(x, k, dest, n, MulOperation()); break;
+    case Div: elementwiseConstant(x, k, dest, n, DivOperation()); break;
+    }
+}
+
+const Functions functions = { instructionSetName, Floats::width, dot, dot4, axpy, scale, sum, elementwise, elementwiseConstant };
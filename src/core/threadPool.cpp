@@ -0,0 +1,124 @@
+#include <algorithm>
+#include "threadPool.h"
+
+using namespace nnFit;
+
+// The number of times an idle thread looks for ranges before it goes to sleep.
+static const unsigned spinCount = 64;
+
+ThreadPool::ThreadPool(unsigned threads) : queued(0), sleeping(0), stopping(false) {
+    if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned i = 0; i < threads; ++i)
+        workers.emplace_back(new Worker());
+    for (unsigned i = 1; i < threads; ++i)
+        threadHandles.emplace_back([this, i] { work(i); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto &thread : threadHandles)
+        thread.join();
+}
+
+void ThreadPool::push(unsigned worker, const Range &range) {
+    {
+        std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+        workers[worker]->ranges.push_back(range);
+    }
+    queued.fetch_add(1);
+    // A sleeping thread either sees the new range before it waits, or is woken up here.
+    if (sleeping.load()) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wakeUp.notify_one();
+    }
+}
+
+bool ThreadPool::take(unsigned worker, Range &range) {
+    if (!queued.load())
+        return false;
+    {
+        auto &own = *workers[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.ranges.empty()) {
+            range = own.ranges.back();
+            own.ranges.pop_back();
+            queued.fetch_sub(1);
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+        auto &victim = *workers[(worker + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.ranges.empty()) {
+            range = victim.ranges.front();
+            victim.ranges.pop_front();
+            queued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(unsigned worker, Range range) {
+    auto loop = range.loop;
+    while (range.end - range.begin > loop->grain) {
+        size_t middle = range.begin + (range.end - range.begin) / 2;
+        push(worker, Range{ loop, middle, range.end });
+        range.end = middle;
+    }
+    (*loop->body)(range.begin, range.end);
+    // The loop may be gone once its last range is done.
+    loop->remaining.fetch_sub(range.end - range.begin);
+}
+
+void ThreadPool::work(unsigned worker) {
+    unsigned idle = 0;
+    for (;;) {
+        Range range;
+        if (take(worker, range)) {
+            run(worker, range);
+            idle = 0;
+            continue;
+        }
+        if (++idle < spinCount) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleeping.fetch_add(1);
+        wakeUp.wait(lock, [this] { return stopping || queued.load(); });
+        sleeping.fetch_sub(1);
+        if (stopping)
+            return;
+        idle = 0;
+    }
+}
+
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain, const std::function<void (size_t, size_t)> &body) {
+    if (end <= begin)
+        return;
+    grain = std::max(grain, size_t(1));
+    if (workers.size() == 1 || end - begin <= grain) {
+        body(begin, end);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(loopMutex);
+    Loop loop;
+    loop.body = &body;
+    loop.grain = grain;
+    loop.remaining = end - begin;
+    run(0, Range{ &loop, begin, end });
+    while (loop.remaining.load()) {
+        Range range;
+        if (take(0, range))
+            run(0, range);
+        else
+            std::this_thread::yield();
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nnFit {
+
+// ThreadPool - the threads that run the parallel loops of the host device.
+// Every thread has its own deque of ranges. A thread that runs a range splits off
+// its upper halves onto its deque until the range is no larger than the grain size
+// of the loop, and the idle threads steal the oldest, i.e. the largest, ranges from
+// the other deques. The thread that starts a loop takes part in running it.
+class ThreadPool {
+public:
+    // Creates a pool with the given number of threads, including the calling thread.
+    // Uses all the hardware threads when the number is 0.
+    explicit ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+
+    // The number of threads that run the loops, including the calling thread.
+    unsigned threads() const {
+        return unsigned(workers.size());
+    }
+
+    // Calls body(first, last) for the subranges of [begin, end) that cover it, and
+    // returns once all of them are done. A subrange is split further only when it's
+    // larger than the grain, so the loops that don't exceed it run on the calling
+    // thread without waking the others. Mustn't be called from the body of a loop.
+    void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void (size_t, size_t)> &body);
+private:
+    ThreadPool(const ThreadPool &) = delete;
+
+    struct Loop {
+        const std::function<void (size_t, size_t)> *body;
+        size_t grain;
+        // The number of iterations that haven't finished yet.
+        std::atomic<size_t> remaining;
+    };
+
+    struct Range {
+        Loop *loop;
+        size_t begin, end;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    void push(unsigned worker, const Range &range);
+    // Takes the newest range of the worker's own deque, or steals the oldest range of another one.
+    bool take(unsigned worker, Range &range);
+    void run(unsigned worker, Range range);
+    void work(unsigned worker);
+
+    // The calling thread of parallelFor uses the first worker's deque.
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threadHandles;
+    // The number of ranges in all the deques.
+    std::atomic<size_t> queued;
+    // The number of threads that wait for ranges.
+    std::atomic<unsigned> sleeping;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    bool stopping;
+    // Only one loop runs at a time.
+    std::mutex loopMutex;
+};
+
+} // namespace nnFit
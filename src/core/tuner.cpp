@@ -0,0 +1,214 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tuner.h"
+#include "opencl.h"
+
+using namespace nnFit;
+
+static const char databaseMagic[] = "nnFitTuning";
+static const unsigned databaseVersion = 2;
+// The number of times every candidate work-group size is launched.
+static const size_t tuningIterations = 20;
+
+KernelTuner::KernelTuner(Device &device) : device(device) {
+}
+
+KernelTuner::KernelTuner(Device &device, const std::string &directory) : device(device), directory(directory) {
+    // It's fine if the directory already exists.
+    mkdir(directory.c_str(), 0755);
+    load();
+}
+
+KernelTuner::Key KernelTuner::key(const std::string &name, const std::string &optionsHash, unsigned dimensions, const size_t *sizes) {
+    // The database is separated by whitespace, so the missing hash is written as a dash.
+    return Key(name, optionsHash.empty()? "-" : optionsHash, dimensions, sizes[0], dimensions > 1? sizes[1] : 0, dimensions > 2? sizes[2] : 0);
+}
+
+bool KernelTuner::find(const Table &table, const Key &key, unsigned dimensions, size_t *values) {
+    auto it = table.find(key);
+    if (it == table.end())
+        return false;
+    for (unsigned i = 0; i < dimensions; ++i)
+        values[i] = it->second[i];
+    return true;
+}
+
+void KernelTuner::store(Table &table, const Key &key, unsigned dimensions, const size_t *values) {
+    std::array<size_t, 3> sizes = {{ 0, 0, 0 }};
+    for (unsigned i = 0; i < dimensions; ++i)
+        sizes[i] = values[i];
+    table[key] = sizes;
+}
+
+bool KernelTuner::find(const Kernel &kernel, unsigned dimensions, const size_t *globalSize, size_t *workgroupSize) const {
+    if (launches.empty())
+        return false;
+    return find(launches, key(kernel.kernelName(), kernel.programOptionsHash(), dimensions, globalSize), dimensions, workgroupSize);
+}
+
+void KernelTuner::store(const Kernel &kernel, unsigned dimensions, const size_t *globalSize, const size_t *workgroupSize) {
+    store(launches, key(kernel.kernelName(), kernel.programOptionsHash(), dimensions, globalSize), dimensions, workgroupSize);
+    save();
+}
+
+bool KernelTuner::findParameters(const char *name, unsigned dimensions, const size_t *shape, size_t *values) const {
+    return find(parameters, key(name, "", dimensions, shape), dimensions, values);
+}
+
+void KernelTuner::storeParameters(const char *name, unsigned dimensions, const size_t *shape, const size_t *values) {
+    store(parameters, key(name, "", dimensions, shape), dimensions, values);
+    save();
+}
+
+// Returns the total device time of the launches in milliseconds, or a negative
+// value when the kernel can't be launched with the given work-group size.
+static double measure(cl_command_queue queue, cl_kernel kernel, unsigned dimensions, const size_t *globalOffset, const size_t *globalSize, const size_t *workgroupSize) {
+    std::vector<cl_event> events;
+    for (size_t i = 0; i < tuningIterations; ++i) {
+        cl_event event = nullptr;
+        if (clEnqueueNDRangeKernel(queue, kernel, dimensions, globalOffset, globalSize, workgroupSize, 0, nullptr, &event) != CL_SUCCESS)
+            break;
+        events.push_back(event);
+    }
+    if (events.empty())
+        return -1.0;
+    clWaitForEvents(cl_uint(events.size()), events.data());
+    double time = 0.0;
+    for (auto event : events) {
+        cl_ulong started = 0, ended = 0;
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &started, nullptr);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &ended, nullptr);
+        time += double(ended - started) * 1.0e-6;
+        clReleaseEvent(event);
+    }
+    return events.size() == tuningIterations? time : -1.0;
+}
+
+// Returns the work-group sizes made of powers of two that divide the global size.
+static std::vector<std::array<size_t, 3>> candidateWorkgroupSizes(unsigned dimensions, const size_t *globalSize, size_t maxThreads) {
+    std::vector<std::array<size_t, 3>> result;
+    std::array<size_t, 3> size = {{ 1, 1, 1 }};
+    std::function<void (unsigned, size_t)> generate = [&] (unsigned dimension, size_t threads) {
+        if (dimension == dimensions) {
+            result.push_back(size);
+            return;
+        }
+        for (size_t x = 1; threads * x <= maxThreads && x <= globalSize[dimension]; x *= 2) {
+            if (globalSize[dimension] % x != 0)
+                break;
+            size[dimension] = x;
+            generate(dimension + 1, threads * x);
+        }
+    };
+    generate(0, 1);
+    return result;
+}
+
+void KernelTuner::tune(const CommandRecording &recording) {
+    // The host kernels don't use the work-group sizes.
+    if (device.isHost())
+        return;
+    cl_int error = 0;
+    auto queue = clCreateCommandQueue(device.context(), device.id(), CL_QUEUE_PROFILING_ENABLE, &error);
+    if (!queue || error != CL_SUCCESS) {
+        device.error(error, "Failed to create command queue");
+        return;
+    }
+    bool tuned = false;
+    for (const auto &command : recording.commands) {
+        size_t workgroupSize[3];
+        auto launch = key(command.name, command.programOptionsHash, command.dimensions, command.globalSize);
+        if (!command.kernel || command.hasWorkgroupSize || find(launches, launch, command.dimensions, workgroupSize))
+            continue;
+        size_t maxThreads = device.maxThreadsPerWorkgroup();
+        clGetKernelWorkGroupInfo(command.kernel, device.id(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxThreads), &maxThreads, nullptr);
+
+        // The driver's default is the baseline that a candidate has to beat.
+        std::array<size_t, 3> best = {{ 0, 0, 0 }};
+        double bestTime = measure(queue, command.kernel, command.dimensions, command.globalOffset, command.globalSize, nullptr);
+        for (const auto &candidate : candidateWorkgroupSizes(command.dimensions, command.globalSize, maxThreads)) {
+            auto time = measure(queue, command.kernel, command.dimensions, command.globalOffset, command.globalSize, candidate.data());
+            if (time >= 0.0 && (bestTime < 0.0 || time < bestTime)) {
+                best = candidate;
+                bestTime = time;
+            }
+        }
+        launches[launch] = best;
+        tuned = true;
+    }
+    clReleaseCommandQueue(queue);
+    if (tuned)
+        save();
+}
+
+std::string KernelTuner::deviceKey() const {
+    std::ostringstream os;
+    os << device.name().c_str() << " / " << device.driverVersion().c_str() << " / " << device.version().c_str() << " / " << device.computeUnits() << " compute units";
+    return os.str();
+}
+
+std::string KernelTuner::filename() const {
+    return directory + "/" + stableHash(deviceKey()) + ".tuning";
+}
+
+void KernelTuner::load() {
+    std::ifstream is(filename());
+    if (!is)
+        return;
+
+    std::string magic, storedKey;
+    unsigned version = 0;
+    is >> magic >> version;
+    is.ignore(1);
+    std::getline(is, storedKey);
+    // Verify the full key to make sure that the file name hash didn't collide.
+    if (!is || magic != databaseMagic || version != databaseVersion || storedKey != deviceKey())
+        return;
+
+    // Every line is a launch or a set of parameters with its name, the hash of the
+    // build options, the dimensions, the sizes and the values.
+    std::string table, name, options;
+    unsigned dimensions;
+    size_t sizes[3], values[3];
+    while (is >> table >> name >> options >> dimensions >> sizes[0] >> sizes[1] >> sizes[2] >> values[0] >> values[1] >> values[2]) {
+        if (dimensions == 0 || dimensions > 3 || (table != "launch" && table != "parameters"))
+            continue;
+        (table == "launch"? launches : parameters)[Key(name, options, dimensions, sizes[0], sizes[1], sizes[2])] = {{ values[0], values[1], values[2] }};
+    }
+}
+
+void KernelTuner::save() const {
+    if (directory.empty())
+        return;
+    auto name = filename();
+    // Write to a temporary file first so that concurrent processes never
+    // observe a partially written database.
+    std::ostringstream suffix;
+    suffix << "." << getpid() << ".tmp";
+    auto temporaryName = name + suffix.str();
+    {
+        std::ofstream os(temporaryName, std::ios::trunc);
+        if (!os)
+            return;
+        os << databaseMagic << " " << databaseVersion << "\n" << deviceKey() << "\n";
+        for (auto table : { std::make_pair("launch", &launches), std::make_pair("parameters", &parameters) }) {
+            for (const auto &entry : *table.second) {
+                const auto &k = entry.first;
+                os << table.first << " " << std::get<0>(k) << " " << std::get<1>(k) << " " << std::get<2>(k) << " " << std::get<3>(k) << " " << std::get<4>(k) << " " << std::get<5>(k);
+                os << " " << entry.second[0] << " " << entry.second[1] << " " << entry.second[2] << "\n";
+            }
+        }
+        if (!os) {
+            os.close();
+            std::remove(temporaryName.c_str());
+            return;
+        }
+    }
+    if (std::rename(temporaryName.c_str(), name.c_str()) != 0)
+        std::remove(temporaryName.c_str());
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <tuple>
+#include <array>
+#include <map>
+
+namespace nnFit {
+
+class Device;
+class Kernel;
+class CommandRecording;
+
+// KernelTuner - the fastest work-group sizes of the kernel launches on one device.
+// The sizes are keyed by the kernel name, the build options of its program and
+// the global size of the launch, so every specialization of a kernel is tuned
+// separately. When the tuner has a directory, the results are stored in a database
+// there that's keyed by the device name and version, so the tuning is done only once.
+class KernelTuner {
+public:
+    KernelTuner(Device &device);
+    KernelTuner(Device &device, const std::string &directory);
+
+    const std::string &path() const {
+        return directory;
+    }
+
+    // Returns false when the launch wasn't tuned yet. A zero work-group size
+    // means that the driver's default work-group size is the fastest.
+    bool find(const Kernel &kernel, unsigned dimensions, const size_t *globalSize, size_t *workgroupSize) const;
+    void store(const Kernel &kernel, unsigned dimensions, const size_t *globalSize, const size_t *workgroupSize);
+
+    // The tuned parameters that aren't the work-group size of a single launch, like
+    // the work-group shape that the matrix vector multiplications of a matrix use.
+    // They are keyed by their name and the shape that they were tuned for.
+    bool findParameters(const char *name, unsigned dimensions, const size_t *shape, size_t *values) const;
+    void storeParameters(const char *name, unsigned dimensions, const size_t *shape, const size_t *values);
+
+    // Measures every kernel launch in the recording that uses the driver's
+    // default work-group size with the work-group sizes that divide its global
+    // size, and stores the fastest one. The launches that were already tuned are skipped.
+    void tune(const CommandRecording &recording);
+private:
+    KernelTuner(const KernelTuner &) = delete;
+    // The name, the hash of the build options, and the dimensions and the sizes.
+    typedef std::tuple<std::string, std::string, unsigned, size_t, size_t, size_t> Key;
+    typedef std::map<Key, std::array<size_t, 3>> Table;
+
+    static Key key(const std::string &name, const std::string &optionsHash, unsigned dimensions, const size_t *sizes);
+    static bool find(const Table &table, const Key &key, unsigned dimensions, size_t *values);
+    static void store(Table &table, const Key &key, unsigned dimensions, const size_t *values);
+    std::string deviceKey() const;
+    std::string filename() const;
+    void load();
+    void save() const;
+
+    Device &device;
+    std::string directory;
+    Table launches;
+    Table parameters;
+};
+
+} // namespace nnFit
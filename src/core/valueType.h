@@ -7,16 +7,29 @@ namespace nnFit {
 struct ValueType {
     enum struct ElementType {
         Float,
+        // Half precision floats. The host has no half type, so the half vectors
+        // are converted to and from float vectors on the device.
+        Half,
+        // Double precision floats, for the devices that support cl_khr_fp64.
+        Double,
+        // Signed bytes, e.g. the quantized weights of a QuantizedMatrix.
+        Int8,
         Uint8,
         Uint16,
-        Uint32
+        Uint32,
+        // Signed 32-bit integers, e.g. the sums of Int8 vectors.
+        Int32
     };
     
     // Typesafe enumarations accessible from struct scope.
     static const ElementType Float = ElementType::Float;
+    static const ElementType Half = ElementType::Half;
+    static const ElementType Double = ElementType::Double;
+    static const ElementType Int8 = ElementType::Int8;
     static const ElementType Uint8 = ElementType::Uint8;
     static const ElementType Uint16 = ElementType::Uint16;
     static const ElementType Uint32 = ElementType::Uint32;
+    static const ElementType Int32 = ElementType::Int32;
     
     constexpr ValueType(ElementType type) : etype(type) {
     }
@@ -37,12 +50,20 @@ struct ValueType {
         return etype != other.etype;
     }
     
+    bool isFloatingPoint() const {
+        return etype == ElementType::Float || etype == ElementType::Half || etype == ElementType::Double;
+    }
+    
     size_t size() const {
         switch (etype) {
             case ElementType::Float: return sizeof(float);
+            case ElementType::Half: return sizeof(uint16_t);
+            case ElementType::Double: return sizeof(double);
+            case ElementType::Int8: return sizeof(int8_t);
             case ElementType::Uint8: return sizeof(uint8_t);
             case ElementType::Uint16: return sizeof(uint16_t);
             case ElementType::Uint32: return sizeof(uint32_t);
+            case ElementType::Int32: return sizeof(int32_t);
         }
     }
 private:
@@ -60,6 +81,16 @@ namespace util {
         static const auto value = ValueType::Float;
     };
 
+    template<>
+    struct ValueTypeSelector<double> {
+        static const auto value = ValueType::Double;
+    };
+
+    template<>
+    struct ValueTypeSelector<int8_t> {
+        static const auto value = ValueType::Int8;
+    };
+
     template<>
     struct ValueTypeSelector<uint8_t> {
         static const auto value = ValueType::Uint8;
@@ -74,6 +105,11 @@ namespace util {
     struct ValueTypeSelector<uint32_t> {
         static const auto value = ValueType::Uint32;
     };
+
+    template<>
+    struct ValueTypeSelector<int32_t> {
+        static const auto value = ValueType::Int32;
+    };
 }
 
 template<typename T>
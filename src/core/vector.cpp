@@ -1,16 +1,50 @@
+#include <algorithm>
 #include <iostream>
 #include "vector.h"
 
 using namespace nnFit;
 
-TensorKernels::Specialization::Specialization(Device &device, std::ifstream &is) : program(device, is) {
-    program.build();
+// The size of the scalars that the kernels of the given type compute with.
+static size_t scalarSize(const ValueType &type) {
+    return type == ValueType::Double? sizeof(double) : sizeof(float);
+}
+
+// The options of the kernels that compute in the precision of the given type.
+static BuildOptions scalarOptions(const ValueType &type, size_t vectorWidth) {
+    auto options = BuildOptions().define("SCALAR", type == ValueType::Double? "double" : "float").define("VECTOR_WIDTH", vectorWidth);
+    if (type == ValueType::Half)
+        options.define("HALF_STORAGE");
+    return options;
+}
+
+// The width of the vectors in the vectorized kernels of the given type. The kernels
+// support vectors of 4, 8 and 16 elements, so the width that the device prefers is
+// rounded to one of them. The devices that prefer scalars get 4 wide vectors.
+static size_t vectorWidth(Device &device, const ValueType &type) {
+    size_t preferred = device.preferredVectorWidth(type == ValueType::Double);
+    if (preferred >= 16)
+        return 16;
+    if (preferred >= 8)
+        return 8;
+    return 4;
+}
+
+// The options of the 'float' kernels. The default definitions of generic.cl build
+// them with 'float4' vectors, so the prebuilt default program is reused for those.
+static BuildOptions floatOptions(size_t vectorWidth) {
+    return vectorWidth == 4? BuildOptions() : scalarOptions(ValueType::Float, vectorWidth);
+}
+
+TensorKernels::Specialization::Specialization(Device &device, const BuildOptions &options, size_t vectorWidth) : program(device.getProgram("generic.cl", options)), vectorWidth(vectorWidth) {
     constantMul = Kernel(program, "constantMul");
     constantDiv = Kernel(program, "constantDiv");
     elementAdd = Kernel(program, "elementAdd");
     elementAddParallel = Kernel(program, "elementAddParallel");
     elementSub = Kernel(program, "elementSub");
     elementMul = Kernel(program, "elementMul");
+    sumVectors = Kernel(program, "sumVectors");
+    convertToFloat = Kernel(program, "convertToFloat");
+    convertFromFloat = Kernel(program, "convertFromFloat");
     fill = Kernel(program, "fill");
     partialSum = Kernel(program, "partialSum");
     matrixIdentity = Kernel(program, "matrixIdentity");
@@ -19,25 +53,62 @@ TensorKernels::Specialization::Specialization(Device &device, std::ifstream &is)
     matrixVectorMulParallel = Kernel(program, "matrixVectorMulParallel");
     matrixVectorMul4Parallel = Kernel(program, "matrixVectorMul4Parallel");
     transposeMatrixVectorMulParallel = Kernel(program, "transposeMatrixVectorMulParallel");
+    matrixMatrixMul = Kernel(program, "matrixMatrixMul");
+    transposeMatrixMatrixMul = Kernel(program, "transposeMatrixMatrixMul");
+    matrixOuterProductSum = Kernel(program, "matrixOuterProductSum");
+    sparseToDense = Kernel(program, "sparseToDense");
+    sparseMatrixMul = Kernel(program, "sparseMatrixMul");
+    sparseOuterProductSum = Kernel(program, "sparseOuterProductSum");
 }
 
-TensorKernels::TensorKernels(Device &device, std::ifstream &genericSource, std::ifstream &fixedSource) : floatKernels(device, genericSource), program(device, fixedSource) {
-    program.build();
+TensorKernels::ShapeSpecialization::ShapeSpecialization(Program &program) {
+    matrixVectorMul4 = Kernel(program, "matrixVectorMul4");
+    matrixVectorMul4Parallel = Kernel(program, "matrixVectorMul4Parallel");
+}
+
+TensorKernels::TensorKernels(Device &device) : program(device.getProgram("fixed.cl")), floatKernels(device, floatOptions(vectorWidth(device, ValueType::Float)), vectorWidth(device, ValueType::Float)), specializeMatrixShapes(true), dev(device) {
     partialTrueCount = Kernel(program, "partialTrueCount");
 }
 
+TensorKernels::ShapeSpecialization &TensorKernels::shapeSpecialization(size_t columns, size_t partSize, const ValueType &type) {
+    auto key = std::make_tuple(columns, partSize, type.type());
+    auto i = shapes.find(key);
+    if (i != shapes.end())
+        return *i->second;
+    
+    auto options = scalarOptions(type, kernels(type).vectorWidth).define("COLUMNS", columns).define("PART_SIZE", partSize);
+    std::unique_ptr<ShapeSpecialization> kernels(new ShapeSpecialization(dev.getProgram("generic.cl", options)));
+    auto &result = *kernels;
+    shapes.insert(std::make_pair(key, std::move(kernels)));
+    return result;
+}
+
+TensorKernels::Specialization &TensorKernels::kernels(const ValueType &type) {
+    assert(type.isFloatingPoint());
+    if (type == ValueType::Float)
+        return floatKernels;
+    auto &kernels = type == ValueType::Half? halfKernels : doubleKernels;
+    if (!kernels) {
+        assert((type != ValueType::Double || dev.supportsDoubles()) && "The device doesn't support doubles");
+        // The half kernels compute in float, so they use the vectors of the float kernels.
+        size_t width = type == ValueType::Half? floatKernels.vectorWidth : vectorWidth(dev, type);
+        kernels.reset(new Specialization(dev, scalarOptions(type, width), width));
+    }
+    return *kernels;
+}
+
 VectorSlice::VectorSlice(Device &device, const Storage &storage, size_t size, size_t offset, const ValueType &type) : dev(device), storage(storage), length(size), off(offset), vtype(type) { }
 
-Vector::Vector(Device &device, const ValueType &type) : dev(device), length(0), vtype(type) {
+Vector::Vector(Device &device, const ValueType &type, StorageLocation location) : dev(device), length(0), vtype(type), loc(location) {
 }
 
-Vector::Vector(Device &device, size_t size, const ValueType &type) : dev(device), storage(device, size*type.size()), length(size), vtype(type) {
+Vector::Vector(Device &device, size_t size, const ValueType &type, StorageLocation location) : dev(device), storage(device, size*type.size(), location), length(size), vtype(type), loc(location) {
 }
 
-Vector::Vector(Device &device, std::initializer_list<float> init) : dev(device), storage(device, init.size()*sizeof(float), init.begin()), length(init.size()), vtype(ValueType::Float) {
+Vector::Vector(Device &device, std::initializer_list<float> init) : dev(device), storage(device, init.size()*sizeof(float), init.begin()), length(init.size()), vtype(ValueType::Float), loc(StorageLocation::Device) {
 }
 
-Vector::Vector(Vector &&other) : dev(other.dev), storage(std::move(other.storage)), length(other.length), vtype(other.vtype) {
+Vector::Vector(Vector &&other) : dev(other.dev), storage(std::move(other.storage)), length(other.length), vtype(other.vtype), loc(other.loc) {
 }
 
 VectorSlice Vector::slice(size_t from) const {
@@ -62,8 +133,8 @@ void Vector::dump() const {
 }
 
 void Vector::fill(float v) const {
-    assert(vtype == ValueType::Float);
-    dev.queue().enqueue1Dim(dev.tensorKernels().floatKernels.fill(*this, v), length);
+    assert(vtype.isFloatingPoint());
+    dev.queue().enqueue1Dim(dev.tensorKernels().kernels(vtype).fill(*this, v), length);
     // FIXME:
     // Doesn't work reliably on 2014 Macbook Pro with Nvidia GPU
     // dev.queue().fill(storage, length*sizeof(float), 0, &v, sizeof(float));
@@ -117,54 +188,155 @@ void Vector::shareWith(Vector &dest) const {
     assert(vtype == dest.vtype);
     storage.shareWith(dest.storage);
     dest.length = length;
+    dest.loc = loc;
 }
 
 void Vector::resize(size_t size) {
-    storage = std::move(Storage(dev, size*vtype.size()));
+    storage = std::move(Storage(dev, size*vtype.size(), loc));
     length = size;
 }
 
-Matrix::Matrix(Device &device) : Vector(device) {
+// The leading dimension of the rows that start at a multiple of the alignment (in bytes).
+static size_t paddedColumns(size_t columns, const ValueType &type, size_t alignment) {
+    if (!alignment)
+        return columns;
+    assert(alignment % type.size() == 0);
+    size_t multiple = alignment / type.size();
+    return (columns + multiple - 1) / multiple * multiple;
+}
+
+Matrix::Matrix(Device &device, StorageLocation location) : Vector(device, ValueType(ValueType::Float), location), stride(0), alignment(0) {
     sizes[0] = 0;
     sizes[1] = 0;
 }
 
-Matrix::Matrix(Device &device, size_t rows, size_t columns) : Vector(device, rows * columns) {
+Matrix::Matrix(Device &device, size_t rows, size_t columns, StorageLocation location) : Vector(device, rows * columns, ValueType(ValueType::Float), location), stride(columns), alignment(0) {
     sizes[0] = rows;
     sizes[1] = columns;
 }
 
-Matrix::Matrix(Device &device, size_t rows, size_t columns, std::initializer_list<float> init) : Vector(device, init) {
+Matrix::Matrix(Device &device, const ValueType &type, StorageLocation location) : Vector(device, type, location), stride(0), alignment(0) {
+    sizes[0] = 0;
+    sizes[1] = 0;
+}
+
+Matrix::Matrix(Device &device, size_t rows, size_t columns, const ValueType &type, StorageLocation location) : Vector(device, rows * columns, type, location), stride(columns), alignment(0) {
+    sizes[0] = rows;
+    sizes[1] = columns;
+}
+
+Matrix::Matrix(Device &device, size_t rows, size_t columns, const ValueType &type, size_t rowAlignment, StorageLocation location) : Vector(device, rows * paddedColumns(columns, type, rowAlignment), type, location), stride(paddedColumns(columns, type, rowAlignment)), alignment(rowAlignment) {
+    sizes[0] = rows;
+    sizes[1] = columns;
+    if (stride != columns && size())
+        zeros();
+}
+
+Matrix::Matrix(Device &device, size_t rows, size_t columns, std::initializer_list<float> init) : Vector(device, init), stride(columns), alignment(0) {
     assert(rows*columns == init.size());
     sizes[0] = rows;
     sizes[1] = columns;
 }
 
-Matrix::Matrix(Matrix &&other) : Vector(std::move(other)) {
+Matrix::Matrix(Matrix &&other) : Vector(std::move(other)), stride(other.stride), alignment(other.alignment) {
     sizes[0] = other.sizes[0];
     sizes[1] = other.sizes[1];
 }
 
 VectorSlice Matrix::row(size_t i, size_t count) const {
-    assert(i < rows());
     assert((i + count) <= rows());
-    return slice(i*columns(), (i+count)*columns());
+    if (count == 0)
+        return slice(i*stride, i*stride);
+    // The padding after the last row isn't a part of the slice.
+    return slice(i*stride, (i+count-1)*stride + columns());
 }
 
 void Matrix::identity() {
-    device().queue().enqueue2Dim(device().tensorKernels().floatKernels.matrixIdentity(*this, columns()), Range2D(sizes[0], sizes[1]));
+    device().queue().enqueue2Dim(device().tensorKernels().kernels(type()).matrixIdentity(MatrixView(*this)), Range2D(sizes[0], sizes[1]));
 }
 
 void Matrix::resize(size_t rows, size_t columns) {
-    Vector::resize(rows*columns);
+    stride = paddedColumns(columns, type(), alignment);
+    Vector::resize(rows*stride);
     sizes[0] = rows;
     sizes[1] = columns;
+    if (stride != columns && size())
+        zeros();
 }
 
 void Matrix::shareWith(Matrix &dest) const {
     Vector::shareWith(dest);
     dest.sizes[0] = sizes[0];
     dest.sizes[1] = sizes[1];
+    dest.stride = stride;
+    dest.alignment = alignment;
+}
+
+MatrixView::MatrixView(const Matrix &x) : matrix(&x), off(0), stride(x.leadingDimension()), transposed(false) {
+    sizes[0] = x.rows();
+    sizes[1] = x.columns();
+}
+
+MatrixView::MatrixView(const Matrix &x, size_t offset, size_t rows, size_t columns, size_t leadingDimension, bool transposed) : matrix(&x), off(offset), stride(leadingDimension), transposed(transposed) {
+    assert(columns <= leadingDimension);
+    assert(!rows || offset + (rows - 1)*leadingDimension + columns <= x.size());
+    sizes[0] = rows;
+    sizes[1] = columns;
+}
+
+MatrixView MatrixView::block(size_t row, size_t column, size_t rows, size_t columns) const {
+    assert(row + rows <= this->rows() && column + columns <= this->columns());
+    if (transposed)
+        return MatrixView(*matrix, off + column*stride + row, columns, rows, stride, true);
+    return MatrixView(*matrix, off + row*stride + column, rows, columns, stride);
+}
+
+MatrixView MatrixView::transpose() const {
+    return MatrixView(*matrix, off, sizes[0], sizes[1], stride, !transposed);
+}
+
+MatrixView MatrixView::stored() const {
+    return MatrixView(*matrix, off, sizes[0], sizes[1], stride);
+}
+
+namespace nnFit {
+
+KernelInvocation &operator <<(KernelInvocation &kernel, const MatrixView &x) {
+    assert(!x.isTransposed());
+    return kernel << x.deviceStorage() << x.offset() << x.leadingDimension();
+}
+
+} // namespace nnFit
+
+// The buffers always have at least one element, as OpenCL doesn't allocate empty buffers.
+SparseMatrix::SparseMatrix(Device &device, size_t rows, size_t columns, size_t capacity) : vals(device, std::max(capacity, size_t(1))), indices(device, std::max(capacity, size_t(1)), ValueType::Uint32), offsets(device, rows + 1, ValueType::Uint32), count(0) {
+    sizes[0] = rows;
+    sizes[1] = columns;
+    offsets.write(std::vector<uint32_t>(rows + 1, 0));
+}
+
+SparseMatrix::SparseMatrix(SparseMatrix &&other) : vals(std::move(other.vals)), indices(std::move(other.indices)), offsets(std::move(other.offsets)), count(other.count) {
+    sizes[0] = other.sizes[0];
+    sizes[1] = other.sizes[1];
+}
+
+void SparseMatrix::write(const uint32_t *rowOffsets, const uint32_t *columnIndices, const float *values) {
+    uint32_t first = rowOffsets[0];
+    std::vector<uint32_t> batchOffsets(rows() + 1);
+    for (size_t i = 0; i < batchOffsets.size(); ++i)
+        batchOffsets[i] = rowOffsets[i] - first;
+    count = batchOffsets.back();
+    assert(count <= capacity());
+    auto &queue = device().queue();
+    offsets.write(batchOffsets);
+    if (!count)
+        return;
+#ifndef NDEBUG
+    for (size_t k = 0; k < count; ++k)
+        assert(columnIndices[first + k] < columns());
+#endif
+    queue.blockingWrite(indices.deviceStorage(), columnIndices + first, count*sizeof(uint32_t));
+    queue.blockingWrite(vals.deviceStorage(), values + first, count*sizeof(float));
 }
 
 static void exec(Kernel &kernel, const Vector &dest, const Vector &x, const Vector &y) {
@@ -218,11 +390,63 @@ static size_t selectColumnPartion(size_t size) {
     return 1;
 }
 
+// Uses the work-group sizes that were tuned for the shape of the matrix
+// when the caller doesn't provide them.
+static void selectWorkgroupSizes(const MatrixView &x, const Range2D &workgroupSizes, size_t &rowsPerWorkgroup, size_t &parts) {
+    rowsPerWorkgroup = workgroupSizes[0];
+    parts = workgroupSizes[1];
+    if (parts != 0)
+        return;
+    size_t shape[] = { x.rows(), x.columns() };
+    size_t tuned[2];
+    if (x.device().kernelTuner().findParameters("mvmul", 2, shape, tuned)) {
+        rowsPerWorkgroup = tuned[0];
+        parts = tuned[1];
+        return;
+    }
+    parts = selectRowPartion(x.columns());
+    rowsPerWorkgroup = selectColumnPartion(x.rows());
+}
+
+// The GEMM_TILE and GEMM_BLOCK definitions of generic.cl.
+static const size_t matrixMulTile = 32;
+static const size_t matrixMulBlock = 4;
+static const size_t matrixMulThreads = matrixMulTile / matrixMulBlock;
+
+// Returns the global size that covers the given number of rows or vectors with tiles.
+static size_t matrixMulGlobalSize(size_t size) {
+    return (size + matrixMulTile - 1) / matrixMulTile * matrixMulThreads;
+}
+
+// The EPILOGUE_ definitions of generic.cl.
+static const uint32_t epilogueBias = 1;
+static const uint32_t epilogueDerivative = 2;
+static const uint32_t epilogueActivationShift = 2;
+
+uint32_t Epilogue::flags() const {
+    return (bias? epilogueBias : 0) | (derivative? epilogueDerivative : 0) | (uint32_t(activation) << epilogueActivationShift);
+}
+
+static void checkEpilogue(const Epilogue &epilogue, const Vector &dest, const MatrixView &x) {
+    assert(!epilogue.bias || (epilogue.bias->size() == x.rows() && epilogue.bias->type() == dest.type()));
+    assert(!epilogue.derivative || (epilogue.derivative->size() == dest.size() && epilogue.derivative->type() == dest.type()));
+}
+
+// The kernels don't read the bias and the derivative when they aren't a part
+// of the epilogue, so they get the destination instead.
+static const Vector &epilogueBiasArgument(const Epilogue &epilogue, const Vector &dest) {
+    return epilogue.bias? *epilogue.bias : dest;
+}
+
+static const Vector &epilogueDerivativeArgument(const Epilogue &epilogue, const Vector &dest) {
+    return epilogue.derivative? *epilogue.derivative : dest;
+}
+
 namespace nnFit {
 
 void add(const Vector &dest, const Vector &x, const Vector &y) {
-    assert(x.type() == ValueType::Float);
-    exec(dest.device().tensorKernels().floatKernels.elementAdd, dest, x, y);
+    assert(x.type().isFloatingPoint());
+    exec(dest.device().tensorKernels().kernels(x.type()).elementAdd, dest, x, y);
 }
     
 void parallelAdd(const Vector &dest, const Vector &x, const Vector &y) {
@@ -231,58 +455,98 @@ void parallelAdd(const Vector &dest, const Vector &x, const Vector &y) {
         return add(dest, x, y);
     }
     
-    assert(x.type() == ValueType::Float);
+    assert(x.type().isFloatingPoint());
     assert(dest.type() == x.type() && y.type() == x.type());
     assert(dest.size() == y.size());
     assert((dest.size() % x.size()) == 0);
            
-    auto task = dest.device().tensorKernels().floatKernels.elementAddParallel(x, y, dest);
+    auto task = dest.device().tensorKernels().kernels(x.type()).elementAddParallel(x, y, dest);
     dest.device().queue().enqueue2Dim(task, Range2D(vectorCount, x.size()));
 }
 
 void add(const Vector &x, const Vector &y) {
-    assert(x.type() == ValueType::Float);
-    exec(x.device().tensorKernels().floatKernels.elementAdd, x, y);
+    assert(x.type().isFloatingPoint());
+    exec(x.device().tensorKernels().kernels(x.type()).elementAdd, x, y);
 }
 
 void sub(const Vector &dest, const Vector &x, const Vector &y) {
-    assert(x.type() == ValueType::Float);
-    exec(dest.device().tensorKernels().floatKernels.elementSub, dest, x, y);
+    assert(x.type().isFloatingPoint());
+    exec(dest.device().tensorKernels().kernels(x.type()).elementSub, dest, x, y);
 }
 
 void sub(const Vector &x, const Vector &y) {
-    assert(x.type() == ValueType::Float);
-    exec(x.device().tensorKernels().floatKernels.elementSub, x, y);
+    assert(x.type().isFloatingPoint());
+    exec(x.device().tensorKernels().kernels(x.type()).elementSub, x, y);
 }
 
 void mul(const Vector &dest, const Vector &x, float k) {
-    assert(x.type() == ValueType::Float);
-    exec(dest.device().tensorKernels().floatKernels.constantMul, dest, x, k);
+    assert(x.type().isFloatingPoint());
+    exec(dest.device().tensorKernels().kernels(x.type()).constantMul, dest, x, k);
 }
 
 void mul(const Vector &x, float k) {
-    assert(x.type() == ValueType::Float);
-    exec(x.device().tensorKernels().floatKernels.constantMul, x, k);
+    assert(x.type().isFloatingPoint());
+    exec(x.device().tensorKernels().kernels(x.type()).constantMul, x, k);
 }
 
 void div(const Vector &dest, const Vector &x, float k) {
-    assert(x.type() == ValueType::Float);
-    exec(dest.device().tensorKernels().floatKernels.constantDiv, dest, x, k);
+    assert(x.type().isFloatingPoint());
+    exec(dest.device().tensorKernels().kernels(x.type()).constantDiv, dest, x, k);
 }
 
 void div(const Vector &x, float k) {
-    assert(x.type() == ValueType::Float);
-    exec(x.device().tensorKernels().floatKernels.constantDiv, x, k);
+    assert(x.type().isFloatingPoint());
+    exec(x.device().tensorKernels().kernels(x.type()).constantDiv, x, k);
 }
 
 void elementwiseMul(const Vector &dest, const Vector &x, const Vector &y) {
-    assert(x.type() == ValueType::Float);
-    exec(dest.device().tensorKernels().floatKernels.elementMul, dest, x, y);
+    assert(x.type().isFloatingPoint());
+    exec(dest.device().tensorKernels().kernels(x.type()).elementMul, dest, x, y);
 }
 
 void elementwiseMul(const Vector &x, const Vector &y) {
-    assert(x.type() == ValueType::Float);
-    exec(x.device().tensorKernels().floatKernels.elementMul, x, y);
+    assert(x.type().isFloatingPoint());
+    exec(x.device().tensorKernels().kernels(x.type()).elementMul, x, y);
+}
+
+void sumVectors(const Vector &dest, const Vector &x, float beta) {
+    assert(x.type().isFloatingPoint());
+    assert(dest.type() == x.type());
+    assert((x.size() % dest.size()) == 0);
+    
+    auto task = x.device().tensorKernels().kernels(x.type()).sumVectors(x, x.size() / dest.size(), beta, dest);
+    x.device().queue().enqueue1Dim(task, dest.size());
+}
+
+void convert(const Vector &dest, const Vector &x) {
+    assert(dest.size() == x.size());
+    if (dest.type() == x.type())
+        return x.copy(dest);
+    
+    // The conversions are done by the kernels of the vector that isn't a float vector.
+    auto &tensorKernels = x.device().tensorKernels();
+    if (x.type() == ValueType::Float) {
+        x.device().queue().enqueue1Dim(tensorKernels.kernels(dest.type()).convertFromFloat(x, dest), x.size());
+    } else {
+        assert(dest.type() == ValueType::Float);
+        x.device().queue().enqueue1Dim(tensorKernels.kernels(x.type()).convertToFloat(x, dest), x.size());
+    }
+}
+
+void writeFloats(const Vector &dest, const std::vector<float> &values) {
+    if (dest.type() == ValueType::Float)
+        return dest.write(values);
+    Vector floats(dest.device(), values.size());
+    floats.write(values);
+    convert(dest, floats);
+}
+
+void readFloats(const Vector &x, std::vector<float> &values) {
+    if (x.type() == ValueType::Float)
+        return x.copy(values);
+    Vector floats(x.device(), x.size());
+    convert(floats, x);
+    floats.copy(values);
 }
 
 void partialSum(const Vector &dest, const Vector &x) {
@@ -305,71 +569,168 @@ void partialTrueCount(const Vector &dest, const Vector &x) {
     x.device().queue().enqueue1Dim(x.device().tensorKernels().partialTrueCount(x, x.size(), partSize, dest), partCount);
 }
     
-void mvmul(const Vector &dest, const Matrix &x, const Vector &y, const Range2D &workgroupSizes) {
-    // Compute workgroup
-    size_t rowsPerWorkgroup = workgroupSizes[0];
-    size_t parts = workgroupSizes[1];
-    if (parts == 0) {
-        parts = selectRowPartion(x.columns());
-        rowsPerWorkgroup = selectColumnPartion(x.rows());
+void mvmul(const Vector &dest, const MatrixView &x, const Vector &y, const Range2D &workgroupSizes, const Epilogue &epilogue) {
+    if (x.isTransposed()) {
+        assert(epilogue.flags() == 0);
+        return transposeMvmul(dest, x.stored(), y);
     }
     
+    size_t rowsPerWorkgroup, parts;
+    selectWorkgroupSizes(x, workgroupSizes, rowsPerWorkgroup, parts);
+    
     assert(x.type() == y.type());
     assert(x.type() == dest.type());
     assert(x.columns() == y.size());
     assert(x.rows() == dest.size());
+    checkEpilogue(epilogue, dest, x);
     
+    const auto &bias = epilogueBiasArgument(epilogue, dest);
+    const auto &derivative = epilogueDerivativeArgument(epilogue, dest);
     size_t partSize = x.columns()/parts;
-    if (partSize % 4 == 0) {
-        assert(x.columns() % 4 == 0);
-        auto &kernel = x.device().tensorKernels().floatKernels.matrixVectorMul4;
-        x.device().queue().enqueue2Dim(kernel(x, y, x.columns()/4, partSize/4, dest, LocalStorage(parts*rowsPerWorkgroup*x.type().size())), Range2D(x.rows(), parts), Range2D(), Range2D(rowsPerWorkgroup, parts));
+    auto &kernels = x.device().tensorKernels();
+    auto &typeKernels = kernels.kernels(x.type());
+    size_t width = typeKernels.vectorWidth;
+    // The last part of the vectorized kernels sums the columns that don't fill a vector,
+    // so they're used whenever every part has at least one vector to sum.
+    if (partSize >= width) {
+        auto &kernel = kernels.specializeMatrixShapes? kernels.shapeSpecialization(x.columns(), partSize/width, x.type()).matrixVectorMul4 : typeKernels.matrixVectorMul4;
+        x.device().queue().enqueue2Dim(kernel(x, y, x.columns(), partSize/width, dest, bias, derivative, size_t(epilogue.flags()), LocalStorage(parts*rowsPerWorkgroup*scalarSize(x.type()))), Range2D(x.rows(), parts), Range2D(), Range2D(rowsPerWorkgroup, parts));
         return;
     }
     
     // Shedule
-    auto &kernel = x.device().tensorKernels().floatKernels.matrixVectorMul;
-    x.device().queue().enqueue2Dim(kernel(x, y, x.columns(), partSize, dest, LocalStorage(parts*rowsPerWorkgroup*x.type().size())), Range2D(x.rows(), parts), Range2D(), Range2D(rowsPerWorkgroup, parts));
+    auto &kernel = typeKernels.matrixVectorMul;
+    x.device().queue().enqueue2Dim(kernel(x, y, x.columns(), partSize, dest, bias, derivative, size_t(epilogue.flags()), LocalStorage(parts*rowsPerWorkgroup*scalarSize(x.type()))), Range2D(x.rows(), parts), Range2D(), Range2D(rowsPerWorkgroup, parts));
 }
     
-void parallelMvmul(const Vector &dest, const Matrix &x, const Vector &y, const Range2D &workgroupSizes) {
+void parallelMvmul(const Vector &dest, const MatrixView &x, const Vector &y, const Range2D &workgroupSizes, const Epilogue &epilogue) {
     size_t vectorCount = y.size() / x.columns();
+    if (x.isTransposed()) {
+        assert(epilogue.flags() == 0);
+        return transposeMvmul(dest, x.stored(), y, vectorCount);
+    }
     if (vectorCount == 1) {
-        return mvmul(dest, x, y, workgroupSizes);
+        return mvmul(dest, x, y, workgroupSizes, epilogue);
     }
     
-    // Compute workgroup
-    size_t rowsPerWorkgroup = workgroupSizes[0];
-    size_t parts = workgroupSizes[1];
-    if (parts == 0) {
-        parts = selectRowPartion(x.columns());
-        rowsPerWorkgroup = selectColumnPartion(x.rows());
-    }
+    size_t rowsPerWorkgroup, parts;
+    selectWorkgroupSizes(x, workgroupSizes, rowsPerWorkgroup, parts);
     
     assert(x.type() == y.type());
     assert(x.type() == dest.type());
     assert((y.size() % x.columns()) == 0);
     assert((dest.size() % x.rows()) == 0);
     assert(vectorCount == dest.size() / x.rows());
+    checkEpilogue(epilogue, dest, x);
     
+    const auto &bias = epilogueBiasArgument(epilogue, dest);
+    const auto &derivative = epilogueDerivativeArgument(epilogue, dest);
     size_t partSize = x.columns()/parts;
-    if (partSize % 4 == 0) {
-        assert(x.columns() % 4 == 0);
-        auto &kernel = x.device().tensorKernels().floatKernels.matrixVectorMul4Parallel;
-        x.device().queue().enqueue3Dim(kernel(x, y, x.columns()/4, partSize/4, dest, LocalStorage(parts*rowsPerWorkgroup*x.type().size())), Range3D(vectorCount, x.rows(), parts), Range3D(), Range3D(1, rowsPerWorkgroup, parts));
+    auto &kernels = x.device().tensorKernels();
+    auto &typeKernels = kernels.kernels(x.type());
+    size_t width = typeKernels.vectorWidth;
+    if (partSize >= width) {
+        auto &kernel = kernels.specializeMatrixShapes? kernels.shapeSpecialization(x.columns(), partSize/width, x.type()).matrixVectorMul4Parallel : typeKernels.matrixVectorMul4Parallel;
+        x.device().queue().enqueue3Dim(kernel(x, y, x.columns(), partSize/width, dest, bias, derivative, size_t(epilogue.flags()), LocalStorage(parts*rowsPerWorkgroup*scalarSize(x.type()))), Range3D(vectorCount, x.rows(), parts), Range3D(), Range3D(1, rowsPerWorkgroup, parts));
         return;
     }
     
-    auto &kernel = x.device().tensorKernels().floatKernels.matrixVectorMulParallel;
-    x.device().queue().enqueue3Dim(kernel(x, y, x.columns(), partSize, dest, LocalStorage(parts*rowsPerWorkgroup*x.type().size())), Range3D(vectorCount, x.rows(), parts), Range3D(), Range3D(1, rowsPerWorkgroup, parts));
+    auto &kernel = typeKernels.matrixVectorMulParallel;
+    x.device().queue().enqueue3Dim(kernel(x, y, x.columns(), partSize, dest, bias, derivative, size_t(epilogue.flags()), LocalStorage(parts*rowsPerWorkgroup*scalarSize(x.type()))), Range3D(vectorCount, x.rows(), parts), Range3D(), Range3D(1, rowsPerWorkgroup, parts));
 }
     
-void transposeMvmul(const Vector &dest, const Matrix &x, const Vector &y, size_t vectorCount) {
+void mmul(const Vector &dest, const MatrixView &x, const Vector &y, const Epilogue &epilogue) {
+    if (x.isTransposed()) {
+        assert(epilogue.flags() == 0);
+        return transposeMmul(dest, x.stored(), y);
+    }
+    size_t vectorCount = y.size() / x.columns();
+    assert(x.type().isFloatingPoint());
+    assert(x.type() == y.type());
+    assert(x.type() == dest.type());
+    assert((y.size() % x.columns()) == 0);
+    assert(vectorCount * x.rows() == dest.size());
+    assert(supportsMmul(x.device()));
+    checkEpilogue(epilogue, dest, x);
+    
+    auto &kernel = x.device().tensorKernels().kernels(x.type()).matrixMatrixMul;
+    x.device().queue().enqueue2Dim(kernel(x, y, x.rows(), x.columns(), vectorCount, dest, epilogueBiasArgument(epilogue, dest), epilogueDerivativeArgument(epilogue, dest), size_t(epilogue.flags())), Range2D(matrixMulGlobalSize(x.rows()), matrixMulGlobalSize(vectorCount)), Range2D(), Range2D(matrixMulThreads, matrixMulThreads));
+}
+
+bool supportsMmul(Device &device) {
+    return device.maxThreadsPerWorkgroup() >= matrixMulThreads * matrixMulThreads;
+}
+    
+void transposeMvmul(const Vector &dest, const MatrixView &x, const Vector &y, size_t vectorCount) {
+    if (x.isTransposed())
+        return parallelMvmul(dest, x.stored(), y);
     assert(x.columns() * vectorCount == dest.size());
     assert(x.rows() * vectorCount == y.size());
     
-    auto task = x.device().tensorKernels().floatKernels.transposeMatrixVectorMulParallel(x, y, x.rows(), dest);
+    auto task = x.device().tensorKernels().kernels(x.type()).transposeMatrixVectorMulParallel(x, y, x.rows(), dest);
     x.device().queue().enqueue2Dim(task, Range2D(vectorCount, x.columns()));
 }
     
+void transposeMmul(const Vector &dest, const MatrixView &x, const Vector &y) {
+    if (x.isTransposed())
+        return mmul(dest, x.stored(), y);
+    size_t vectorCount = y.size() / x.rows();
+    assert(x.type().isFloatingPoint());
+    assert(x.type() == y.type());
+    assert(x.type() == dest.type());
+    assert((y.size() % x.rows()) == 0);
+    assert(vectorCount * x.columns() == dest.size());
+    assert(supportsMmul(x.device()));
+    
+    auto &kernel = x.device().tensorKernels().kernels(x.type()).transposeMatrixMatrixMul;
+    x.device().queue().enqueue2Dim(kernel(x, y, x.rows(), x.columns(), vectorCount, dest), Range2D(matrixMulGlobalSize(x.columns()), matrixMulGlobalSize(vectorCount)), Range2D(), Range2D(matrixMulThreads, matrixMulThreads));
+}
+    
+void outerProductSum(const MatrixView &dest, const Vector &x, const Vector &y, float beta) {
+    // transpose(dest) = sum(y[v] * transpose(x[v]))
+    if (dest.isTransposed())
+        return outerProductSum(dest.stored(), y, x, beta);
+    size_t vectorCount = x.size() / dest.rows();
+    assert(dest.type().isFloatingPoint());
+    assert(x.type() == dest.type());
+    assert(y.type() == dest.type());
+    assert((x.size() % dest.rows()) == 0);
+    assert(vectorCount * dest.columns() == y.size());
+    assert(supportsMmul(dest.device()));
+    
+    auto &kernel = dest.device().tensorKernels().kernels(x.type()).matrixOuterProductSum;
+    dest.device().queue().enqueue2Dim(kernel(x, y, dest.rows(), dest.columns(), vectorCount, beta, dest), Range2D(matrixMulGlobalSize(dest.columns()), matrixMulGlobalSize(dest.rows())), Range2D(), Range2D(matrixMulThreads, matrixMulThreads));
+}
+    
+void toDense(const Vector &dest, const SparseMatrix &x) {
+    assert(dest.type() == ValueType::Float);
+    assert(dest.size() == x.rows() * x.columns());
+    
+    auto &kernel = dest.device().tensorKernels().floatKernels.sparseToDense;
+    dest.device().queue().enqueue1Dim(kernel(x.values(), x.columnIndices(), x.rowOffsets(), x.columns(), dest), x.rows());
+}
+
+void sparseMmul(const Vector &dest, const MatrixView &x, const SparseMatrix &y, const Epilogue &epilogue) {
+    assert(x.type() == ValueType::Float);
+    assert(dest.type() == x.type());
+    assert(!x.isTransposed());
+    assert(x.columns() == y.columns());
+    assert(dest.size() == x.rows() * y.rows());
+    checkEpilogue(epilogue, dest, x);
+    
+    auto &kernel = x.device().tensorKernels().kernels(x.type()).sparseMatrixMul;
+    x.device().queue().enqueue2Dim(kernel(x, y.values(), y.columnIndices(), y.rowOffsets(), dest, epilogueBiasArgument(epilogue, dest), epilogueDerivativeArgument(epilogue, dest), size_t(epilogue.flags())), Range2D(x.rows(), y.rows()));
+}
+
+void sparseOuterProductSum(const MatrixView &dest, const Vector &x, const SparseMatrix &y, float beta) {
+    assert(dest.type() == ValueType::Float);
+    assert(x.type() == dest.type());
+    assert(!dest.isTransposed());
+    assert(dest.columns() == y.columns());
+    assert(x.size() == dest.rows() * y.rows());
+    
+    auto &kernel = dest.device().tensorKernels().kernels(dest.type()).sparseOuterProductSum;
+    dest.device().queue().enqueue1Dim(kernel(x, y.values(), y.columnIndices(), y.rowOffsets(), y.rows(), dest.columns(), beta, dest), dest.rows());
+}
+    
 } // namespace nnFit
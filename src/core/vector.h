@@ -2,6 +2,8 @@
 
 #include <assert.h>
 #include <vector>
+#include <map>
+#include <tuple>
 #include "opencl.h"
 #include "valueType.h"
 
@@ -9,16 +11,20 @@ namespace nnFit {
 
 class TensorKernels {
 public:
-    TensorKernels(Device &device, std::ifstream &genericSource, std::ifstream &fixedSource);
+    TensorKernels(Device &device);
     
     struct Specialization {
-        Program program;
+        Program &program;
+        size_t vectorWidth;
         Kernel constantMul;
         Kernel constantDiv;
         Kernel elementAdd;
         Kernel elementAddParallel;
         Kernel elementSub;
         Kernel elementMul;
+        Kernel sumVectors;
+        Kernel convertToFloat;
+        Kernel convertFromFloat;
         Kernel fill;
         Kernel partialSum;
         Kernel matrixIdentity;
@@ -27,12 +33,48 @@ public:
         Kernel matrixVectorMulParallel;
         Kernel matrixVectorMul4Parallel;
         Kernel transposeMatrixVectorMulParallel;
+        Kernel matrixMatrixMul;
+        Kernel transposeMatrixMatrixMul;
+        Kernel matrixOuterProductSum;
+        Kernel sparseToDense;
+        Kernel sparseMatrixMul;
+        Kernel sparseOuterProductSum;
         
-        Specialization(Device &device, std::ifstream &is);
+        Specialization(Device &device, const BuildOptions &options, size_t vectorWidth);
     };
-    Program program;
+    
+    // The vectorized matrix vector multiplication kernels that are built
+    // for one matrix shape.
+    struct ShapeSpecialization {
+        Kernel matrixVectorMul4;
+        Kernel matrixVectorMul4Parallel;
+        
+        ShapeSpecialization(Program &program);
+    };
+    
+    // Returns the vectorized matrix vector multiplication kernels that are
+    // specialized for the given number of columns and part size (in vectors).
+    // The vectors have the width of the kernels of the given type.
+    ShapeSpecialization &shapeSpecialization(size_t columns, size_t partSize, const ValueType &type = ValueType(ValueType::Float));
+    
+    // Returns the kernels for the vectors of the given floating point type.
+    // The half kernels load and store half elements, but compute in float.
+    // The double kernels need a device that supports doubles.
+    // They are built when they are used for the first time.
+    Specialization &kernels(const ValueType &type);
+    
+    Program &program;
     Kernel partialTrueCount;
     Specialization floatKernels;
+    
+    // Set to true when the matrix vector multiplications should use the kernels
+    // that are specialized for the shape of the matrix.
+    bool specializeMatrixShapes;
+private:
+    Device &dev;
+    std::unique_ptr<Specialization> halfKernels;
+    std::unique_ptr<Specialization> doubleKernels;
+    std::map<std::tuple<size_t, size_t, ValueType::ElementType>, std::unique_ptr<ShapeSpecialization>> shapes;
 };
 
 class VectorSlice {
@@ -65,10 +107,13 @@ private:
     ValueType vtype;
 };
 
+template<typename T>
+class VectorMapping;
+
 class Vector {
 public:
-    Vector(Device &device, const ValueType &type = ValueType(ValueType::Float));
-    Vector(Device &device, size_t size, const ValueType &type = ValueType(ValueType::Float));
+    Vector(Device &device, const ValueType &type = ValueType(ValueType::Float), StorageLocation location = StorageLocation::Device);
+    Vector(Device &device, size_t size, const ValueType &type = ValueType(ValueType::Float), StorageLocation location = StorageLocation::Device);
     Vector(Device &device, std::initializer_list<float> init);
     Vector(Vector &&other);
     
@@ -92,6 +137,10 @@ public:
         return vtype;
     }
     
+    StorageLocation location() const {
+        return loc;
+    }
+    
     VectorSlice slice(size_t from) const;
     VectorSlice slice(size_t from, size_t to) const;
     
@@ -123,6 +172,15 @@ public:
         read(dest.data(), dest.size());
     }
     
+    // Maps the vector into the host memory. The data is accessed in place when
+    // the vector is stored in the host memory. The vector mustn't be used by
+    // the kernels until the mapping is destroyed.
+    template<typename T>
+    VectorMapping<T> map() const {
+        assert(vtype == valueType<T>());
+        return VectorMapping<T>(*this);
+    }
+    
     // Shares the data in this vector with another vector.
     void shareWith(Vector &dest) const;
     
@@ -136,16 +194,70 @@ private:
     Storage storage;
     size_t length;
     ValueType vtype;
+    StorageLocation loc;
+};
+
+// VectorMapping - the elements of a vector that's mapped into the host memory.
+template<typename T>
+class VectorMapping {
+public:
+    explicit VectorMapping(const Vector &vector) : vector(&vector), elements(nullptr), length(vector.size()) {
+        if (length)
+            elements = static_cast<T*>(vector.device().queue().map(vector.deviceStorage(), length*sizeof(T)));
+    }
+    
+    VectorMapping(VectorMapping &&other) : vector(other.vector), elements(other.elements), length(other.length) {
+        other.elements = nullptr;
+    }
+    
+    ~VectorMapping() {
+        if (elements)
+            vector->device().queue().unmap(vector->deviceStorage(), elements);
+    }
+    
+    T *data() const {
+        return elements;
+    }
+    
+    size_t size() const {
+        return length;
+    }
+    
+    T *begin() const {
+        return elements;
+    }
+    
+    T *end() const {
+        return elements + length;
+    }
+    
+    T &operator [](size_t i) const {
+        assert(i < length);
+        return elements[i];
+    }
+private:
+    VectorMapping(const VectorMapping &) = delete;
+    const Vector *vector;
+    T *elements;
+    size_t length;
 };
 
 inline KernelInvocation &operator <<(KernelInvocation &kernel, const Vector &x) {
     return kernel << x.deviceStorage();
 }
     
+// Matrix - a row-major matrix. The rows are dense by default, i.e. the elements of
+// a row follow the last element of the previous row. A matrix can also pad its rows,
+// so that every row starts at a multiple of the given alignment (in bytes). The vector
+// of a padded matrix includes the padding, which is zeroed when the matrix is allocated
+// and isn't read by the matrix operations.
 class Matrix: public Vector {
 public:
-    Matrix(Device &device);
-    Matrix(Device &device, size_t rows, size_t columns);
+    Matrix(Device &device, StorageLocation location = StorageLocation::Device);
+    Matrix(Device &device, size_t rows, size_t columns, StorageLocation location = StorageLocation::Device);
+    Matrix(Device &device, const ValueType &type, StorageLocation location = StorageLocation::Device);
+    Matrix(Device &device, size_t rows, size_t columns, const ValueType &type, StorageLocation location = StorageLocation::Device);
+    Matrix(Device &device, size_t rows, size_t columns, const ValueType &type, size_t rowAlignment, StorageLocation location = StorageLocation::Device);
     Matrix(Device &device, size_t rows, size_t columns, std::initializer_list<float> init);
     Matrix(Matrix &&other);
     
@@ -155,6 +267,10 @@ public:
     size_t columns() const {
         return sizes[1];
     }
+    // The number of elements between the starts of two consecutive rows.
+    size_t leadingDimension() const {
+        return stride;
+    }
     
     // Return a slice containing row(s) of a matrix.
     VectorSlice row(size_t i, size_t count = 1) const;
@@ -167,6 +283,119 @@ public:
 private:
     Matrix(const Matrix &) = delete;
     size_t sizes[2];
+    size_t stride;
+    // The alignment of the rows in bytes, or 0 when the rows are dense.
+    size_t alignment;
+};
+
+// MatrixView - a block of a row-major matrix whose rows are leadingDimension elements
+// apart and start offset elements into the matrix, optionally transposed. The matrix
+// operations read the views in place, so the blocks of columns and the transposed
+// matrices don't have to be copied. A view references the matrix, so the matrix
+// must outlive it.
+class MatrixView {
+public:
+    MatrixView(const Matrix &x);
+    MatrixView(const Matrix &x, size_t offset, size_t rows, size_t columns, size_t leadingDimension, bool transposed = false);
+    
+    Device &device() const {
+        return matrix->device();
+    }
+    const Storage &deviceStorage() const {
+        return matrix->deviceStorage();
+    }
+    const ValueType &type() const {
+        return matrix->type();
+    }
+    size_t offset() const {
+        return off;
+    }
+    // The shape of the view, i.e. of the transposed block when the view is transposed.
+    size_t rows() const {
+        return transposed? sizes[1] : sizes[0];
+    }
+    size_t columns() const {
+        return transposed? sizes[0] : sizes[1];
+    }
+    // The shape of the block as it's stored in the matrix.
+    size_t storedRows() const {
+        return sizes[0];
+    }
+    size_t storedColumns() const {
+        return sizes[1];
+    }
+    size_t leadingDimension() const {
+        return stride;
+    }
+    bool isTransposed() const {
+        return transposed;
+    }
+    
+    // Returns the rows by columns block of this view that starts at the given row and column.
+    MatrixView block(size_t row, size_t column, size_t rows, size_t columns) const;
+    MatrixView transpose() const;
+    // Returns the view of the same block that isn't transposed.
+    MatrixView stored() const;
+private:
+    const Matrix *matrix;
+    size_t off;
+    size_t sizes[2];
+    size_t stride;
+    bool transposed;
+};
+
+// Passes the storage, the offset and the leading dimension of the view. The view
+// mustn't be transposed, the operations choose the kernels for the transposed views.
+KernelInvocation &operator <<(KernelInvocation &kernel, const MatrixView &x);
+
+// SparseMatrix - a batch of sparse float vectors in the compressed sparse row (CSR) format.
+// The non-zeros of the row r are values[k] in the columns columnIndices[k] for
+// rowOffsets[r] <= k < rowOffsets[r + 1]. The buffers are allocated for the given number
+// of non-zeros up front, so that the commands that read a batch can be recorded and
+// replayed with the following batches. Only the non-zeros are uploaded.
+class SparseMatrix {
+public:
+    SparseMatrix(Device &device, size_t rows, size_t columns, size_t capacity);
+    SparseMatrix(SparseMatrix &&other);
+    
+    Device &device() const {
+        return vals.device();
+    }
+    size_t rows() const {
+        return sizes[0];
+    }
+    size_t columns() const {
+        return sizes[1];
+    }
+    // The largest number of non-zeros that the matrix can store.
+    size_t capacity() const {
+        return vals.size();
+    }
+    // The number of non-zeros that were written last.
+    size_t nonzeros() const {
+        return count;
+    }
+    const Vector &values() const {
+        return vals;
+    }
+    const Vector &columnIndices() const {
+        return indices;
+    }
+    const Vector &rowOffsets() const {
+        return offsets;
+    }
+    
+    // Writes the rows of a CSR matrix. rowOffsets has rows() + 1 elements. The offsets don't have
+    // to start at 0, the column indices and the values are read from the first offset, so
+    // that a batch can be written from a range of rows of a larger matrix.
+    void write(const uint32_t *rowOffsets, const uint32_t *columnIndices, const float *values);
+private:
+    SparseMatrix(const SparseMatrix &) = delete;
+    Vector vals;
+    Vector indices;
+    Vector offsets;
+    size_t sizes[2];
+    size_t count;
 };
 
 // dest = x + y
@@ -195,6 +424,18 @@ void elementwiseMul(const Vector &dest, const Vector &x, const Vector &y);
 // x = x .* y
 void elementwiseMul(const Vector &x, const Vector &y);
 
+// dest = beta * dest + x[0] + x[1] + ... + x[N - 1]
+// dest isn't read when beta is 0.
+void sumVectors(const Vector &dest, const Vector &x, float beta = 1.0f);
+
+// dest = x, converted between float vectors and half or double vectors.
+void convert(const Vector &dest, const Vector &x);
+
+// dest = values, converted on the device when dest isn't a float vector.
+void writeFloats(const Vector &dest, const std::vector<float> &values);
+// values = x, converted on the device when x isn't a float vector.
+void readFloats(const Vector &x, std::vector<float> &values);
+
 // Computes a partial sum
 void partialSum(const Vector &dest, const Vector &x);
 
@@ -202,13 +443,73 @@ void partialSum(const Vector &dest, const Vector &x);
 // x must be a uint8 vector, while dest must be a uint32 vector
 void partialTrueCount(const Vector &dest, const Vector &x);
 
+// The operations that a matrix multiplication applies to its results before
+// they are written, so that they don't need separate passes over the results.
+// dest[v] = activation(x * y[v] + bias)
+// derivative[v] = activation'(x * y[v] + bias)
+struct Epilogue {
+    enum Activation {
+        Identity,
+        Sigmoid,
+        Tanh,
+        RectifiedLinearUnit
+    };
+    
+    // Added to every result vector when it isn't null.
+    const Vector *bias;
+    Activation activation;
+    // Receives the derivatives of the activation when it isn't null.
+    const Vector *derivative;
+    
+    Epilogue(const Vector *bias = nullptr, Activation activation = Identity, const Vector *derivative = nullptr) : bias(bias), activation(activation), derivative(derivative) { }
+    
+    // Returns the epilogue argument of the matrix multiplication kernels.
+    uint32_t flags() const;
+};
+
 // Matrix by vector multiplication
-// dest = x * y
-void mvmul(const Vector &dest, const Matrix &x, const Vector &y, const Range2D &workgroupSizes = Range2D());
+// dest = epilogue(x * y)
+// The work-group sizes that were tuned for the shape of x are used when
+// the work-group sizes aren't given.
+// The matrix operations accept any view of a matrix. The transposed views are
+// multiplied by the transposed kernels, which don't apply epilogues.
+void mvmul(const Vector &dest, const MatrixView &x, const Vector &y, const Range2D &workgroupSizes = Range2D(), const Epilogue &epilogue = Epilogue());
+    
+void parallelMvmul(const Vector &dest, const MatrixView &x, const Vector &y, const Range2D &workgroupSizes = Range2D(), const Epilogue &epilogue = Epilogue());
     
-void parallelMvmul(const Vector &dest, const Matrix &x, const Vector &y, const Range2D &workgroupSizes = Range2D());
+// Matrix by matrix multiplication of x and the vectors in y
+// dest[v] = epilogue(x * y[v])
+// The vectors are multiplied by tiles, so every element of x is read from
+// the global memory once per tile of vectors instead of once per vector.
+void mmul(const Vector &dest, const MatrixView &x, const Vector &y, const Epilogue &epilogue = Epilogue());
+
+// Return true when the device can run the tiled matrix multiplication.
+bool supportsMmul(Device &device);
     
 // Transposed matrix by vector multiplication
-void transposeMvmul(const Vector &dest, const Matrix &x, const Vector &y, size_t vectorCount = 1);
+void transposeMvmul(const Vector &dest, const MatrixView &x, const Vector &y, size_t vectorCount = 1);
+
+// Transposed matrix by matrix multiplication of x and the vectors in y
+// dest[v] = transpose(x) * y[v]
+// Like mmul, it multiplies the vectors by tiles.
+void transposeMmul(const Vector &dest, const MatrixView &x, const Vector &y);
+
+// Sum of the outer products of the vectors in x and y
+// dest = beta * dest + sum(x[v] * transpose(y[v]))
+// dest isn't read when beta is 0, so it doesn't have to be zeroed first.
+void outerProductSum(const MatrixView &dest, const Vector &x, const Vector &y, float beta = 1.0f);
+
+// dest = the rows of x expanded to dense vectors
+void toDense(const Vector &dest, const SparseMatrix &x);
+
+// Matrix by sparse matrix multiplication of x and the sparse vectors in the rows of y
+// dest[v] = epilogue(x * y[v])
+// Only the columns of x that have a non-zero in y[v] are read.
+void sparseMmul(const Vector &dest, const MatrixView &x, const SparseMatrix &y, const Epilogue &epilogue = Epilogue());
+
+// Sum of the outer products of the vectors in x and the sparse vectors in the rows of y
+// dest = beta * dest + sum(x[v] * transpose(y[v]))
+// Only the columns of dest that have a non-zero in y are updated when beta is 1.
+void sparseOuterProductSum(const MatrixView &dest, const Vector &x, const SparseMatrix &y, float beta = 1.0f);
     
 } // namespace nnFit
@@ -23,11 +23,21 @@ public:
     
     virtual const Vector &predict(NNContext &ctx, const Vector &input) = 0;
     virtual const Vector &feedforward(NNContext &ctx, const Vector &input) = 0;
+    // The first layer of a network gets the sparse inputs here. The layers that don't
+    // multiply the sparse inputs directly get them expanded to dense vectors.
+    virtual const Vector &predictSparse(NNContext &ctx, const SparseMatrix &input);
+    virtual const Vector &feedforwardSparse(NNContext &ctx, const SparseMatrix &input);
     virtual const Vector &backpropagate(NNContext &ctx, const Vector &expectedOutput, const ErrorCriterion &criterion, bool backpropagateDown = true) = 0;
     virtual const Vector &backpropagate(NNContext &ctx, const Vector &errorInput, bool backpropagateDown = true) = 0;
     
     virtual void collectWeightsAndGradients(std::vector<std::pair<const Vector*, const Vector*>> &weightsAndGradients) { }
-    virtual void accumulateGradients(NNContext &ctx) { }
+    // Called after the weights returned by collectWeightsAndGradients were changed,
+    // e.g. by an optimizer, so that the layer can update the copies it computes with.
+    virtual void synchronizeWeights() { }
+    // Adds the gradients of the last backpropagation to the accumulated gradients.
+    // The accumulated gradients are replaced instead when 'overwrite' is set,
+    // so they don't have to be zeroed at the start of a mini-batch.
+    virtual void accumulateGradients(NNContext &ctx, bool overwrite = false) { }
 };
 
 } // namespace nnFit
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "classificationEvaluator.h"
+#include "core/reduction.h"
 
 using namespace nnFit;
 
@@ -11,22 +12,28 @@ ClassificationEvaluator::Result ClassificationEvaluator::evaluate(Network &net,
     auto size = data.size();
     assert((size % parallelisationFactor) == 0);
     auto &device = net.device();
-    Vector input(device, data.inputSize() * parallelisationFactor);
-    Vector output(device, data.outputSize() * parallelisationFactor);
+    Vector input(device, data.inputSize() * parallelisationFactor, data.inputType());
+    Vector output(device, data.outputSize() * parallelisationFactor, data.outputType());
     assert(data.hasClassificationLabels());
     const auto &labels = *data.classificationLabels();
     Vector classificationResult(device, labels.size(), ValueType(ValueType::Uint8));
 
-    auto &eval = net.context().floatKernels.evaluateClassification;
+    InstrumentationScope scope(device, "evaluate");
+    auto &eval = net.context().kernels(data.outputType()).evaluateClassification;
     for (size_t i = 0; i < size; i += parallelisationFactor) {
-        data.get(i, parallelisationFactor, input, output);
+        {
+            InstrumentationScope dataScope(device, "data.get");
+            data.get(i, parallelisationFactor, input, output);
+        }
         const auto &hypothesis = net.predict(input);
+        InstrumentationScope evalScope(device, "evaluateClassification");
         device.queue().enqueue1Dim(eval(hypothesis, classCount, labels, classificationResult), parallelisationFactor, i);
     }
     
     // Compute the number of correct predictions
+    InstrumentationScope countScope(device, "countCorrectPredictions");
     Vector count(device, 1, ValueType(ValueType::Uint32));
-    partialTrueCount(count, classificationResult);
+    reduce(count, Reduction::CountNonzero, classificationResult);
     std::vector<uint32_t> hostCounts;
     count.copy(hostCounts);
     
@@ -0,0 +1,146 @@
+#include <chrono>
+#include "dataParallelTrainer.h"
+#include "errorCriterion.h"
+#include "optimizers/optimizer.h"
+#include "core/reduction.h"
+
+using namespace nnFit;
+
+DataParallelTrainer::DataParallelTrainer(ErrorCriterion &criterion, size_t parallelisationFactor) : criterion(criterion), parallelisationFactor(parallelisationFactor), throughput(0) {
+    reshuffleIndices = false;
+}
+
+void DataParallelTrainer::addReplica(Network &network, Dataset &data, Optimizer &opt) {
+    Replica replica = { &network, &data, &opt, network.weightsAndGradients() };
+    if (!replicas.empty()) {
+        assert(data.size() == replicas[0].data->size());
+        assert(replica.weightsAndGradients.size() == replicas[0].weightsAndGradients.size());
+    }
+    replicas.push_back(std::move(replica));
+}
+
+void DataParallelTrainer::gradientDescent(size_t iterations) {
+    assert(!replicas.empty());
+    train(iterations, replicas[0].data->size());
+}
+
+void DataParallelTrainer::miniBatchGradientDescent(size_t iterations, size_t miniBatchSize) {
+    train(iterations, miniBatchSize);
+}
+
+// Copies the weights of the first replica to the other replicas.
+void DataParallelTrainer::broadcastWeights() {
+    std::vector<float> weights;
+    for (size_t i = 0; i < replicas[0].weightsAndGradients.size(); ++i) {
+        weights.clear();
+        readFloats(*replicas[0].weightsAndGradients[i].first, weights);
+        for (size_t r = 1; r < replicas.size(); ++r)
+            writeFloats(*replicas[r].weightsAndGradients[i].first, weights);
+    }
+    for (size_t r = 1; r < replicas.size(); ++r)
+        replicas[r].network->synchronizeWeights();
+}
+
+// Replaces the gradients of every replica with the sum of the gradients of all the replicas.
+// The replicas can use different OpenCL platforms, so the gradients are summed on the host.
+void DataParallelTrainer::allReduceGradients() {
+    std::vector<float> sum, gradients;
+    for (size_t i = 0; i < replicas[0].weightsAndGradients.size(); ++i) {
+        sum.clear();
+        readFloats(*replicas[0].weightsAndGradients[i].second, sum);
+        for (size_t r = 1; r < replicas.size(); ++r) {
+            gradients.clear();
+            readFloats(*replicas[r].weightsAndGradients[i].second, gradients);
+            assert(gradients.size() == sum.size());
+            for (size_t j = 0; j < sum.size(); ++j)
+                sum[j] += gradients[j];
+        }
+        for (const auto &replica : replicas)
+            writeFloats(*replica.weightsAndGradients[i].second, sum);
+    }
+}
+
+void DataParallelTrainer::train(size_t iterations, size_t miniBatchSize) {
+    assert(!replicas.empty());
+    size_t replicaCount = replicas.size();
+    size_t trainingExampleCount = replicas[0].data->size();
+    assert((trainingExampleCount % parallelisationFactor) == 0);
+    assert((trainingExampleCount % miniBatchSize) == 0);
+    assert((miniBatchSize % (parallelisationFactor * replicaCount)) == 0);
+    size_t batchCount = trainingExampleCount / miniBatchSize;
+    size_t passCount = trainingExampleCount / parallelisationFactor;
+    size_t passPerBatchCount = miniBatchSize / parallelisationFactor;
+    size_t passPerReplicaCount = passPerBatchCount / replicaCount;
+    std::vector<size_t> indices(passCount);
+    for (size_t i = 0; i < indices.size(); ++i)
+        indices[i] = i;
+    
+    // The batch buffers of every replica live on its own device.
+    std::vector<std::unique_ptr<Vector>> inputs, outputs, errors;
+    for (const auto &replica : replicas) {
+        auto &device = replica.network->device();
+        inputs.emplace_back(new Vector(device, replica.data->inputSize() * parallelisationFactor, replica.data->inputType()));
+        outputs.emplace_back(new Vector(device, replica.data->outputSize() * parallelisationFactor, replica.data->outputType()));
+        errors.emplace_back(new Vector(device, replica.data->outputSize() * parallelisationFactor, replica.data->outputType()));
+    }
+    std::vector<float> errs;
+    
+    broadcastWeights();
+    for (const auto &replica : replicas) {
+        for (auto &i : replica.weightsAndGradients)
+            i.second->zeros();
+    }
+    
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t iteration = 0; iteration < iterations; ++iteration) {
+        for (auto &e : errors)
+            e->zeros();
+        if (reshuffleIndices)
+            std::random_shuffle(indices.begin(), indices.end());
+        
+        for (size_t batch = 0; batch < batchCount; ++batch) {
+            // The passes are enqueued round-robin across the replicas. The upload of a
+            // batch may block until the previous pass on the same device has completed,
+            // but by then the other replicas already have a pass enqueued, so the devices
+            // are kept busy concurrently.
+            for (size_t i = 0; i < passPerReplicaCount; ++i) {
+                for (size_t r = 0; r < replicaCount; ++r) {
+                    auto &replica = replicas[r];
+                    auto &network = *replica.network;
+                    size_t pass = batch*passPerBatchCount + r*passPerReplicaCount + i;
+                    replica.data->get(indices[pass]*parallelisationFactor, parallelisationFactor, *inputs[r], *outputs[r]);
+                    const auto &prediction = network.feedforward(*inputs[r]);
+                    criterion.computeError(network.context(), prediction, *outputs[r], *errors[r]);
+                    network.backpropagate(*outputs[r], criterion, /* overwriteGradients= */ i == 0);
+                }
+            }
+            
+            allReduceGradients();
+            for (const auto &replica : replicas) {
+                // gradients = gradients / numberOfTrainingExamples
+                replica.optimizer->optimize(replica.weightsAndGradients, miniBatchSize);
+                replica.network->synchronizeWeights();
+            }
+        }
+        
+        // Compute the iteration error.
+        float iterationError = 0.0f;
+        for (size_t r = 0; r < replicaCount; ++r) {
+            Vector replicaErrorSum(replicas[r].network->device(), 1, reductionType(Reduction::Sum, errors[r]->type()));
+            reduce(replicaErrorSum, Reduction::Sum, *errors[r]);
+            errs.clear();
+            readFloats(replicaErrorSum, errs);
+            iterationError += errs[0];
+        }
+        iterationError /= float(trainingExampleCount);
+        
+        if (afterIteration) {
+            afterIteration(iteration, iterationError);
+        }
+    }
+    
+    for (const auto &replica : replicas)
+        replica.network->device().queue().finish();
+    auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    throughput = seconds > 0? double(trainingExampleCount * iterations) / seconds : 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <functional>
+#include "network.h"
+#include "core/dataset.h"
+
+namespace nnFit {
+
+class Optimizer;
+class ErrorCriterion;
+
+// DataParallelTrainer - trains replicas of the same network on several devices.
+//
+// Every replica is trained on its own share of each mini-batch. The gradients
+// of all the replicas are summed before every replica runs its optimizer, so
+// the replicas stay identical.
+//
+// The replicas on the sub-devices of a partitioned CPU device run their kernels
+// only on the cores of their own sub-device. The host thread that enqueues the
+// commands of all the replicas isn't pinned to any of them.
+class DataParallelTrainer {
+public:
+    std::function<void (size_t, float)> afterIteration;
+    bool reshuffleIndices;
+    
+    DataParallelTrainer(ErrorCriterion &criterion, size_t parallelisationFactor = 1);
+    
+    // Adds a replica. The network, the dataset and the optimizer must all use
+    // the same device, and the networks of all the replicas must have the same layers.
+    void addReplica(Network &network, Dataset &data, Optimizer &opt);
+    
+    size_t replicaCount() const {
+        return replicas.size();
+    }
+    
+    void gradientDescent(size_t iterations);
+    void miniBatchGradientDescent(size_t iterations, size_t miniBatchSize);
+    
+    // The number of training examples processed per second by the last training run.
+    double examplesPerSecond() const {
+        return throughput;
+    }
+    
+    // Returns the speedup of the last training run over the given single
+    // replica throughput, divided by the number of replicas.
+    double scalingEfficiency(double singleReplicaExamplesPerSecond) const {
+        return throughput / (singleReplicaExamplesPerSecond * replicas.size());
+    }
+private:
+    struct Replica {
+        Network *network;
+        Dataset *data;
+        Optimizer *optimizer;
+        std::vector<std::pair<const Vector*, const Vector*>> weightsAndGradients;
+    };
+    
+    void train(size_t iterations, size_t miniBatchSize);
+    void broadcastWeights();
+    void allReduceGradients();
+    
+    ErrorCriterion &criterion;
+    size_t parallelisationFactor;
+    std::vector<Replica> replicas;
+    double throughput;
+};
+
+} // namespace nnFit
@@ -5,28 +5,29 @@ using namespace nnFit;
 
 static void checkLayerParams(const Vector &prediction, const Vector &expectedOutput, const Vector &derivative, const Vector &errorTerm) {
     assert(prediction.size() == expectedOutput.size());
+    assert(prediction.type() == expectedOutput.type());
     assert(prediction.size() == derivative.size());
     assert(prediction.size() == errorTerm.size());
 }
 
 const Vector &MSECriterion::computeError(NNContext &ctx, const Vector &prediction, const Vector &expectedOutput, Vector &accumulatedErrors) {
     assert(prediction.size() == expectedOutput.size());
-    ctx.queue().enqueue1Dim(ctx.floatKernels.meanSquaredError(prediction, expectedOutput, accumulatedErrors), prediction.size());
+    ctx.queue().enqueue1Dim(ctx.kernels(prediction.type()).meanSquaredError(prediction, expectedOutput, accumulatedErrors), prediction.size());
     return accumulatedErrors;
 }
 
 void MSECriterion::computeLayerError(NNContext &ctx, const Vector &prediction, const Vector &expectedOutput, const Vector &derivative, const Vector &errorTerm) const {
     checkLayerParams(prediction, expectedOutput, derivative, errorTerm);
-    ctx.queue().enqueue1Dim(ctx.floatKernels.computeMSELayerError(prediction, expectedOutput, derivative, errorTerm), prediction.size());
+    ctx.queue().enqueue1Dim(ctx.kernels(prediction.type()).computeMSELayerError(prediction, expectedOutput, derivative, errorTerm), prediction.size());
 }
 
 const Vector &CrossEntropyCriterion::computeError(NNContext &ctx, const Vector &prediction, const Vector &expectedOutput, Vector &accumulatedErrors) {
     assert(prediction.size() == expectedOutput.size());
-    ctx.queue().enqueue1Dim(ctx.floatKernels.crossEntropyError(prediction, expectedOutput, accumulatedErrors), prediction.size());
+    ctx.queue().enqueue1Dim(ctx.kernels(prediction.type()).crossEntropyError(prediction, expectedOutput, accumulatedErrors), prediction.size());
     return accumulatedErrors;
 }
 
 void CrossEntropyCriterion::computeLayerError(NNContext &ctx, const Vector &prediction, const Vector &expectedOutput, const Vector &derivative, const Vector &errorTerm) const {
     checkLayerParams(prediction, expectedOutput, derivative, errorTerm);
-    ctx.queue().enqueue1Dim(ctx.floatKernels.computeCrossEntropyLayerError(prediction, expectedOutput, errorTerm), prediction.size());
+    ctx.queue().enqueue1Dim(ctx.kernels(prediction.type()).computeCrossEntropyLayerError(prediction, expectedOutput, errorTerm), prediction.size());
 }
\ No newline at end of file
@@ -7,8 +7,29 @@
 
 using namespace nnFit;
 
-Layer::Layer(Device &device, size_t neuronCount, size_t inputCount, TransferFunction transferFunction, size_t parallelisationFactor)
-: weights(device, neuronCount, inputCount), biases(device, neuronCount), weightGradients(device, neuronCount, inputCount), biasGradients(device, neuronCount), activations(device, neuronCount*parallelisationFactor), errorTerms(device, neuronCount*parallelisationFactor), errorOutputs(device, inputCount*parallelisationFactor), previousInput(nullptr), function(transferFunction), parallelisationFactor(parallelisationFactor) {
+// The batch size from which the tiled matrix multiplication is usually
+// faster than a matrix vector multiplication per input vector.
+static const size_t matrixMulMinimumBatchSize = 8;
+
+// The half layers accumulate their gradients in float.
+static ValueType gradientType(const ValueType &storageType) {
+    return storageType == ValueType::Half? ValueType(ValueType::Float) : storageType;
+}
+
+Layer::Layer(Device &device, size_t neuronCount, size_t inputCount, TransferFunction transferFunction, size_t parallelisationFactor, const ValueType &storageType)
+: weights(device, neuronCount, inputCount, storageType), biases(device, neuronCount, storageType), weightGradients(device, neuronCount, inputCount, gradientType(storageType)), biasGradients(device, neuronCount, gradientType(storageType)), activations(device, neuronCount*parallelisationFactor, storageType), errorTerms(device, neuronCount*parallelisationFactor, storageType), errorOutputs(device, inputCount*parallelisationFactor, storageType), previousInput(nullptr), previousSparseInput(nullptr), previousInputType(storageType), convertedInput(device, storageType), function(transferFunction), parallelisationFactor(parallelisationFactor) {
+    assert(storageType.isFloatingPoint());
+    if (device.isHost() && storageType != ValueType::Float) {
+        // The host device only has the float kernels, so reject the layer before it launches any.
+        device.fatalError(CL_INVALID_VALUE, "The host device only supports float layers");
+    }
+    useMatrixMul = parallelisationFactor >= matrixMulMinimumBatchSize && supportsMmul(device);
+    if (storageType == ValueType::Half) {
+        masterWeights.reset(new Matrix(device, neuronCount, inputCount));
+        masterBiases.reset(new Vector(device, neuronCount));
+        floatErrorTerms.reset(new Vector(device, neuronCount*parallelisationFactor));
+        floatInput.reset(new Vector(device, inputCount*parallelisationFactor));
+    }
 }
 
 void Layer::init(uint32_t seed) {
@@ -17,18 +38,19 @@ void Layer::init(uint32_t seed) {
     std::vector<float> init(weights.size());
     for (auto &v : init)
         v = d(gen);
-    weights.write(init);
+    writeFloats(masterWeights? *masterWeights : weights, init);
     init.resize(biases.size());
     for (auto &v : init)
         v = d(gen);
-    biases.write(init);
+    writeFloats(masterBiases? *masterBiases : biases, init);
+    synchronizeWeights();
 }
 
 void Layer::dump() {
     std::vector<float> w(weights.size());
-    weights.copy(w);
+    readFloats(weights, w);
     std::vector<float> b(biases.size());
-    biases.copy(b);
+    readFloats(biases, b);
     std::cout << "Neurons :\n";
     for (size_t i = 0; i < neuronCount(); ++i) {
         std::cout << "#" << i << ": " << b[i] << ", ";
@@ -40,112 +62,275 @@ void Layer::dump() {
 }
 
 void Layer::tune() {
-    // Tune weights by input multiplication
-    const std::array<size_t, 7> workgroupColumns = {1,2,4,8,16,32,64};
-    const std::array<size_t, 10> workgroupRows = {1,2,3,4,5,7,8,10,16,32};
     auto &device = weights.device();
-    const size_t iterations = 100;
+    auto &tuner = device.kernelTuner();
     
-    Vector output(device, weights.rows());
-    Vector input(device, weights.columns());
-    input.ones();
-    double bestTime = 0;
-    bool first = true;
-    for (auto rows: workgroupRows) {
-        if ((weights.rows() % rows) != 0)
-            continue;
-        for (auto columns: workgroupColumns) {
-            if ((weights.columns() % columns) != 0)
+    // Tune weights by input multiplication. The host device ignores the work-group sizes.
+    size_t shape[] = { weights.rows(), weights.columns() };
+    size_t workgroupSize[2];
+    if (!device.isHost() && !tuner.findParameters("mvmul", 2, shape, workgroupSize)) {
+        const std::array<size_t, 7> workgroupColumns = {1,2,4,8,16,32,64};
+        const std::array<size_t, 10> workgroupRows = {1,2,3,4,5,7,8,10,16,32};
+        const size_t iterations = 100;
+        
+        Vector output(device, weights.rows(), weights.type());
+        Vector input(device, weights.columns(), weights.type());
+        input.ones();
+        double bestTime = 0;
+        bool first = true;
+        for (auto rows: workgroupRows) {
+            if ((weights.rows() % rows) != 0)
                 continue;
-            auto time = device.profile([&, this] () {
-                for (size_t i = 0; i < iterations; ++i)
-                    parallelMvmul(output, weights, input, Range2D(rows, columns));
-            });
-            if (first || time < bestTime) {
-                weightInputMulWorkgroupSize = Range2D(rows, columns);
-                first = false;
-                bestTime = time;
+            for (auto columns: workgroupColumns) {
+                if ((weights.columns() % columns) != 0)
+                    continue;
+                auto time = device.profile([&, this] () {
+                    for (size_t i = 0; i < iterations; ++i)
+                        parallelMvmul(output, weights, input, Range2D(rows, columns));
+                });
+                if (first || time < bestTime) {
+                    workgroupSize[0] = rows;
+                    workgroupSize[1] = columns;
+                    first = false;
+                    bestTime = time;
+                }
             }
         }
+        tuner.storeParameters("mvmul", 2, shape, workgroupSize);
+        std::cout << "Best workgroup size for "<<weights.rows() << " by " << weights.columns() << " matrix vector multiplication: " << workgroupSize[0] << ", " << workgroupSize[1] << "\n";
+    }
+    
+    // Pick the faster of the tiled matrix multiplication and the matrix vector
+    // multiplications for the whole batch.
+    if (parallelisationFactor > 1 && supportsMmul(device)) {
+        const size_t iterations = 100;
+        Vector output(device, weights.rows()*parallelisationFactor, weights.type());
+        Vector input(device, weights.columns()*parallelisationFactor, weights.type());
+        input.ones();
+        auto matrixVectorTime = device.profile([&, this] () {
+            for (size_t i = 0; i < iterations; ++i)
+                parallelMvmul(output, weights, input);
+        });
+        auto matrixTime = device.profile([&, this] () {
+            for (size_t i = 0; i < iterations; ++i)
+                mmul(output, weights, input);
+        });
+        useMatrixMul = matrixTime < matrixVectorTime;
     }
-    std::cout << "Best workgroup size for "<<weights.rows() << " by " << weights.columns() << " matrix vector multiplication: " << weightInputMulWorkgroupSize[0] << ", " << weightInputMulWorkgroupSize[1] << "\n";
+    
+    // Tune the rest of the kernels that are launched by a training pass.
+    NNContext ctx(device);
+    Vector input(device, inputCount()*parallelisationFactor, weights.type());
+    input.ones();
+    auto &queue = device.queue();
+    queue.startRecording();
+    feedforward(ctx, input);
+    backpropagate(ctx, activations);
+    accumulateGradients(ctx);
+    tuner.tune(queue.stopRecording());
+    
+    // The tuning runs accumulated the gradients of the dummy input.
+    weightGradients.zeros();
+    biasGradients.zeros();
+    previousInput = nullptr;
+    previousSparseInput = nullptr;
+}
+
+static Epilogue::Activation epilogueActivation(const TransferFunction &function) {
+    switch (function.type()) {
+    case TransferFunction::Linear:
+        return Epilogue::Identity;
+    case TransferFunction::Sigmoid:
+        return Epilogue::Sigmoid;
+    case TransferFunction::Tanh:
+        return Epilogue::Tanh;
+    case TransferFunction::RectifiedLinearUnit:
+        return Epilogue::RectifiedLinearUnit;
+    }
+    assert(false && "Invalid transfer function");
+    return Epilogue::Identity;
+}
+
+// activation = epilogue(Wx)
+static void multiply(const Vector &activations, const Matrix &weights, const Vector &input, bool useMatrixMul, const Epilogue &epilogue) {
+    if (useMatrixMul)
+        mmul(activations, weights, input, epilogue);
+    else
+        parallelMvmul(activations, weights, input, Range2D(), epilogue);
 }
 
 const Vector &Layer::predictLinear(NNContext &ctx, const Vector &input) {
-    parallelMvmul(activations, weights, input, weightInputMulWorkgroupSize);
-    parallelAdd(activations, biases, activations);
+    multiply(activations, weights, input, useMatrixMul, Epilogue(&biases));
+    return activations;
+}
+
+const Vector &Layer::predictActivation(NNContext &ctx, const Vector &input, const Vector *derivatives) {
+    multiply(activations, weights, input, useMatrixMul, Epilogue(&biases, epilogueActivation(function), derivatives));
     return activations;
 }
 
 const Vector &Layer::predict(NNContext &ctx, const Vector &input) {
     assert(input.size() == inputCount()*parallelisationFactor);
-    previousInput = &input;
+    InstrumentationScope scope(weights.device(), "forward");
+    previousInput = &convertInput(input);
+    previousSparseInput = nullptr;
     // activation = f(Wx + b)
-    return function.apply(ctx, predictLinear(ctx, input));
+    return predictActivation(ctx, *previousInput, nullptr);
 }
 
 const Vector &Layer::feedforward(NNContext &ctx, const Vector &input) {
     assert(input.size() == inputCount()*parallelisationFactor);
-    previousInput = &input;
+    InstrumentationScope scope(weights.device(), "forward");
+    previousInput = &convertInput(input);
+    previousSparseInput = nullptr;
     // activation = f(Wx + b)
     // derivative = f'(Wx + b)
-    return function.apply(ctx, predictLinear(ctx, input), /* derivatives= */ errorTerms);
+    return predictActivation(ctx, *previousInput, &errorTerms);
+}
+
+// activation = f(Wx + b) for the sparse inputs x
+// derivative = f'(Wx + b), when derivatives aren't null.
+static const Vector &predictSparseActivation(const Vector &activations, const Matrix &weights, const Vector &biases, const TransferFunction &function, const SparseMatrix &input, const Vector *derivatives) {
+    sparseMmul(activations, weights, input, Epilogue(&biases, epilogueActivation(function), derivatives));
+    return activations;
+}
+
+const Vector &Layer::predictSparse(NNContext &ctx, const SparseMatrix &input) {
+    assert(weights.type() == ValueType::Float);
+    assert(input.rows() == parallelisationFactor && input.columns() == inputCount());
+    InstrumentationScope scope(weights.device(), "forward");
+    previousInput = nullptr;
+    previousSparseInput = &input;
+    previousInputType = ValueType::Float;
+    return predictSparseActivation(activations, weights, biases, function, input, nullptr);
+}
+
+const Vector &Layer::feedforwardSparse(NNContext &ctx, const SparseMatrix &input) {
+    assert(weights.type() == ValueType::Float);
+    assert(input.rows() == parallelisationFactor && input.columns() == inputCount());
+    InstrumentationScope scope(weights.device(), "forward");
+    previousInput = nullptr;
+    previousSparseInput = &input;
+    previousInputType = ValueType::Float;
+    return predictSparseActivation(activations, weights, biases, function, input, &errorTerms);
 }
 
 const Vector &Layer::backpropagate(NNContext &ctx, const Vector &expectedOutput, const ErrorCriterion &criterion, bool backpropagateDown) {
+    assert(weights.type() != ValueType::Half && "The output layer must store floats or doubles");
     // error is computed by the error criterion
     criterion.computeLayerError(ctx, activations, expectedOutput, /* derivatives= */ errorTerms, errorTerms);
     // Propagate error to the previous layer(s) if needed.
     if (backpropagateDown) {
         backpropagate(ctx);
     }
-    return errorOutputs;
+    return errorOutput();
 }
 
 const Vector &Layer::backpropagate(NNContext &ctx, const Vector &errorInput, bool backpropagateDown) {
+    // The next layer converts the error back to the type of its input.
+    assert(errorInput.type() == weights.type());
     // error = derivative .* errorInput
     elementwiseMul(errorTerms, errorInput);
     // Propagate error to the previous layer(s) if needed.
     if (backpropagateDown) {
         backpropagate(ctx);
     }
-    return errorOutputs;
+    return errorOutput();
 }
 
 const Vector &Layer::backpropagate(NNContext &ctx) {
+    InstrumentationScope scope(weights.device(), "propagateError");
     // errorOutput = transpose(Weights) * error
-    transposeMvmul(errorOutputs, weights, errorTerms, parallelisationFactor);
-    return errorOutputs;
+    if (parallelisationFactor > 1 && supportsMmul(weights.device()))
+        transposeMmul(errorOutputs, weights, errorTerms);
+    else
+        transposeMvmul(errorOutputs, weights, errorTerms, parallelisationFactor);
+    if (previousInputType != weights.type()) {
+        if (!convertedErrorOutputs || convertedErrorOutputs->type() != previousInputType)
+            convertedErrorOutputs.reset(new Vector(weights.device(), errorOutputs.size(), previousInputType));
+        convert(*convertedErrorOutputs, errorOutputs);
+    }
+    return errorOutput();
 }
 
 void Layer::updatePreviousInput(const Vector &input) {
-    previousInput = &input;
+    previousInput = &convertInput(input);
+    previousSparseInput = nullptr;
+}
+
+const Vector &Layer::convertInput(const Vector &input) {
+    previousInputType = input.type();
+    if (input.type() == weights.type())
+        return input;
+    if (convertedInput.size() != input.size())
+        convertedInput.resize(input.size());
+    convert(convertedInput, input);
+    return convertedInput;
 }
 
-static const Kernel &chooseWeightGradientKernel(NNContext &ctx, size_t parallelisationFactor, bool use4wide) {
+static const Kernel &chooseWeightGradientKernel(NNContext::Specialization &kernels, size_t parallelisationFactor, bool use4wide) {
     if (parallelisationFactor == 1) {
-        return use4wide? ctx.floatKernels.computeWeightGradients4 : ctx.floatKernels.computeWeightGradients;
+        return use4wide? kernels.computeWeightGradients4 : kernels.computeWeightGradients;
     }
-    return use4wide? ctx.floatKernels.computeWeightGradients4Parallel : ctx.floatKernels.computeWeightGradientsParallel;
+    return use4wide? kernels.computeWeightGradients4Parallel : kernels.computeWeightGradientsParallel;
+}
+
+static KernelInvocation weightGradientInvocation(const Kernel &kernel, const Vector &errorTerms, const Vector &input, const Matrix &weightGradients, size_t parallelisationFactor, bool use4wide) {
+    if (!use4wide)
+        return parallelisationFactor == 1? kernel(errorTerms, input, weightGradients) : kernel(errorTerms, input, weightGradients, parallelisationFactor);
+    return parallelisationFactor == 1? kernel(errorTerms, input, weightGradients, weightGradients.columns()) : kernel(errorTerms, input, weightGradients, parallelisationFactor, weightGradients.columns());
 }
 
-void Layer::accumulateGradients(NNContext &ctx) {
+void Layer::accumulateGradients(NNContext &ctx, bool overwrite) {
+    InstrumentationScope scope(weights.device(), "accumulateGradients");
     auto &queue = ctx.queue();
+    // The half error terms and inputs are converted, so the gradients are computed
+    // and accumulated by the float kernels. They're much smaller than the gradients.
+    const Vector *errors = &errorTerms;
+    const Vector *input = previousInput;
+    if (floatErrorTerms) {
+        convert(*floatErrorTerms, errorTerms);
+        errors = floatErrorTerms.get();
+        if (input) {
+            convert(*floatInput, *input);
+            input = floatInput.get();
+        }
+    }
     // weightGradient += error * input'
-    bool use4wide = weightGradients.columns() % 4 == 0;
-    const auto &kernel = chooseWeightGradientKernel(ctx, parallelisationFactor, use4wide);
-    queue.enqueue2Dim(parallelisationFactor == 1? kernel(errorTerms, *previousInput, weightGradients) : kernel(errorTerms, *previousInput, weightGradients, parallelisationFactor), Range2D(weightGradients.rows(), use4wide? weightGradients.columns()/4 : weightGradients.columns()));
+    if (previousSparseInput) {
+        sparseOuterProductSum(weightGradients, *errors, *previousSparseInput, overwrite? 0.0f : 1.0f);
+    } else if (supportsMmul(weights.device())) {
+        outerProductSum(weightGradients, *errors, *input, overwrite? 0.0f : 1.0f);
+    } else {
+        if (overwrite)
+            weightGradients.zeros();
+        // The 4 wide kernels handle the columns that don't fill a vector themselves.
+        size_t columns = weightGradients.columns();
+        bool use4wide = columns >= 4;
+        const auto &kernel = chooseWeightGradientKernel(ctx.kernels(weightGradients.type()), parallelisationFactor, use4wide);
+        queue.enqueue2Dim(weightGradientInvocation(kernel, *errors, *input, weightGradients, parallelisationFactor, use4wide), Range2D(weightGradients.rows(), use4wide? (columns + 3)/4 : columns));
+    }
     
     // biasGradient += error
     if (parallelisationFactor == 1) {
-        add(biasGradients, errorTerms);
+        if (overwrite)
+            errors->copy(biasGradients);
+        else
+            add(biasGradients, *errors);
         return;
     }
-    assert(errorTerms.size() == biasGradients.size()*parallelisationFactor);
-    queue.enqueue1Dim(ctx.floatKernels.computeBiasGradients(errorTerms, parallelisationFactor, biasGradients), biasGradients.size());
+    assert(errors->size() == biasGradients.size()*parallelisationFactor);
+    sumVectors(biasGradients, *errors, overwrite? 0.0f : 1.0f);
 }
 
 void Layer::collectWeightsAndGradients(std::vector<std::pair<const Vector*, const Vector*>> &weightsAndGradients) {
-    weightsAndGradients.push_back(std::make_pair(&weights, &weightGradients));
-    weightsAndGradients.push_back(std::make_pair(&biases, &biasGradients));
+    weightsAndGradients.push_back(std::make_pair(masterWeights? masterWeights.get() : &weights, &weightGradients));
+    weightsAndGradients.push_back(std::make_pair(masterBiases? masterBiases.get() : &biases, &biasGradients));
+}
+
+void Layer::synchronizeWeights() {
+    if (!masterWeights)
+        return;
+    convert(weights, *masterWeights);
+    convert(biases, *masterBiases);
 }
@@ -12,7 +12,15 @@ class ErrorCriterion;
 class Layer: public AbstractLayer {
 public:
     
-    Layer(Device &device, size_t neuronCount, size_t inputCount, TransferFunction transferFunction = TransferFunction::Linear, size_t parallelisationFactor = 1);
+    // The weights, activations and error terms are stored as storageType values.
+    // A half layer computes in float, but halves the memory traffic of its matrix
+    // multiplications. Its gradients are accumulated in float, and the optimizer
+    // updates float master weights, so the small steps aren't rounded away. The half
+    // weights are converted from them by synchronizeWeights. The inputs of a different
+    // type are converted, and so are the error outputs that are propagated back to
+    // them. The output layer must be a float or double layer, so that the errors
+    // aren't accumulated in half precision.
+    Layer(Device &device, size_t neuronCount, size_t inputCount, TransferFunction transferFunction = TransferFunction::Linear, size_t parallelisationFactor = 1, const ValueType &storageType = ValueType(ValueType::Float));
     
     size_t neuronCount() const {
         return weights.rows();
@@ -23,13 +31,26 @@ public:
     const TransferFunction &transferFunction() const {
         return function;
     }
+    const ValueType &storageType() const {
+        return weights.type();
+    }
+    // The weights that the optimizer updates, i.e. the float master weights of a half
+    // layer. After writing the master weights, call synchronizeWeights to update the
+    // half weights that the passes use.
     const Matrix &neuronWeights() const {
-        return weights;
+        return masterWeights? *masterWeights : weights;
     }
     const Matrix &neuronWeightGradients() const {
         return weightGradients;
     }
     const Vector &neuronBiases() const {
+        return masterBiases? *masterBiases : biases;
+    }
+    // The weights and biases in the storage type, which the passes use.
+    const Matrix &storedWeights() const {
+        return weights;
+    }
+    const Vector &storedBiases() const {
         return biases;
     }
     const Vector &neuronBiasGradients() const {
@@ -45,7 +66,7 @@ public:
         return errorTerms;
     }
     const Vector &errorOutput() const {
-        return errorOutputs;
+        return previousInputType == weights.type()? errorOutputs : *convertedErrorOutputs;
     }
     
     void init(uint32_t seed) override;
@@ -54,25 +75,48 @@ public:
     
     const Vector &predict(NNContext &ctx, const Vector &input) override;
     const Vector &feedforward(NNContext &ctx, const Vector &input) override;
+    // The sparse inputs are multiplied by the sparse kernels, so the work of the layer and
+    // of its weight gradients scales with the number of non-zeros. Float layers only.
+    const Vector &predictSparse(NNContext &ctx, const SparseMatrix &input) override;
+    const Vector &feedforwardSparse(NNContext &ctx, const SparseMatrix &input) override;
     const Vector &backpropagate(NNContext &ctx, const Vector &expectedOutput, const ErrorCriterion &criterion, bool backpropagateDown = true) override;
     const Vector &backpropagate(NNContext &ctx, const Vector &errorInput, bool backpropagateDown = true) override;
     
     const Vector &predictLinear(NNContext &ctx, const Vector &input);
+    // activation = f(Wx + b)
+    // derivative = f'(Wx + b), when derivatives aren't null.
+    // The bias and the transfer function are applied by the matrix multiplication.
+    const Vector &predictActivation(NNContext &ctx, const Vector &input, const Vector *derivatives);
     const Vector &backpropagate(NNContext &ctx);
     void updatePreviousInput(const Vector &input);
-    void accumulateGradients(NNContext &ctx) override;
+    // Returns the input in the storage type of the layer.
+    const Vector &convertInput(const Vector &input);
+    void accumulateGradients(NNContext &ctx, bool overwrite = false) override;
     void collectWeightsAndGradients(std::vector<std::pair<const Vector*, const Vector*>> &weightsAndGradients) override;
+    void synchronizeWeights() override;
 private:
     Layer(const Layer&) = delete;
     Matrix weights;
     Vector biases;
+    // The float weights that the optimizer updates, when the weights are halfs.
+    std::unique_ptr<Matrix> masterWeights;
+    std::unique_ptr<Vector> masterBiases;
     Matrix weightGradients;
     Vector biasGradients;
     Vector activations;
     Vector errorTerms;
     Vector errorOutputs;
     const Vector *previousInput;
-    Range2D weightInputMulWorkgroupSize;
+    // The input of the last pass when it was sparse, previousInput is null then.
+    const SparseMatrix *previousSparseInput;
+    ValueType previousInputType;
+    // The converted inputs and error outputs, when the inputs have a different type.
+    Vector convertedInput;
+    std::unique_ptr<Vector> convertedErrorOutputs;
+    // The float error terms and inputs that the gradients of a half layer are computed from.
+    std::unique_ptr<Vector> floatErrorTerms, floatInput;
+    // Set when the linear part of the predictions uses the tiled matrix multiplication.
+    bool useMatrixMul;
     TransferFunction function;
     size_t parallelisationFactor;
 };
@@ -3,7 +3,8 @@
 
 using namespace nnFit;
 
-NNContext::Specialization::Specialization(Device &device, Program &program) {
+NNContext::Specialization::Specialization(Device &device, const BuildOptions &options) {
+    auto &program = device.getProgram("nn.cl", options);
     sigmoidPredict = Kernel(program, "sigmoidPredict");
     sigmoidFeedforward = Kernel(program, "sigmoidFeedforward");
     tanhPredict = Kernel(program, "tanhPredict");
@@ -18,11 +19,50 @@ NNContext::Specialization::Specialization(Device &device, Program &program) {
     computeWeightGradients4 = Kernel(program, "computeWeightGradient4");
     computeWeightGradientsParallel = Kernel(program, "computeWeightGradientParallel");
     computeWeightGradients4Parallel = Kernel(program, "computeWeightGradient4Parallel");
-    computeBiasGradients = Kernel(program, "computeBiasGradient");
     evaluateClassification = Kernel(program, "evaluateClassification");
 }
 
-NNContext::NNContext(Device &device) : floatKernels(device, device.getProgram("nn.cl")), queue_(device.queue()) {
+NNContext::DoubleSpecialization::DoubleSpecialization(Device &device) : Specialization(device, BuildOptions().define("SCALAR", "double")) {
+}
+
+NNContext::HalfSpecialization::HalfSpecialization(Device &device) : Specialization(device, BuildOptions().define("HALF_STORAGE")) {
+}
+
+NNContext::NNContext(Device &device) : floatKernels(device.shared<Specialization>()), dev(device), queue_(device.queue()), denseInputs(device) {
+}
+
+NNContext::Specialization &NNContext::kernels(const ValueType &type) {
+    switch (type.type()) {
+    case ValueType::Float:
+        return floatKernels;
+    case ValueType::Half:
+        if (dev.isHost())
+            dev.fatalError(CL_INVALID_VALUE, "The host device only has the float network kernels");
+        return dev.shared<HalfSpecialization>();
+    case ValueType::Double:
+        if (dev.isHost() || !dev.supportsDoubles())
+            dev.fatalError(CL_INVALID_VALUE, "The device doesn't support the double network kernels");
+        return dev.shared<DoubleSpecialization>();
+    default:
+        break;
+    }
+    // The vectors of the other types aren't network activations.
+    dev.fatalError(CL_INVALID_VALUE, "The network kernels compute with floats, halfs or doubles");
+}
+
+const Vector &NNContext::denseInput(const SparseMatrix &input) {
+    if (denseInputs.size() != input.rows() * input.columns())
+        denseInputs.resize(input.rows() * input.columns());
+    toDense(denseInputs, input);
+    return denseInputs;
+}
+
+const Vector &AbstractLayer::predictSparse(NNContext &ctx, const SparseMatrix &input) {
+    return predict(ctx, ctx.denseInput(input));
+}
+
+const Vector &AbstractLayer::feedforwardSparse(NNContext &ctx, const SparseMatrix &input) {
+    return feedforward(ctx, ctx.denseInput(input));
 }
 
 Network::Network(Device &device) : dev(device), ctx(device), backpropagateUntil(0) {
@@ -44,6 +84,12 @@ std::vector<std::pair<const Vector*, const Vector*>> Network::weightsAndGradient
     return result;
 }
 
+void Network::synchronizeWeights() {
+    for (const auto &layer: layers) {
+        layer->synchronizeWeights();
+    }
+}
+
 void Network::init(uint32_t seed) {
     for (const auto &layer : layers) {
         layer->init(seed);
@@ -68,29 +114,67 @@ void Network::tune() {
 }
 
 const Vector &Network::predict(const Vector &input) {
+    InstrumentationScope scope(dev, "predict");
     const auto *x = &input;
-    for (const auto &layer : layers) {
-        x = &layer->predict(ctx, *x);
+    for (size_t i = 0; i < layers.size(); ++i) {
+        InstrumentationScope layerScope(dev, "layer", i);
+        x = &layers[i]->predict(ctx, *x);
     }
     return *x;
 }
 
 const Vector &Network::feedforward(const Vector &input) {
+    InstrumentationScope scope(dev, "feedforward");
     const auto *x = &input;
-    for (const auto &layer : layers) {
-        x = &layer->feedforward(ctx, *x);
+    for (size_t i = 0; i < layers.size(); ++i) {
+        InstrumentationScope layerScope(dev, "layer", i);
+        x = &layers[i]->feedforward(ctx, *x);
     }
     return *x;
 }
 
-void Network::backpropagate(const Vector &expectedOutput, const ErrorCriterion &criterion) {
+const Vector &Network::predict(const SparseMatrix &input) {
+    InstrumentationScope scope(dev, "predict");
+    const Vector *x;
+    {
+        InstrumentationScope layerScope(dev, "layer", 0);
+        x = &layers[0]->predictSparse(ctx, input);
+    }
+    for (size_t i = 1; i < layers.size(); ++i) {
+        InstrumentationScope layerScope(dev, "layer", i);
+        x = &layers[i]->predict(ctx, *x);
+    }
+    return *x;
+}
+
+const Vector &Network::feedforward(const SparseMatrix &input) {
+    InstrumentationScope scope(dev, "feedforward");
+    const Vector *x;
+    {
+        InstrumentationScope layerScope(dev, "layer", 0);
+        x = &layers[0]->feedforwardSparse(ctx, input);
+    }
+    for (size_t i = 1; i < layers.size(); ++i) {
+        InstrumentationScope layerScope(dev, "layer", i);
+        x = &layers[i]->feedforward(ctx, *x);
+    }
+    return *x;
+}
+
+void Network::backpropagate(const Vector &expectedOutput, const ErrorCriterion &criterion, bool overwriteGradients) {
+    InstrumentationScope scope(dev, "backpropagate");
     size_t i = layers.size() - 1;
-    const auto *error = &layers[i]->backpropagate(ctx, expectedOutput, criterion, i != backpropagateUntil);
-    layers[i]->accumulateGradients(ctx);
+    const Vector *error;
+    {
+        InstrumentationScope layerScope(dev, "layer", i);
+        error = &layers[i]->backpropagate(ctx, expectedOutput, criterion, i != backpropagateUntil);
+        layers[i]->accumulateGradients(ctx, overwriteGradients);
+    }
     
     for (; i != backpropagateUntil; ) {
         --i;
+        InstrumentationScope layerScope(dev, "layer", i);
         error = &layers[i]->backpropagate(ctx, *error, i != backpropagateUntil);
-        layers[i]->accumulateGradients(ctx);
+        layers[i]->accumulateGradients(ctx, overwriteGradients);
     }
 }
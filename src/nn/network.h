@@ -8,6 +8,7 @@ class ErrorCriterion;
 
 class NNContext {
 public:
+    // The kernels are shared by all the networks that use the same device.
     struct Specialization {
         Kernel sigmoidPredict;
         Kernel sigmoidFeedforward;
@@ -24,20 +25,37 @@ public:
         Kernel computeWeightGradients4;
         Kernel computeWeightGradientsParallel;
         Kernel computeWeightGradients4Parallel;
-        Kernel computeBiasGradients;
         Kernel evaluateClassification;
         
-        Specialization(Device &device, Program &program);
+        Specialization(Device &device, const BuildOptions &options = BuildOptions());
     };
-    Specialization floatKernels;
+    // The kernels that compute in double precision.
+    struct DoubleSpecialization: Specialization {
+        DoubleSpecialization(Device &device);
+    };
+    // The kernels of the half vectors, which compute in float.
+    struct HalfSpecialization: Specialization {
+        HalfSpecialization(Device &device);
+    };
+    Specialization &floatKernels;
     
     NNContext(Device &device);
     
+    // Returns the kernels for the vectors of the given type, float, half or double.
+    // The half and double kernels are built when they are used for the first time.
+    Specialization &kernels(const ValueType &type);
+    
     CommandQueue &queue() const {
         return queue_;
     }
+    
+    // Returns the sparse inputs expanded to dense vectors, for the layers that
+    // don't multiply the sparse inputs directly.
+    const Vector &denseInput(const SparseMatrix &input);
 private:
+    Device &dev;
     CommandQueue &queue_;
+    Vector denseInputs;
 };
 
 class Network {
@@ -55,6 +73,8 @@ public:
     Network &add(std::unique_ptr<AbstractLayer> layer);
     
     std::vector<std::pair<const Vector*, const Vector*>> weightsAndGradients();
+    // Has to be called after the weights returned by weightsAndGradients were changed.
+    void synchronizeWeights();
     
     void init(uint32_t seed);
     void init();
@@ -62,7 +82,12 @@ public:
     void tune();
     const Vector &predict(const Vector &input);
     const Vector &feedforward(const Vector &input);
-    void backpropagate(const Vector &expectedOutput, const ErrorCriterion &criterion);
+    // The sparse inputs are multiplied by the first layer without expanding them.
+    const Vector &predict(const SparseMatrix &input);
+    const Vector &feedforward(const SparseMatrix &input);
+    // The accumulated gradients are replaced by the gradients of this pass
+    // when 'overwriteGradients' is set, e.g. for the first pass of a mini-batch.
+    void backpropagate(const Vector &expectedOutput, const ErrorCriterion &criterion, bool overwriteGradients = false);
 private:
     Network(const Network&) = delete;
     Device &dev;
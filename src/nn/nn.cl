@@ -1,137 +1,181 @@
-#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+// The program can be specialized with SCALAR, the scalar type (float or double, float by default),
+// and with HALF_STORAGE, when the vectors are stored as half precision floats. The half elements
+// are loaded and stored with vload_half and vstore_half, so they are computed with as floats.
 
-typedef float Scalar;
-typedef float4 Scalar4;
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef SCALAR
+#define SCALAR float
+#endif
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+typedef SCALAR Scalar;
+typedef CONCAT(SCALAR, 4) Scalar4;
+
+// Element - the type of the elements in the global memory.
+// LOAD(p, i)       - loads the i-th element of p as a Scalar.
+// STORE(x, p, i)   - stores the Scalar x as the i-th element of p.
+// LOAD4(p, i)      - loads the i-th group of 4 elements of p as a Scalar4.
+// STORE4(x, p, i)  - stores the Scalar4 x as the i-th group of 4 elements of p.
+#ifdef HALF_STORAGE
+typedef half Element;
+#define LOAD(p, i) vload_half(i, p)
+#define STORE(x, p, i) vstore_half(x, i, p)
+#define LOAD4(p, i) vload_half4(i, p)
+#define STORE4(x, p, i) vstore_half4(x, i, p)
+#else
+typedef Scalar Element;
+#define LOAD(p, i) ((p)[i])
+#define STORE(x, p, i) ((p)[i] = (x))
+#define LOAD4(p, i) vload4(i, p)
+#define STORE4(x, p, i) vstore4(x, i, p)
+#endif
 
 Scalar sigmoid(Scalar x) {
     return (Scalar)1.0/((Scalar)1.0 + exp(-x));
 }
 
-kernel void sigmoidPredict(global Scalar *x) {
+kernel void sigmoidPredict(global Element *x) {
     size_t i = get_global_id(0);
-    x[i] = sigmoid(x[i]);
+    STORE(sigmoid(LOAD(x, i)), x, i);
 }
 
-kernel void sigmoidFeedforward(global Scalar *x, global Scalar *derivative) {
+kernel void sigmoidFeedforward(global Element *x, global Element *derivative) {
     size_t i = get_global_id(0);
-    Scalar y = sigmoid(x[i]);
-    x[i] = y;
-    derivative[i] = y*((Scalar)1.0 - y);
+    Scalar y = sigmoid(LOAD(x, i));
+    STORE(y, x, i);
+    STORE(y*((Scalar)1.0 - y), derivative, i);
 }
 
-kernel void tanhPredict(global Scalar *x) {
+kernel void tanhPredict(global Element *x) {
     size_t i = get_global_id(0);
-    x[i] = tanh(x[i]);
+    STORE(tanh(LOAD(x, i)), x, i);
 }
 
-kernel void tanhFeedforward(global Scalar *x, global Scalar *derivative) {
+kernel void tanhFeedforward(global Element *x, global Element *derivative) {
     size_t i = get_global_id(0);
-    Scalar y = tanh(x[i]);
-    x[i] = y;
-    derivative[i] = 1 - y*y;
+    Scalar y = tanh(LOAD(x, i));
+    STORE(y, x, i);
+    STORE(1 - y*y, derivative, i);
 }
 
-kernel void reluPredict(global Scalar *x) {
+kernel void reluPredict(global Element *x) {
     size_t i = get_global_id(0);
-    x[i] = max(x[i], (Scalar)0.0);
+    STORE(max(LOAD(x, i), (Scalar)0.0), x, i);
 }
 
-kernel void reluFeedforward(global Scalar *x, global Scalar *derivative) {
+kernel void reluFeedforward(global Element *x, global Element *derivative) {
     size_t i = get_global_id(0);
-    if (x[i] > 0.0) {
-        derivative[i] = 1.0;
+    if (LOAD(x, i) > 0.0) {
+        STORE((Scalar)1.0, derivative, i);
     } else {
-        x[i] = 0.0;
-        derivative[i] = 0.0;
+        STORE((Scalar)0.0, x, i);
+        STORE((Scalar)0.0, derivative, i);
     }
 }
 
-kernel void meanSquaredError(global Scalar *prediction, global Scalar *y, global Scalar *output) {
+kernel void meanSquaredError(const global Element *prediction, const global Element *y, global Element *output) {
     size_t i = get_global_id(0);
-    Scalar diff = y[i] - prediction[i];
-    output[i] += diff * diff;
+    Scalar diff = LOAD(y, i) - LOAD(prediction, i);
+    STORE(LOAD(output, i) + diff * diff, output, i);
 }
 
-kernel void crossEntropyError(global Scalar *prediction, global Scalar *y, global Scalar *output) {
+kernel void crossEntropyError(const global Element *prediction, const global Element *y, global Element *output) {
     size_t i = get_global_id(0);
-    Scalar err = -(y[i]*log(prediction[i]) + ((Scalar)1.0 - y[i])*log((Scalar)1.0 - prediction[i]));
-    output[i] += isnan(err)? (Scalar)0.0 : err;
+    Scalar p = LOAD(prediction, i), t = LOAD(y, i);
+    Scalar err = -(t*log(p) + ((Scalar)1.0 - t)*log((Scalar)1.0 - p));
+    STORE(LOAD(output, i) + (isnan(err)? (Scalar)0.0 : err), output, i);
 }
 
 // The "responsibility" of the last layer with MSE criterion.
-kernel void computeMSELayerError(global Scalar *prediction, global Scalar *y, global Scalar *derivative, global Scalar *errorTerm) {
+kernel void computeMSELayerError(const global Element *prediction, const global Element *y, const global Element *derivative, global Element *errorTerm) {
     size_t i = get_global_id(0);
-    errorTerm[i] = (prediction[i] - y[i]) * derivative[i];
+    STORE((LOAD(prediction, i) - LOAD(y, i)) * LOAD(derivative, i), errorTerm, i);
 }
 
 // The "responsibility" of the last layer with cross entropy error.
-kernel void computeCrossEntropyLayerError(global Scalar *prediction, global Scalar *y, global Scalar *errorTerm) {
+kernel void computeCrossEntropyLayerError(const global Element *prediction, const global Element *y, global Element *errorTerm) {
     size_t i = get_global_id(0);
-    errorTerm[i] = prediction[i] - y[i];
+    STORE(LOAD(prediction, i) - LOAD(y, i), errorTerm, i);
 }
 
 // gradients = error * input'
 // bias gradients are just added
-kernel void computeWeightGradient(global Scalar *errorTerm, global Scalar *input, global Scalar *weightGradients) {
+kernel void computeWeightGradient(const global Element *errorTerm, const global Element *input, global Element *weightGradients) {
     size_t row = get_global_id(0);
     size_t column = get_global_id(1);
     size_t columns = get_global_size(1);
-    weightGradients[row*columns + column] += errorTerm[row] * input[column];
+    size_t i = row*columns + column;
+    STORE(LOAD(weightGradients, i) + LOAD(errorTerm, row) * LOAD(input, column), weightGradients, i);
 }
 
-kernel void computeWeightGradient4(global Scalar *errorTerm, global Scalar4 *input, global Scalar4 *weightGradients) {
+// The 4 wide kernels run a thread for every 4 columns. The rows don't have to be
+// aligned to 4 columns, and the thread of the last columns handles the columns
+// that don't fill a vector.
+kernel void computeWeightGradient4(const global Element *errorTerm, const global Element *input, global Element *weightGradients, const uint columns) {
     size_t row = get_global_id(0);
-    size_t column = get_global_id(1);
-    size_t columns = get_global_size(1);
-    weightGradients[row*columns + column] += errorTerm[row] * input[column];
+    size_t column = get_global_id(1)*4;
+    global Element *gradients = weightGradients + row*columns;
+    Scalar error = LOAD(errorTerm, row);
+    if (column + 4 <= columns) {
+        STORE4(LOAD4(gradients + column, 0) + error * LOAD4(input + column, 0), gradients + column, 0);
+        return;
+    }
+    for (; column < columns; ++column)
+        STORE(LOAD(gradients, column) + error * LOAD(input, column), gradients, column);
 }
 
-kernel void computeWeightGradientParallel(global Scalar *errorTerm, global Scalar *input, global Scalar *weightGradients, const uint count) {
+kernel void computeWeightGradientParallel(const global Element *errorTerm, const global Element *input, global Element *weightGradients, const uint count) {
     size_t row = get_global_id(0);
     size_t rows = get_global_size(0);
     size_t column = get_global_id(1);
     size_t columns = get_global_size(1);
     Scalar sum = 0.0;
     for (size_t i = 0; i < count; ++i) {
-        sum += errorTerm[i*rows + row] * input[i*columns + column];
+        sum += LOAD(errorTerm, i*rows + row) * LOAD(input, i*columns + column);
     }
-    weightGradients[row*columns + column] += sum;
+    size_t i = row*columns + column;
+    STORE(LOAD(weightGradients, i) + sum, weightGradients, i);
 }
 
-kernel void computeWeightGradient4Parallel(global Scalar *errorTerm, global Scalar4 *input, global Scalar4 *weightGradients, const uint count) {
+kernel void computeWeightGradient4Parallel(const global Element *errorTerm, const global Element *input, global Element *weightGradients, const uint count, const uint columns) {
     size_t row = get_global_id(0);
     size_t rows = get_global_size(0);
-    size_t column = get_global_id(1);
-    size_t columns = get_global_size(1);
-    Scalar4 sum = 0.0;
-    for (size_t i = 0; i < count; ++i) {
-        sum += errorTerm[i*rows + row] * input[i*columns + column];
+    size_t column = get_global_id(1)*4;
+    global Element *gradients = weightGradients + row*columns;
+    if (column + 4 <= columns) {
+        Scalar4 sum = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            sum += LOAD(errorTerm, i*rows + row) * LOAD4(input + i*columns + column, 0);
+        }
+        STORE4(LOAD4(gradients + column, 0) + sum, gradients + column, 0);
+        return;
     }
-    weightGradients[row*columns + column] += sum;
-}
-
-kernel void computeBiasGradient(global Scalar *errorTerm, const uint count, global Scalar *biasGradients) {
-    size_t i = get_global_id(0);
-    Scalar sum = 0.0;
-    const global Scalar *errorTermEl = errorTerm + i;
-    for (size_t j = 0; j < count; ++j) {
-        sum += errorTermEl[j*get_global_size(0)];
+    for (; column < columns; ++column) {
+        Scalar sum = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            sum += LOAD(errorTerm, i*rows + row) * LOAD(input, i*columns + column);
+        }
+        STORE(LOAD(gradients, column) + sum, gradients, column);
     }
-    biasGradients[i] += sum;
 }
 
-kernel void evaluateClassification(global Scalar *outputs, const uint size, global ushort *labels, global uchar *dest) {
+kernel void evaluateClassification(const global Element *outputs, const uint size, const global ushort *labels, global uchar *dest) {
     size_t part = get_global_id(0);
     
-    const global Scalar *output = outputs + size*(get_global_id(0) - get_global_offset(0));
-    Scalar maxValue = output[0];
+    const global Element *output = outputs + size*(get_global_id(0) - get_global_offset(0));
+    Scalar maxValue = LOAD(output, 0);
     size_t maxIndex = 0;
     for (size_t i = 1; i < size; ++i) {
-        if (output[i] > maxValue) {
-            maxValue = output[i];
+        Scalar value = LOAD(output, i);
+        if (value > maxValue) {
+            maxValue = value;
             maxIndex = i;
         }
     }
     dest[part] = maxIndex == labels[part];
 }
-
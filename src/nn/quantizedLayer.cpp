@@ -0,0 +1,52 @@
+#include "quantizedLayer.h"
+#include "layer.h"
+
+using namespace nnFit;
+
+QuantizedLayer::QuantizedLayer(const Layer &layer, bool quantizeInputs)
+: weights(layer.neuronWeights().device(), layer.neuronCount(), layer.inputCount()), biases(layer.neuronWeights().device(), layer.neuronCount()), activations(layer.neuronWeights().device(), layer.activation().size()), inputValues(layer.neuronWeights().device(), ValueType::Int8), inputScales(layer.neuronWeights().device()), errorOutputs(layer.neuronWeights().device()), function(layer.transferFunction()), quantizeInputs(quantizeInputs) {
+    assert(layer.storageType() == ValueType::Float);
+    weights.quantize(layer.neuronWeights());
+    layer.neuronBiases().copy(biases);
+    if (quantizeInputs) {
+        size_t parallelisationFactor = activations.size() / neuronCount();
+        inputValues.resize(inputCount() * parallelisationFactor);
+        inputScales.resize(parallelisationFactor);
+    }
+}
+
+const Vector &QuantizedLayer::predict(NNContext &ctx, const Vector &input) {
+    assert(input.type() == ValueType::Float);
+    assert(input.size() * neuronCount() == activations.size() * inputCount());
+    InstrumentationScope scope(activations.device(), "forward");
+    // activation = f(Wx + b)
+    if (quantizeInputs) {
+        quantizeVectors(inputValues, inputScales, input);
+        quantizedMmul(activations, weights, inputValues, inputScales, biases);
+    } else {
+        quantizedMmul(activations, weights, input, biases);
+    }
+    return function.apply(ctx, activations);
+}
+
+const Vector &QuantizedLayer::feedforward(NNContext &ctx, const Vector &input) {
+    // Quantized layers can't be trained, so the training passes only predict.
+    return predict(ctx, input);
+}
+
+const Vector &QuantizedLayer::backpropagate(NNContext &ctx, const Vector &expectedOutput, const ErrorCriterion &criterion, bool backpropagateDown) {
+    return inferenceOnly();
+}
+
+const Vector &QuantizedLayer::backpropagate(NNContext &ctx, const Vector &errorInput, bool backpropagateDown) {
+    return inferenceOnly();
+}
+
+const Vector &QuantizedLayer::inferenceOnly() {
+    // The quantized weights have no gradients, so nothing is propagated back to the input.
+    auto &device = activations.device();
+    device.error(CL_INVALID_OPERATION, "Quantized layers are inference only, they can't be backpropagated");
+    errorOutputs.resize(activations.size() / neuronCount() * inputCount());
+    errorOutputs.zeros();
+    return errorOutputs;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "core/quantization.h"
+#include "transferFunction.h"
+#include "abstractLayer.h"
+
+namespace nnFit {
+
+class Layer;
+
+// QuantizedLayer - an inference only copy of a trained float layer, with its weights
+// quantized to int8 values with a scale and a zero point per neuron. The biases and
+// the activations stay floats. When 'quantizeInputs' is set, the inputs are quantized
+// to int8 values as well, and the products are accumulated as int32 values.
+class QuantizedLayer: public AbstractLayer {
+public:
+    QuantizedLayer(const Layer &layer, bool quantizeInputs = false);
+    
+    size_t neuronCount() const {
+        return weights.rows();
+    }
+    size_t inputCount() const {
+        return weights.columns();
+    }
+    const QuantizedMatrix &neuronWeights() const {
+        return weights;
+    }
+    
+    bool backpropagates() const override {
+        return false;
+    }
+    
+    const Vector &predict(NNContext &ctx, const Vector &input) override;
+    const Vector &feedforward(NNContext &ctx, const Vector &input) override;
+    const Vector &backpropagate(NNContext &ctx, const Vector &expectedOutput, const ErrorCriterion &criterion, bool backpropagateDown = true) override;
+    const Vector &backpropagate(NNContext &ctx, const Vector &errorInput, bool backpropagateDown = true) override;
+private:
+    QuantizedLayer(const QuantizedLayer&) = delete;
+    // Reports that the layer can't be trained and returns zero error outputs.
+    const Vector &inferenceOnly();
+    QuantizedMatrix weights;
+    Vector biases;
+    Vector activations;
+    // The quantized inputs and their scales, when the inputs are quantized.
+    Vector inputValues;
+    Vector inputScales;
+    // The zero errors returned when the layer is backpropagated.
+    Vector errorOutputs;
+    TransferFunction function;
+    bool quantizeInputs;
+};
+
+} // namespace nnFit
@@ -3,12 +3,14 @@
 #include "trainer.h"
 #include "errorCriterion.h"
 #include "optimizers/optimizer.h"
+#include "core/reduction.h"
 
 using namespace nnFit;
 
 Trainer::Trainer(Network &network, ErrorCriterion &criterion, Dataset &data, size_t parallelisationFactor) : network(network), criterion(criterion), data(data), trainingExampleCount(data.size()), parallelisationFactor(parallelisationFactor) {
     reshuffleIndices = false;
     profile = false;
+    replayTrainingSteps = false;
 }
 
 void Trainer::gradientDescent(Optimizer &opt, size_t iterations) {
@@ -19,11 +21,42 @@ void Trainer::miniBatchGradientDescent(Optimizer &opt, size_t iterations, size_t
     train(opt, iterations, miniBatchSize);
 }
 
+// Runs the given step, recording its commands the first time it's run and
+// replaying them afterwards. Steps that can't be replayed are always run.
+void Trainer::runStep(CommandRecording &recording, const std::function<void ()> &step) {
+    if (!replayTrainingSteps || !recording.isReplayable()) {
+        step();
+        return;
+    }
+    auto &queue = network.device().queue();
+    if (recording.isEmpty()) {
+        queue.startRecording();
+        step();
+        recording = queue.stopRecording();
+        return;
+    }
+    queue.replay(recording);
+}
+
 void Trainer::train(Optimizer &opt, size_t iterations, size_t miniBatchSize) {
-    Vector input(network.device(), data.inputSize() * parallelisationFactor);
-    Vector output(network.device(), data.outputSize() * parallelisationFactor);
-    Vector errors(network.device(), data.outputSize() * parallelisationFactor);
-    Vector errorSum(network.device(), 1);
+    // Two sets of batch buffers are used alternately so that on an out of order
+    // queue the upload of the next batch doesn't wait for the previous pass.
+    // The sparse inputs are uploaded as CSR batches, and only their non-zeros are multiplied.
+    auto sparseData = data.sparseInputs();
+    std::vector<Vector> inputs;
+    std::vector<SparseMatrix> sparseInputs;
+    inputs.reserve(2);
+    sparseInputs.reserve(2);
+    for (size_t i = 0; i < 2; ++i) {
+        if (sparseData)
+            sparseInputs.emplace_back(network.device(), parallelisationFactor, data.inputSize(), sparseData->maxNonzeros() * parallelisationFactor);
+        else
+            inputs.emplace_back(network.device(), data.inputSize() * parallelisationFactor, data.inputType());
+    }
+    Vector outputs[] = { Vector(network.device(), data.outputSize() * parallelisationFactor, data.outputType()), Vector(network.device(), data.outputSize() * parallelisationFactor, data.outputType()) };
+    size_t pass = 0;
+    Vector errors(network.device(), data.outputSize() * parallelisationFactor, data.outputType());
+    Vector errorSum(network.device(), 1, reductionType(Reduction::Sum, data.outputType()));
     std::vector<float> errs;
     
     auto weightsAndGradients = network.weightsAndGradients();
@@ -39,47 +72,98 @@ void Trainer::train(Optimizer &opt, size_t iterations, size_t miniBatchSize) {
     for (size_t i = 0; i < indices.size(); ++i)
         indices[i] = i;
     
+    // The first pass of every mini-batch overwrites the gradients instead of
+    // adding to them. They are zeroed only once, for the layers that don't
+    // compute their gradients.
+    for (auto &i : weightsAndGradients) {
+        i.second->zeros();
+    }
+    // The first pass of a mini-batch is recorded separately from the others.
+    CommandRecording passRecordings[2], optimizationRecording;
+    // The set of batch buffers that every pass was recorded with.
+    size_t recordedBuffers[2] = { 0, 0 };
+    
     std::chrono::high_resolution_clock::time_point iterationStart;
+    auto &device = network.device();
     for (size_t iteration = 0; iteration < iterations; ++iteration) {
-        // Reset errors
-        errors.zeros();
-        if (profile)
-            iterationStart = std::chrono::high_resolution_clock::now();
-        // Shuffle indices if needed
-        if (reshuffleIndices)
-            std::random_shuffle(indices.begin(), indices.end());
+        float iterationError;
+        {
+            InstrumentationScope iterationScope(device, "iteration");
+            // Reset errors
+            errors.zeros();
+            if (profile)
+                iterationStart = std::chrono::high_resolution_clock::now();
+            // Shuffle indices if needed
+            if (reshuffleIndices)
+                std::random_shuffle(indices.begin(), indices.end());
         
-        for (size_t batch = 0; batch < batchCount; ++batch) {
+            for (size_t batch = 0; batch < batchCount; ++batch) {
             
-            // Reset gradients
-            for (auto &i : weightsAndGradients) {
-                i.second->zeros();
-            }
-            
-            // Train
-            for (size_t i = 0; i < passPerBatchCount; ++i) {
-                data.get(indices[batch*passPerBatchCount + i]*parallelisationFactor, parallelisationFactor, input, output);
+                // Train
+                for (size_t i = 0; i < passPerBatchCount; ++i, ++pass) {
+                    size_t buffers = pass % 2;
+                    auto &output = outputs[buffers];
+                    {
+                        InstrumentationScope dataScope(device, "data.get");
+                        size_t first = indices[batch*passPerBatchCount + i]*parallelisationFactor;
+                        if (sparseData)
+                            sparseData->get(first, parallelisationFactor, sparseInputs[buffers], output);
+                        else
+                            data.get(first, parallelisationFactor, inputs[buffers], output);
+                    }
                 
-                const auto &prediction = network.feedforward(input);
-                criterion.computeError(network.context(), prediction, output, errors);
-                network.backpropagate(output, criterion);
-            }
+                    InstrumentationScope passScope(device, "pass");
+                    size_t kind = i == 0? 0 : 1;
+                    auto &passRecording = passRecordings[kind];
+                    if (passRecording.isEmpty())
+                        recordedBuffers[kind] = buffers;
+                    if (sparseData) {
+                        const auto &recorded = sparseInputs[recordedBuffers[kind]];
+                        const auto &input = sparseInputs[buffers];
+                        passRecording.bind(recorded.values().deviceStorage(), input.values().deviceStorage());
+                        passRecording.bind(recorded.columnIndices().deviceStorage(), input.columnIndices().deviceStorage());
+                        passRecording.bind(recorded.rowOffsets().deviceStorage(), input.rowOffsets().deviceStorage());
+                    } else {
+                        passRecording.bind(inputs[recordedBuffers[kind]].deviceStorage(), inputs[buffers].deviceStorage());
+                    }
+                    passRecording.bind(outputs[recordedBuffers[kind]].deviceStorage(), output.deviceStorage());
+                    runStep(passRecording, [&] () {
+                        const auto &prediction = sparseData? network.feedforward(sparseInputs[buffers]) : network.feedforward(inputs[buffers]);
+                        {
+                            InstrumentationScope errorScope(device, "computeError");
+                            criterion.computeError(network.context(), prediction, output, errors);
+                        }
+                        network.backpropagate(output, criterion, /* overwriteGradients= */ i == 0);
+                    });
+                }
             
-            // gradients = gradients / numberOfTrainingExamples
-            // Scale the gradients while optimizing to avoid redundant division step.
-            opt.optimize(weightsAndGradients, miniBatchSize);
-        }
+                InstrumentationScope optimizeScope(device, "optimize");
+                runStep(optimizationRecording, [&] () {
+                    // gradients = gradients / numberOfTrainingExamples
+                    // Scale the gradients while optimizing to avoid redundant division step.
+                    opt.optimize(weightsAndGradients, miniBatchSize);
+                    network.synchronizeWeights();
+                });
+            }
         
-        // Compute the iteration error.
-        partialSum(errorSum, errors);
-        errorSum.copy(errs);
-        float iterationError = errs[0] / float(trainingExampleCount);
+            // Compute the iteration error.
+            {
+                InstrumentationScope errorScope(device, "iterationError");
+                reduce(errorSum, Reduction::Sum, errors);
+                readFloats(errorSum, errs);
+                iterationError = errs[0] / float(trainingExampleCount);
+            }
+        }
         
         if (profile) {
             network.device().queue().finish();
             auto now = std::chrono::high_resolution_clock::now();
             auto seconds = std::chrono::duration_cast<std::chrono::seconds>(now - iterationStart).count();
             std::cout << "One training iteration ran for " << seconds << "s\n";
+            if (auto instrumentation = device.instrumentation()) {
+                instrumentation->writeReport(std::cout);
+                instrumentation->reset();
+            }
         }
         if (afterIteration) {
             afterIteration(iteration, iterationError);
@@ -14,6 +14,11 @@ public:
     std::function<void (size_t, float)> afterIteration;
     bool reshuffleIndices;
     bool profile;
+    // When set, the commands of the first training pass and of the first
+    // optimization step are recorded and replayed for the following ones.
+    // The replayed commands reuse the host state captured when they were
+    // recorded, so it's off by default.
+    bool replayTrainingSteps;
     
     Trainer(Network &network, ErrorCriterion &criterion, Dataset &data, size_t parallelisationFactor = 1);
     
@@ -26,6 +31,7 @@ public:
     
 private:
     void train(Optimizer &opt, size_t iterations, size_t miniBatchSize);
+    void runStep(CommandRecording &recording, const std::function<void ()> &step);
     Network &network;
     ErrorCriterion &criterion;
     Dataset &data;
@@ -3,27 +3,27 @@
 
 using namespace nnFit;
 
-static const Kernel &predictFunction(NNContext &ctx, TransferFunction::Kind kind) {
+static const Kernel &predictFunction(NNContext::Specialization &kernels, TransferFunction::Kind kind) {
     switch (kind) {
     case TransferFunction::Sigmoid:
-        return ctx.floatKernels.sigmoidPredict;
+        return kernels.sigmoidPredict;
     case TransferFunction::Tanh:
-        return ctx.floatKernels.tanhPredict;
+        return kernels.tanhPredict;
     case TransferFunction::RectifiedLinearUnit:
-        return ctx.floatKernels.reluPredict;
+        return kernels.reluPredict;
     default: break;
     }
     assert(false && "Invalid transfer function");
 }
 
-static const Kernel &feedforwardFunction(NNContext &ctx, TransferFunction::Kind kind) {
+static const Kernel &feedforwardFunction(NNContext::Specialization &kernels, TransferFunction::Kind kind) {
     switch (kind) {
     case TransferFunction::Sigmoid:
-        return ctx.floatKernels.sigmoidFeedforward;
+        return kernels.sigmoidFeedforward;
     case TransferFunction::Tanh:
-        return ctx.floatKernels.tanhFeedforward;
+        return kernels.tanhFeedforward;
     case TransferFunction::RectifiedLinearUnit:
-        return ctx.floatKernels.reluFeedforward;
+        return kernels.reluFeedforward;
     default: break;
     }
     assert(false && "Invalid transfer function");
@@ -32,7 +32,7 @@ static const Kernel &feedforwardFunction(NNContext &ctx, TransferFunction::Kind
 const Vector &TransferFunction::apply(NNContext &ctx, const Vector &input) const {
     if (kind == Linear)
         return input;
-    ctx.queue().enqueue1Dim(predictFunction(ctx, kind)(input), input.size());
+    ctx.queue().enqueue1Dim(predictFunction(ctx.kernels(input.type()), kind)(input), input.size());
     return input;
 }
 
@@ -43,6 +43,6 @@ const Vector &TransferFunction::apply(NNContext &ctx, const Vector &input, const
         derivative.ones();
         return input;
     }
-    ctx.queue().enqueue1Dim(feedforwardFunction(ctx, kind)(input, derivative), input.size());
+    ctx.queue().enqueue1Dim(feedforwardFunction(ctx.kernels(input.type()), kind)(input, derivative), input.size());
     return input;
 }
\ No newline at end of file
@@ -17,6 +17,10 @@ public:
     
     TransferFunction(Kind kind) : kind(kind) { }
     
+    Kind type() const {
+        return kind;
+    }
+    
     // Applies the transfer function to the given input vector and returns it.
     const Vector &apply(NNContext &ctx, const Vector &input) const;
     
@@ -1,14 +1,25 @@
 
-typedef float Scalar;
+// The program can be specialized with SCALAR, the type of the weights (float or double,
+// float by default).
 
-kernel void gradientDescent(global Scalar *weights, global Scalar *gradients, const float learningRate) {
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef SCALAR
+#define SCALAR float
+#endif
+
+typedef SCALAR Scalar;
+
+kernel void gradientDescent(global Scalar *weights, const global Scalar *gradients, const float learningRate) {
     size_t i = get_global_id(0);
     weights[i] = weights[i] - learningRate*gradients[i];
 }
 
-kernel void momentumGradientDescent(global Scalar *weights, global Scalar *gradients, global Scalar *velocity, const float learningRate, const float momentumDecay) {
+kernel void momentumGradientDescent(global Scalar *weights, const global Scalar *gradients, global Scalar *velocity, const float learningRate, const float momentumDecay) {
     size_t i = get_global_id(0);
     Scalar v = velocity[i]*momentumDecay - learningRate*gradients[i];
     weights[i] = weights[i] + v;
     velocity[i] = v;
-}
\ No newline at end of file
+}
@@ -2,6 +2,20 @@
 
 using namespace nnFit;
 
+// Returns the kernel that updates the weights of the given type. The double
+// kernels are built when they are used for the first time. The half layers
+// pass their float master weights and gradients.
+static const Kernel &updateKernel(Device &device, const ValueType &type, const char *name, const Kernel &kernel, Kernel &doubleKernel) {
+    assert((type == ValueType::Float || type == ValueType::Double) && "The optimizers update float or double weights");
+    if (type != ValueType::Double)
+        return kernel;
+    if (!doubleKernel) {
+        assert(device.supportsDoubles());
+        doubleKernel = Kernel(device.getProgram("gradientDescent.cl", BuildOptions().define("SCALAR", "double")), name);
+    }
+    return doubleKernel;
+}
+
 GradientDescent::GradientDescent(Device &device, float learningRate)
 : device(device), learningRate(learningRate) {
     kernel = Kernel(device.getProgram("gradientDescent.cl"), "gradientDescent");
@@ -14,8 +28,10 @@ void GradientDescent::optimize(const std::vector<std::pair<const Vector*, const
         const auto &weights = *i.first;
         const auto &gradients = *i.second;
         assert(weights.size() == gradients.size());
+        assert(weights.type() == gradients.type());
 
-        queue.enqueue1Dim(kernel(weights, gradients, k), weights.size());
+        const auto &update = updateKernel(device, weights.type(), "gradientDescent", kernel, doubleKernel);
+        queue.enqueue1Dim(update(weights, gradients, k), weights.size());
     }
 }
 
@@ -26,7 +42,7 @@ MomentumGradientDescent::MomentumGradientDescent(Device &device, float learningR
 void MomentumGradientDescent::optimize(const std::vector<std::pair<const Vector*, const Vector*>> &weightsAndGradients, size_t trainingExamples) {
     if (velocities.empty()) {
         for (const auto &i : weightsAndGradients) {
-            velocities.push_back(Vector(device, i.first->size()));
+            velocities.push_back(Vector(device, i.first->size(), i.first->type()));
             velocities.back().zeros();
         }
     }
@@ -37,7 +53,9 @@ void MomentumGradientDescent::optimize(const std::vector<std::pair<const Vector*
         const auto &weights = *weightsAndGradients[i].first;
         const auto &gradients = *weightsAndGradients[i].second;
         assert(weights.size() == gradients.size());
+        assert(weights.type() == gradients.type());
         
-        queue.enqueue1Dim(kernel(weights, gradients, velocities[i], k, momentumDecay), weights.size());
+        const auto &update = updateKernel(device, weights.type(), "momentumGradientDescent", kernel, doubleKernel);
+        queue.enqueue1Dim(update(weights, gradients, velocities[i], k, momentumDecay), weights.size());
     }
 }
\ No newline at end of file
@@ -12,7 +12,7 @@ public:
     
 private:
     Device &device;
-    Kernel kernel;
+    Kernel kernel, doubleKernel;
     float learningRate;
 };
     
@@ -23,7 +23,7 @@ public:
     void optimize(const std::vector<std::pair<const Vector*, const Vector*>> &weightsAndGradients, size_t trainingExamples) override;
 private:
     Device &device;
-    Kernel kernel;
+    Kernel kernel, doubleKernel;
     std::vector<Vector> velocities;
     float learningRate, momentumDecay;
 };
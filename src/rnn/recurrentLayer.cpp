@@ -44,7 +44,7 @@ const Vector &RecurrentLayer::feedforward(NNContext &ctx, const Vector &input) {
     const auto &derivatives = unrolledState[currentSequenceLength].derivatives;
     // activation = f(Wx + b)
     // derivative = f'(Wx + b)
-    return layer.transferFunction().apply(ctx, layer.predictLinear(ctx, mergeInput(input)), derivatives);
+    return layer.predictActivation(ctx, mergeInput(input), &derivatives);
 }
 
 RecurrentLayer::UnrolledState::UnrolledState(Device &device, size_t neuronCount, size_t inputSize) : input(device, inputSize), derivatives(device, neuronCount) {
@@ -1,12 +1,22 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
+#include <dirent.h>
+#include <unistd.h>
 #include "core/opencl.h"
 #include "core/vector.h"
 #include "core/random.h"
+#include "core/reduction.h"
+#include "core/expression.h"
+#include "core/quantization.h"
 #include "nn/network.h"
 #include "nn/dropout.h"
+#include "nn/quantizedLayer.h"
 #include "nn/trainer.h"
+#include "nn/dataParallelTrainer.h"
 #include "nn/errorCriterion.h"
 #include "nn/classificationEvaluator.h"
 #include "rnn/recurrentLayer.h"
@@ -47,11 +57,82 @@ static Device selectDevice() {
         else if (device.vendor().find("AMD") != std::string::npos)
             return std::move(device);
     }
-    if (devices.empty())
-        return std::move(Device::findAll()[0]);
+    if (!devices.empty())
+        return std::move(devices[0]);
+    devices = Device::findAll();
+    if (devices.empty()) {
+        // There's no OpenCL driver.
+        return Device::host();
+    }
     return std::move(devices[0]);
 }
 
+void testProgramCache(Device &device) {
+    // The host device doesn't build OpenCL programs.
+    if (device.isHost())
+        return;
+    // The second build of the same program should load the binary stored by the first one.
+    const char source[] = "kernel void cacheTest(global float *x) { x[get_global_id(0)] = 42.0f; }";
+    Program first(device, source, sizeof(source) - 1);
+    first.build("-DCACHE_TEST");
+    Program second(device, source, sizeof(source) - 1);
+    second.build("-DCACHE_TEST");
+    assert(second.isLoadedFromCache());
+    
+    Kernel kernel(second, "cacheTest");
+    Vector x(device, 4);
+    device.queue().enqueue1Dim(kernel(x), x.size());
+    assertEquals(x, {42.0f,42.0f,42.0f,42.0f});
+}
+
+void testProgramSpecialization(Device &device) {
+    // Every specialization of a program is built only once.
+    auto &generic = device.getProgram("generic.cl");
+    assert(&generic == &device.getProgram("generic.cl"));
+    auto &specialized = device.getProgram("generic.cl", BuildOptions().define("COLUMNS", size_t(100)).define("PART_SIZE", size_t(25)));
+    assert(&generic != &specialized);
+    
+    // The specialized and generic matrix by vector kernels should produce the same result.
+    auto &kernels = device.tensorKernels();
+    Matrix m(device, 400, 400);
+    m.identity();
+    Vector v(device, 400);
+    v.fill(42.0f);
+    Vector result(device, 400);
+    for (bool specialize : { false, true }) {
+        kernels.specializeMatrixShapes = specialize;
+        result.fill(0.0f);
+        mvmul(result, m, v, Range2D(4, 4));
+        assertEquals(result, std::vector<float>(result.size(), 42.0f));
+    }
+    assert(&kernels.shapeSpecialization(100, 25) == &kernels.shapeSpecialization(100, 25));
+}
+
+void testLazyKernels(Device &device) {
+    // The host device doesn't build OpenCL programs.
+    if (device.isHost())
+        return;
+    // Programs that are built at the same time are independent of each other.
+    const char first[] = "kernel void first(global float *x) { x[get_global_id(0)] = 1.0f; }";
+    const char second[] = "kernel void second(global float *x) { x[get_global_id(0)] += 2.0f; }";
+    Program a(device, first, sizeof(first) - 1);
+    Program b(device, second, sizeof(second) - 1);
+    a.buildAsync();
+    b.buildAsync();
+    
+    // The kernels are created on first use, after their program is built.
+    Kernel firstKernel(a, "first");
+    Kernel secondKernel(b, "second");
+    Vector x(device, 4);
+    device.queue().enqueue1Dim(firstKernel(x), x.size());
+    device.queue().enqueue1Dim(secondKernel(x), x.size());
+    assertEquals(x, {3.0f,3.0f,3.0f,3.0f});
+    
+    // The networks on the same device share their kernels.
+    Network n1(device), n2(device);
+    assert(&n1.context().floatKernels == &n2.context().floatKernels);
+}
+
 void testVectors(Device &device) {
     Vector x(device, {1.0f,2.0f,3.0f,4.0f});
     Vector y(device, {0.0f,1.0f,5.0f,10.0f});
@@ -104,6 +185,263 @@ void testVectors(Device &device) {
     assertEquals(x, {0.0f,2.0f,7.0f,13.0f});
 }
 
+void testOutOfOrderQueue(Device &device) {
+    CommandQueue queue(device, false, /* outOfOrder= */true);
+    auto &prevQueue = device.queue();
+    device.queue(queue);
+    
+    // Dependent operations must still observe each other's results.
+    Vector x(device, {1.0f,2.0f,3.0f,4.0f});
+    Vector y(device, {0.0f,1.0f,5.0f,10.0f});
+    Vector z(device, x.size());
+    Vector w(device, x.size());
+    add(z, x, y);
+    mul(w, x, 2.0f);
+    elementwiseMul(z, w);
+    assertEquals(z, {2.0f,12.0f,48.0f,112.0f});
+    
+    // Write after read.
+    x.copy(w);
+    x.fill(7.0f);
+    assertEquals(w, {1.0f,2.0f,3.0f,4.0f});
+    assertEquals(x, {7.0f,7.0f,7.0f,7.0f});
+    
+    // Explicit wait lists.
+    auto event = queue.enqueue1Dim(device.tensorKernels().floatKernels.fill(y, 3.0f), y.size());
+    queue.copy(y.deviceStorage(), z.deviceStorage(), y.size()*sizeof(float), 0, 0, { event });
+    assertEquals(z, {3.0f,3.0f,3.0f,3.0f});
+    
+    queue.finish();
+    device.queue(prevQueue);
+}
+
+void testMemoryPool(Device &device) {
+    // The host device allocates its buffers directly.
+    if (device.isHost())
+        return;
+    auto &pool = device.memoryPool();
+    {
+        // Buffers allocated next to each other in a slab mustn't overlap.
+        Vector x(device, 3);
+        Vector y(device, 5);
+        Vector z(device, 7);
+        x.fill(1.0f);
+        y.fill(2.0f);
+        z.fill(3.0f);
+        assertEquals(x, std::vector<float>(3, 1.0f));
+        assertEquals(y, std::vector<float>(5, 2.0f));
+        assertEquals(z, std::vector<float>(7, 3.0f));
+        auto stats = pool.statistics();
+        assert(stats.bytesInUse >= 15*sizeof(float));
+        assert(stats.bytesReserved >= stats.bytesInUse);
+        assert(stats.highWaterMark >= stats.bytesInUse);
+    }
+    device.queue().finish();
+    
+    // Freed blocks are reused instead of being carved out of the slab again. The slab
+    // only has room for a few blocks, so it would run out without the reuse.
+    const size_t blockSize = pool.alignment();
+    const size_t slabSize = 4*blockSize;
+    MemoryPool smallPool(device.context(), device.id(), slabSize);
+    size_t firstOffset = 0;
+    for (int i = 0; i < 100; ++i) {
+        cl_int error = CL_SUCCESS;
+        auto buffer = smallPool.allocate(blockSize, error);
+        assert(buffer && error == CL_SUCCESS);
+        size_t offset = 0;
+        clGetMemObjectInfo(buffer, CL_MEM_OFFSET, sizeof(offset), &offset, nullptr);
+        if (i == 0)
+            firstOffset = offset;
+        assert(offset == firstOffset);
+        clReleaseMemObject(buffer);
+    }
+    auto stats = smallPool.statistics();
+    assert(stats.bytesReserved == slabSize);
+    assert(stats.bytesInUse == 0);
+    assert(stats.highWaterMark == blockSize);
+}
+
+void testCommandRecording(Device &device) {
+    auto &queue = device.queue();
+    Vector x(device, {1.0f,2.0f,3.0f,4.0f});
+    Vector y(device, {0.0f,1.0f,5.0f,10.0f});
+    Vector dest(device, x.size());
+    
+    // dest = (x + y) * 2
+    queue.startRecording();
+    add(dest, x, y);
+    mul(dest, 2.0f);
+    auto recording = queue.stopRecording();
+    assert(recording.isReplayable());
+    assertEquals(dest, {2.0f,6.0f,16.0f,28.0f});
+    
+    dest.zeros();
+    queue.replay(recording);
+    assertEquals(dest, {2.0f,6.0f,16.0f,28.0f});
+    
+    // Replay with a different input.
+    Vector z(device, {1.0f,1.0f,1.0f,1.0f});
+    recording.bind(x.deviceStorage(), z.deviceStorage());
+    queue.replay(recording);
+    assertEquals(dest, {2.0f,4.0f,12.0f,22.0f});
+    
+    // Blocking reads can't be replayed.
+    queue.startRecording();
+    add(dest, x, y);
+    std::vector<float> values;
+    dest.copy(values);
+    assert(!queue.stopRecording().isReplayable());
+}
+
+void testProfiler(Device &device) {
+    // The host device doesn't have profiling events.
+    if (device.isHost())
+        return;
+    CommandQueue queue(device, /* profile= */true);
+    auto &prevQueue = device.queue();
+    device.queue(queue);
+    Vector x(device, {1.0f,2.0f,3.0f,4.0f});
+    Vector dest(device, 4);
+    for (int i = 0; i < 10; ++i)
+        mul(dest, x, 2.0f);
+    queue.finish();
+    device.queue(prevQueue);
+    
+    auto &profiler = queue.profiler();
+    const auto &launches = profiler.launches();
+    assert(launches.size() == 10);
+    for (const auto &launch : launches) {
+        assert(launch.queued <= launch.submitted);
+        assert(launch.started <= launch.ended);
+        assert(launch.dimensions == 1 && launch.globalSize[0] == 4);
+        assert(launch.arguments.size() == 3);
+        assert(launch.arguments[1] == std::to_string(2.0f));
+    }
+    auto stats = profiler.statistics();
+    assert(stats.size() == 1);
+    auto &kernelStats = stats.begin()->second;
+    assert(kernelStats.invocations == 10);
+    assert(kernelStats.median <= kernelStats.p99);
+    
+    std::stringstream trace;
+    profiler.writeChromeTrace(trace);
+    assert(trace.str().find("\"traceEvents\"") != std::string::npos);
+    assert(trace.str().find(launches[0].name) != std::string::npos);
+    
+    // The replayed launches keep the arguments that were recorded.
+    device.queue(queue);
+    queue.startRecording();
+    mul(dest, x, 3.0f);
+    auto recording = queue.stopRecording();
+    queue.replay(recording);
+    queue.finish();
+    device.queue(prevQueue);
+    assert(profiler.launches().size() == 12);
+    assert(profiler.launches().back().arguments.size() == 3);
+    assert(profiler.launches().back().arguments[1] == std::to_string(3.0f));
+}
+
+// Returns a new empty directory for the files of a test.
+static std::string temporaryDirectory() {
+    auto tmp = std::getenv("TMPDIR");
+    std::string path = std::string(tmp && *tmp? tmp : "/tmp") + "/nnFitTest.XXXXXX";
+    assert(mkdtemp(&path[0]));
+    return path;
+}
+
+static void removeDirectory(const std::string &path) {
+    if (auto dir = opendir(path.c_str())) {
+        while (auto entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..")
+                unlink((path + "/" + name).c_str());
+        }
+        closedir(dir);
+    }
+    rmdir(path.c_str());
+}
+
+void testKernelTuner(Device &device) {
+    // The host device doesn't use the work-group sizes.
+    if (device.isHost())
+        return;
+    auto directory = temporaryDirectory();
+    // The sizes stored by the test mustn't be used by the other tests.
+    auto previousTuner = device.kernelTuner(std::unique_ptr<KernelTuner>(new KernelTuner(device)));
+    Vector x(device, 4096);
+    Vector y(device, 4096);
+    x.ones();
+    y.ones();
+    auto &queue = device.queue();
+    queue.startRecording();
+    add(x, y);
+    auto recording = queue.stopRecording();
+    const auto &elementAdd = device.tensorKernels().floatKernels.elementAdd;
+    
+    // The second tuner should load the work-group size stored by the first one.
+    size_t globalSize[] = { x.size() };
+    size_t workgroupSize[1], loadedWorkgroupSize[1];
+    {
+        KernelTuner tuner(device, directory);
+        tuner.tune(recording);
+        assert(tuner.find(elementAdd, 1, globalSize, workgroupSize));
+    }
+    {
+        KernelTuner tuner(device, directory);
+        assert(tuner.find(elementAdd, 1, globalSize, loadedWorkgroupSize));
+        assert(workgroupSize[0] == loadedWorkgroupSize[0]);
+        size_t otherGlobalSize[] = { 1024 };
+        assert(!tuner.find(elementAdd, 1, otherGlobalSize, workgroupSize));
+        // The kernels of the other specializations of the program are tuned separately.
+        const auto &halfElementAdd = device.tensorKernels().kernels(ValueType(ValueType::Half)).elementAdd;
+        assert(!tuner.find(halfElementAdd, 1, globalSize, workgroupSize));
+    }
+    removeDirectory(directory);
+    
+    // The launches without a work-group size use the tuned one.
+    size_t tunedWorkgroupSize[] = { 4 };
+    device.kernelTuner().store(elementAdd, 1, globalSize, tunedWorkgroupSize);
+    x.ones();
+    add(x, y);
+    assertEquals(x, std::vector<float>(x.size(), 2.0f));
+    
+    // Layers tune their matrix multiplication and the kernels of a training pass.
+    Layer layer(device, 20, 16, TransferFunction::Sigmoid);
+    layer.tune();
+    size_t shape[] = { 20, 16 };
+    size_t mvmulWorkgroupSize[2];
+    assert(device.kernelTuner().findParameters("mvmul", 2, shape, mvmulWorkgroupSize));
+    assertEquals(layer.neuronWeightGradients(), std::vector<float>(20*16, 0.0f));
+    device.kernelTuner(std::move(previousTuner));
+}
+
+void testHostStorage(Device &device) {
+    for (auto location : { StorageLocation::Device, StorageLocation::Host, StorageLocation::SharedVirtualMemory }) {
+        Vector x(device, 4, ValueType(ValueType::Float), location);
+        {
+            auto values = x.map<float>();
+            assert(values.size() == 4);
+            for (size_t i = 0; i < values.size(); ++i)
+                values[i] = float(i);
+        }
+        Vector y(device, {1.0f,1.0f,1.0f,1.0f});
+        Vector dest(device, 4);
+        add(dest, x, y);
+        assertEquals(dest, {1.0f,2.0f,3.0f,4.0f});
+        
+        // The mapping waits for the kernels that use the vector.
+        add(x, x, y);
+        auto values = x.map<float>();
+        assert(values[3] == 4.0f);
+    }
+    
+    // The resized storage stays in the same location.
+    Matrix m(device, StorageLocation::Host);
+    m.resize(2, 2);
+    assert(m.location() == StorageLocation::Host);
+    assert(m.deviceStorage().location() != StorageLocation::Device);
+}
+
 void testSum(Device &device) {
     Vector x(device, {1.0f,2.0f,3.0f,4.0f});
     Vector single(device, 1);
@@ -119,6 +457,360 @@ void testSum(Device &device) {
     assertEquals(x, {6.0f, 15.0f, 24.0f, 33.0f});
 }
 
+void testReductions(Device &device) {
+    Vector x(device, {3.0f,-1.0f,4.0f,1.0f,-5.0f,9.0f,2.0f,9.0f,0.0f});
+    Vector y(device, {1.0f,2.0f,3.0f,4.0f,5.0f,6.0f,7.0f,8.0f,9.0f});
+    Vector result(device, 1);
+    Vector index(device, 1, ValueType(ValueType::Uint32));
+    reduce(result, Reduction::Sum, x);
+    assertEquals(result, {22.0f});
+    reduce(result, Reduction::Max, x);
+    assertEquals(result, {9.0f});
+    reduce(result, Reduction::Min, x);
+    assertEquals(result, {-5.0f});
+    reduce(index, Reduction::ArgMax, x);
+    assertEquals(index, {uint32_t(5)});
+    dot(result, x, y);
+    assertEquals(result, {3.0f-2.0f+12.0f+4.0f-25.0f+54.0f+14.0f+72.0f});
+    reduce(index, Reduction::CountNonzero, x);
+    assertEquals(index, {uint32_t(8)});
+    Vector v(device, {3.0f,4.0f});
+    reduce(result, Reduction::L2Norm, v);
+    assertEquals(result, {5.0f});
+    
+    // Large enough for two stages.
+    {
+        size_t size = 100000;
+        std::vector<float> values(size);
+        for (size_t i = 0; i < size; ++i)
+            values[i] = float(i % 100);
+        values[70001] = 500.0f;
+        values[90000] = 500.0f;
+        values[123] = 0.0f;
+        Vector large(device, size);
+        large.write(values);
+        reduce(result, Reduction::Sum, large);
+        assertEquals(result, {4950976.0f});
+        reduce(result, Reduction::Max, large);
+        assertEquals(result, {500.0f});
+        reduce(index, Reduction::ArgMax, large);
+        assertEquals(index, {uint32_t(70001)});
+        reduce(index, Reduction::CountNonzero, large);
+        assertEquals(index, {uint32_t(size - 1000)});
+    }
+    
+    // Integer vectors are reduced with uint32 accumulators.
+    {
+        size_t size = 5000;
+        std::vector<uint8_t> values(size);
+        for (size_t i = 0; i < size; ++i)
+            values[i] = uint8_t(i % 3);
+        Vector bytes(device, size, ValueType(ValueType::Uint8));
+        bytes.write(values);
+        Vector sum(device, 1, ValueType(ValueType::Uint32));
+        reduce(sum, Reduction::Sum, bytes);
+        assertEquals(sum, {uint32_t(4999)});
+        reduce(sum, Reduction::Max, bytes);
+        assertEquals(sum, {uint32_t(2)});
+        reduce(sum, Reduction::CountNonzero, bytes);
+        assertEquals(sum, {uint32_t(3333)});
+    }
+
+    // The signed bytes are reduced with int32 accumulators.
+    {
+        size_t size = 5000;
+        std::vector<int8_t> values(size);
+        for (size_t i = 0; i < size; ++i)
+            values[i] = int8_t(int(i % 5) - 3);
+        Vector bytes(device, size, ValueType(ValueType::Int8));
+        bytes.write(values);
+        Vector sum(device, 1, ValueType(ValueType::Int32));
+        reduce(sum, Reduction::Sum, bytes);
+        assertEquals(sum, {int32_t(-5000)});
+        reduce(sum, Reduction::Min, bytes);
+        assertEquals(sum, {int32_t(-3)});
+        reduce(sum, Reduction::Max, bytes);
+        assertEquals(sum, {int32_t(1)});
+        Vector negative(device, 3, ValueType(ValueType::Int8));
+        negative.write(std::vector<int8_t>{-7, -2, -9});
+        reduce(sum, Reduction::Max, negative);
+        assertEquals(sum, {int32_t(-2)});
+    }
+}
+
+void testExpressions(Device &device) {
+    Vector x(device, {1.0f,2.0f,3.0f,4.0f});
+    Vector y(device, {2.0f,0.0f,1.0f,3.0f});
+    Vector z(device, {1.0f,5.0f,2.0f,2.0f});
+    Vector result(device, 4);
+    auto &expressions = device.shared<Expressions>();
+    auto kernelCount = expressions.kernelCount();
+    evaluate(result, x * 2.0f + y * z);
+    assertEquals(result, {4.0f,4.0f,8.0f,14.0f});
+    assert(expressions.kernelCount() == kernelCount + 1);
+    
+    // The expressions with the same structure share a kernel.
+    evaluate(result, z * 0.5f + x * y);
+    assertEquals(result, {2.5f,2.5f,4.0f,13.0f});
+    assert(expressions.kernelCount() == kernelCount + 1);
+    
+    evaluate(result, max(-x, y - 2.0f) / 2.0f);
+    assertEquals(result, {0.0f,-1.0f,-0.5f,0.5f});
+    evaluate(result, sqrt(x * x) + exp(y - y) - log(z / z));
+    assertEquals(result, {2.0f,3.0f,4.0f,5.0f});
+    
+    // The destination can be one of the operands.
+    evaluate(x, x - y * 0.5f);
+    assertEquals(x, {0.0f,2.0f,2.5f,2.5f});
+    
+    // Smaller vectors are repeated.
+    Vector vectors(device, {1.0f,2.0f,3.0f,4.0f,5.0f,6.0f,7.0f,8.0f});
+    Vector sums(device, 8);
+    evaluate(sums, vectors + z);
+    assertEquals(sums, {2.0f,7.0f,5.0f,6.0f,6.0f,11.0f,9.0f,10.0f});
+}
+
+void testHalfStorage(Device &device) {
+    // The host device only has the float kernels.
+    if (device.isHost())
+        return;
+    // The values are exact in half precision.
+    Vector x(device, {0.5f,-1.25f,3.0f,1000.0f});
+    Vector hx(device, 4, ValueType(ValueType::Half));
+    convert(hx, x);
+    Vector result(device, 4);
+    convert(result, hx);
+    assertEquals(result, {0.5f,-1.25f,3.0f,1000.0f});
+    
+    // The elementwise operations are computed in float and stored as halfs.
+    add(hx, hx);
+    mul(hx, 0.5f);
+    Vector hy(device, 4, ValueType(ValueType::Half));
+    hy.fill(2.0f);
+    elementwiseMul(hx, hy);
+    convert(result, hx);
+    assertEquals(result, {1.0f,-2.5f,6.0f,2000.0f});
+    Vector sum(device, 1);
+    reduce(sum, Reduction::Sum, hx);
+    assertEquals(sum, {2004.5f});
+    
+    Vector vectors(device, {1.0f,2.0f,3.0f,4.0f,5.0f,6.0f,7.0f,8.0f});
+    Vector hvectors(device, 8, ValueType(ValueType::Half));
+    convert(hvectors, vectors);
+    sumVectors(hx, hvectors, 0.0f);
+    convert(result, hx);
+    assertEquals(result, {6.0f,8.0f,10.0f,12.0f});
+    
+    // The half matrix multiplications match the float ones. All the products
+    // and sums are small integers, so they are exact in both.
+    const size_t rows = 37, columns = 64, vectorCount = 9;
+    std::vector<float> matrix(rows*columns), inputs(columns*vectorCount);
+    for (size_t i = 0; i < matrix.size(); ++i)
+        matrix[i] = float(i % 5);
+    for (size_t i = 0; i < inputs.size(); ++i)
+        inputs[i] = float(i % 3);
+    Matrix m(device, rows, columns);
+    m.write(matrix);
+    Matrix hm(device, rows, columns, ValueType(ValueType::Half));
+    convert(hm, m);
+    Vector input(device, columns*vectorCount);
+    input.write(inputs);
+    Vector hinput(device, columns*vectorCount, ValueType(ValueType::Half));
+    convert(hinput, input);
+    Vector expected(device, rows*vectorCount), output(device, rows*vectorCount);
+    Vector houtput(device, rows*vectorCount, ValueType(ValueType::Half));
+    std::vector<float> expectedValues;
+    parallelMvmul(expected, m, input);
+    expected.copy(expectedValues);
+    parallelMvmul(houtput, hm, hinput);
+    convert(output, houtput);
+    assertEquals(output, expectedValues);
+    if (supportsMmul(device)) {
+        houtput.zeros();
+        mmul(houtput, hm, hinput);
+        convert(output, houtput);
+        assertEquals(output, expectedValues);
+    }
+
+    // The half layers are optimized through float master weights and gradients, so
+    // the steps below the half precision of a weight still add up.
+    Network net(device);
+    auto halfLayer = new Layer(device, 2, 3, TransferFunction::Sigmoid, 1, ValueType::Half);
+    net.add(std::unique_ptr<Layer>(halfLayer));
+    net.add(std::unique_ptr<Layer>(new Layer(device, 1, 2, TransferFunction::Sigmoid)));
+    net.init(/* seed= */7);
+    auto parameters = net.weightsAndGradients();
+    for (const auto &parameter : parameters) {
+        assert(parameter.first->type() == ValueType::Float && parameter.second->type() == ValueType::Float);
+        writeFloats(*parameter.first, std::vector<float>(parameter.first->size(), 0.5f));
+        writeFloats(*parameter.second, std::vector<float>(parameter.second->size(), 1.0f));
+    }
+    net.synchronizeWeights();
+    // The halfs next to 0.5 are 2^-12 below and 2^-11 above it, so every step alone is rounded away.
+    GradientDescent opt(device, 1e-4f);
+    for (int i = 0; i < 10; ++i)
+        opt.optimize(parameters, 1);
+    net.synchronizeWeights();
+    std::vector<float> halfWeights;
+    readFloats(halfLayer->storedWeights(), halfWeights);
+    for (auto w : halfWeights)
+        assert(std::abs(w - 0.499f) < 2.5e-4f);
+    // The weights written through the layer aren't overwritten by the master weights.
+    assert(halfLayer->neuronWeights().type() == ValueType::Float);
+    writeFloats(halfLayer->neuronWeights(), { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f });
+    net.synchronizeWeights();
+    readFloats(halfLayer->storedWeights(), halfWeights);
+    assert(halfWeights == std::vector<float>({ 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f }));
+
+    // The transfer functions of the half vectors use the half network kernels.
+    Vector activations(device, {-1.0f, 0.0f, 2.0f});
+    Vector hactivations(device, 3, ValueType(ValueType::Half)), hderivatives(device, 3, ValueType(ValueType::Half));
+    convert(hactivations, activations);
+    TransferFunction(TransferFunction::RectifiedLinearUnit).apply(net.context(), hactivations, hderivatives);
+    convert(activations, hactivations);
+    assertEquals(activations, {0.0f, 0.0f, 2.0f});
+    convert(activations, hderivatives);
+    assertEquals(activations, {0.0f, 0.0f, 1.0f});
+}
+
+void testDoublePrecision(Device &device) {
+    if (!device.supportsDoubles())
+        return;
+    // The values aren't representable as floats.
+    Vector x(device, 3, ValueType(ValueType::Double));
+    x.write(std::vector<double>{1.0 + 1e-12, -3.0 - 1e-10, 16777217.0});
+    add(x, x);
+    assertEquals(x, std::vector<double>{2.0 + 2e-12, -6.0 - 2e-10, 33554434.0});
+    Vector floats(device, {0.5f,-2.0f,3.0f});
+    convert(x, floats);
+    Vector result(device, 3);
+    convert(result, x);
+    assertEquals(result, {0.5f,-2.0f,3.0f});
+    
+    // The double sums are accumulated in double precision.
+    std::vector<double> values(1000);
+    double expectedSum = 0.0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = double(1 << 30) + double(i);
+        expectedSum += values[i];
+    }
+    Vector y(device, values.size(), ValueType(ValueType::Double));
+    y.write(values);
+    Vector sum(device, 1, ValueType(ValueType::Double));
+    reduce(sum, Reduction::Sum, y);
+    assertEquals(sum, std::vector<double>{expectedSum});
+    
+    // The gradients of a double network match the central differences of its error.
+    Network net(device);
+    net.add(std::unique_ptr<Layer>(new Layer(device, 3, 2, TransferFunction::Sigmoid, 1, ValueType::Double)));
+    net.add(std::unique_ptr<Layer>(new Layer(device, 1, 3, TransferFunction::Tanh, 1, ValueType::Double)));
+    net.init(/* seed= */7);
+    Vector input(device, 2, ValueType(ValueType::Double));
+    input.write(std::vector<double>{0.3, -0.7});
+    Vector expected(device, 1, ValueType(ValueType::Double));
+    expected.write(std::vector<double>{0.5});
+    MSECriterion criterion;
+    net.feedforward(input);
+    net.backpropagate(expected, criterion, /* overwriteGradients= */ true);
+    // The MSE criterion computes the gradients of error = (prediction - expected)^2 / 2.
+    auto error = [&] () {
+        std::vector<double> prediction;
+        net.predict(input).copy(prediction);
+        return (prediction[0] - 0.5) * (prediction[0] - 0.5) / 2.0;
+    };
+    const double epsilon = 1e-6;
+    for (const auto &i : net.weightsAndGradients()) {
+        std::vector<double> weights, gradients;
+        i.first->copy(weights);
+        i.second->copy(gradients);
+        for (size_t j = 0; j < weights.size(); ++j) {
+            auto w = weights[j];
+            weights[j] = w + epsilon;
+            i.first->write(weights);
+            auto errorAbove = error();
+            weights[j] = w - epsilon;
+            i.first->write(weights);
+            auto errorBelow = error();
+            weights[j] = w;
+            i.first->write(weights);
+            assert(std::abs((errorAbove - errorBelow) / (2.0 * epsilon) - gradients[j]) < 1e-8);
+        }
+    }
+}
+
+void testQuantization(Device &device) {
+    // The host device only has the float kernels.
+    if (device.isHost())
+        return;
+    // The number of columns isn't a multiple of 4.
+    const size_t rows = 5, columns = 7;
+    std::vector<float> matrix(rows*columns);
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < columns; ++j)
+            matrix[i*columns + j] = (float(j) - 2.0f) * float(i + 1) * 0.1f;
+    }
+    Matrix m(device, rows, columns);
+    m.write(matrix);
+    QuantizedMatrix q(device, rows, columns);
+    q.quantize(m);
+    Matrix dequantized(device, rows, columns);
+    q.dequantize(dequantized);
+    std::vector<float> values, scales;
+    dequantized.copy(values);
+    q.scales().copy(scales);
+    // Every element is within half a step of its row.
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < columns; ++j)
+            assert(std::abs(values[i*columns + j] - matrix[i*columns + j]) <= scales[i] * 0.501f);
+    }
+    
+    std::vector<float> biases(rows);
+    for (size_t i = 0; i < rows; ++i)
+        biases[i] = float(i) - 2.0f;
+    Vector bias(device, rows);
+    bias.write(biases);
+    // The matrix vector and the tiled matrix multiplications match the host.
+    for (size_t vectorCount : { 3, 20 }) {
+        std::vector<float> inputs(columns*vectorCount);
+        for (size_t i = 0; i < inputs.size(); ++i)
+            inputs[i] = float(i % 11) * 0.25f - 1.0f;
+        Vector x(device, inputs.size());
+        x.write(inputs);
+        Vector result(device, rows*vectorCount);
+        std::vector<float> output;
+        quantizedMmul(result, q, x, bias);
+        result.copy(output);
+        for (size_t v = 0; v < vectorCount; ++v) {
+            for (size_t i = 0; i < rows; ++i) {
+                float expected = biases[i];
+                for (size_t j = 0; j < columns; ++j)
+                    expected += values[i*columns + j] * inputs[v*columns + j];
+                assert(std::abs(output[v*rows + i] - expected) < 1e-4f);
+            }
+        }
+        
+        // The int8 vectors are multiplied with int32 accumulation.
+        Vector qx(device, inputs.size(), ValueType(ValueType::Int8));
+        Vector qxScales(device, vectorCount);
+        quantizeVectors(qx, qxScales, x);
+        std::vector<int8_t> inputValues;
+        std::vector<float> inputScales;
+        qx.copy(inputValues);
+        qxScales.copy(inputScales);
+        output.clear();
+        quantizedMmul(result, q, qx, qxScales, bias);
+        result.copy(output);
+        for (size_t v = 0; v < vectorCount; ++v) {
+            for (size_t i = 0; i < rows; ++i) {
+                float expected = biases[i];
+                for (size_t j = 0; j < columns; ++j)
+                    expected += values[i*columns + j] * inputScales[v] * float(inputValues[v*columns + j]);
+                assert(std::abs(output[v*rows + i] - expected) < 1e-4f);
+            }
+        }
+    }
+}
+
 Matrix ones(Device &device, size_t rows, size_t columns) {
     Matrix m(device, rows, columns);
     m.ones();
@@ -188,7 +880,37 @@ void testBLAS(Device &device) {
         parallelMvmul(result, m, v, Range2D(4, 4));
         assertEquals(result, vs);
     }
-    
+    {
+        // Use the vectorized version with the columns that don't fill a vector,
+        // like the 784 pixels and the bias column of MNIST.
+        const size_t rows = 7, columns = 785, vectorCount = 3;
+        std::vector<float> ms(rows*columns), vs(columns*vectorCount), expected(rows*vectorCount, 0.0f);
+        for (size_t i = 0; i < ms.size(); ++i)
+            ms[i] = float(int(i % 5) - 2);
+        for (size_t i = 0; i < vs.size(); ++i)
+            vs[i] = float(i % 3);
+        for (size_t v = 0; v < vectorCount; ++v) {
+            for (size_t i = 0; i < rows; ++i) {
+                for (size_t j = 0; j < columns; ++j)
+                    expected[v*rows + i] += ms[i*columns + j] * vs[v*columns + j];
+            }
+        }
+        Matrix m(device, rows, columns);
+        m.write(ms);
+        Vector v(device, vs.size());
+        v.write(vs);
+        Vector x(device, columns);
+        x.write(std::vector<float>(vs.begin(), vs.begin() + columns));
+        Vector result(device, rows);
+        for (const auto &workgroupSizes : { Range2D(), Range2D(1, 5), Range2D(1, 1) }) {
+            mvmul(result, m, x, workgroupSizes);
+            assertEquals(result, std::vector<float>(expected.begin(), expected.begin() + rows));
+        }
+        Vector results(device, rows*vectorCount);
+        parallelMvmul(results, m, v, Range2D(1, 5));
+        assertEquals(results, expected);
+    }
+
     // Transposed matrix by vector multiplication
     {
         Vector result(device, 3);
@@ -197,6 +919,182 @@ void testBLAS(Device &device) {
     }
 }
 
+// Prints the GFLOP/s of the batched matrix vector multiplication and the tiled matrix multiplication.
+void benchmarkMatrixMul(Device &device, size_t rows, size_t columns, size_t vectorCount) {
+    const size_t iterations = 20;
+    Matrix m(device, rows, columns);
+    m.ones();
+    Vector x(device, columns*vectorCount);
+    x.ones();
+    Vector result(device, rows*vectorCount);
+    auto matrixVectorTime = device.profile([&] () {
+        for (size_t i = 0; i < iterations; ++i)
+            parallelMvmul(result, m, x);
+    });
+    auto matrixTime = device.profile([&] () {
+        for (size_t i = 0; i < iterations; ++i)
+            mmul(result, m, x);
+    });
+    // The times are in milliseconds.
+    double flops = 2.0 * rows * columns * vectorCount * iterations;
+    std::cout << rows << " by " << columns << " matrix, " << vectorCount << " vectors: parallelMvmul " << flops / (matrixVectorTime * 1.0e6) << " GFLOP/s, mmul " << flops / (matrixTime * 1.0e6) << " GFLOP/s\n";
+}
+
+void testMatrixMul(Device &device) {
+    if (!supportsMmul(device))
+        return;
+    // The shape isn't a multiple of the tile sizes in any dimension.
+    const size_t rows = 37, columns = 50, vectorCount = 45;
+    std::vector<float> matrix(rows*columns), vectors(columns*vectorCount), expected(rows*vectorCount, 0.0f);
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < columns; ++j)
+            matrix[i*columns + j] = float((i + j) % 5);
+    }
+    for (size_t v = 0; v < vectorCount; ++v) {
+        for (size_t j = 0; j < columns; ++j)
+            vectors[v*columns + j] = float((v*3 + j) % 7);
+    }
+    for (size_t v = 0; v < vectorCount; ++v) {
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j < columns; ++j)
+                expected[v*rows + i] += matrix[i*columns + j] * vectors[v*columns + j];
+        }
+    }
+    Matrix m(device, rows, columns);
+    m.write(matrix);
+    Vector x(device, columns*vectorCount);
+    x.write(vectors);
+    Vector result(device, rows*vectorCount);
+    mmul(result, m, x);
+    assertEquals(result, expected);
+    
+    // The transposed multiplication of the results should match the host as well.
+    std::vector<float> transposed(columns*vectorCount, 0.0f);
+    for (size_t v = 0; v < vectorCount; ++v) {
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j < columns; ++j)
+                transposed[v*columns + j] += matrix[i*columns + j] * expected[v*rows + i];
+        }
+    }
+    Vector transposedResult(device, columns*vectorCount);
+    transposeMmul(transposedResult, m, result);
+    assertEquals(transposedResult, transposed);
+    
+    // The bias, the transfer function and its derivative are applied by the epilogue.
+    std::vector<float> biases(rows), activations(rows*vectorCount), derivatives(rows*vectorCount);
+    for (size_t i = 0; i < rows; ++i)
+        biases[i] = -float(i % 3) * 100.0f;
+    for (size_t v = 0; v < vectorCount; ++v) {
+        for (size_t i = 0; i < rows; ++i) {
+            float linear = expected[v*rows + i] + biases[i];
+            activations[v*rows + i] = std::max(linear, 0.0f);
+            derivatives[v*rows + i] = linear > 0.0f? 1.0f : 0.0f;
+        }
+    }
+    Vector bias(device, rows);
+    bias.write(biases);
+    Vector derivative(device, rows*vectorCount);
+    Epilogue epilogue(&bias, Epilogue::RectifiedLinearUnit, &derivative);
+    mmul(result, m, x, epilogue);
+    assertEquals(result, activations);
+    assertEquals(derivative, derivatives);
+    derivative.zeros();
+    parallelMvmul(result, m, x, Range2D(), epilogue);
+    assertEquals(result, activations);
+    assertEquals(derivative, derivatives);
+    
+    // The layers of the MNIST network.
+    for (size_t batch : { 1, 8, 32, 128 }) {
+        benchmarkMatrixMul(device, 400, 784, batch);
+        benchmarkMatrixMul(device, 10, 400, batch);
+    }
+}
+
+void testMatrixViews(Device &device) {
+    // A 4 by 6 matrix and the products of its blocks computed on the host.
+    const size_t rows = 4, columns = 6;
+    std::vector<float> data(rows*columns);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = float(int(i % 7) - 3);
+    Matrix m(device, rows, columns);
+    m.write(data);
+    MatrixView view(m);
+    assert(m.row(1, 2).size() == m.leadingDimension() + columns && m.row(1, 2).offset() == m.leadingDimension());
+    assert(m.row(2, 0).size() == 0 && m.row(rows, 0).size() == 0);
+    
+    // The block of the rows 1-2 and the columns 2-4.
+    auto block = view.block(1, 2, 2, 3);
+    assert(block.rows() == 2 && block.columns() == 3 && block.leadingDimension() == columns);
+    Vector x(device, { 1.0f, 2.0f, 3.0f });
+    Vector result(device, 2);
+    mvmul(result, block, x);
+    std::vector<float> expected(2, 0.0f);
+    for (size_t i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < 3; ++j)
+            expected[i] += data[(1 + i)*columns + 2 + j] * float(j + 1);
+    }
+    assertEquals(result, expected);
+    
+    // The transposed block is multiplied by the transposed kernels.
+    Vector y(device, { 1.0f, -1.0f });
+    Vector transposed(device, 3);
+    mvmul(transposed, block.transpose(), y);
+    std::vector<float> expectedTransposed(3);
+    for (size_t j = 0; j < 3; ++j)
+        expectedTransposed[j] = data[columns + 2 + j] - data[2*columns + 2 + j];
+    assertEquals(transposed, expectedTransposed);
+    // A block of a transposed view is the transpose of a block.
+    auto column = view.transpose().block(2, 1, 3, 2);
+    assert(column.isTransposed() && column.offset() == block.offset());
+    mvmul(transposed, column, y);
+    assertEquals(transposed, expectedTransposed);
+    
+    // The rows of a padded matrix start at multiples of 32 bytes.
+    Matrix padded(device, rows, columns, ValueType::Float, 32);
+    assert(padded.leadingDimension() == 8 && padded.size() == rows*8);
+    assertEquals(padded, std::vector<float>(rows*8, 0.0f));
+    std::vector<float> paddedData(rows*8, 0.0f);
+    for (size_t i = 0; i < rows; ++i)
+        std::copy(data.begin() + i*columns, data.begin() + (i + 1)*columns, paddedData.begin() + i*8);
+    padded.write(paddedData);
+    Vector ones(device, columns);
+    ones.ones();
+    Vector dense(device, rows), aligned(device, rows);
+    mvmul(dense, m, ones);
+    mvmul(aligned, padded, ones);
+    std::vector<float> denseSums, alignedSums;
+    dense.copy(denseSums);
+    aligned.copy(alignedSums);
+    assertEquals(denseSums, alignedSums.data(), alignedSums.size());
+    padded.identity();
+    std::vector<float> eye;
+    padded.copy(eye);
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < 8; ++j)
+            assert(eye[i*8 + j] == (i == j? 1.0f : 0.0f));
+    }
+    
+    if (!supportsMmul(device))
+        return;
+    // The tiled kernels read and write the blocks in place.
+    Vector vectors(device, { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f });
+    Vector products(device, 4);
+    mmul(products, block, vectors);
+    Vector reference(device, 4);
+    parallelMvmul(reference, block, vectors);
+    std::vector<float> tiled, batched;
+    products.copy(tiled);
+    reference.copy(batched);
+    assertEquals(tiled, batched.data(), batched.size());
+    
+    // sum(x[v] * transpose(y[v])) is written to the block, and its transpose to the transposed view.
+    m.zeros();
+    outerProductSum(block, Vector(device, { 1.0f, 2.0f }), Vector(device, { 1.0f, 0.0f, -1.0f }), 0.0f);
+    assertEquals(m, { 0.0f,0.0f,0.0f,0.0f,0.0f,0.0f, 0.0f,0.0f,1.0f,0.0f,-1.0f,0.0f, 0.0f,0.0f,2.0f,0.0f,-2.0f,0.0f, 0.0f,0.0f,0.0f,0.0f,0.0f,0.0f });
+    outerProductSum(view.block(0, 0, 2, 3).transpose(), Vector(device, { 1.0f, 2.0f, 3.0f }), Vector(device, { 1.0f, -1.0f }), 0.0f);
+    assertEquals(m, { 1.0f,2.0f,3.0f,0.0f,0.0f,0.0f, -1.0f,-2.0f,-3.0f,0.0f,-1.0f,0.0f, 0.0f,0.0f,2.0f,0.0f,-2.0f,0.0f, 0.0f,0.0f,0.0f,0.0f,0.0f,0.0f });
+}
+
 void testBooleanOperations(Device &device) {
     Vector x(device, 4, ValueType(ValueType::Uint8));
     x.write({ uint8_t(0), uint8_t(1), uint8_t(1), uint8_t(0) });
@@ -369,6 +1267,12 @@ void testBackprop(Device &device) {
         layer.updatePreviousInput(input);
         layer.accumulateGradients(net.context());
         assertEquals(layer.neuronBiasGradients(), { 11.75f, 18.0f, 24.25f });
+        assertEquals(layer.neuronWeightGradients(), { 15.75f, 25.0f, 34.25f });
+        
+        // The gradients are replaced when they are overwritten.
+        layer.accumulateGradients(net.context(), /* overwrite= */ true);
+        assertEquals(layer.neuronBiasGradients(), { 10.75f, 17.0f, 23.25f });
+        assertEquals(layer.neuronWeightGradients(), { 15.75f, 25.0f, 34.25f });
     }
 }
 
@@ -430,6 +1334,226 @@ void testTrainer(Device &device) {
     }
 }
 
+void testSparseInputs(Device &device) {
+    // Three sparse vectors of 5 elements, written from the rows 1-3 of a larger CSR matrix.
+    std::vector<uint32_t> rowOffsets = { 0, 2, 4, 4, 7 };
+    std::vector<uint32_t> columnIndices = { 0, 1, 1, 4, 0, 2, 4 };
+    std::vector<float> values = { 9.0f, 9.0f, 2.0f, -1.0f, 3.0f, 1.0f, 2.0f };
+    SparseMatrix x(device, 3, 5, 5);
+    x.write(rowOffsets.data() + 1, columnIndices.data(), values.data());
+    assert(x.nonzeros() == 5);
+    std::vector<float> dense = { 0.0f,2.0f,0.0f,0.0f,-1.0f, 0.0f,0.0f,0.0f,0.0f,0.0f, 3.0f,0.0f,1.0f,0.0f,2.0f };
+    Vector denseX(device, dense.size());
+    toDense(denseX, x);
+    assertEquals(denseX, dense);
+    
+    // The sparse products match the dense ones, including the epilogue.
+    Matrix m(device, 2, 5, { 1.0f,2.0f,3.0f,4.0f,5.0f, -1.0f,0.0f,1.0f,0.0f,-1.0f });
+    Vector bias(device, { 0.0f, 1.0f });
+    Vector derivative(device, 6);
+    Vector result(device, 6);
+    sparseMmul(result, m, x, Epilogue(&bias, Epilogue::RectifiedLinearUnit, &derivative));
+    assertEquals(result, { 0.0f,2.0f, 0.0f,1.0f, 16.0f,0.0f });
+    assertEquals(derivative, { 0.0f,1.0f, 0.0f,1.0f, 1.0f,0.0f });
+    
+    // dest = sum(e[v] * transpose(x[v])) only touches the columns with non-zeros when beta is 1.
+    Vector errors(device, { 1.0f,2.0f, 5.0f,5.0f, -1.0f,1.0f });
+    Matrix gradients(device, 2, 5);
+    gradients.fill(7.0f);
+    sparseOuterProductSum(gradients, errors, x, 0.0f);
+    assertEquals(gradients, { -3.0f,2.0f,-1.0f,0.0f,-3.0f, 3.0f,4.0f,1.0f,0.0f,0.0f });
+    sparseOuterProductSum(MatrixView(gradients).block(0, 0, 1, 5), Vector(device, { 1.0f, 1.0f, 1.0f }), x);
+    assertEquals(gradients, { 0.0f,4.0f,0.0f,0.0f,-2.0f, 3.0f,4.0f,1.0f,0.0f,0.0f });
+    
+    // Training with the sparse inputs of XOR gives the weights of the dense training.
+    Matrix inputs(device, 4, 2, { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f });
+    Matrix outputs(device, 4, 1, { 0.0f, 1.0f, 1.0f, 0.0f });
+    SimpleDataset denseData(inputs, outputs);
+    SimpleSparseDataset sparseData(2, { 0, 0, 1, 2, 4 }, { 0, 1, 0, 1 }, { 1.0f, 1.0f, 1.0f, 1.0f }, outputs);
+    assert(sparseData.maxNonzeros() == 2);
+    std::vector<float> weights[2];
+    for (size_t i = 0; i < 2; ++i) {
+        Network net(device);
+        auto layer = new Layer(device, 3, 2, TransferFunction::Sigmoid, 2);
+        net.add(std::unique_ptr<Layer>(layer));
+        net.add(std::unique_ptr<Layer>(new Layer(device, 1, 3, TransferFunction::Sigmoid, 2)));
+        net.init(/* seed= */12);
+        GradientDescent opt(device, 3.0);
+        MSECriterion criterion;
+        Dataset &data = i == 0? static_cast<Dataset&>(denseData) : sparseData;
+        Trainer trainer(net, criterion, data, 2);
+        // The sparse training replays its steps, so the weights also check the replayed passes.
+        trainer.replayTrainingSteps = i == 1;
+        trainer.gradientDescent(opt, 20);
+        layer->neuronWeights().copy(weights[i]);
+    }
+    for (size_t i = 0; i < weights[0].size(); ++i)
+        assert(std::abs(weights[0][i] - weights[1][i]) < 1.0e-4f);
+}
+
+void testInstrumentation(Device &device) {
+    Matrix inputs(device, 4, 2, { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f });
+    Matrix outputs(device, 4, 1, { 0.0f, 1.0f, 1.0f, 0.0f });
+    SimpleDataset data(inputs, outputs);
+    Network net(device);
+    net.add(std::unique_ptr<Layer>(new Layer(device, 3, 2, TransferFunction::Sigmoid)));
+    net.add(std::unique_ptr<Layer>(new Layer(device, 1, 3, TransferFunction::Sigmoid)));
+    net.init(/* seed= */12);
+    GradientDescent opt(device, 3.0);
+    MSECriterion criterion;
+    
+    CommandQueue queue(device, /* profile= */true);
+    auto &prevQueue = device.queue();
+    device.queue(queue);
+    device.instrument(true);
+    Trainer trainer(net, criterion, data);
+    trainer.gradientDescent(opt, 3);
+    
+    auto findScope = [] (const Instrumentation::Scope &parent, const std::string &name) -> const Instrumentation::Scope & {
+        for (const auto &child : parent.children) {
+            if (child->name == name)
+                return *child;
+        }
+        assert(false);
+        return parent;
+    };
+    auto &root = device.instrumentation()->report();
+    auto &iteration = findScope(root, "iteration");
+    assert(iteration.calls == 3);
+    auto &pass = findScope(iteration, "pass");
+    assert(pass.calls == 12);
+    auto &layer = findScope(findScope(pass, "feedforward"), "layer 1");
+    // The bias and the transfer function are applied by the matrix multiplication.
+    auto &forward = findScope(layer, "forward");
+    assert(forward.calls == 12 && forward.launches == 12);
+    assert(findScope(iteration, "iterationError").bytesFromDevice == 3 * sizeof(float));
+    
+    std::stringstream json;
+    device.instrumentation()->writeJSON(json);
+    assert(json.str().find("\"accumulateGradients\"") != std::string::npos);
+    device.instrumentation()->reset();
+    assert(device.instrumentation()->report().children[0]->calls == 0);
+    
+    // The replayed passes attribute their launches to the scopes they were recorded in.
+    // Only the first two passes are recorded, so only they count as calls.
+    trainer.replayTrainingSteps = true;
+    trainer.gradientDescent(opt, 3);
+    auto &replayedPass = findScope(findScope(device.instrumentation()->report(), "iteration"), "pass");
+    auto &replayedForward = findScope(findScope(findScope(replayedPass, "feedforward"), "layer 1"), "forward");
+    assert(replayedPass.calls == 12);
+    assert(replayedForward.calls == 2 && replayedForward.launches == 12);
+    
+    device.instrument(false);
+    device.queue(prevQueue);
+}
+
+void testDataParallelTrainer(Device &device) {
+    Matrix inputs(device, 4, 2, { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f });
+    Matrix outputs(device, 4, 1, { 0.0f, 1.0f, 1.0f, 0.0f });
+    SimpleDataset data(inputs, outputs);
+    
+    Vector t00(device, {0.0f, 0.0f});
+    Vector t10(device, {1.0f, 0.0f});
+    Vector t01(device, {0.0f, 1.0f});
+    
+    // Two replicas on the same device behave like two devices as the gradients
+    // are exchanged through the host.
+    Network net1(device), net2(device);
+    for (auto net : { &net1, &net2 }) {
+        net->add(std::unique_ptr<Layer>(new Layer(device, 3, 2, TransferFunction::Sigmoid)));
+        net->add(std::unique_ptr<Layer>(new Layer(device, 1, 3, TransferFunction::Sigmoid)));
+    }
+    net1.init(/* seed= */12);
+    net2.init(/* seed= */42);
+    
+    GradientDescent opt1(device, 3.0), opt2(device, 3.0);
+    MSECriterion criterion;
+    DataParallelTrainer trainer(criterion);
+    trainer.addReplica(net1, data, opt1);
+    trainer.addReplica(net2, data, opt2);
+    float previousError = 0.0f;
+    trainer.afterIteration = [&] (size_t i, float error) {
+        if (i != 0) {
+            assert(previousError >= error);
+        }
+        previousError = error;
+    };
+    trainer.gradientDescent(300);
+    assert(trainer.examplesPerSecond() > 0);
+    
+    // The replicas must stay identical.
+    auto weights1 = net1.weightsAndGradients(), weights2 = net2.weightsAndGradients();
+    for (size_t i = 0; i < weights1.size(); ++i) {
+        std::vector<float> w;
+        weights1[i].first->copy(w);
+        assertEquals(*weights2[i].first, w);
+    }
+    assertEquals(net2.predict(t00), false);
+    assertEquals(net2.predict(t10), true);
+    assertEquals(net2.predict(t01), true);
+}
+
+// Trains a replica of the same network on each of the given devices and returns the throughput.
+double measureTrainingThroughput(const std::vector<Device*> &devices) {
+    std::vector<std::unique_ptr<CommandQueue>> queues;
+    // The previous default queues are restored before the local queues are destroyed.
+    std::vector<std::unique_ptr<QueueScope>> queueScopes;
+    std::vector<std::unique_ptr<Matrix>> matrices;
+    std::vector<std::unique_ptr<SimpleDataset>> datasets;
+    std::vector<std::unique_ptr<Network>> networks;
+    std::vector<std::unique_ptr<GradientDescent>> optimizers;
+    std::vector<float> inputs(256 * 64), outputs(256 * 8);
+    for (size_t i = 0; i < inputs.size(); ++i)
+        inputs[i] = float(i % 7) / 7.0f;
+    for (size_t i = 0; i < outputs.size(); ++i)
+        outputs[i] = float(i % 2);
+    
+    const size_t parallelisationFactor = 4;
+    MSECriterion criterion;
+    DataParallelTrainer trainer(criterion, parallelisationFactor);
+    for (auto device : devices) {
+        queues.emplace_back(new CommandQueue(*device));
+        queueScopes.emplace_back(new QueueScope(*device, *queues.back()));
+        matrices.emplace_back(new Matrix(*device, 256, 64));
+        matrices.back()->write(inputs);
+        matrices.emplace_back(new Matrix(*device, 256, 8));
+        matrices.back()->write(outputs);
+        datasets.emplace_back(new SimpleDataset(*matrices[matrices.size() - 2], *matrices.back()));
+        networks.emplace_back(new Network(*device));
+        networks.back()->add(std::unique_ptr<Layer>(new Layer(*device, 128, 64, TransferFunction::Sigmoid, parallelisationFactor)));
+        networks.back()->add(std::unique_ptr<Layer>(new Layer(*device, 8, 128, TransferFunction::Sigmoid, parallelisationFactor)));
+        networks.back()->init(/* seed= */12);
+        optimizers.emplace_back(new GradientDescent(*device, 0.1));
+        trainer.addReplica(*networks.back(), *datasets.back(), *optimizers.back());
+    }
+    trainer.miniBatchGradientDescent(5, 32);
+    return trainer.examplesPerSecond();
+}
+
+void testDeviceFission(Device &device) {
+    if (!device.isCPU())
+        return;
+    // Report the training throughput for every partitioning scheme.
+    double single = measureTrainingThroughput({ &device });
+    std::cout << "Whole device: " << single << " examples/s\n";
+    
+    auto report = [&] (const char *scheme, std::vector<Device> subDevices) {
+        if (subDevices.size() < 2)
+            return;
+        std::vector<Device*> devices;
+        for (auto &subDevice : subDevices) {
+            assert(subDevice.isSubDevice());
+            subDevice.init();
+            devices.push_back(&subDevice);
+        }
+        double throughput = measureTrainingThroughput(devices);
+        std::cout << scheme << ", " << devices.size() << " sub-devices: " << throughput << " examples/s, " << throughput / single << "x the whole device\n";
+    };
+    report("NUMA nodes", device.partitionByNUMANode());
+    if (device.computeUnits() >= 2)
+        report("Two halves", device.partitionEqually(device.computeUnits() / 2));
+}
+
 void testMNIST(Device &device) {
     std::cout << "Loading MNIST dataset...\n";
     
@@ -475,6 +1599,105 @@ void testMNIST(Device &device) {
     trainer.miniBatchGradientDescent(opt, 30, 50);
 }
 
+// The network of the MNIST benchmarks: a hidden layer of the given storage type and a float
+// output layer, both after a dropout layer. Returns the hidden and the output layer.
+static std::pair<Layer*, Layer*> addMNISTLayers(Network &net, const MNIST &trainingSet, size_t parallelisationFactor, const ValueType &hiddenType = ValueType(ValueType::Float)) {
+    auto &device = net.device();
+    const size_t hiddenUnits = 400;
+    const size_t imageSize = trainingSet.imageWidth()*trainingSet.imageHeight();
+    auto hiddenLayer = new Layer(device, hiddenUnits, imageSize, TransferFunction::RectifiedLinearUnit, parallelisationFactor, hiddenType);
+    auto outputLayer = new Layer(device, 10, hiddenUnits, TransferFunction::Sigmoid, parallelisationFactor);
+    net.add(std::unique_ptr<DropoutLayer>(new DropoutLayer(device, imageSize, 0.9, parallelisationFactor)));
+    net.add(std::unique_ptr<Layer>(hiddenLayer));
+    net.add(std::unique_ptr<DropoutLayer>(new DropoutLayer(device, hiddenUnits, 0.9, parallelisationFactor)));
+    net.add(std::unique_ptr<Layer>(outputLayer));
+    net.init(/* seed= */12);
+    net.tune();
+    return std::make_pair(hiddenLayer, outputLayer);
+}
+
+// Trains the network of the MNIST benchmarks with mini-batches of 50 examples.
+static void trainMNIST(Network &net, MNIST &trainingSet, size_t parallelisationFactor, size_t iterations) {
+    GradientDescent opt(net.device(), 0.3);
+    CrossEntropyCriterion criterion;
+    Trainer trainer(net, criterion, trainingSet, parallelisationFactor);
+    trainer.reshuffleIndices = true;
+    trainer.miniBatchGradientDescent(opt, iterations, 50);
+}
+
+// Trains the MNIST network with its dataset and hidden layer stored as the given
+// type for a few iterations, and reports the accuracy and the throughput of every
+// type side by side. The output layer stays a float layer.
+void benchmarkMNISTStorage(Device &device) {
+    // The host device only has the float kernels.
+    if (device.isHost())
+        return;
+    const size_t parallelisationFactor = 50;
+    const size_t iterations = 3;
+    std::ostringstream report;
+    for (auto type : { ValueType(ValueType::Float), ValueType(ValueType::Half) }) {
+        MNIST trainingSet(device, type);
+        if (trainingSet.load("train-images.idx3-ubyte", "train-labels.idx1-ubyte"))
+            return;
+        MNIST testSet(device, type);
+        if (testSet.load("t10k-images.idx3-ubyte", "t10k-labels.idx1-ubyte"))
+            return;
+        
+        Network net(device);
+        addMNISTLayers(net, trainingSet, parallelisationFactor, type);
+        auto start = std::chrono::high_resolution_clock::now();
+        trainMNIST(net, trainingSet, parallelisationFactor, iterations);
+        device.queue().finish();
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+        
+        ClassificationEvaluator evaluator(testSet);
+        auto result = evaluator.evaluate(net, parallelisationFactor);
+        report << (type == ValueType::Float? "float" : "half") << " storage: test set accuracy " << result.percentageOfCorrectPredictions() << "%, " << double(trainingSet.size()*iterations) / seconds.count() << " examples/s\n";
+    }
+    std::cout << "MNIST after " << iterations << " iteration(s):\n" << report.str();
+}
+
+// Trains the float MNIST network for a few iterations, and compares its test set
+// accuracy and prediction throughput with the quantized copies of its layers.
+void benchmarkMNISTQuantization(Device &device) {
+    // The host device only has the float kernels.
+    if (device.isHost())
+        return;
+    MNIST trainingSet(device);
+    if (trainingSet.load("train-images.idx3-ubyte", "train-labels.idx1-ubyte"))
+        return;
+    MNIST testSet(device);
+    if (testSet.load("t10k-images.idx3-ubyte", "t10k-labels.idx1-ubyte"))
+        return;
+    
+    const size_t parallelisationFactor = 50;
+    Network net(device);
+    auto layers = addMNISTLayers(net, trainingSet, parallelisationFactor);
+    trainMNIST(net, trainingSet, parallelisationFactor, 3);
+    
+    // The first evaluation of a network also builds its kernels, so only the second one is timed.
+    ClassificationEvaluator evaluator(testSet);
+    auto evaluate = [&] (Network &network, double &seconds) {
+        evaluator.evaluate(network, parallelisationFactor);
+        auto start = std::chrono::high_resolution_clock::now();
+        auto result = evaluator.evaluate(network, parallelisationFactor);
+        seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        return result.percentageOfCorrectPredictions();
+    };
+    double floatSeconds = 0;
+    auto floatAccuracy = evaluate(net, floatSeconds);
+    std::cout << "MNIST float weights: test set accuracy " << floatAccuracy << "%\n";
+    // The dropout layers don't change the predictions, so the quantized networks leave them out.
+    for (bool quantizeInputs : { false, true }) {
+        Network quantized(device);
+        quantized.add(std::unique_ptr<QuantizedLayer>(new QuantizedLayer(*layers.first, quantizeInputs)));
+        quantized.add(std::unique_ptr<QuantizedLayer>(new QuantizedLayer(*layers.second, quantizeInputs)));
+        double seconds = 0;
+        auto accuracy = evaluate(quantized, seconds);
+        std::cout << "MNIST " << (quantizeInputs? "int8 weights and inputs" : "int8 weights") << ": test set accuracy " << accuracy << "% (" << accuracy - floatAccuracy << " points), " << floatSeconds / seconds << "x the prediction throughput\n";
+    }
+}
+
 void testRecurrentLayers(Device &device) {
     Network net(device);
     auto &ctx = net.context();
@@ -514,16 +1737,96 @@ void testRecurrentLayers(Device &device) {
     assertEquals(outputLayer.predict(ctx, hiddenLayer.predict(ctx, bit1)), true);
 }
 
+// Runs the float tests on the host device, and checks that it trains a network
+// to the same weights as the given device.
+void testHostDevice(Device &device) {
+    if (device.isHost())
+        return;
+    auto host = Device::host();
+    host.init();
+    CommandQueue queue(host);
+    host.queue(queue);
+    assert(host.isCPU() && host.computeUnits() >= 1);
+    for (auto test : { testProgramSpecialization, testVectors, testOutOfOrderQueue, testCommandRecording, testHostStorage, testSum, testReductions, testExpressions, testBLAS, testMatrixMul, testMatrixViews, testBooleanOperations, testRandom, testTransferFunctions, testLayers, testLogicGates, testBackprop, testTrainer, testSparseInputs, testInstrumentation, testDataParallelTrainer, testRecurrentLayers })
+        test(host);
+    
+    std::vector<float> inputValues(16 * 24), outputValues(16 * 4);
+    for (size_t i = 0; i < inputValues.size(); ++i)
+        inputValues[i] = float(i % 5) / 5.0f;
+    for (size_t i = 0; i < outputValues.size(); ++i)
+        outputValues[i] = float(i % 3 == 0);
+    std::vector<std::vector<float>> weights[2];
+    Device *devices[] = { &device, &host };
+    for (size_t d = 0; d < 2; ++d) {
+        auto &dev = *devices[d];
+        Matrix inputs(dev, 16, 24);
+        inputs.write(inputValues);
+        Matrix outputs(dev, 16, 4);
+        outputs.write(outputValues);
+        SimpleDataset data(inputs, outputs);
+        Network net(dev);
+        net.add(std::unique_ptr<Layer>(new Layer(dev, 32, 24, TransferFunction::Tanh, 4)));
+        net.add(std::unique_ptr<Layer>(new Layer(dev, 4, 32, TransferFunction::Sigmoid, 4)));
+        net.init(/* seed= */12);
+        GradientDescent opt(dev, 0.5);
+        MSECriterion criterion;
+        Trainer trainer(net, criterion, data, 4);
+        trainer.miniBatchGradientDescent(opt, 20, 4);
+        for (const auto &parameter : net.weightsAndGradients()) {
+            weights[d].push_back(std::vector<float>());
+            parameter.first->copy(weights[d].back());
+        }
+        dev.queue().finish();
+    }
+    // The sums are rounded differently.
+    assert(weights[0].size() == weights[1].size());
+    for (size_t i = 0; i < weights[0].size(); ++i) {
+        assert(weights[0][i].size() == weights[1][i].size());
+        for (size_t j = 0; j < weights[0][i].size(); ++j)
+            assert(std::abs(weights[0][i][j] - weights[1][i][j]) < 1e-3f);
+    }
+}
+
+// Compares the training throughput of the host device with the OpenCL CPU devices.
+void benchmarkHostDevice() {
+    auto host = Device::host();
+    host.init();
+    std::cout << "'" << host.name() << "': " << measureTrainingThroughput({ &host }) << " examples/s\n";
+    for (auto &cpu : Device::findAll()) {
+        if (!cpu.isCPU())
+            continue;
+        cpu.init();
+        std::cout << "OpenCL CPU device '" << cpu.name() << "': " << measureTrainingThroughput({ &cpu }) << " examples/s\n";
+    }
+}
+
 int main(int argc, const char * argv[]) {
     auto device = selectDevice();
+    device.cacheCompiledPrograms("nnFitProgramCache");
     device.init();
     std::cout << "Using device '" << device.name() << "' by '" << device.vendor() << "', version '" << device.version() << "'\n";
     CommandQueue queue(device);
     device.queue(queue);
 
+    testProgramCache(device);
+    testProgramSpecialization(device);
+    testLazyKernels(device);
     testVectors(device);
+    testOutOfOrderQueue(device);
+    testMemoryPool(device);
+    testCommandRecording(device);
+    testHostStorage(device);
+    testProfiler(device);
+    testKernelTuner(device);
     testSum(device);
+    testReductions(device);
+    testExpressions(device);
+    testHalfStorage(device);
+    testDoublePrecision(device);
+    testQuantization(device);
     testBLAS(device);
+    testMatrixMul(device);
+    testMatrixViews(device);
     testBooleanOperations(device);
     testRandom(device);
     testTransferFunctions(device);
@@ -531,8 +1834,16 @@ int main(int argc, const char * argv[]) {
     testLogicGates(device);
     testBackprop(device);
     testTrainer(device);
+    testSparseInputs(device);
+    testInstrumentation(device);
+    testDataParallelTrainer(device);
+    testDeviceFission(device);
     testRecurrentLayers(device);
+    testHostDevice(device);
+    benchmarkHostDevice();
     testMNIST(device);
+    benchmarkMNISTStorage(device);
+    benchmarkMNISTQuantization(device);
     
     return 0;
 }
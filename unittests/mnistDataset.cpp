@@ -1,7 +1,14 @@
 #include <iostream>
+#include <algorithm>
+#include <memory>
 #include "mnistDataset.h"
 
-MNIST::MNIST(Device &device) : device(device), images_(device), labelProbabilities_(device), labels(device,ValueType::Uint16) {
+// CPU devices use the dataset in the host memory without copying it.
+static StorageLocation datasetLocation(Device &device) {
+    return device.isCPU()? StorageLocation::Host : StorageLocation::Device;
+}
+
+MNIST::MNIST(Device &device, const ValueType &imageType) : device(device), images_(device, imageType, datasetLocation(device)), labelProbabilities_(device, datasetLocation(device)), labels(device,ValueType::Uint16) {
 }
 
 size_t MNIST::size() const {
@@ -16,6 +23,10 @@ size_t MNIST::outputSize() const {
     return 10;
 }
 
+ValueType MNIST::inputType() const {
+    return images_.type();
+}
+
 void MNIST::get(size_t i, size_t count, Vector &input, Vector &output) {
     images_.row(i, count).copy(input);
     labelProbabilities_.row(i, count).copy(output);
@@ -80,20 +91,30 @@ bool MNIST::load(const char *imageFilename, const char *labelFilename) {
     fread(pixels.data(), sizeof(uint8_t), pixels.size(), imagesFile);
     fclose(imagesFile);
     
-    // Upload to device
-    std::vector<float> fpixels(pixels.size());
-    for (size_t i = 0; i < pixels.size(); ++i) {
-        fpixels[i] = float(pixels[i])/255.0f;
-    }
+    // Convert the data directly into the mapped device storage. The half
+    // images are converted from floats on the device.
     size_t imageSize = imagesHeader.width * imagesHeader.height;
     images_.resize(imagesHeader.numberOfImages, imageSize);
-    images_.write(fpixels);
-    
-    std::vector<float> probabilities(labelValues.size()*10, 0.0f);
-    for (size_t i = 0; i < labelValues.size(); ++i) {
-        probabilities[i*10 + labelValues[i]] = 1.0f;
+    std::unique_ptr<Matrix> floatImages;
+    if (images_.type() == ValueType::Half)
+        floatImages.reset(new Matrix(device, imagesHeader.numberOfImages, imageSize, datasetLocation(device)));
+    auto &fimages = floatImages? *floatImages : images_;
+    {
+        auto fpixels = fimages.map<float>();
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            fpixels[i] = float(pixels[i])/255.0f;
+        }
     }
+    if (floatImages)
+        convert(images_, *floatImages);
+    
     labelProbabilities_.resize(labelValues.size(), 10);
-    labelProbabilities_.write(probabilities);
+    {
+        auto probabilities = labelProbabilities_.map<float>();
+        std::fill(probabilities.begin(), probabilities.end(), 0.0f);
+        for (size_t i = 0; i < labelValues.size(); ++i) {
+            probabilities[i*10 + labelValues[i]] = 1.0f;
+        }
+    }
     return false;
 }
@@ -8,7 +8,8 @@ using namespace nnFit;
 
 class MNIST: public Dataset {
 public:
-    MNIST(Device &device);
+    // The images are stored as imageType values, which must be float or half.
+    MNIST(Device &device, const ValueType &imageType = ValueType(ValueType::Float));
     
     // Return true on error.
     bool load(const char *imageFilename, const char *labelFilename);
@@ -24,6 +25,7 @@ public:
     size_t size() const override;
     size_t inputSize() const override;
     size_t outputSize() const override;
+    ValueType inputType() const override;
     
     void get(size_t i, size_t count, Vector &input, Vector &output) override;
     